@@ -0,0 +1,560 @@
+// Load generator for kb-service. Drives a KnowledgeBase in process, or a
+// TCPServer over sockets, with a configurable operation mix and reports
+// throughput and latency percentiles per operation.
+#include <algorithm>
+#include <arpa/inet.h>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <filesystem>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <sys/socket.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+#include <nlohmann/json.hpp>
+#include "knowledge_base.h"
+#include "embedding_service.h"
+#include "request_handler.h"
+#include "server.h"
+
+namespace fs = std::filesystem;
+
+namespace {
+
+enum Op { kAdd, kSearch, kUpdate, kRemove, kOpCount };
+const char* const kOpNames[kOpCount] = {"add", "search", "update", "remove"};
+
+struct BenchOptions {
+  std::string mode = "inproc";  // inproc or tcp
+  std::string host;             // tcp: external server; empty starts one in process
+  int port = 50151;
+  std::string db_path;          // empty: a temporary directory, removed afterwards
+  int dimension = 128;
+  size_t corpus = 10000;
+  size_t ops = 20000;
+  int threads = 4;
+  int top_k = 5;
+  int mix[kOpCount] = {10, 80, 5, 5};  // relative weights
+  kb::IndexOptions index_options;
+  bool json = false;
+  uint64_t seed = 42;
+};
+
+struct OpStats {
+  std::vector<uint32_t> latencies_ns;
+  size_t errors = 0;
+};
+
+using ThreadStats = std::vector<OpStats>;
+
+std::string memoryText(uint64_t n) {
+  static const char* const kTopics[] = {"indentation", "testing", "deployments", "code review", "naming",
+                                        "logging", "error handling", "dependencies"};
+  return "Benchmark memory " + std::to_string(n) + " about " + kTopics[n % 8] + " in project " +
+         std::to_string(n % 101);
+}
+
+std::string queryText(uint64_t n) {
+  return "What was decided about " + std::to_string(n % 101) + " and memory " + std::to_string(n);
+}
+
+// Ids usable by update and remove. Removals take their id out first so two
+// threads never remove the same memory.
+class IdPool {
+public:
+  void add(std::string id) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    ids_.push_back(std::move(id));
+  }
+
+  bool pick(std::mt19937_64& rng, bool take, std::string* id) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (ids_.empty()) {
+      return false;
+    }
+    size_t i = rng() % ids_.size();
+    *id = ids_[i];
+    if (take) {
+      ids_[i] = std::move(ids_.back());
+      ids_.pop_back();
+    }
+    return true;
+  }
+
+private:
+  std::mutex mutex_;
+  std::vector<std::string> ids_;
+};
+
+// One operation against the system under test; returns success. Only the
+// call itself is timed, so work done before it (embedding in process) is
+// not counted.
+class Driver {
+public:
+  virtual ~Driver() = default;
+  virtual bool add(const std::string& id, const std::string& content) = 0;
+  virtual bool search(const std::string& query, int top_k) = 0;
+  virtual bool update(const std::string& id, const std::string& content) = 0;
+  virtual bool remove(const std::string& id) = 0;
+
+  std::chrono::steady_clock::time_point started;
+};
+
+class InProcessDriver : public Driver {
+public:
+  InProcessDriver(kb::KnowledgeBase& kb, kb::EmbeddingService& embedder) : kb_(kb), embedder_(embedder) {}
+
+  bool add(const std::string& id, const std::string& content) override {
+    kb::Memory memory;
+    memory.id = id;
+    memory.content = content;
+    memory.category = "bench";
+    memory.embedding = embedder_.embed(content);
+    started = std::chrono::steady_clock::now();
+    return kb_.add(memory);
+  }
+
+  bool search(const std::string& query, int top_k) override {
+    std::vector<float> embedding = embedder_.embed(query);
+    started = std::chrono::steady_clock::now();
+    kb_.search(embedding, top_k);
+    return true;
+  }
+
+  bool update(const std::string& id, const std::string& content) override {
+    std::vector<float> embedding = embedder_.embed(content);
+    started = std::chrono::steady_clock::now();
+    return kb_.update(id, content, embedding);
+  }
+
+  bool remove(const std::string& id) override {
+    started = std::chrono::steady_clock::now();
+    return kb_.remove(id);
+  }
+
+private:
+  kb::KnowledgeBase& kb_;
+  kb::EmbeddingService& embedder_;
+};
+
+// Blocking newline-delimited JSON over one connection per thread
+class TcpDriver : public Driver {
+public:
+  TcpDriver(const std::string& host, int port) {
+    fd_ = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd_ < 0) {
+      throw std::runtime_error("Failed to create socket");
+    }
+    int one = 1;
+    setsockopt(fd_, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    if (inet_pton(AF_INET, host.c_str(), &addr.sin_addr) != 1 ||
+        connect(fd_, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0) {
+      close(fd_);
+      throw std::runtime_error("Failed to connect to " + host + ":" + std::to_string(port));
+    }
+  }
+
+  ~TcpDriver() override { close(fd_); }
+
+  bool add(const std::string& id, const std::string& content) override {
+    return call({{"endpoint", "/add"}, {"params", {{"id", id}, {"content", content}, {"category", "bench"}}}});
+  }
+
+  bool search(const std::string& query, int top_k) override {
+    return call({{"endpoint", "/search"}, {"params", {{"query", query}, {"top_k", top_k}}}});
+  }
+
+  bool update(const std::string& id, const std::string& content) override {
+    return call({{"endpoint", "/update"}, {"params", {{"id", id}, {"content", content}}}});
+  }
+
+  bool remove(const std::string& id) override {
+    return call({{"endpoint", "/remove"}, {"params", {{"id", id}}}});
+  }
+
+  bool addBatch(const std::vector<std::pair<std::string, std::string>>& memories) {
+    nlohmann::json items = nlohmann::json::array();
+    for (const auto& [id, content] : memories) {
+      items.push_back({{"id", id}, {"content", content}, {"category", "bench"}});
+    }
+    return call({{"endpoint", "/add_batch"}, {"params", {{"memories", items}}}});
+  }
+
+private:
+  bool call(const nlohmann::json& request) {
+    std::string line = request.dump();
+    line += '\n';
+    started = std::chrono::steady_clock::now();
+
+    for (size_t sent = 0; sent < line.size();) {
+      ssize_t n = send(fd_, line.data() + sent, line.size() - sent, MSG_NOSIGNAL);
+      if (n <= 0) {
+        throw std::runtime_error("Connection lost");
+      }
+      sent += n;
+    }
+
+    size_t newline;
+    while ((newline = buffer_.find('\n')) == std::string::npos) {
+      char chunk[65536];
+      ssize_t n = recv(fd_, chunk, sizeof(chunk), 0);
+      if (n <= 0) {
+        throw std::runtime_error("Connection lost");
+      }
+      buffer_.append(chunk, n);
+    }
+    bool ok = buffer_.find("\"success\":true") < newline;
+    buffer_.erase(0, newline + 1);
+    return ok;
+  }
+
+  int fd_;
+  std::string buffer_;
+};
+
+std::string benchId(uint64_t n) {
+  return "bench_" + std::to_string(n);
+}
+
+void preload(const BenchOptions& options, kb::KnowledgeBase* kb, kb::EmbeddingService& embedder,
+             TcpDriver* tcp, IdPool& pool) {
+  constexpr size_t kBatch = 500;
+  for (size_t begin = 0; begin < options.corpus; begin += kBatch) {
+    size_t end = std::min(options.corpus, begin + kBatch);
+    if (kb) {
+      std::vector<kb::Memory> memories(end - begin);
+      for (size_t i = begin; i < end; ++i) {
+        kb::Memory& memory = memories[i - begin];
+        memory.id = benchId(i);
+        memory.content = memoryText(i);
+        memory.category = "bench";
+        memory.embedding = embedder.embed(memory.content);
+      }
+      kb->addBatch(memories);
+    } else {
+      std::vector<std::pair<std::string, std::string>> memories;
+      for (size_t i = begin; i < end; ++i) {
+        memories.emplace_back(benchId(i), memoryText(i));
+      }
+      if (!tcp->addBatch(memories)) {
+        throw std::runtime_error("Preloading the corpus failed");
+      }
+    }
+    for (size_t i = begin; i < end; ++i) {
+      pool.add(benchId(i));
+    }
+  }
+}
+
+void runWorker(const BenchOptions& options, Driver& driver, IdPool& pool, std::atomic<size_t>& remaining,
+               std::atomic<uint64_t>& next_id, uint64_t seed, ThreadStats* stats) {
+  std::mt19937_64 rng(seed);
+  int total_weight = 0;
+  for (int weight : options.mix) {
+    total_weight += weight;
+  }
+
+  std::string id;
+  while (true) {
+    size_t left = remaining.load(std::memory_order_relaxed);
+    do {
+      if (left == 0) {
+        return;
+      }
+    } while (!remaining.compare_exchange_weak(left, left - 1, std::memory_order_relaxed));
+
+    int roll = static_cast<int>(rng() % total_weight);
+    int op = 0;
+    while (roll >= options.mix[op]) {
+      roll -= options.mix[op++];
+    }
+
+    bool ok;
+    switch (op) {
+      case kAdd: {
+        uint64_t n = next_id.fetch_add(1, std::memory_order_relaxed);
+        id = benchId(n);
+        ok = driver.add(id, memoryText(n));
+        if (ok) {
+          pool.add(id);
+        }
+        break;
+      }
+      case kSearch:
+        ok = driver.search(queryText(rng()), options.top_k);
+        break;
+      case kUpdate:
+        // Fails when a concurrent remove got the id first
+        ok = pool.pick(rng, false, &id) && driver.update(id, memoryText(rng()));
+        break;
+      default:
+        ok = pool.pick(rng, true, &id) && driver.remove(id);
+        break;
+    }
+    auto elapsed = std::chrono::steady_clock::now() - driver.started;
+
+    OpStats& op_stats = (*stats)[op];
+    if (ok) {
+      op_stats.latencies_ns.push_back(static_cast<uint32_t>(
+        std::min<int64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count(), UINT32_MAX)));
+    } else {
+      ++op_stats.errors;
+    }
+  }
+}
+
+double percentileUs(const std::vector<uint32_t>& sorted, double p) {
+  if (sorted.empty()) {
+    return 0.0;
+  }
+  size_t rank = static_cast<size_t>(p * (sorted.size() - 1) + 0.5);
+  return sorted[rank] / 1000.0;
+}
+
+nlohmann::json report(const BenchOptions& options, std::vector<ThreadStats>& per_thread, double elapsed_s) {
+  nlohmann::json result = {
+    {"mode", options.mode},
+    {"index", options.index_options.type},
+    {"metric", options.index_options.metric},
+    {"storage", options.index_options.storage},
+    {"result_cache", options.index_options.result_cache},
+    {"dimension", options.dimension},
+    {"corpus", options.corpus},
+    {"threads", options.threads},
+    {"top_k", options.top_k},
+    {"elapsed_s", elapsed_s},
+  };
+
+  size_t total = 0;
+  nlohmann::json ops = nlohmann::json::object();
+  for (int op = 0; op < kOpCount; ++op) {
+    std::vector<uint32_t> latencies;
+    size_t errors = 0;
+    for (auto& stats : per_thread) {
+      latencies.insert(latencies.end(), stats[op].latencies_ns.begin(), stats[op].latencies_ns.end());
+      errors += stats[op].errors;
+    }
+    if (latencies.empty() && errors == 0) {
+      continue;
+    }
+    std::sort(latencies.begin(), latencies.end());
+
+    double sum = 0;
+    for (uint32_t latency : latencies) {
+      sum += latency;
+    }
+    total += latencies.size();
+    ops[kOpNames[op]] = {
+      {"count", latencies.size()},
+      {"errors", errors},
+      {"qps", latencies.size() / elapsed_s},
+      {"mean_us", latencies.empty() ? 0.0 : sum / latencies.size() / 1000.0},
+      {"p50_us", percentileUs(latencies, 0.50)},
+      {"p99_us", percentileUs(latencies, 0.99)},
+      {"p999_us", percentileUs(latencies, 0.999)},
+    };
+  }
+  result["ops"] = ops;
+  result["total_qps"] = total / elapsed_s;
+  return result;
+}
+
+void printTable(const nlohmann::json& result) {
+  std::cout << "kb-bench " << result["mode"].get<std::string>() << ": " << result["corpus"] << " memories, dim "
+            << result["dimension"] << ", " << result["index"].get<std::string>() << "/"
+            << result["storage"].get<std::string>() << ", " << result["threads"] << " threads, top_k "
+            << result["top_k"] << "\n";
+  std::cout << std::left << std::setw(8) << "op" << std::right << std::setw(10) << "count" << std::setw(8)
+            << "errors" << std::setw(12) << "qps" << std::setw(11) << "mean_us" << std::setw(11) << "p50_us"
+            << std::setw(11) << "p99_us" << std::setw(11) << "p999_us" << "\n";
+  std::cout << std::fixed << std::setprecision(1);
+  for (const auto& [name, stats] : result["ops"].items()) {
+    std::cout << std::left << std::setw(8) << name << std::right << std::setw(10)
+              << stats["count"].get<size_t>() << std::setw(8) << stats["errors"].get<size_t>() << std::setw(12)
+              << stats["qps"].get<double>() << std::setw(11) << stats["mean_us"].get<double>() << std::setw(11)
+              << stats["p50_us"].get<double>() << std::setw(11) << stats["p99_us"].get<double>()
+              << std::setw(11) << stats["p999_us"].get<double>() << "\n";
+  }
+  std::cout << "total " << result["total_qps"].get<double>() << " ops/s in " << result["elapsed_s"].get<double>()
+            << " s" << std::endl;
+}
+
+// "add=10,search=80,update=5,remove=5"; operations left out get weight 0
+void parseMix(const std::string& spec, int* mix) {
+  std::fill(mix, mix + kOpCount, 0);
+  size_t begin = 0;
+  while (begin < spec.size()) {
+    size_t end = spec.find(',', begin);
+    if (end == std::string::npos) {
+      end = spec.size();
+    }
+    std::string item = spec.substr(begin, end - begin);
+    size_t eq = item.find('=');
+    auto name = std::find(std::begin(kOpNames), std::end(kOpNames), item.substr(0, eq));
+    if (eq == std::string::npos || name == std::end(kOpNames)) {
+      throw std::runtime_error("Bad --mix entry: " + item);
+    }
+    mix[name - std::begin(kOpNames)] = std::stoi(item.substr(eq + 1));
+    begin = end + 1;
+  }
+  if (std::all_of(mix, mix + kOpCount, [](int weight) { return weight <= 0; })) {
+    throw std::runtime_error("--mix needs a positive weight");
+  }
+}
+
+} // namespace
+
+int main(int argc, char* argv[]) {
+  BenchOptions options;
+
+  for (int i = 1; i < argc; ++i) {
+    std::string arg = argv[i];
+    if (arg == "--mode" && i + 1 < argc) {
+      options.mode = argv[++i];
+    } else if (arg == "--host" && i + 1 < argc) {
+      options.host = argv[++i];
+    } else if (arg == "--port" && i + 1 < argc) {
+      options.port = std::stoi(argv[++i]);
+    } else if (arg == "--db" && i + 1 < argc) {
+      options.db_path = argv[++i];
+    } else if (arg == "--dim" && i + 1 < argc) {
+      options.dimension = std::stoi(argv[++i]);
+    } else if (arg == "--corpus" && i + 1 < argc) {
+      options.corpus = std::stoul(argv[++i]);
+    } else if (arg == "--ops" && i + 1 < argc) {
+      options.ops = std::stoul(argv[++i]);
+    } else if (arg == "--threads" && i + 1 < argc) {
+      options.threads = std::max(1, std::stoi(argv[++i]));
+    } else if (arg == "--top-k" && i + 1 < argc) {
+      options.top_k = std::stoi(argv[++i]);
+    } else if (arg == "--mix" && i + 1 < argc) {
+      parseMix(argv[++i], options.mix);
+    } else if (arg == "--index" && i + 1 < argc) {
+      options.index_options.type = argv[++i];
+    } else if (arg == "--metric" && i + 1 < argc) {
+      options.index_options.metric = argv[++i];
+    } else if (arg == "--storage" && i + 1 < argc) {
+      options.index_options.storage = argv[++i];
+    } else if (arg == "--result-cache" && i + 1 < argc) {
+      options.index_options.result_cache = std::stoul(argv[++i]);
+    } else if (arg == "--seed" && i + 1 < argc) {
+      options.seed = std::stoull(argv[++i]);
+    } else if (arg == "--json") {
+      options.json = true;
+    } else if (arg == "--help") {
+      std::cout << "Usage: " << argv[0] << " [options]\n"
+                << "Options:\n"
+                << "  --mode M        inproc (KnowledgeBase calls) or tcp (requests over sockets) (default: inproc)\n"
+                << "  --host ADDR     tcp: benchmark a running server instead of starting one\n"
+                << "  --port PORT     tcp: server port (default: 50151)\n"
+                << "  --db PATH       Store to use (default: a temporary directory, removed afterwards)\n"
+                << "  --dim N         Embedding dimension (default: 128)\n"
+                << "  --corpus N      Memories loaded before timing starts (default: 10000)\n"
+                << "  --ops N         Timed operations across all threads (default: 20000)\n"
+                << "  --threads N     Concurrent clients (default: 4)\n"
+                << "  --top-k N       Results per search (default: 5)\n"
+                << "  --mix SPEC      Operation weights (default: add=10,search=80,update=5,remove=5)\n"
+                << "  --index TYPE    Index type, as for kb-service (default: flat)\n"
+                << "  --metric M      l2, ip or cosine (default: l2)\n"
+                << "  --storage S     f32, f16 or sq8 (default: f32)\n"
+                << "  --result-cache N  Cached search results, LRU; 0 disables (default: 0)\n"
+                << "  --seed N        Random seed (default: 42)\n"
+                << "  --json          Print the report as one JSON object\n"
+                << "  --help          Show this help\n";
+      return 0;
+    } else {
+      std::cerr << "Unknown option: " << arg << std::endl;
+      return 1;
+    }
+  }
+
+  bool temporary_db = options.db_path.empty() && options.host.empty();
+  if (temporary_db) {
+    options.db_path = (fs::temp_directory_path() / ("kb_bench_" + std::to_string(
+      std::chrono::steady_clock::now().time_since_epoch().count()))).string();
+  }
+
+  int rc = 0;
+  try {
+    if (options.mode != "inproc" && options.mode != "tcp") {
+      throw std::runtime_error("Unknown mode: " + options.mode);
+    }
+    auto embedder = std::make_shared<kb::MockEmbeddingService>(options.dimension);
+
+    std::shared_ptr<kb::KnowledgeBase> kb;
+    std::unique_ptr<kb::TCPServer> server;
+    if (options.host.empty()) {
+      kb = std::make_shared<kb::KnowledgeBase>(options.db_path, options.dimension, options.index_options);
+      if (options.mode == "tcp") {
+        server = std::make_unique<kb::TCPServer>(options.port, kb,
+                                                 std::make_shared<kb::RequestHandler>(kb, embedder));
+        server->start();
+      }
+    } else if (options.mode != "tcp") {
+      throw std::runtime_error("--host needs --mode tcp");
+    }
+    std::string host = options.host.empty() ? "127.0.0.1" : options.host;
+
+    std::vector<std::unique_ptr<Driver>> drivers;
+    for (int t = 0; t < options.threads; ++t) {
+      if (options.mode == "tcp") {
+        drivers.push_back(std::make_unique<TcpDriver>(host, options.port));
+      } else {
+        drivers.push_back(std::make_unique<InProcessDriver>(*kb, *embedder));
+      }
+    }
+
+    IdPool pool;
+    preload(options, options.mode == "inproc" ? kb.get() : nullptr, *embedder,
+            options.mode == "tcp" ? static_cast<TcpDriver*>(drivers[0].get()) : nullptr, pool);
+
+    std::atomic<size_t> remaining(options.ops);
+    std::atomic<uint64_t> next_id(options.corpus);
+    std::vector<ThreadStats> stats(options.threads, ThreadStats(kOpCount));
+    std::vector<std::thread> threads;
+
+    auto start = std::chrono::steady_clock::now();
+    for (int t = 0; t < options.threads; ++t) {
+      threads.emplace_back(runWorker, std::cref(options), std::ref(*drivers[t]), std::ref(pool),
+                           std::ref(remaining), std::ref(next_id), options.seed + t, &stats[t]);
+    }
+    for (auto& thread : threads) {
+      thread.join();
+    }
+    double elapsed_s = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    nlohmann::json result = report(options, stats, elapsed_s);
+    if (options.json) {
+      std::cout << result.dump() << std::endl;
+    } else {
+      printTable(result);
+    }
+
+    drivers.clear();
+    if (server) {
+      server->stop();
+    }
+  } catch (const std::exception& e) {
+    std::cerr << "kb-bench: " << e.what() << std::endl;
+    rc = 1;
+  }
+
+  if (temporary_db) {
+    std::error_code ec;
+    fs::remove_all(options.db_path, ec);
+  }
+  return rc;
+}
@@ -0,0 +1,59 @@
+#pragma once
+
+#include "embedding_service.h"
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace kb {
+
+// Coalesces concurrent embed()/embedBatch() calls into shared embedBatch()
+// calls on another EmbeddingService. A dispatcher that picks up a request
+// waits up to `window` for more to arrive (or until max_batch texts are
+// queued) and sends them together; up to `dispatchers` batches are in
+// flight at once. A batch the inner service rejects (EmbeddingInputError)
+// is split in halves and sent again, so only callers whose own texts are
+// rejected see the error; any other error reaches every caller in the
+// failed batch.
+class BatchingEmbeddingService : public EmbeddingService {
+public:
+  BatchingEmbeddingService(std::shared_ptr<EmbeddingService> inner, size_t max_batch,
+                           std::chrono::microseconds window, size_t dispatchers = 4);
+  ~BatchingEmbeddingService() override;
+
+  BatchingEmbeddingService(const BatchingEmbeddingService&) = delete;
+  BatchingEmbeddingService& operator=(const BatchingEmbeddingService&) = delete;
+
+  std::vector<float> embed(const std::string& text) override;
+  std::vector<std::vector<float>> embedBatch(const std::vector<std::string>& texts) override;
+  int dimension() const override { return inner_->dimension(); }
+
+private:
+  struct Pending {
+    std::string text;
+    std::promise<std::vector<float>> result;
+  };
+
+  std::vector<std::future<std::vector<float>>> enqueue(const std::vector<std::string>& texts);
+  void dispatchLoop();
+  // Embeds `count` requests and fulfils their promises
+  void send(Pending* batch, size_t count);
+
+  std::shared_ptr<EmbeddingService> inner_;
+  size_t max_batch_;
+  std::chrono::microseconds window_;
+
+  std::deque<Pending> queue_;
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  bool stopping_;
+  std::vector<std::thread> dispatchers_;
+};
+
+} // namespace kb
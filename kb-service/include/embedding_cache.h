@@ -0,0 +1,43 @@
+#pragma once
+
+#include "embedding_service.h"
+#include <atomic>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace kb {
+
+// LRU cache in front of another EmbeddingService, keyed by the SHA-256 of
+// the text so long texts cost 32 bytes of key. Thread-safe.
+class CachingEmbeddingService : public EmbeddingService {
+public:
+  CachingEmbeddingService(std::shared_ptr<EmbeddingService> inner, size_t capacity);
+
+  std::vector<float> embed(const std::string& text) override;
+  std::vector<std::vector<float>> embedBatch(const std::vector<std::string>& texts) override;
+  int dimension() const override { return inner_->dimension(); }
+
+  uint64_t hits() const { return hits_.load(); }
+  uint64_t misses() const { return misses_.load(); }
+
+private:
+  using Entry = std::pair<std::string, std::vector<float>>;
+
+  static std::string cacheKey(const std::string& text);
+  bool lookup(const std::string& key, std::vector<float>* embedding);
+  void insert(const std::string& key, const std::vector<float>& embedding);
+
+  std::shared_ptr<EmbeddingService> inner_;
+  size_t capacity_;
+  std::list<Entry> lru_;  // most recently used first
+  std::unordered_map<std::string, std::list<Entry>::iterator> entries_;
+  std::mutex mutex_;
+  std::atomic<uint64_t> hits_;
+  std::atomic<uint64_t> misses_;
+};
+
+} // namespace kb
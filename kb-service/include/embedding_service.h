@@ -1,10 +1,20 @@
 #pragma once
 
+#include <stdexcept>
 #include <string>
 #include <vector>
 
 namespace kb {
 
+// The backend rejected the texts themselves, or answered them in a way that
+// does not fit them, so sending the same texts again would fail the same
+// way. Backends throw std::runtime_error for everything else (unreachable,
+// overloaded, failing).
+class EmbeddingInputError : public std::runtime_error {
+public:
+  using std::runtime_error::runtime_error;
+};
+
 // Interface for embedding generation
 // In a real implementation, this would call an external API or model
 class EmbeddingService {
@@ -14,6 +24,10 @@ public:
   // Generate embedding from text (returns 1024-dim vector)
   virtual std::vector<float> embed(const std::string& text) = 0;
 
+  // Embeddings for several texts, aligned with the input. Backends with a
+  // per-call cost override this; the default embeds one text at a time.
+  virtual std::vector<std::vector<float>> embedBatch(const std::vector<std::string>& texts);
+
   virtual int dimension() const = 0;
 };
 
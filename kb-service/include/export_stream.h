@@ -0,0 +1,62 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include "record_codec.h"
+
+namespace kb {
+
+// Portable copy of a store's contents, written by KnowledgeBase::exportTo()
+// and read by importFrom(). All integers little-endian:
+//   header: "KBEXPORT" | u32 version | u32 dimension | u8 len + vector encoding name
+//   entry:  u8 kind | u32 len + key | u32 len + value [| u32 len + vector]
+//   end:    u8 'e' | u64 entries written before it
+// A memory ('m') carries its id, its record as stored (see encodeRecord)
+// and its vector in the header's encoding; a preference ('p') its key and
+// value. The end marker lets a reader tell a truncated stream from a
+// complete one.
+struct ExportEntry {
+  enum class Kind : uint8_t { Memory = 'm', Preference = 'p' };
+
+  Kind kind = Kind::Memory;
+  std::string key;     // memory id or preference key
+  std::string value;   // encoded record or preference value
+  std::string vector;  // memories only
+};
+
+class ExportWriter {
+public:
+  explicit ExportWriter(FILE* out) : out_(out) {}
+
+  bool writeHeader(uint32_t dimension, VectorEncoding encoding);
+  bool write(const ExportEntry& entry);
+  // Writes the end marker and flushes
+  bool finish();
+
+private:
+  bool put(const std::string& bytes);
+
+  FILE* out_;
+  uint64_t count_ = 0;
+};
+
+class ExportReader {
+public:
+  explicit ExportReader(FILE* in) : in_(in) {}
+
+  bool readHeader(uint32_t* dimension, VectorEncoding* encoding);
+  // The next entry; false at the end marker or on a malformed or truncated
+  // stream, told apart by complete()
+  bool next(ExportEntry* entry);
+  bool complete() const { return complete_; }
+
+private:
+  bool readString(std::string* value);
+
+  FILE* in_;
+  uint64_t count_ = 0;
+  bool complete_ = false;
+};
+
+} // namespace kb
@@ -0,0 +1,54 @@
+#pragma once
+
+#include "embedding_service.h"
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace kb {
+
+struct HttpEmbeddingOptions {
+  std::string url;            // http://host[:port]/path of an OpenAI-style /v1/embeddings endpoint
+  std::string model;          // sent as "model" when set
+  std::string api_key;        // sent as a bearer token when set
+  bool normalize = false;     // scale returned vectors to unit length (models that do not)
+  int timeout_ms = 10000;     // per socket read/write
+  size_t max_idle_connections = 8;
+};
+
+// Embeddings from a model server speaking the OpenAI embeddings API
+// (`{"input": [...]}` -> `{"data": [{"index", "embedding"}]}`), as served
+// by text-embeddings-inference, vLLM, Ollama and others. Plain HTTP/1.1
+// with keep-alive; idle connections are pooled and reused across calls.
+// Failures throw std::runtime_error; a 400, 413 or 422, which blame the
+// request body, throws EmbeddingInputError.
+class HttpEmbeddingService : public EmbeddingService {
+public:
+  HttpEmbeddingService(const HttpEmbeddingOptions& options, int dim);
+  ~HttpEmbeddingService() override;
+
+  std::vector<float> embed(const std::string& text) override;
+  std::vector<std::vector<float>> embedBatch(const std::vector<std::string>& texts) override;
+  int dimension() const override { return dim_; }
+
+private:
+  int connect() const;
+  int acquireConnection(bool* reused);
+  void releaseConnection(int fd);
+
+  // Sends one request on fd and returns the response body. Sets *reusable
+  // when the server left the connection open.
+  std::string roundTrip(int fd, const std::string& request, bool* reusable);
+
+  HttpEmbeddingOptions options_;
+  int dim_;
+  std::string authority_;  // as in the URL, brackets included, for the Host header
+  std::string host_;
+  std::string port_;
+  std::string path_;
+
+  std::vector<int> idle_;
+  std::mutex idle_mutex_;
+};
+
+} // namespace kb
@@ -0,0 +1,114 @@
+#pragma once
+
+#include "knowledge_base.h"
+#include "embedding_service.h"
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace kb {
+
+struct IngestOptions {
+  size_t max_batch = 64;                      // memories per embedding + addBatch() call
+  std::chrono::milliseconds max_delay{5};     // wait this long for a batch to fill
+  std::chrono::milliseconds retry_delay{1000};  // pause after a failed embedding call, doubled per retry
+  std::chrono::milliseconds max_retry_delay{60000};  // longest pause between attempts
+  int max_attempts = 8;                       // rejections by the embedder before a memory is given up on
+};
+
+// A queued add that was given up on
+struct IngestFailure {
+  uint64_t ticket = 0;
+  std::string id;
+  std::string error;
+};
+
+// Asynchronous adds. submit() makes a memory durable in the knowledge
+// base's ingest queue and returns without embedding it; a worker thread
+// embeds queued memories in batches and stores and indexes each batch with
+// one addBatch() call. Every submission gets an increasing ticket;
+// waitFor(ticket) blocks until that submission has been processed, i.e. is
+// searchable or failed, and waitForAll(ticket) until all earlier ones have
+// been too. A batch the embedder rejects (EmbeddingInputError) is bisected
+// to find the memories it rejects on their own; a batch that fails any
+// other way, e.g. with the embedder unreachable, misconfigured or
+// answering in another dimension, is retried whole. Either
+// waits out growing pauses on a retry list, off the queue, so it holds up
+// neither later submissions nor waiters on them. A memory is given up on
+// after max_attempts rejections; while the embedder is down nothing is.
+// A batch the store fails to write is retried the same way, its tickets
+// still outstanding. failures() reports memories given up on, and those
+// the store rejected (an id added elsewhere meanwhile). Whatever is still
+// queued at shutdown or after a crash is picked up again on the next start.
+class IngestPipeline {
+public:
+  IngestPipeline(std::shared_ptr<KnowledgeBase> kb, std::shared_ptr<EmbeddingService> embedder,
+                 const IngestOptions& options = IngestOptions());
+  ~IngestPipeline();
+
+  IngestPipeline(const IngestPipeline&) = delete;
+  IngestPipeline& operator=(const IngestPipeline&) = delete;
+
+  // Returns the memory's id and sets *ticket, or returns "" when the id is
+  // already stored or queued or the queue write failed. memory.embedding is
+  // ignored.
+  std::string submit(const Memory& memory, uint64_t* ticket);
+
+  // False if the timeout expired first
+  bool waitFor(uint64_t ticket, std::chrono::milliseconds timeout);
+  bool waitForAll(uint64_t ticket, std::chrono::milliseconds timeout);
+
+  // Failed submissions with tickets in (since, ticket], oldest first; the
+  // most recent 1024 failures are kept
+  std::vector<IngestFailure> failures(uint64_t since, uint64_t ticket) const;
+
+  // Ticket of the most recent submission (0 before the first), for waiting
+  // on everything submitted so far
+  uint64_t lastTicket() const;
+  size_t pending() const;
+
+private:
+  struct Item {
+    uint64_t ticket;
+    Memory memory;
+    int attempts = 0;     // times the embedder rejected this memory alone
+    int retries = 0;      // failed embedding calls so far, for the backoff
+    std::string error{};  // set once given up on
+  };
+
+  // What embedding a batch came to
+  struct Embedded {
+    std::vector<Item> done;   // embedded, or given up on (no embedding)
+    std::vector<Item> retry;  // to be tried again after a pause
+    std::string error;        // the last embedding error
+  };
+
+  void run();
+  // Embeds the batch, halving it on rejection until single memories fail
+  void embed(std::vector<Item> batch, Embedded* result);
+
+  std::shared_ptr<KnowledgeBase> kb_;
+  std::shared_ptr<EmbeddingService> embedder_;
+  IngestOptions options_;
+
+  std::deque<Item> queue_;
+  std::multimap<std::chrono::steady_clock::time_point, Item> retrying_;  // by when to try again
+  std::set<uint64_t> outstanding_;              // tickets handed out and not yet processed
+  std::map<uint64_t, IngestFailure> failures_;  // by ticket
+  uint64_t next_ticket_;
+  mutable std::mutex mutex_;
+  std::condition_variable work_cv_;
+  std::condition_variable done_cv_;
+  bool stopping_;
+  std::thread worker_;
+};
+
+} // namespace kb
@@ -0,0 +1,40 @@
+#pragma once
+
+#include "response_writer.h"
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+namespace kb {
+
+// Appends compact JSON to a caller-owned buffer, so hot responses skip the
+// nlohmann DOM and reuse the buffer's capacity from one request to the
+// next. The writer only places commas and colons. Strings are escaped like
+// nlohmann::json::dump(), with invalid UTF-8 replaced by U+FFFD instead of
+// throwing.
+class JsonWriter final : public ResponseWriter {
+public:
+  explicit JsonWriter(std::string* out) : out_(out), first_(true), after_key_(false) {}
+
+  void beginObject() override;
+  void endObject() override;
+  void beginArray() override;
+  void endArray() override;
+  void key(std::string_view name) override;
+
+  void string(std::string_view value) override;
+  void boolean(bool value) override;
+  void integer(int64_t value) override;
+  void unsignedInteger(uint64_t value) override;
+  void real(float value) override;  // shortest round-trip form; NaN and infinity become null
+  void null() override;
+
+private:
+  void separate();
+
+  std::string* out_;
+  bool first_;      // nothing written yet in the current object or array
+  bool after_key_;  // next value belongs to the key just written
+};
+
+} // namespace kb
@@ -1,11 +1,24 @@
 #pragma once
 
+#include <cstdio>
+#include <map>
 #include <memory>
 #include <string>
 #include <vector>
 #include <mutex>
+#include <shared_mutex>
+#include <atomic>
+#include <thread>
+#include <condition_variable>
+#include <unordered_map>
+#include <unordered_set>
 #include <faiss/IndexFlat.h>
+#include <faiss/IndexIDMap.h>
+#include <rocksdb/cache.h>
 #include <rocksdb/db.h>
+#include "lexical_index.h"
+#include "memory_id.h"
+#include "record_codec.h"
 
 namespace kb {
 
@@ -17,6 +30,62 @@ struct Memory {
   std::vector<float> embedding;
 };
 
+// FAISS index selection. `type` is "flat" (exact), "hnsw", "ivf", "ivfpq"
+// or a raw faiss::index_factory string. Types that need training serve
+// from an exact flat index until the corpus is large enough to train on,
+// and are retrained as it grows.
+//
+// `metric` decides what SearchResult::score means: "l2" gives the squared
+// L2 distance (lower is closer); "ip" gives the inner product and "cosine"
+// the cosine similarity (higher is closer). "cosine" normalizes vectors
+// before indexing; use "ip" when embeddings are already unit length.
+//
+// `storage` sets how vectors are held, both in the FAISS index and in the
+// embeddings column family: "f32" as is, "f16" as half floats (half the
+// memory) or "sq8" as 8-bit scalar-quantized codes (a quarter). It applies
+// to "flat", "hnsw" and "ivf"; "ivfpq" and raw factory strings keep their own
+// index codes and only change what is stored on disk. sq8 indexes need
+// training, so until then they serve from an f16 flat index. Reopening a
+// store with a different setting re-encodes its vectors once.
+struct IndexOptions {
+  std::string type = "flat";
+  std::string metric = "l2";
+  std::string storage = "f32";
+  int nprobe = 16;      // IVF lists probed per query
+  int ef_search = 64;   // HNSW candidate list size
+  int load_threads = 0; // threads scanning storage when the index is built; 0 = one per core
+  size_t result_cache = 0;  // cached search results, LRU; 0 disables
+  bool lexical = true;      // keep a BM25 index over contents for lexical and hybrid search
+};
+
+// RocksDB tuning. Every column family gets bloom filters for point
+// lookups (hydration, preferences), with index and filter blocks
+// held in the block cache. The default column family also has a 5-byte
+// prefix extractor, so scans of "pref:" and "meta:" keys seek by prefix.
+// Stores given the same block_cache share it; without one, each store
+// creates its own of block_cache_mb.
+struct StoreOptions {
+  size_t block_cache_mb = 256;
+  std::shared_ptr<rocksdb::Cache> block_cache;
+  double bloom_bits_per_key = 10;  // 0 disables bloom filters
+  bool pipelined_writes = true;    // overlap WAL and memtable writes of concurrent writers
+  bool sync_writes = false;        // fsync the WAL on every write rather than leaving it to the OS
+  uint64_t replication_wal_hours = 0;  // on a primary, keep the WAL this long for replicas (up to 1 GB)
+  rocksdb::Env* env = nullptr;     // file system access, e.g. a fault-injecting wrapper in tests; default Env if null
+};
+
+// Per-request search tuning and filters. Tuning values of 0 keep the
+// IndexOptions default. Filters are applied inside the FAISS search, so
+// top_k counts only matching memories: `category` must match exactly when
+// set, and timestamps must fall in [since, until] (0 leaves a bound open).
+struct SearchOptions {
+  int nprobe = 0;
+  int ef_search = 0;
+  std::string category;
+  int64_t since = 0;
+  int64_t until = 0;
+};
+
 struct SearchResult {
   std::string id;
   std::string content;
@@ -25,37 +94,287 @@ struct SearchResult {
   int64_t timestamp;
 };
 
+// What an export or import moved
+struct TransferCounts {
+  uint64_t memories = 0;
+  uint64_t preferences = 0;
+  bool unmarked = false;  // an import was stored and indexed, but not recorded for replicas
+};
+
+// A write batch of a store's WAL, as shipped from a primary to replicas
+struct WalBatch {
+  uint64_t sequence = 0;  // sequence number of its first write
+  std::string data;       // rocksdb::WriteBatch representation
+};
+
+class SearchResultCache;
+
 class KnowledgeBase {
 public:
-  KnowledgeBase(const std::string& db_path, int dimension = 1024);
+  KnowledgeBase(const std::string& db_path, int dimension = 1024,
+                const IndexOptions& index_options = IndexOptions(),
+                const StoreOptions& store_options = StoreOptions());
   ~KnowledgeBase();
 
   // Core operations
   bool add(const Memory& memory);
   std::string addAndReturnId(const Memory& memory);
-  std::vector<SearchResult> search(const std::vector<float>& query_embedding, int top_k = 5);
+  std::vector<SearchResult> search(const std::vector<float>& query_embedding, int top_k = 5,
+                                   const SearchOptions& options = SearchOptions());
+
+  // Keyword retrieval over memory contents (IndexOptions::lexical).
+  // searchLexical() ranks by BM25 alone, scoring higher for better matches,
+  // and never touches the vector index. searchHybrid() fuses the BM25 and
+  // vector rankings by reciprocal rank: each result scores the sum over the
+  // rankings it appears in of 1 / (60 + rank). Both apply the filters of
+  // `options`; neither goes through the result cache.
+  std::vector<SearchResult> searchLexical(const std::string& query, int top_k,
+                                          const SearchOptions& options = SearchOptions());
+  std::vector<SearchResult> searchHybrid(const std::string& query, const std::vector<float>& query_embedding,
+                                         int top_k, const SearchOptions& options = SearchOptions());
+
+  // Batch operations. addBatch() writes all memories in one RocksDB
+  // WriteBatch and one FAISS add, returning ids aligned with the input
+  // ("" where an entry failed). searchBatch() runs every query through a
+  // single FAISS search call.
+  std::vector<std::string> addBatch(const std::vector<Memory>& memories);
+  std::vector<std::vector<SearchResult>> searchBatch(const std::vector<std::vector<float>>& query_embeddings,
+                                                     int top_k = 5,
+                                                     const SearchOptions& options = SearchOptions());
   bool update(const std::string& id, const std::string& content, const std::vector<float>& embedding);
   bool remove(const std::string& id);
 
-  // Metadata operations
+  // Durable queue behind asynchronous adds (see IngestPipeline). enqueue()
+  // stores a memory without its embedding under the caller's ticket, synced
+  // to the WAL, and returns its id ("" if the id is stored or queued
+  // already, or the write failed); synchronous adds of a queued id fail.
+  // queuedMemories() lists the queue in ticket order so it can be resumed
+  // after a restart. addBatch() with tickets aligned to the memories also
+  // drops their queue entries, in the same write that stores them; an entry
+  // without a valid embedding is only dropped. It returns no ids at all when
+  // the write failed, leaving every queue entry in place.
+  std::string enqueue(uint64_t ticket, const Memory& memory);
+  std::vector<std::pair<uint64_t, Memory>> queuedMemories();
+  std::vector<std::string> addBatch(const std::vector<Memory>& memories, const std::vector<uint64_t>& tickets);
+
+  // Metadata operations. Preferences are read from an in-memory copy,
+  // loaded at startup and written through on update; unset keys read as "".
+  // getUserPreferences() returns values aligned with `keys`, and
+  // listUserPreferences() every preference whose key starts with `prefix`,
+  // in key order.
   bool updateUserPreference(const std::string& key, const std::string& value);
   std::string getUserPreference(const std::string& key);
+  std::vector<std::string> getUserPreferences(const std::vector<std::string>& keys);
+  std::vector<std::pair<std::string, std::string>> listUserPreferences(const std::string& prefix = "");
 
-  // Utility
+  // Moving and backing up stores. exportTo() streams every indexed memory,
+  // with its vector, and every preference (see export_stream.h) from one
+  // RocksDB snapshot, so it sees the store as of its start and neither
+  // reads nor writes wait for it. importFrom() writes the memories of such
+  // a stream to SST files that are ingested in one step and then indexed in
+  // a single pass; imported ids replace stored ones, and vectors are
+  // re-encoded if the stream used another storage encoding. A stream of
+  // another dimension, or a malformed or truncated one, is rejected before
+  // anything changes. The stream is read and staged before writers wait,
+  // and they wait only for the ingest and the indexing; searches never do.
+  // Once the memories are ingested they are indexed even if recording the
+  // import for replicas or writing the preferences fails; importFrom() then
+  // returns false with counts filled in, and counts->unmarked set if
+  // replicas must be reseeded.
+  // checkpoint() creates `dir`, which must not exist, as a RocksDB
+  // checkpoint of the store (hard links where the file system allows) with
+  // an index snapshot to open from; writers wait only while the index is
+  // copied and the checkpoint linked.
+  bool exportTo(FILE* out, TransferCounts* counts = nullptr);
+  bool importFrom(FILE* in, TransferCounts* counts = nullptr);
+  bool checkpoint(const std::string& dir);
+
+  // Replication. readWal() returns the WAL's batches from sequence number
+  // `since` on, stopping after about max_bytes, and the store's latest
+  // sequence number; false once the WAL no longer reaches back that far.
+  // applyWal() applies such batches to a replica -- store, index and
+  // preferences -- skipping any it already has, and advances
+  // replicationPosition(), the next sequence number it wants, in the same
+  // atomic write as each batch. It fails on a gap and on a batch marking an
+  // import on the primary (ingested files are not in the WAL); either way
+  // the replica has to be seeded afresh from a checkpoint of the primary.
+  // A replica must not be written to otherwise.
+  bool readWal(uint64_t since, size_t max_bytes, std::vector<WalBatch>* batches, uint64_t* latest);
+  bool applyWal(const std::vector<WalBatch>& batches);
+  uint64_t replicationPosition() const;
+
+  // Utility. exists() answers from the index's id map without touching
+  // RocksDB; a memory being written becomes visible once it is indexed.
   bool exists(const std::string& id);
   size_t size() const;
+  int dimension() const { return dimension_; }
+
+  // Approximate bytes held by the in-memory index and its label maps
+  size_t indexMemoryBytes() const;
+
+  // Stored vector of a memory, as it was added (up to the precision of the
+  // storage encoding); false if there is none
+  bool getEmbedding(const std::string& id, std::vector<float>* embedding);
+
+  // Recall@top_k of the live index against exact search over the stored
+  // embeddings, averaged over num_queries queries sampled from the corpus.
+  // Scans all embeddings, so meant for diagnostics rather than serving.
+  double measureRecall(size_t num_queries = 100, int top_k = 10,
+                       const SearchOptions& options = SearchOptions());
 
 private:
+  void migrateLegacyRecords();
+  void migrateVectorEncoding();
+  void loadPreferences();
+  // Starts ids_ past every generated id in the store
+  void seedIdGenerator();
+
+  using Hits = std::vector<std::pair<std::string, float>>;
+  std::vector<Hits> findNeighbours(const float* queries, size_t nq, int top_k, const SearchOptions& options);
+  Hits findLexical(const std::string& query, int top_k, const SearchOptions& options);
+  // Whether the label's metadata passes the filters of `options`, with its
+  // category already resolved to an id; expects index_mutex_ held
+  bool matchesFilters(faiss::idx_t label, const SearchOptions& options, uint32_t category) const;
+  std::vector<std::string> lexicalTerms(const std::string& content) const;
+  std::vector<std::vector<SearchResult>> searchVectors(const float* queries, size_t nq, int top_k,
+                                                       const SearchOptions& options);
+  std::vector<std::vector<SearchResult>> hydrate(const std::vector<Hits>& hits);
+
+  // Index persistence. saveIndex() writes a FAISS snapshot together with the
+  // label map and the RocksDB sequence number it reflects; loadIndex() loads
+  // it and replays only the WAL written since, falling back to a full scan
+  // of the embeddings column family when no usable snapshot exists.
   void loadIndex();
   void saveIndex();
-  std::string generateId();
+  struct IndexCopy;
+  IndexCopy copyIndex();  // expects write_mutex_ held
+  bool writeSnapshot(const IndexCopy& copy, const std::string& path) const;
+  bool loadSnapshot();
+  bool replayWal(rocksdb::SequenceNumber since);
+  void buildIndexFromStorage();
+  void resetIndex();
+  std::string snapshotPath() const;
 
-  std::unique_ptr<faiss::IndexFlatL2> index_;
+  // Index construction. factoryString() expands index_options_.type for a
+  // corpus of the given size. buildIndex() builds an index of the given
+  // labels from the embeddings column family (as of `snapshot`), training
+  // it when the type needs it. rebuildIndex() builds one from the current
+  // labels and swaps it in; labels are kept and tombstones dropped. Callers
+  // hold write_mutex_ so storage and label maps stay put; searches keep
+  // running on the old index meanwhile. rebuildIndexOnline() is the
+  // maintenance thread's variant: it builds from a copy of the labels
+  // without write_mutex_, while insertVector(s) and tombstone() record the
+  // changes writers make, and takes the locks only to replay those onto the
+  // new index and swap it in. untrainedFactory() is the exact index served
+  // before a type that needs training has enough vectors. Both scans of the
+  // embeddings column family split its key range over loadThreads()
+  // threads that decode in parallel and hand FAISS bounded chunks.
+  std::string factoryString(size_t corpus_size) const;
+  std::string untrainedFactory() const;
+  std::unique_ptr<faiss::IndexIDMap2> makeIndex(const std::string& factory) const;
+  std::unique_ptr<faiss::IndexIDMap2> buildIndex(const std::unordered_map<std::string, faiss::idx_t>& labels,
+                                                 size_t live, const rocksdb::Snapshot* snapshot, bool* trained);
+  void rebuildIndex();
+  void rebuildIndexOnline();
+  std::vector<float> sampleVectors(size_t count, const rocksdb::Snapshot* snapshot = nullptr);
+  size_t loadThreads() const;
+  const float* prepareVectors(const float* vectors, size_t n, std::vector<float>* buffer) const;
+
+  // Index maintenance. Removed and replaced vectors are tombstoned and
+  // filtered out of searches; the maintenance thread drops them from FAISS
+  // in one pass once enough have accumulated (or rebuilds, for index types
+  // without removal), trains or retrains the index when due, and
+  // periodically snapshots it. insertVector(s) and tombstone() expect
+  // index_mutex_ held exclusively; compactTombstones() expects write_mutex_
+  // and returns false when the index cannot remove vectors and needs a
+  // rebuild instead.
+  // They keep the lexical index in step, from terms the callers tokenize
+  // with lexicalTerms() before taking the lock.
+  faiss::idx_t insertVector(const std::string& id, const float* vector, const std::string& category,
+                            int64_t timestamp, const std::vector<std::string>& terms);
+  void insertVectors(const std::vector<std::string>& ids, const std::vector<const Memory*>& memories,
+                     const float* vectors, const std::vector<std::vector<std::string>>& terms);
+  void tombstone(const std::string& id);
+  bool compactionDue() const;
+  bool trainingDue() const;
+  bool compactTombstones();
+  void maintenanceLoop();
+
+  std::unique_ptr<faiss::IndexIDMap2> index_;
   std::unique_ptr<rocksdb::DB> db_;
-  std::vector<std::string> id_map_;
+  rocksdb::WriteOptions write_options_;  // for writes made on behalf of clients
+  std::vector<rocksdb::ColumnFamilyHandle*> cf_handles_;
+  rocksdb::ColumnFamilyHandle* embeddings_cf_;
+  rocksdb::ColumnFamilyHandle* ingest_cf_;
+  // Per-label metadata kept in memory so search filters run inside FAISS
+  // without reading RocksDB. Category names are interned.
+  struct IndexEntry {
+    std::string id;
+    uint32_t category;
+    int64_t timestamp;
+  };
+  uint32_t internCategory(const std::string& category);
+
+  // Consistent copy of the index taken by copyIndex(), written out by
+  // writeSnapshot() without holding any lock
+  struct IndexCopy {
+    std::unique_ptr<faiss::Index> index;
+    std::vector<std::pair<faiss::idx_t, IndexEntry>> labels;
+    std::vector<faiss::idx_t> tombstones;
+    LexicalIndex lexical;
+    std::vector<std::string> categories;
+    rocksdb::SequenceNumber sequence;
+    faiss::idx_t next_label;
+    uint64_t trained_size;
+  };
+
+  std::unordered_map<faiss::idx_t, IndexEntry> entries_;
+  std::unordered_map<std::string, faiss::idx_t> id_to_label_;
+  std::unordered_set<faiss::idx_t> tombstones_;
+  LexicalIndex lexical_;  // live labels only; empty unless index_options_.lexical
+  std::vector<std::string> categories_;
+  std::unordered_map<std::string, uint32_t> category_ids_;
+  faiss::idx_t next_label_;
+  std::atomic<uint64_t> writes_since_snapshot_;
+  // Imports so far, under write_mutex_. Ingested files bypass the WAL, so a
+  // snapshot copied before an import must not be saved after it.
+  uint64_t imports_;
+  MemoryIdGenerator ids_;  // for memories added without an id
+  std::atomic<uint64_t> replication_position_;  // written under write_mutex_
+  // Bumped by every change to the indexed memories; cached search results
+  // are only served at the generation they were computed at
+  std::atomic<uint64_t> generation_;
+  std::unique_ptr<SearchResultCache> result_cache_;
+
+  std::map<std::string, std::string> preferences_;  // by key, without the "pref:" prefix
+  std::shared_mutex preference_mutex_;
   int dimension_;
   std::string db_path_;
-  std::mutex index_mutex_;
+  IndexOptions index_options_;
+  faiss::MetricType metric_type_;
+  VectorEncoding vector_encoding_;  // index_options_.storage
+  bool normalize_;               // cosine metric: L2-normalize before indexing/searching
+  bool requires_training_;       // index_options_.type must be trained before use
+  bool supports_removal_;        // cleared once the index rejects remove_ids()
+  size_t trained_size_;          // live vectors at the last training; 0 = untrained
+  // Changes to the index while rebuildIndexOnline() runs, under index_mutex_:
+  // labels added with their prepared vectors, and labels tombstoned
+  bool rebuilding_;
+  std::vector<faiss::idx_t> rebuild_labels_;
+  std::vector<float> rebuild_vectors_;
+  std::unordered_set<faiss::idx_t> rebuild_tombstones_;
+
+  // Locking: writers serialize on write_mutex_ for their RocksDB writes and
+  // take index_mutex_ exclusively only to mutate the in-memory index.
+  // Searches share index_mutex_ and run in parallel. Order: write, then index.
+  std::mutex write_mutex_;
+  std::mutex import_mutex_;  // taken before write_mutex_; imports share a staging directory
+  std::unordered_set<std::string> queued_ids_;  // ids in the ingest queue, under write_mutex_
+  mutable std::shared_mutex index_mutex_;
+
+  std::thread maintenance_thread_;
+  std::condition_variable_any maintenance_cv_;
+  bool stop_maintenance_;
 };
 
 } // namespace kb
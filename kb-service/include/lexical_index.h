@@ -0,0 +1,66 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <functional>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace kb {
+
+// BM25 inverted index over memory contents, keyed by the labels of the
+// vector index. Removed documents leave their postings behind until dead
+// postings outnumber live ones, so removal is O(terms of the document).
+// Not thread-safe; KnowledgeBase guards it together with the vector index.
+class LexicalIndex {
+public:
+  using Label = int64_t;
+
+  // Words of ASCII letters (lowercased), digits and any non-ASCII bytes. A word
+  // joined by '_', '.', '-', '/' or ':' (a file name, path or error code)
+  // is kept whole as well as split into its parts, so both match.
+  static std::vector<std::string> tokenize(const std::string& text);
+
+  void add(Label label, const std::vector<std::string>& terms);
+  void remove(Label label);
+  void clear();
+
+  // Up to k labels by BM25 score over the distinct `terms`, best first,
+  // counting only labels `accept` admits
+  std::vector<std::pair<Label, float>> search(const std::vector<std::string>& terms, size_t k,
+                                              const std::function<bool(Label)>& accept) const;
+
+  size_t size() const { return documents_.size(); }
+  size_t memoryBytes() const;
+
+  // Live postings and document lengths; term lists are rebuilt on load
+  bool save(FILE* f) const;
+  bool load(FILE* f);
+
+private:
+  struct Posting {
+    Label label;
+    uint32_t frequency;
+  };
+  struct Term {
+    std::vector<Posting> postings;
+    uint32_t live = 0;  // postings of documents still present
+  };
+  struct Document {
+    uint32_t length;              // terms, counting repeats
+    std::vector<uint32_t> terms;  // distinct term ids, for removal
+  };
+
+  void purgeDeadPostings();
+
+  std::unordered_map<std::string, uint32_t> term_ids_;
+  std::vector<Term> terms_;
+  std::unordered_map<Label, Document> documents_;
+  uint64_t total_length_ = 0;
+  size_t live_postings_ = 0;
+  size_t dead_postings_ = 0;
+};
+
+} // namespace kb
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+namespace kb {
+
+// Generated ids are "mem_" and 16 lowercase hex digits of a 64-bit value:
+// milliseconds since the epoch above a per-millisecond sequence number.
+// Fixed width, so RocksDB keeps generated memories in creation order.
+std::string formatMemoryId(uint64_t value);
+
+// Value of an id in the generated format; false for any other id
+bool parseMemoryId(const std::string& id, uint64_t* value);
+
+// Ids for memories added without one, increasing within the process.
+// A generator given a node number below kMaxNodes only hands out values
+// whose low sequence bits are that number, so generators of different
+// nodes never hand out the same id. Lock-free.
+class MemoryIdGenerator {
+public:
+  static constexpr uint32_t kMaxNodes = 256;
+
+  MemoryIdGenerator() = default;
+  explicit MemoryIdGenerator(uint32_t node);
+
+  std::string next();
+
+  // Ids handed out from now on sort after `id`, if it is a generated one,
+  // so they stay unique across restarts even if the clock has gone back
+  void observe(const std::string& id);
+
+private:
+  std::atomic<uint64_t> last_{0};  // value of the last generated id
+  uint64_t node_ = 0;
+  uint64_t stride_ = 1;  // kMaxNodes with a node number, else 1
+};
+
+} // namespace kb
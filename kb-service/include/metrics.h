@@ -0,0 +1,128 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+#include <nlohmann/json.hpp>
+
+namespace kb {
+
+using MetricLabels = std::vector<std::pair<std::string, std::string>>;
+
+namespace detail {
+
+// Observers spread over this many cache-line-sized shards by thread, so
+// concurrent updates rarely contend
+constexpr size_t kMetricShards = 16;
+size_t metricShard();
+
+} // namespace detail
+
+// Monotonic count, updated with relaxed atomics
+class Counter {
+public:
+  void add(uint64_t n = 1) { shards_[detail::metricShard()].value.fetch_add(n, std::memory_order_relaxed); }
+  uint64_t value() const;
+
+private:
+  struct alignas(64) Shard {
+    std::atomic<uint64_t> value{0};
+  };
+  std::array<Shard, detail::kMetricShards> shards_;
+};
+
+// Latency distribution over fixed exponential buckets: bucket i holds
+// durations up to 2^i microseconds, the last one everything slower
+class Histogram {
+public:
+  static constexpr size_t kBuckets = 24;  // 1us .. ~8.4s, plus +Inf
+
+  struct Snapshot {
+    std::array<uint64_t, kBuckets + 1> counts{};
+    uint64_t count = 0;
+    double sum_seconds = 0.0;
+
+    // Estimated by interpolating within the bucket holding the quantile
+    double quantileSeconds(double q) const;
+  };
+
+  void observe(std::chrono::nanoseconds elapsed);
+  Snapshot snapshot() const;
+
+  // Upper bound of bucket i in seconds; infinity for the last
+  static double bucketBound(size_t i);
+
+private:
+  struct alignas(64) Shard {
+    std::array<std::atomic<uint64_t>, kBuckets + 1> counts{};
+    std::atomic<uint64_t> sum_ns{0};
+  };
+  std::array<Shard, detail::kMetricShards> shards_;
+};
+
+// Records the time from construction to destruction
+class ScopedTimer {
+public:
+  explicit ScopedTimer(Histogram& histogram)
+    : histogram_(histogram), start_(std::chrono::steady_clock::now()) {}
+  ~ScopedTimer() { histogram_.observe(std::chrono::steady_clock::now() - start_); }
+
+  ScopedTimer(const ScopedTimer&) = delete;
+  ScopedTimer& operator=(const ScopedTimer&) = delete;
+
+private:
+  Histogram& histogram_;
+  std::chrono::steady_clock::time_point start_;
+};
+
+// Process-wide metric registry. Registration takes a lock and returns a
+// reference that stays valid for the life of the process, so call sites
+// look their metrics up once and update them lock-free afterwards.
+// Gauges are read through callbacks when metrics are rendered.
+class Metrics {
+public:
+  static Metrics& global();
+
+  Counter& counter(const std::string& name, const std::string& help, const MetricLabels& labels = {});
+  Histogram& histogram(const std::string& name, const std::string& help, const MetricLabels& labels = {});
+
+  // Replaces any gauge registered under the same name and labels. A
+  // cumulative gauge is exposed as a counter.
+  void gauge(const std::string& name, const std::string& help, std::function<double()> read,
+             const MetricLabels& labels = {}, bool cumulative = false);
+  void removeGauge(const std::string& name, const MetricLabels& labels = {});
+
+  // Prometheus text exposition format 0.0.4
+  std::string renderPrometheus() const;
+
+  // {"<name>": [{"labels": {...}, "value": N}, ...]}; histograms report
+  // count, mean and p50/p99/p99.9 in microseconds instead of a value
+  nlohmann::json toJson() const;
+
+private:
+  enum class Type { Counter, Gauge, Histogram };
+
+  struct Entry {
+    std::string name;
+    std::string help;
+    MetricLabels labels;
+    Type type;
+    std::unique_ptr<Counter> counter;
+    std::unique_ptr<Histogram> histogram;
+    std::function<double()> read;
+  };
+
+  Entry* findLocked(const std::string& name, const MetricLabels& labels);
+
+  std::vector<std::unique_ptr<Entry>> entries_;  // in registration order
+  mutable std::mutex mutex_;
+};
+
+} // namespace kb
@@ -0,0 +1,34 @@
+#pragma once
+
+#include <atomic>
+#include <string>
+#include <thread>
+
+namespace kb {
+
+// Minimal HTTP endpoint for Prometheus scrapes: answers GET /metrics with
+// Metrics::global() in text format, one request per connection, on its
+// own thread so a slow scraper never holds up request workers.
+class MetricsServer {
+public:
+  explicit MetricsServer(int port, const std::string& bind_address = "127.0.0.1");
+  ~MetricsServer();
+
+  MetricsServer(const MetricsServer&) = delete;
+  MetricsServer& operator=(const MetricsServer&) = delete;
+
+  void start();
+  void stop();
+
+private:
+  void serveLoop();
+  void serveConnection(int fd);
+
+  int port_;
+  std::string bind_address_;
+  int server_fd_;
+  std::atomic<bool> running_;
+  std::thread thread_;
+};
+
+} // namespace kb
@@ -0,0 +1,49 @@
+#pragma once
+
+#include "response_writer.h"
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace kb {
+
+// Appends MessagePack to a caller-owned buffer. Maps and arrays are written
+// with 32-bit size headers that are filled in when they are closed, so
+// nothing needs to be counted up front. Floats are encoded as float32.
+class MsgpackWriter final : public ResponseWriter {
+public:
+  explicit MsgpackWriter(std::string* out) : out_(out) {}
+
+  void beginObject() override;
+  void endObject() override;
+  void beginArray() override;
+  void endArray() override;
+  void key(std::string_view name) override;
+
+  void string(std::string_view value) override;
+  void boolean(bool value) override;
+  void integer(int64_t value) override;
+  void unsignedInteger(uint64_t value) override;
+  void real(float value) override;
+  void null() override;
+
+  // Raw bytes (MessagePack bin), used for float32 vectors
+  void binary(const void* data, size_t size);
+
+private:
+  struct Container {
+    size_t header;   // offset of the size field in *out_
+    uint32_t count;
+    bool array;
+  };
+
+  void element();
+  void begin(uint8_t marker, bool array);
+  void end();
+
+  std::string* out_;
+  std::vector<Container> open_;
+};
+
+} // namespace kb
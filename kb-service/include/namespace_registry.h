@@ -0,0 +1,94 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace kb {
+
+class KnowledgeBase;
+class IngestPipeline;
+class Replicator;
+
+// A namespace's knowledge base and, when adds are asynchronous, the ingest
+// pipeline feeding it. On a replica, the replicator keeping it current
+// instead; replicas take no writes of their own.
+struct Tenant {
+  std::shared_ptr<KnowledgeBase> kb;
+  std::shared_ptr<IngestPipeline> ingest;
+  std::shared_ptr<Replicator> replicator = nullptr;
+};
+
+struct NamespaceOptions {
+  size_t max_open = 64;                    // loaded namespaces before the least recently used idle one is closed
+  std::chrono::seconds idle_timeout{600};  // close namespaces unused this long; 0 keeps them loaded
+};
+
+// Isolated memory spaces selected by name. The default namespace ("") is
+// the service's main store and always loaded. Every other namespace has
+// its own RocksDB store and FAISS index under <root>/<name>, opened on
+// first use and closed again -- snapshotting its index, so the next open
+// is quick -- once it has been idle for idle_timeout or more than max_open
+// are loaded. A namespace is never closed while a request holds it.
+class NamespaceRegistry {
+public:
+  // Opens the tenant stored at path; throws std::runtime_error on failure
+  using OpenFn = std::function<Tenant(const std::string& path)>;
+
+  NamespaceRegistry(Tenant default_tenant, const std::string& root, OpenFn open,
+                    const NamespaceOptions& options = NamespaceOptions());
+  ~NamespaceRegistry();
+
+  NamespaceRegistry(const NamespaceRegistry&) = delete;
+  NamespaceRegistry& operator=(const NamespaceRegistry&) = delete;
+
+  // Sets *tenant to the namespace, opening it if needed. Returns false with
+  // *error set for an invalid name or a store that failed to open.
+  bool acquire(const std::string& name, Tenant* tenant, std::string* error);
+
+  // Named namespaces loaded right now
+  size_t openCount() const;
+
+  // 1 to 128 characters from [A-Za-z0-9_.@-], not starting with '.'
+  static bool validName(const std::string& name);
+
+private:
+  struct Slot {
+    Tenant tenant;      // empty while closed
+    bool busy = false;  // being opened or closed
+    std::chrono::steady_clock::time_point last_used;
+  };
+
+  using Victims = std::vector<std::pair<std::string, Tenant>>;
+
+  // evictLocked() marks the namespaces to close busy and takes their
+  // tenants out, expired ones and beyond max_open the least recently used;
+  // close() closes them once the caller has released mutex_.
+  bool inUseLocked(const Slot& slot) const;
+  Victims evictLocked(const std::string& keep, bool expired_only);
+  void close(Victims victims);
+
+  void reaperLoop();
+
+  Tenant default_tenant_;
+  std::string root_;
+  OpenFn open_;
+  NamespaceOptions options_;
+
+  std::unordered_map<std::string, Slot> slots_;
+  size_t open_count_;
+  mutable std::mutex mutex_;
+  std::condition_variable slot_cv_;  // a slot stopped being busy
+  std::condition_variable reaper_cv_;
+  bool stopping_;
+  std::thread reaper_;
+};
+
+} // namespace kb
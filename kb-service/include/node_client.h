@@ -0,0 +1,47 @@
+#pragma once
+
+#include <mutex>
+#include <string>
+#include <vector>
+#include <nlohmann/json.hpp>
+
+namespace kb {
+
+struct NodeClientOptions {
+  int timeout_ms = 10000;  // per socket read/write
+  size_t max_idle_connections = 8;
+};
+
+// Client for another kb-service node, used by shard routers and replicas.
+// Speaks the binary protocol (see TCPServer) over pooled keep-alive
+// connections, so concurrent calls each get their own. Failures to reach
+// the node throw std::runtime_error; error responses are returned as is.
+class NodeClient {
+public:
+  // `address` is host:port
+  explicit NodeClient(const std::string& address, const NodeClientOptions& options = NodeClientOptions());
+  ~NodeClient();
+
+  NodeClient(const NodeClient&) = delete;
+  NodeClient& operator=(const NodeClient&) = delete;
+
+  nlohmann::json call(const std::string& endpoint, const nlohmann::json& params);
+
+  const std::string& address() const { return address_; }
+
+private:
+  int connect() const;
+  int acquireConnection(bool* reused);
+  void releaseConnection(int fd);
+  std::string roundTrip(int fd, const std::string& frame);
+
+  std::string address_;
+  NodeClientOptions options_;
+  std::string host_;
+  std::string port_;
+
+  std::vector<int> idle_;
+  std::mutex idle_mutex_;
+};
+
+} // namespace kb
@@ -0,0 +1,56 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <rocksdb/slice.h>
+
+namespace kb {
+
+// Metadata stored per memory in the default column family. The vector
+// itself lives separately in the embeddings column family so lookups that
+// only need metadata never touch it.
+struct MemoryRecord {
+  std::string content;
+  std::string category;
+  int64_t timestamp = 0;
+};
+
+// Binary record layout (all integers little-endian):
+//   u8 version | i64 timestamp | u32 len + category | u32 len + content
+std::string encodeRecord(const std::string& content, const std::string& category, int64_t timestamp);
+bool decodeRecord(const rocksdb::Slice& value, MemoryRecord* record);
+
+// Embeddings are stored in one of three encodings, chosen per store:
+//   Float32: raw little-endian float32 array (4 bytes per dimension)
+//   Float16: little-endian IEEE half floats (2 bytes per dimension)
+//   Int8:    f32 min | f32 step | u8 codes, value = min + code * step,
+//            with the range taken from the vector itself (1 byte per dimension)
+// decodeVector() fails when the blob does not have the encoding's size for
+// the given dimension.
+enum class VectorEncoding : uint8_t { Float32, Float16, Int8 };
+
+// "f32", "f16" and "sq8"; parseVectorEncoding() returns false for anything else
+const char* vectorEncodingName(VectorEncoding encoding);
+bool parseVectorEncoding(const std::string& name, VectorEncoding* encoding);
+size_t encodedVectorSize(size_t dimension, VectorEncoding encoding);
+
+std::string encodeVector(const float* vector, size_t dimension,
+                         VectorEncoding encoding = VectorEncoding::Float32);
+bool decodeVector(const rocksdb::Slice& value, size_t dimension, float* out,
+                  VectorEncoding encoding = VectorEncoding::Float32);
+
+// IEEE 754 binary16 conversion, rounding to nearest even
+uint16_t floatToHalf(float value);
+float halfToFloat(uint16_t value);
+
+// Memories accepted by an asynchronous add but not embedded yet wait in the
+// ingest column family. Keys are big-endian u64 tickets so they iterate in
+// arrival order; values are u32 len + id followed by the record above.
+std::string encodeTicket(uint64_t ticket);
+bool decodeTicket(const rocksdb::Slice& key, uint64_t* ticket);
+std::string encodeQueuedMemory(const std::string& id, const std::string& content,
+                               const std::string& category, int64_t timestamp);
+bool decodeQueuedMemory(const rocksdb::Slice& value, std::string* id, MemoryRecord* record);
+
+} // namespace kb
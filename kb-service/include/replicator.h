@@ -0,0 +1,62 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include "node_client.h"
+
+namespace kb {
+
+class KnowledgeBase;
+
+struct ReplicaOptions {
+  std::string primary;                          // host:port of the node to follow
+  std::chrono::milliseconds poll_interval{100};  // wait between polls once caught up
+  size_t max_batch_bytes = 4 << 20;             // WAL bytes requested per poll
+};
+
+// Keeps a read-only replica of one of a primary's namespaces current. A
+// background thread polls the primary's /replicate endpoint for the WAL
+// from the replica's replicationPosition() on and applies what comes back
+// with KnowledgeBase::applyWal(), straight away again while the primary
+// has more. Failures are logged, once per distinct error, and retried
+// after the poll interval. seeded() tells whether the replica has anything
+// to serve: it has caught up with the primary at least once (or was opened
+// from a checkpoint, or had replicated before) and has not fallen off the
+// primary's WAL since. An unreachable primary leaves it as it is.
+class Replicator {
+public:
+  Replicator(std::shared_ptr<KnowledgeBase> kb, const std::string& name_space, const ReplicaOptions& options);
+  ~Replicator();
+
+  Replicator(const Replicator&) = delete;
+  Replicator& operator=(const Replicator&) = delete;
+
+  // Primary writes not yet applied, as of the last successful poll
+  uint64_t lag() const { return lag_.load(std::memory_order_relaxed); }
+  bool seeded() const { return seeded_.load(std::memory_order_acquire); }
+
+private:
+  void run();
+  // One poll; true if the primary had more to send
+  bool poll();
+
+  std::shared_ptr<KnowledgeBase> kb_;
+  std::string name_space_;
+  ReplicaOptions options_;
+  NodeClient primary_;
+  std::string last_error_;  // replication thread only
+  std::atomic<uint64_t> lag_;
+  std::atomic<bool> seeded_;
+
+  std::thread thread_;
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  bool stopping_;
+};
+
+} // namespace kb
@@ -3,28 +3,81 @@
 #include <string>
 #include <memory>
 #include <nlohmann/json.hpp>
+#include "namespace_registry.h"
 
 namespace kb {
 
-class KnowledgeBase;
+struct Memory;
+struct RequestParams;
 class EmbeddingService;
+class ResponseWriter;
+class ShardRouter;
 
 class RequestHandler {
 public:
-  RequestHandler(std::shared_ptr<KnowledgeBase> kb, std::shared_ptr<EmbeddingService> embedder);
+  // With an ingest pipeline, /add queues memories and returns before they
+  // are embedded; /wait blocks until they are searchable.
+  RequestHandler(std::shared_ptr<KnowledgeBase> kb, std::shared_ptr<EmbeddingService> embedder,
+                 std::shared_ptr<IngestPipeline> ingest = nullptr);
+
+  // Every endpoint takes an optional "namespace" naming the memory space it
+  // works on; without one it uses the registry's default namespace.
+  RequestHandler(std::shared_ptr<NamespaceRegistry> namespaces, std::shared_ptr<EmbeddingService> embedder);
+
+  // Serves no store of its own: every request goes through the router to
+  // the shards holding the data
+  explicit RequestHandler(std::shared_ptr<ShardRouter> router);
+
+  // /export, /import and /checkpoint take paths relative to `dir` and are
+  // refused until one is set; call before serving
+  void setExportDirectory(const std::string& dir) { export_dir_ = dir; }
 
   std::string handle(const std::string& request_json);
 
+  // Appends the response to *out, so callers can reuse one buffer. /add and
+  // the search endpoints are parsed with a SAX pass into reused
+  // per-thread fields and answered without building a JSON DOM; anything
+  // the fast path does not recognize goes through nlohmann::json as before.
+  void handle(const std::string& request_json, std::string* out);
+
+  // The same request and response documents as MessagePack, for the
+  // binary protocol (see TCPServer)
+  void handleMessagePack(const std::string& request, std::string* out);
+
 private:
-  nlohmann::json handleAdd(const nlohmann::json& params);
-  nlohmann::json handleSearch(const nlohmann::json& params);
-  nlohmann::json handleUpdate(const nlohmann::json& params);
-  nlohmann::json handleRemove(const nlohmann::json& params);
-  nlohmann::json handleUpdatePreference(const nlohmann::json& params);
-  nlohmann::json handleGetPreference(const nlohmann::json& params);
-
-  std::shared_ptr<KnowledgeBase> kb_;
+  void process(const std::string& request_data, bool msgpack, std::string* out);
+  bool resolveTenant(const std::string& name, Tenant* tenant, std::string* error);
+
+  // Hot endpoints, fed by either path; false if `endpoint` is not one of them
+  bool dispatchFast(const std::string& endpoint, const RequestParams& params, const Tenant& tenant,
+                    ResponseWriter& writer);
+  void handleAdd(const RequestParams& params, const Tenant& tenant, ResponseWriter& writer);
+  void handleAddAsync(const RequestParams& params, const Memory& memory, const Tenant& tenant,
+                      ResponseWriter& writer);
+  void handleSearch(const RequestParams& params, const Tenant& tenant, ResponseWriter& writer);
+  void handleSearchBatch(const RequestParams& params, const Tenant& tenant, ResponseWriter& writer);
+  void handleSearchById(const RequestParams& params, const Tenant& tenant, ResponseWriter& writer);
+
+  nlohmann::json handleAddBatch(const nlohmann::json& params, const Tenant& tenant);
+  nlohmann::json handleWait(const nlohmann::json& params, const Tenant& tenant);
+  nlohmann::json handleUpdate(const nlohmann::json& params, const Tenant& tenant);
+  nlohmann::json handleRemove(const nlohmann::json& params, const Tenant& tenant);
+  nlohmann::json handleUpdatePreference(const nlohmann::json& params, const Tenant& tenant);
+  nlohmann::json handleGetPreference(const nlohmann::json& params, const Tenant& tenant);
+  nlohmann::json handleGetPreferences(const nlohmann::json& params, const Tenant& tenant);
+  nlohmann::json handleListPreferences(const nlohmann::json& params, const Tenant& tenant);
+  nlohmann::json handleStats(const Tenant& tenant);
+  nlohmann::json handleExport(const nlohmann::json& params, const Tenant& tenant);
+  nlohmann::json handleImport(const nlohmann::json& params, const Tenant& tenant);
+  nlohmann::json handleCheckpoint(const nlohmann::json& params, const Tenant& tenant);
+  nlohmann::json handleGetEmbedding(const nlohmann::json& params, const Tenant& tenant);
+  nlohmann::json handleReplicate(const nlohmann::json& params, const Tenant& tenant);
+
+  Tenant default_tenant_;
+  std::shared_ptr<NamespaceRegistry> namespaces_;  // null: only the default namespace
   std::shared_ptr<EmbeddingService> embedder_;
+  std::shared_ptr<ShardRouter> router_;  // null unless this node routes to shards
+  std::string export_dir_;  // empty: no file access over the API
 };
 
 } // namespace kb
@@ -0,0 +1,29 @@
+#pragma once
+
+#include <cstdint>
+#include <string_view>
+
+namespace kb {
+
+// Streaming encoder for responses, so hot endpoints can answer in either
+// wire format without building a JSON DOM. Callers emit a well-formed
+// sequence: keys only inside objects, each followed by exactly one value.
+class ResponseWriter {
+public:
+  virtual ~ResponseWriter() = default;
+
+  virtual void beginObject() = 0;
+  virtual void endObject() = 0;
+  virtual void beginArray() = 0;
+  virtual void endArray() = 0;
+  virtual void key(std::string_view name) = 0;
+
+  virtual void string(std::string_view value) = 0;
+  virtual void boolean(bool value) = 0;
+  virtual void integer(int64_t value) = 0;
+  virtual void unsignedInteger(uint64_t value) = 0;
+  virtual void real(float value) = 0;
+  virtual void null() = 0;
+};
+
+} // namespace kb
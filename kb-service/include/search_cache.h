@@ -0,0 +1,39 @@
+#pragma once
+
+#include "knowledge_base.h"
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace kb {
+
+// LRU cache of search results, keyed by the SHA-256 of the query vector,
+// top_k and search options. Each entry remembers the index generation it
+// was computed at; looked up at any other generation it is dropped as a
+// miss, so a write invalidates every entry without walking the cache.
+// Thread-safe.
+class SearchResultCache {
+public:
+  explicit SearchResultCache(size_t capacity);
+
+  static std::string key(const float* query, size_t dimension, int top_k, const SearchOptions& options);
+
+  bool lookup(const std::string& key, uint64_t generation, std::vector<SearchResult>* results);
+  void insert(const std::string& key, uint64_t generation, const std::vector<SearchResult>& results);
+
+private:
+  struct Entry {
+    std::string key;
+    uint64_t generation;
+    std::vector<SearchResult> results;
+  };
+
+  size_t capacity_;
+  std::list<Entry> lru_;  // most recently used first
+  std::unordered_map<std::string, std::list<Entry>::iterator> entries_;
+  std::mutex mutex_;
+};
+
+} // namespace kb
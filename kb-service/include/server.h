@@ -7,34 +7,78 @@
 #include <thread>
 #include <vector>
 #include <mutex>
+#include <unordered_map>
+#include "thread_pool.h"
 
 namespace kb {
 
 class KnowledgeBase;
 class RequestHandler;
 
+struct ServerOptions {
+  int backlog = 128;        // listen() backlog
+  int worker_threads = 0;   // request workers; 0 = hardware concurrency
+  std::string bind_address = "127.0.0.1";  // IPv4 address to listen on; 0.0.0.0 for every interface
+  size_t max_request_bytes = 64 << 20;     // longest request line or frame; longer ones close the connection
+  size_t max_queued_requests = 64;         // pipelined requests buffered per connection
+  size_t max_pending_output = 4 << 20;     // unsent response bytes per connection
+};
+
+// Single epoll reactor thread doing all socket I/O, handing complete
+// requests to a fixed pool of workers. Requests on one connection are
+// handled one at a time so responses go out in request order. A connection
+// with max_queued_requests waiting, or max_pending_output unsent, is not
+// read from -- and its requests not handled, for the output -- until the
+// peer catches up, so a client that pipelines without reading its replies
+// is held back by TCP rather than buffered in memory.
+//
+// Each connection speaks newline-delimited JSON unless its first four bytes
+// are the binary preamble ("\xB1KB\x01"). After that, requests and
+// responses are frames of a big-endian u32 length followed by a
+// MessagePack document with the same shape as the JSON one.
 class TCPServer {
 public:
-  TCPServer(int port, std::shared_ptr<KnowledgeBase> kb, std::shared_ptr<RequestHandler> handler);
+  // Port 0 listens on a free port, which port() reports once started
+  TCPServer(int port, std::shared_ptr<KnowledgeBase> kb, std::shared_ptr<RequestHandler> handler,
+            const ServerOptions& options = ServerOptions());
   ~TCPServer();
 
   void start();
   void stop();
   bool isRunning() const { return running_; }
+  int port() const { return port_; }
+  int activeConnections() const { return active_connections_.load(); }
 
 private:
-  void acceptLoop();
-  void handleClient(int client_fd);
-  void joinAllThreads();
+  struct Connection;
+
+  void eventLoop();
+  void acceptConnections();
+  void readFromConnection(const std::shared_ptr<Connection>& conn);
+  void processRequests(const std::shared_ptr<Connection>& conn);
+
+  // The following expect conn->mutex to be held
+  bool splitRequestsLocked(Connection& conn);  // false if the connection was closed
+  bool readPausedLocked(const Connection& conn) const;
+  void scheduleLocked(const std::shared_ptr<Connection>& conn);
+  void flushLocked(Connection& conn);
+  void updateInterestLocked(Connection& conn);
+  void closeLocked(Connection& conn);
+
+  std::shared_ptr<Connection> findConnection(int fd);
 
   int port_;
   std::shared_ptr<KnowledgeBase> kb_;
   std::shared_ptr<RequestHandler> handler_;
+  ServerOptions options_;
   int server_fd_;
+  int epoll_fd_;
+  int wake_fd_;
   std::atomic<bool> running_;
-  std::thread accept_thread_;
-  std::vector<std::shared_ptr<std::thread>> client_threads_;
-  std::mutex threads_mutex_;
+  std::thread event_thread_;
+  std::unique_ptr<ThreadPool> workers_;
+  std::unordered_map<int, std::shared_ptr<Connection>> connections_;
+  std::mutex connections_mutex_;
   std::atomic<int> active_connections_;
 };
 
@@ -0,0 +1,82 @@
+#pragma once
+
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+#include <nlohmann/json.hpp>
+#include "memory_id.h"
+#include "node_client.h"
+#include "thread_pool.h"
+
+namespace kb {
+
+class EmbeddingService;
+
+struct ShardRouterOptions {
+  std::string metric = "l2";  // the shards' metric, which decides whether lower vector scores rank first
+  size_t fanout_threads = 0;  // threads calling shards; 0 = four per shard
+  uint32_t router_id = 0;     // below MemoryIdGenerator::kMaxNodes, distinct for every router of a cluster
+  NodeClientOptions client;
+};
+
+// Spreads memories over kb-service nodes (shards) by a hash of their id and
+// answers the same requests a single node does, namespaces included:
+//  - /add, /update, /remove and /get_embedding go to the shard owning the
+//    id; the router generates ids for memories added without one, so it
+//    knows where they live. /add_batch splits the batch by shard. Generated
+//    ids carry the router id, so routers never generate the same one; an
+//    add a shard refuses as a duplicate id (a router restarted with its
+//    clock behind) is retried with a fresh id.
+//  - /search and /search_batch go to every shard and merge the per-shard
+//    top-k into the global one. The router embeds /search queries itself,
+//    once, rather than each shard embedding them again; /search_by_id
+//    fetches the vector from its owner and searches every shard with it.
+//  - /wait and /stats gather from every shard; preferences live on the
+//    first shard.
+//  - /export, /import, /checkpoint and /replicate address one store and
+//    are sent to each shard directly.
+// Every shard must be up for a request that needs it to succeed. Lexical
+// scores are computed per shard, from that shard's term statistics, so
+// merged lexical and hybrid rankings are close to but not exactly those of
+// one node holding everything.
+class ShardRouter {
+public:
+  // `shards` are host:port addresses; their order decides which shard owns
+  // which ids, so every router of a cluster must list them alike
+  ShardRouter(const std::vector<std::string>& shards, std::shared_ptr<EmbeddingService> embedder,
+              const ShardRouterOptions& options = ShardRouterOptions());
+
+  ShardRouter(const ShardRouter&) = delete;
+  ShardRouter& operator=(const ShardRouter&) = delete;
+
+  // The response to a request, as one node holding every shard would give
+  // it. Unreachable shards throw std::runtime_error.
+  nlohmann::json route(const std::string& endpoint, const nlohmann::json& params);
+
+  // FNV-1a of the id modulo the shard count, the same in every process
+  size_t shardFor(const std::string& id) const;
+  size_t shardCount() const { return shards_.size(); }
+
+private:
+  // Makes the calls in parallel and returns their responses in order
+  std::vector<nlohmann::json> fanOut(const std::string& endpoint,
+                                     const std::vector<std::pair<size_t, nlohmann::json>>& calls);
+  std::vector<nlohmann::json> scatter(const std::string& endpoint, const nlohmann::json& params);
+
+  nlohmann::json routeAdd(const nlohmann::json& params);
+  nlohmann::json routeAddBatch(const nlohmann::json& params);
+  nlohmann::json routeSearch(const nlohmann::json& params);
+  nlohmann::json routeSearchBatch(const nlohmann::json& params);
+  nlohmann::json routeSearchById(const nlohmann::json& params);
+  nlohmann::json routeWait(const nlohmann::json& params);
+  nlohmann::json routeStats(const nlohmann::json& params);
+
+  std::vector<std::unique_ptr<NodeClient>> shards_;
+  std::shared_ptr<EmbeddingService> embedder_;
+  ShardRouterOptions options_;
+  MemoryIdGenerator ids_;
+  ThreadPool pool_;
+};
+
+} // namespace kb
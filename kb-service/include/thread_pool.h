@@ -0,0 +1,39 @@
+#pragma once
+
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <vector>
+
+namespace kb {
+
+// Fixed-size pool of worker threads draining a FIFO task queue.
+class ThreadPool {
+public:
+  explicit ThreadPool(size_t num_threads);
+  ~ThreadPool();
+
+  ThreadPool(const ThreadPool&) = delete;
+  ThreadPool& operator=(const ThreadPool&) = delete;
+
+  void submit(std::function<void()> task);
+
+  // Runs the tasks already queued, then joins the workers. Tasks submitted
+  // afterwards are dropped.
+  void shutdown();
+
+  size_t size() const { return workers_.size(); }
+
+private:
+  void workerLoop();
+
+  std::vector<std::thread> workers_;
+  std::queue<std::function<void()>> tasks_;
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  bool stopping_;
+};
+
+} // namespace kb
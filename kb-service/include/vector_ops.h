@@ -0,0 +1,23 @@
+#pragma once
+
+#include <cstddef>
+
+namespace kb {
+
+// Float kernels shared by the embedding backends and scoring code. On x86
+// the AVX2 versions are picked at runtime when the CPU has them; on ARM
+// NEON is always used. Every path reduces in the same order (eight lanes,
+// folded pairwise, then the remainder in sequence), so results do not
+// depend on which one runs.
+
+float dot(const float* a, const float* b, size_t n);
+float squaredNorm(const float* v, size_t n);
+
+// Scales v to unit L2 length in place; an all-zero vector is left as is.
+// Returns the original norm.
+float normalize(float* v, size_t n);
+
+// out[i] = bytes[i] / 255 * 2 - 1: byte values spread evenly over [-1, 1]
+void bytesToUnitRange(const unsigned char* bytes, size_t n, float* out);
+
+} // namespace kb
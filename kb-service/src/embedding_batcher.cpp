@@ -0,0 +1,123 @@
+#include "embedding_batcher.h"
+#include <algorithm>
+
+namespace kb {
+
+BatchingEmbeddingService::BatchingEmbeddingService(std::shared_ptr<EmbeddingService> inner, size_t max_batch,
+                                                   std::chrono::microseconds window, size_t dispatchers)
+  : inner_(std::move(inner)), max_batch_(std::max<size_t>(1, max_batch)), window_(window), stopping_(false) {
+  dispatchers = std::max<size_t>(1, dispatchers);
+  for (size_t i = 0; i < dispatchers; ++i) {
+    dispatchers_.emplace_back(&BatchingEmbeddingService::dispatchLoop, this);
+  }
+}
+
+BatchingEmbeddingService::~BatchingEmbeddingService() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stopping_ = true;
+  }
+  cv_.notify_all();
+  for (auto& dispatcher : dispatchers_) {
+    dispatcher.join();
+  }
+}
+
+std::vector<std::future<std::vector<float>>> BatchingEmbeddingService::enqueue(
+    const std::vector<std::string>& texts) {
+  std::vector<std::future<std::vector<float>>> futures;
+  futures.reserve(texts.size());
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (const auto& text : texts) {
+      queue_.push_back(Pending{text, std::promise<std::vector<float>>()});
+      futures.push_back(queue_.back().result.get_future());
+    }
+  }
+  cv_.notify_all();
+  return futures;
+}
+
+std::vector<float> BatchingEmbeddingService::embed(const std::string& text) {
+  return enqueue({text})[0].get();
+}
+
+std::vector<std::vector<float>> BatchingEmbeddingService::embedBatch(const std::vector<std::string>& texts) {
+  std::vector<std::future<std::vector<float>>> futures = enqueue(texts);
+  std::vector<std::vector<float>> embeddings;
+  embeddings.reserve(futures.size());
+  for (auto& future : futures) {
+    embeddings.push_back(future.get());
+  }
+  return embeddings;
+}
+
+void BatchingEmbeddingService::dispatchLoop() {
+  std::unique_lock<std::mutex> lock(mutex_);
+
+  while (true) {
+    cv_.wait(lock, [this]() { return stopping_ || !queue_.empty(); });
+    if (queue_.empty()) {
+      // Stopping, and everything queued has been sent
+      return;
+    }
+
+    // Give concurrent callers a moment to join this batch
+    cv_.wait_for(lock, window_, [this]() { return stopping_ || queue_.size() >= max_batch_; });
+    if (queue_.empty()) {
+      // Another dispatcher took the requests
+      continue;
+    }
+
+    size_t count = std::min(queue_.size(), max_batch_);
+    std::vector<Pending> batch;
+    batch.reserve(count);
+    for (size_t i = 0; i < count; ++i) {
+      batch.push_back(std::move(queue_.front()));
+      queue_.pop_front();
+    }
+    lock.unlock();
+
+    send(batch.data(), batch.size());
+
+    lock.lock();
+  }
+}
+
+void BatchingEmbeddingService::send(Pending* batch, size_t count) {
+  std::vector<std::string> texts;
+  texts.reserve(count);
+  for (size_t i = 0; i < count; ++i) {
+    texts.push_back(batch[i].text);
+  }
+
+  std::exception_ptr error;
+  try {
+    std::vector<std::vector<float>> embeddings = inner_->embedBatch(texts);
+    for (size_t i = 0; i < count; ++i) {
+      batch[i].result.set_value(std::move(embeddings.at(i)));
+    }
+    return;
+  } catch (const EmbeddingInputError&) {
+    if (count > 1) {
+      // The texts come from unrelated callers; halve the batch until the
+      // ones the service rejects on their own are found
+      send(batch, count / 2);
+      send(batch + count / 2, count - count / 2);
+      return;
+    }
+    error = std::current_exception();
+  } catch (...) {
+    error = std::current_exception();
+  }
+
+  for (size_t i = 0; i < count; ++i) {
+    try {
+      batch[i].result.set_exception(error);
+    } catch (const std::future_error&) {
+      // Already satisfied before the failure
+    }
+  }
+}
+
+} // namespace kb
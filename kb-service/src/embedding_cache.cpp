@@ -0,0 +1,93 @@
+#include "embedding_cache.h"
+#include <openssl/sha.h>
+
+namespace kb {
+
+CachingEmbeddingService::CachingEmbeddingService(std::shared_ptr<EmbeddingService> inner, size_t capacity)
+  : inner_(std::move(inner)), capacity_(capacity), hits_(0), misses_(0) {}
+
+std::string CachingEmbeddingService::cacheKey(const std::string& text) {
+  unsigned char hash[SHA256_DIGEST_LENGTH];
+  SHA256(reinterpret_cast<const unsigned char*>(text.c_str()), text.length(), hash);
+  return std::string(reinterpret_cast<const char*>(hash), sizeof(hash));
+}
+
+bool CachingEmbeddingService::lookup(const std::string& key, std::vector<float>* embedding) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto it = entries_.find(key);
+  if (it == entries_.end()) {
+    ++misses_;
+    return false;
+  }
+
+  lru_.splice(lru_.begin(), lru_, it->second);
+  *embedding = it->second->second;
+  ++hits_;
+  return true;
+}
+
+void CachingEmbeddingService::insert(const std::string& key, const std::vector<float>& embedding) {
+  if (capacity_ == 0) {
+    return;
+  }
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto it = entries_.find(key);
+  if (it != entries_.end()) {
+    // Another caller embedded the same text meanwhile
+    lru_.splice(lru_.begin(), lru_, it->second);
+    return;
+  }
+
+  lru_.emplace_front(key, embedding);
+  entries_[key] = lru_.begin();
+  if (lru_.size() > capacity_) {
+    entries_.erase(lru_.back().first);
+    lru_.pop_back();
+  }
+}
+
+std::vector<float> CachingEmbeddingService::embed(const std::string& text) {
+  std::string key = cacheKey(text);
+  std::vector<float> embedding;
+  if (!lookup(key, &embedding)) {
+    embedding = inner_->embed(text);
+    insert(key, embedding);
+  }
+  return embedding;
+}
+
+std::vector<std::vector<float>> CachingEmbeddingService::embedBatch(const std::vector<std::string>& texts) {
+  std::vector<std::vector<float>> embeddings(texts.size());
+
+  // Only texts not cached, once each, go to the inner service
+  std::vector<std::string> keys(texts.size());
+  std::unordered_map<std::string, size_t> miss_slots;
+  std::vector<std::string> misses;
+  for (size_t i = 0; i < texts.size(); ++i) {
+    keys[i] = cacheKey(texts[i]);
+    if (miss_slots.count(keys[i]) == 0 && !lookup(keys[i], &embeddings[i])) {
+      miss_slots.emplace(keys[i], misses.size());
+      misses.push_back(texts[i]);
+    }
+  }
+
+  if (misses.empty()) {
+    return embeddings;
+  }
+
+  std::vector<std::vector<float>> computed = inner_->embedBatch(misses);
+  for (size_t i = 0; i < texts.size(); ++i) {
+    auto it = miss_slots.find(keys[i]);
+    if (it != miss_slots.end()) {
+      embeddings[i] = computed[it->second];
+    }
+  }
+  for (const auto& [key, slot] : miss_slots) {
+    insert(key, computed[slot]);
+  }
+
+  return embeddings;
+}
+
+} // namespace kb
@@ -1,9 +1,19 @@
 #include "embedding_service.h"
+#include "vector_ops.h"
 #include <openssl/sha.h>
-#include <cmath>
+#include <algorithm>
 
 namespace kb {
 
+std::vector<std::vector<float>> EmbeddingService::embedBatch(const std::vector<std::string>& texts) {
+  std::vector<std::vector<float>> embeddings;
+  embeddings.reserve(texts.size());
+  for (const auto& text : texts) {
+    embeddings.push_back(embed(text));
+  }
+  return embeddings;
+}
+
 MockEmbeddingService::MockEmbeddingService(int dim) : dim_(dim) {}
 
 std::vector<float> MockEmbeddingService::embed(const std::string& text) {
@@ -20,29 +30,20 @@ std::vector<float> MockEmbeddingService::embed(const std::string& text) {
   unsigned char hash[SHA256_DIGEST_LENGTH];
   SHA256(reinterpret_cast<const unsigned char*>(text.c_str()), text.length(), hash);
 
-  // Expand hash to fill embedding dimension
-  for (int i = 0; i < dim_; ++i) {
-    int hash_idx = i % SHA256_DIGEST_LENGTH;
-    int byte_idx = (i / SHA256_DIGEST_LENGTH) % SHA256_DIGEST_LENGTH;
-
-    // Combine multiple hash bytes to create pseudo-random values
-    unsigned char combined = hash[hash_idx] ^ hash[byte_idx];
-    embedding[i] = (static_cast<float>(combined) / 255.0f) * 2.0f - 1.0f;
-  }
-
-  // Normalize to unit length
-  float norm = 0.0f;
-  for (float v : embedding) {
-    norm += v * v;
-  }
-  norm = std::sqrt(norm);
-
-  if (norm > 0.0f) {
-    for (float& v : embedding) {
-      v /= norm;
+  // Element i combines hash bytes i % 32 and (i / 32) % 32, so each run of
+  // 32 elements is the hash XORed with one of its own bytes
+  std::vector<unsigned char> combined(dim_);
+  for (int start = 0; start < dim_; start += SHA256_DIGEST_LENGTH) {
+    unsigned char key = hash[(start / SHA256_DIGEST_LENGTH) % SHA256_DIGEST_LENGTH];
+    int count = std::min(SHA256_DIGEST_LENGTH, dim_ - start);
+    for (int j = 0; j < count; ++j) {
+      combined[start + j] = hash[j] ^ key;
     }
   }
 
+  bytesToUnitRange(combined.data(), combined.size(), embedding.data());
+  normalize(embedding.data(), embedding.size());
+
   return embedding;
 }
 
@@ -0,0 +1,125 @@
+#include "export_stream.h"
+#include <cstring>
+
+namespace kb {
+
+namespace {
+
+const char kExportMagic[8] = {'K', 'B', 'E', 'X', 'P', 'O', 'R', 'T'};
+constexpr uint32_t kExportVersion = 1;
+constexpr char kEndMarker = 'e';
+
+// Fields beyond this are taken as corruption rather than allocated
+constexpr uint32_t kMaxFieldBytes = 1u << 30;
+
+// Shifts rather than memcpy, so the stream is little-endian on any host
+template <typename T>
+void putFixed(std::string* out, T value) {
+  for (size_t i = 0; i < sizeof(T); ++i) {
+    out->push_back(static_cast<char>((static_cast<uint64_t>(value) >> (8 * i)) & 0xff));
+  }
+}
+
+template <typename T>
+bool readFixed(FILE* in, T* value) {
+  unsigned char bytes[sizeof(T)];
+  if (std::fread(bytes, sizeof(T), 1, in) != 1) {
+    return false;
+  }
+  uint64_t parsed = 0;
+  for (size_t i = 0; i < sizeof(T); ++i) {
+    parsed |= static_cast<uint64_t>(bytes[i]) << (8 * i);
+  }
+  *value = static_cast<T>(parsed);
+  return true;
+}
+
+void putString(std::string* out, const std::string& value) {
+  putFixed(out, static_cast<uint32_t>(value.size()));
+  out->append(value);
+}
+
+} // namespace
+
+bool ExportWriter::put(const std::string& bytes) {
+  return std::fwrite(bytes.data(), 1, bytes.size(), out_) == bytes.size();
+}
+
+bool ExportWriter::writeHeader(uint32_t dimension, VectorEncoding encoding) {
+  std::string header(kExportMagic, sizeof(kExportMagic));
+  putFixed(&header, kExportVersion);
+  putFixed(&header, dimension);
+  std::string name = vectorEncodingName(encoding);
+  header.push_back(static_cast<char>(name.size()));
+  header.append(name);
+  return put(header);
+}
+
+bool ExportWriter::write(const ExportEntry& entry) {
+  std::string bytes;
+  bytes.reserve(1 + 3 * sizeof(uint32_t) + entry.key.size() + entry.value.size() + entry.vector.size());
+  bytes.push_back(static_cast<char>(entry.kind));
+  putString(&bytes, entry.key);
+  putString(&bytes, entry.value);
+  if (entry.kind == ExportEntry::Kind::Memory) {
+    putString(&bytes, entry.vector);
+  }
+  ++count_;
+  return put(bytes);
+}
+
+bool ExportWriter::finish() {
+  std::string end(1, kEndMarker);
+  putFixed(&end, count_);
+  return put(end) && std::fflush(out_) == 0;
+}
+
+bool ExportReader::readHeader(uint32_t* dimension, VectorEncoding* encoding) {
+  char magic[sizeof(kExportMagic)];
+  uint32_t version;
+  unsigned char length;
+  if (std::fread(magic, sizeof(magic), 1, in_) != 1 || std::memcmp(magic, kExportMagic, sizeof(magic)) != 0 ||
+      !readFixed(in_, &version) || version != kExportVersion || !readFixed(in_, dimension) ||
+      std::fread(&length, 1, 1, in_) != 1) {
+    return false;
+  }
+  std::string name(length, '\0');
+  return (length == 0 || std::fread(&name[0], length, 1, in_) == 1) && parseVectorEncoding(name, encoding);
+}
+
+bool ExportReader::readString(std::string* value) {
+  uint32_t length;
+  if (!readFixed(in_, &length) || length > kMaxFieldBytes) {
+    return false;
+  }
+  value->resize(length);
+  return length == 0 || std::fread(&(*value)[0], length, 1, in_) == 1;
+}
+
+bool ExportReader::next(ExportEntry* entry) {
+  int kind = std::fgetc(in_);
+  if (kind == kEndMarker) {
+    uint64_t count;
+    complete_ = readFixed(in_, &count) && count == count_;
+    return false;
+  }
+  if (kind != static_cast<int>(ExportEntry::Kind::Memory) && kind != static_cast<int>(ExportEntry::Kind::Preference)) {
+    return false;
+  }
+
+  entry->kind = static_cast<ExportEntry::Kind>(kind);
+  if (!readString(&entry->key) || !readString(&entry->value)) {
+    return false;
+  }
+  if (entry->kind == ExportEntry::Kind::Memory) {
+    if (!readString(&entry->vector)) {
+      return false;
+    }
+  } else {
+    entry->vector.clear();
+  }
+  ++count_;
+  return true;
+}
+
+} // namespace kb
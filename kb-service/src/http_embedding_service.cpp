@@ -0,0 +1,418 @@
+#include "http_embedding_service.h"
+#include "vector_ops.h"
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <nlohmann/json.hpp>
+
+using json = nlohmann::json;
+
+namespace kb {
+
+namespace {
+
+constexpr size_t kReadChunkSize = 64 * 1024;
+
+// Upper bound on a response body; 1024 floats as JSON text is ~20KB, so
+// this leaves room for batches of several thousand texts.
+constexpr size_t kMaxResponseSize = 256 * 1024 * 1024;
+
+// The connection failed before a response arrived, so the request can be
+// retried on a fresh one (a pooled keep-alive socket may have been closed
+// by the server in the meantime).
+class ConnectionError : public std::runtime_error {
+public:
+  using std::runtime_error::runtime_error;
+};
+
+std::string lowercase(std::string value) {
+  std::transform(value.begin(), value.end(), value.begin(),
+                 [](unsigned char c) { return static_cast<char>(std::tolower(c)); });
+  return value;
+}
+
+std::string trim(const std::string& value) {
+  size_t begin = value.find_first_not_of(" \t");
+  if (begin == std::string::npos) {
+    return "";
+  }
+  size_t end = value.find_last_not_of(" \t");
+  return value.substr(begin, end - begin + 1);
+}
+
+void sendAll(int fd, const std::string& data) {
+  size_t sent = 0;
+  while (sent < data.size()) {
+    ssize_t n = ::send(fd, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      throw ConnectionError("Failed to send embedding request: " + std::string(std::strerror(errno)));
+    }
+    sent += static_cast<size_t>(n);
+  }
+}
+
+// Buffered reads from a blocking socket with SO_RCVTIMEO set.
+class ResponseReader {
+public:
+  explicit ResponseReader(int fd) : fd_(fd), received_(0) {}
+
+  // Next line without its CRLF
+  std::string readLine() {
+    while (true) {
+      size_t end = buffer_.find("\r\n");
+      if (end != std::string::npos) {
+        std::string line = buffer_.substr(0, end);
+        buffer_.erase(0, end + 2);
+        return line;
+      }
+      fill();
+    }
+  }
+
+  std::string read(size_t n) {
+    while (buffer_.size() < n) {
+      fill();
+    }
+    std::string data = buffer_.substr(0, n);
+    buffer_.erase(0, n);
+    return data;
+  }
+
+  std::string readToEnd() {
+    while (fill(false)) {
+    }
+    return std::move(buffer_);
+  }
+
+private:
+  // Returns false on orderly shutdown when allowed, throws otherwise
+  bool fill(bool require = true) {
+    char chunk[kReadChunkSize];
+    ssize_t n;
+    do {
+      n = ::recv(fd_, chunk, sizeof(chunk), 0);
+    } while (n < 0 && errno == EINTR);
+
+    if (n < 0) {
+      std::string error = "Failed to read embedding response: " + std::string(std::strerror(errno));
+      // A server that closed an idle connection usually resets it once the
+      // request arrives rather than ending it cleanly
+      if (received_ == 0 && (errno == ECONNRESET || errno == EPIPE)) {
+        throw ConnectionError(error);
+      }
+      throw std::runtime_error(error);
+    }
+    if (n == 0) {
+      if (!require) {
+        return false;
+      }
+      if (received_ == 0) {
+        throw ConnectionError("Embedding server closed the connection");
+      }
+      throw std::runtime_error("Embedding response truncated");
+    }
+
+    received_ += static_cast<size_t>(n);
+    if (received_ > kMaxResponseSize) {
+      throw std::runtime_error("Embedding response too large");
+    }
+    buffer_.append(chunk, static_cast<size_t>(n));
+    return true;
+  }
+
+  int fd_;
+  size_t received_;
+  std::string buffer_;
+};
+
+} // namespace
+
+HttpEmbeddingService::HttpEmbeddingService(const HttpEmbeddingOptions& options, int dim)
+  : options_(options), dim_(dim), port_("80"), path_("/v1/embeddings") {
+
+  const std::string scheme = "http://";
+  if (options_.url.compare(0, scheme.size(), scheme) != 0) {
+    throw std::runtime_error("Embedding URL must start with http://: " + options_.url);
+  }
+
+  std::string rest = options_.url.substr(scheme.size());
+  size_t slash = rest.find('/');
+  std::string authority = rest.substr(0, slash);
+  authority_ = authority;
+  if (slash != std::string::npos) {
+    path_ = rest.substr(slash);
+  }
+
+  // host, host:port, [v6 address] or [v6 address]:port
+  size_t colon = authority.rfind(':');
+  size_t bracket = authority.rfind(']');
+  if (colon != std::string::npos && (bracket == std::string::npos || colon > bracket)) {
+    port_ = authority.substr(colon + 1);
+    authority.resize(colon);
+  }
+  if (authority.size() >= 2 && authority.front() == '[' && authority.back() == ']') {
+    authority = authority.substr(1, authority.size() - 2);
+  }
+  host_ = authority;
+
+  if (host_.empty() || port_.empty() || (host_.find(':') != std::string::npos && authority_.front() != '[')) {
+    throw std::runtime_error("Invalid embedding URL: " + options_.url);
+  }
+}
+
+HttpEmbeddingService::~HttpEmbeddingService() {
+  for (int fd : idle_) {
+    ::close(fd);
+  }
+}
+
+int HttpEmbeddingService::connect() const {
+  addrinfo hints;
+  std::memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+
+  addrinfo* addresses = nullptr;
+  int rc = ::getaddrinfo(host_.c_str(), port_.c_str(), &hints, &addresses);
+  if (rc != 0) {
+    throw std::runtime_error("Failed to resolve embedding server " + host_ + ": " + gai_strerror(rc));
+  }
+
+  timeval timeout;
+  timeout.tv_sec = options_.timeout_ms / 1000;
+  timeout.tv_usec = (options_.timeout_ms % 1000) * 1000;
+
+  int fd = -1;
+  for (addrinfo* address = addresses; address; address = address->ai_next) {
+    fd = ::socket(address->ai_family, address->ai_socktype | SOCK_CLOEXEC, address->ai_protocol);
+    if (fd < 0) {
+      continue;
+    }
+
+    // SO_SNDTIMEO also bounds connect() on Linux
+    ::setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    ::setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    if (::connect(fd, address->ai_addr, address->ai_addrlen) == 0) {
+      break;
+    }
+    ::close(fd);
+    fd = -1;
+  }
+  ::freeaddrinfo(addresses);
+
+  if (fd < 0) {
+    throw std::runtime_error("Failed to connect to embedding server " + host_ + ":" + port_);
+  }
+
+  int one = 1;
+  ::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  return fd;
+}
+
+int HttpEmbeddingService::acquireConnection(bool* reused) {
+  {
+    std::lock_guard<std::mutex> lock(idle_mutex_);
+    if (!idle_.empty()) {
+      int fd = idle_.back();
+      idle_.pop_back();
+      *reused = true;
+      return fd;
+    }
+  }
+  *reused = false;
+  return connect();
+}
+
+void HttpEmbeddingService::releaseConnection(int fd) {
+  {
+    std::lock_guard<std::mutex> lock(idle_mutex_);
+    if (idle_.size() < options_.max_idle_connections) {
+      idle_.push_back(fd);
+      return;
+    }
+  }
+  ::close(fd);
+}
+
+std::string HttpEmbeddingService::roundTrip(int fd, const std::string& request, bool* reusable) {
+  sendAll(fd, request);
+  ResponseReader reader(fd);
+
+  // Status line: HTTP/1.x CODE REASON
+  std::string status_line = reader.readLine();
+  if (status_line.size() < 12 || status_line.compare(0, 5, "HTTP/") != 0) {
+    throw std::runtime_error("Malformed embedding response: " + status_line);
+  }
+  bool http11 = status_line.compare(0, 8, "HTTP/1.1") == 0;
+  int status = std::atoi(status_line.c_str() + 9);
+
+  long long content_length = -1;
+  bool chunked = false;
+  bool close_requested = !http11;
+  for (std::string line = reader.readLine(); !line.empty(); line = reader.readLine()) {
+    size_t colon = line.find(':');
+    if (colon == std::string::npos) {
+      continue;
+    }
+    std::string name = lowercase(trim(line.substr(0, colon)));
+    std::string value = lowercase(trim(line.substr(colon + 1)));
+    if (name == "content-length") {
+      content_length = std::stoll(value);
+    } else if (name == "transfer-encoding") {
+      chunked = value.find("chunked") != std::string::npos;
+    } else if (name == "connection") {
+      close_requested = value.find("close") != std::string::npos;
+    }
+  }
+
+  std::string body;
+  if (chunked) {
+    while (true) {
+      size_t size = std::stoul(reader.readLine(), nullptr, 16);
+      if (size == 0) {
+        // Skip trailers
+        while (!reader.readLine().empty()) {
+        }
+        break;
+      }
+      if (body.size() + size > kMaxResponseSize) {
+        throw std::runtime_error("Embedding response too large");
+      }
+      body += reader.read(size);
+      reader.readLine();
+    }
+  } else if (content_length >= 0) {
+    if (static_cast<unsigned long long>(content_length) > kMaxResponseSize) {
+      throw std::runtime_error("Embedding response too large");
+    }
+    body = reader.read(static_cast<size_t>(content_length));
+  } else {
+    body = reader.readToEnd();
+    close_requested = true;
+  }
+
+  *reusable = !close_requested;
+
+  if (status != 200) {
+    std::string error = "Embedding server returned " + std::to_string(status) + ": " + body.substr(0, 200);
+    // Only these blame the request body. Other 4xx are the server's state
+    // or our configuration (timeouts, rate limits, a revoked key, a wrong
+    // URL) and would fail any input the same way.
+    if (status == 400 || status == 413 || status == 422) {
+      throw EmbeddingInputError(error);
+    }
+    throw std::runtime_error(error);
+  }
+  return body;
+}
+
+std::vector<float> HttpEmbeddingService::embed(const std::string& text) {
+  return embedBatch({text})[0];
+}
+
+std::vector<std::vector<float>> HttpEmbeddingService::embedBatch(const std::vector<std::string>& texts) {
+  // Empty texts get the zero vector, like the mock; model servers reject them
+  std::vector<std::vector<float>> embeddings(texts.size(), std::vector<float>(dim_, 0.0f));
+  std::vector<size_t> positions;
+  json inputs = json::array();
+  for (size_t i = 0; i < texts.size(); ++i) {
+    if (!texts[i].empty()) {
+      positions.push_back(i);
+      inputs.push_back(texts[i]);
+    }
+  }
+  if (positions.empty()) {
+    return embeddings;
+  }
+
+  json payload;
+  payload["input"] = std::move(inputs);
+  if (!options_.model.empty()) {
+    payload["model"] = options_.model;
+  }
+  std::string body = payload.dump();
+
+  std::string request = "POST " + path_ + " HTTP/1.1\r\n"
+                        "Host: " + authority_ + "\r\n"
+                        "Content-Type: application/json\r\n"
+                        "Accept: application/json\r\n"
+                        "Connection: keep-alive\r\n"
+                        "Content-Length: " + std::to_string(body.size()) + "\r\n";
+  if (!options_.api_key.empty()) {
+    request += "Authorization: Bearer " + options_.api_key + "\r\n";
+  }
+  request += "\r\n";
+  request += body;
+
+  std::string response_body;
+  for (int attempt = 0;; ++attempt) {
+    bool reused = false;
+    int fd = acquireConnection(&reused);
+    try {
+      bool reusable = false;
+      response_body = roundTrip(fd, request, &reusable);
+      if (reusable) {
+        releaseConnection(fd);
+      } else {
+        ::close(fd);
+      }
+      break;
+    } catch (const ConnectionError&) {
+      ::close(fd);
+      if (!reused || attempt > 0) {
+        throw;
+      }
+      // A pooled connection went stale; retry once on a fresh one
+    } catch (...) {
+      ::close(fd);
+      throw;
+    }
+  }
+
+  json response = json::parse(response_body);
+  const json& data = response.at("data");
+  if (!data.is_array() || data.size() != positions.size()) {
+    throw std::runtime_error("Embedding server returned " + std::to_string(data.size()) +
+                           " embeddings for " + std::to_string(positions.size()) + " inputs");
+  }
+
+  // Every input must get exactly one embedding; a repeated index would
+  // leave another input with the zero vector
+  std::vector<bool> filled(positions.size(), false);
+  for (size_t i = 0; i < data.size(); ++i) {
+    size_t index = data[i].value("index", i);
+    if (index >= positions.size()) {
+      throw std::runtime_error("Embedding server returned an out-of-range index");
+    }
+    if (filled[index]) {
+      throw std::runtime_error("Embedding server returned index " + std::to_string(index) + " twice");
+    }
+    filled[index] = true;
+
+    std::vector<float> embedding = data[i].at("embedding").get<std::vector<float>>();
+    if (embedding.size() != static_cast<size_t>(dim_)) {
+      // A model that does not match --dim, not a problem with the text
+      throw std::runtime_error("Embedding server returned " + std::to_string(embedding.size()) +
+                               " dimensions, expected " + std::to_string(dim_));
+    }
+    if (options_.normalize) {
+      normalize(embedding.data(), embedding.size());
+    }
+    embeddings[positions[index]] = std::move(embedding);
+  }
+
+  return embeddings;
+}
+
+} // namespace kb
@@ -0,0 +1,285 @@
+#include "ingest_pipeline.h"
+#include <algorithm>
+#include <iostream>
+#include <iterator>
+#include <stdexcept>
+
+namespace kb {
+
+namespace {
+
+constexpr size_t kMaxFailures = 1024;
+
+} // namespace
+
+IngestPipeline::IngestPipeline(std::shared_ptr<KnowledgeBase> kb, std::shared_ptr<EmbeddingService> embedder,
+                               const IngestOptions& options)
+  : kb_(std::move(kb)), embedder_(std::move(embedder)), options_(options), next_ticket_(1), stopping_(false) {
+  options_.max_batch = std::max<size_t>(1, options_.max_batch);
+
+  // Resume memories accepted before the last shutdown
+  for (auto& queued : kb_->queuedMemories()) {
+    next_ticket_ = std::max(next_ticket_, queued.first + 1);
+    outstanding_.insert(queued.first);
+    queue_.push_back(Item{queued.first, std::move(queued.second)});
+  }
+
+  worker_ = std::thread(&IngestPipeline::run, this);
+}
+
+IngestPipeline::~IngestPipeline() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stopping_ = true;
+  }
+  work_cv_.notify_all();
+  worker_.join();
+}
+
+std::string IngestPipeline::submit(const Memory& memory, uint64_t* ticket) {
+  uint64_t assigned;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    assigned = next_ticket_++;
+    outstanding_.insert(assigned);
+  }
+
+  // The durable write happens outside the lock so concurrent submissions
+  // share RocksDB's group commit. It refuses ids stored or queued already.
+  std::string id = kb_->enqueue(assigned, memory);
+
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (id.empty()) {
+      outstanding_.erase(assigned);
+    } else {
+      Item item{assigned, memory};
+      item.memory.id = id;
+      item.memory.embedding.clear();
+      queue_.push_back(std::move(item));
+    }
+  }
+
+  if (id.empty()) {
+    // Waiters on later tickets may have been held up by this one
+    done_cv_.notify_all();
+    return "";
+  }
+
+  work_cv_.notify_one();
+  *ticket = assigned;
+  return id;
+}
+
+bool IngestPipeline::waitFor(uint64_t ticket, std::chrono::milliseconds timeout) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  return done_cv_.wait_for(lock, timeout, [this, ticket]() { return !outstanding_.count(ticket); });
+}
+
+bool IngestPipeline::waitForAll(uint64_t ticket, std::chrono::milliseconds timeout) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  return done_cv_.wait_for(lock, timeout, [this, ticket]() {
+    return outstanding_.empty() || *outstanding_.begin() > ticket;
+  });
+}
+
+uint64_t IngestPipeline::lastTicket() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return next_ticket_ - 1;
+}
+
+std::vector<IngestFailure> IngestPipeline::failures(uint64_t since, uint64_t ticket) const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  std::vector<IngestFailure> found;
+  for (auto it = failures_.upper_bound(since); it != failures_.end() && it->first <= ticket; ++it) {
+    found.push_back(it->second);
+  }
+  return found;
+}
+
+size_t IngestPipeline::pending() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return outstanding_.size();
+}
+
+void IngestPipeline::run() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  auto retry_due = [this]() {
+    return !retrying_.empty() && retrying_.begin()->first <= std::chrono::steady_clock::now();
+  };
+
+  while (true) {
+    while (!stopping_ && queue_.empty() && !retry_due()) {
+      if (retrying_.empty()) {
+        work_cv_.wait(lock);
+      } else {
+        work_cv_.wait_until(lock, retrying_.begin()->first);
+      }
+    }
+    if (stopping_ && queue_.empty()) {
+      // Everything queued has been processed; memories still waiting to be
+      // retried stay durable in the ingest queue
+      return;
+    }
+
+    std::vector<Item> batch;
+    if (retry_due()) {
+      while (batch.size() < options_.max_batch && retry_due()) {
+        batch.push_back(std::move(retrying_.begin()->second));
+        retrying_.erase(retrying_.begin());
+      }
+    } else {
+      // Let a burst of submissions fill the batch
+      work_cv_.wait_for(lock, options_.max_delay,
+                        [this]() { return stopping_ || queue_.size() >= options_.max_batch; });
+
+      size_t count = std::min(queue_.size(), options_.max_batch);
+      batch.assign(std::make_move_iterator(queue_.begin()), std::make_move_iterator(queue_.begin() + count));
+      queue_.erase(queue_.begin(), queue_.begin() + count);
+    }
+    lock.unlock();
+
+    // Memories back from a failed write were embedded (or given up on)
+    // already and only need storing
+    Embedded embedded;
+    std::vector<Item> to_embed;
+    for (Item& item : batch) {
+      if (item.memory.embedding.empty() && item.error.empty()) {
+        to_embed.push_back(std::move(item));
+      } else {
+        embedded.done.push_back(std::move(item));
+      }
+    }
+    if (!to_embed.empty()) {
+      embed(std::move(to_embed), &embedded);
+    }
+
+    // Memories given up on go in without an embedding, which only drops
+    // their queue entries
+    std::vector<Memory> memories;
+    std::vector<uint64_t> tickets;
+    memories.reserve(embedded.done.size());
+    tickets.reserve(embedded.done.size());
+    for (Item& item : embedded.done) {
+      memories.push_back(std::move(item.memory));
+      tickets.push_back(item.ticket);
+    }
+    std::vector<std::string> ids;
+    bool stored = true;
+    if (!memories.empty()) {
+      ids = kb_->addBatch(memories, tickets);
+      stored = !ids.empty();
+    }
+    if (stored) {
+      for (size_t i = 0; i < memories.size(); ++i) {
+        if (embedded.done[i].error.empty() && ids[i].empty()) {
+          embedded.done[i].error = "Memory id already exists";
+        }
+      }
+    } else {
+      // Nothing was written and the queue entries are all still there, so
+      // the batch is retried like a failed embedding call, tickets and all
+      for (size_t i = 0; i < memories.size(); ++i) {
+        Item& item = embedded.done[i];
+        item.memory = std::move(memories[i]);
+        ++item.retries;
+        embedded.retry.push_back(std::move(item));
+      }
+      memories.clear();
+      embedded.error = "storing the batch failed";
+    }
+
+    lock.lock();
+    for (size_t i = 0; i < memories.size(); ++i) {
+      outstanding_.erase(tickets[i]);
+      if (!embedded.done[i].error.empty()) {
+        failures_[tickets[i]] = IngestFailure{tickets[i], memories[i].id, std::move(embedded.done[i].error)};
+        if (failures_.size() > kMaxFailures) {
+          failures_.erase(failures_.begin());
+        }
+      }
+    }
+    done_cv_.notify_all();
+
+    if (embedded.retry.empty()) {
+      continue;
+    }
+    std::cerr << "Ingest: " << embedded.retry.size() << " memories failed, will retry: "
+              << embedded.error << std::endl;
+    auto now = std::chrono::steady_clock::now();
+    for (Item& item : embedded.retry) {
+      auto delay = options_.retry_delay * (1 << std::min(item.retries - 1, 16));
+      auto deadline = now + std::min<std::chrono::milliseconds>(delay, options_.max_retry_delay);
+      retrying_.emplace(deadline, std::move(item));
+    }
+  }
+}
+
+void IngestPipeline::embed(std::vector<Item> batch, Embedded* result) {
+  std::vector<std::string> texts;
+  texts.reserve(batch.size());
+  for (const auto& item : batch) {
+    texts.push_back(item.memory.content);
+  }
+
+  std::string error;
+  bool rejected = false;
+  try {
+    std::vector<std::vector<float>> embeddings = embedder_->embedBatch(texts);
+    // Answers that do not fit the store point at the embedder (a model of
+    // another dimension), not at the memories, so they never count as
+    // rejections: addBatch() would drop the memories for good
+    if (embeddings.size() != batch.size()) {
+      throw std::runtime_error("embedder returned " + std::to_string(embeddings.size()) + " embeddings for " +
+                               std::to_string(batch.size()) + " texts");
+    }
+    for (const auto& embedding : embeddings) {
+      if (embedding.size() != static_cast<size_t>(kb_->dimension())) {
+        throw std::runtime_error("embedder returned " + std::to_string(embedding.size()) +
+                                 " dimensions, the store has " + std::to_string(kb_->dimension()));
+      }
+    }
+    for (size_t i = 0; i < batch.size(); ++i) {
+      batch[i].memory.embedding = std::move(embeddings[i]);
+      result->done.push_back(std::move(batch[i]));
+    }
+    return;
+  } catch (const EmbeddingInputError& e) {
+    error = e.what();
+    rejected = true;
+  } catch (const std::exception& e) {
+    error = e.what();
+  }
+
+  result->error = error;
+  if (!rejected) {
+    // Nothing points at the input, so the batch is tried again as it is
+    for (Item& item : batch) {
+      ++item.retries;
+      result->retry.push_back(std::move(item));
+    }
+    return;
+  }
+
+  if (batch.size() > 1) {
+    std::vector<Item> second(std::make_move_iterator(batch.begin() + batch.size() / 2),
+                             std::make_move_iterator(batch.end()));
+    batch.resize(batch.size() / 2);
+    embed(std::move(batch), result);
+    embed(std::move(second), result);
+    return;
+  }
+
+  Item& item = batch.front();
+  ++item.retries;
+  if (++item.attempts < options_.max_attempts) {
+    result->retry.push_back(std::move(item));
+    return;
+  }
+  std::cerr << "Ingest: giving up on memory " << item.memory.id << " after " << item.attempts
+            << " attempts: " << error << std::endl;
+  item.error = "Embedding failed: " + error;
+  result->done.push_back(std::move(item));
+}
+
+} // namespace kb
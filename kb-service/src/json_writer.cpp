@@ -0,0 +1,167 @@
+#include "json_writer.h"
+#include <charconv>
+#include <cmath>
+
+namespace kb {
+
+namespace {
+
+constexpr char kHexDigits[] = "0123456789abcdef";
+constexpr char kReplacementCharacter[] = "\xEF\xBF\xBD";
+
+// Length of the valid UTF-8 sequence starting at p, or 0 if it is invalid
+// (truncated, overlong, a surrogate or beyond U+10FFFF)
+size_t utf8SequenceLength(const unsigned char* p, const unsigned char* end) {
+  auto continuation = [](unsigned char c) { return (c & 0xC0) == 0x80; };
+  size_t available = static_cast<size_t>(end - p);
+
+  if (p[0] >= 0xC2 && p[0] <= 0xDF) {
+    return available >= 2 && continuation(p[1]) ? 2 : 0;
+  }
+  if (p[0] >= 0xE0 && p[0] <= 0xEF) {
+    if (available < 3 || !continuation(p[1]) || !continuation(p[2])) {
+      return 0;
+    }
+    if ((p[0] == 0xE0 && p[1] < 0xA0) || (p[0] == 0xED && p[1] > 0x9F)) {
+      return 0;
+    }
+    return 3;
+  }
+  if (p[0] >= 0xF0 && p[0] <= 0xF4) {
+    if (available < 4 || !continuation(p[1]) || !continuation(p[2]) || !continuation(p[3])) {
+      return 0;
+    }
+    if ((p[0] == 0xF0 && p[1] < 0x90) || (p[0] == 0xF4 && p[1] > 0x8F)) {
+      return 0;
+    }
+    return 4;
+  }
+  return 0;
+}
+
+} // namespace
+
+void JsonWriter::separate() {
+  if (after_key_) {
+    after_key_ = false;
+    return;
+  }
+  if (!first_) {
+    out_->push_back(',');
+  }
+  first_ = false;
+}
+
+void JsonWriter::beginObject() {
+  separate();
+  out_->push_back('{');
+  first_ = true;
+}
+
+void JsonWriter::endObject() {
+  out_->push_back('}');
+  first_ = false;
+}
+
+void JsonWriter::beginArray() {
+  separate();
+  out_->push_back('[');
+  first_ = true;
+}
+
+void JsonWriter::endArray() {
+  out_->push_back(']');
+  first_ = false;
+}
+
+void JsonWriter::key(std::string_view name) {
+  string(name);
+  out_->push_back(':');
+  after_key_ = true;
+}
+
+void JsonWriter::string(std::string_view value) {
+  separate();
+  out_->push_back('"');
+
+  const auto* p = reinterpret_cast<const unsigned char*>(value.data());
+  const auto* end = p + value.size();
+  while (p < end) {
+    // Copy runs that need no escaping in one append
+    const auto* run = p;
+    while (p < end && *p >= 0x20 && *p < 0x80 && *p != '"' && *p != '\\') {
+      ++p;
+    }
+    out_->append(reinterpret_cast<const char*>(run), static_cast<size_t>(p - run));
+    if (p == end) {
+      break;
+    }
+
+    unsigned char c = *p;
+    if (c >= 0x80) {
+      size_t length = utf8SequenceLength(p, end);
+      if (length == 0) {
+        out_->append(kReplacementCharacter);
+        ++p;
+      } else {
+        out_->append(reinterpret_cast<const char*>(p), length);
+        p += length;
+      }
+      continue;
+    }
+
+    switch (c) {
+      case '"': out_->append("\\\""); break;
+      case '\\': out_->append("\\\\"); break;
+      case '\b': out_->append("\\b"); break;
+      case '\f': out_->append("\\f"); break;
+      case '\n': out_->append("\\n"); break;
+      case '\r': out_->append("\\r"); break;
+      case '\t': out_->append("\\t"); break;
+      default: {
+        char escaped[] = {'\\', 'u', '0', '0', kHexDigits[c >> 4], kHexDigits[c & 0xF]};
+        out_->append(escaped, sizeof(escaped));
+      }
+    }
+    ++p;
+  }
+
+  out_->push_back('"');
+}
+
+void JsonWriter::boolean(bool value) {
+  separate();
+  out_->append(value ? "true" : "false");
+}
+
+void JsonWriter::integer(int64_t value) {
+  separate();
+  char buffer[24];
+  auto result = std::to_chars(buffer, buffer + sizeof(buffer), value);
+  out_->append(buffer, result.ptr);
+}
+
+void JsonWriter::unsignedInteger(uint64_t value) {
+  separate();
+  char buffer[24];
+  auto result = std::to_chars(buffer, buffer + sizeof(buffer), value);
+  out_->append(buffer, result.ptr);
+}
+
+void JsonWriter::real(float value) {
+  if (!std::isfinite(value)) {
+    null();
+    return;
+  }
+  separate();
+  char buffer[32];
+  auto result = std::to_chars(buffer, buffer + sizeof(buffer), value);
+  out_->append(buffer, result.ptr);
+}
+
+void JsonWriter::null() {
+  separate();
+  out_->append("null");
+}
+
+} // namespace kb
@@ -1,260 +1,2436 @@
 #include "knowledge_base.h"
+#include "export_stream.h"
+#include "memory_id.h"
+#include "record_codec.h"
+#include "metrics.h"
+#include "search_cache.h"
+#include <algorithm>
 #include <chrono>
-#include <sstream>
-#include <iomanip>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <exception>
+#include <filesystem>
+#include <functional>
+#include <limits>
 #include <random>
+#include <rocksdb/metadata.h>
 #include <rocksdb/options.h>
+#include <rocksdb/filter_policy.h>
+#include <rocksdb/slice_transform.h>
+#include <rocksdb/snapshot.h>
+#include <rocksdb/sst_file_writer.h>
+#include <rocksdb/table.h>
+#include <rocksdb/utilities/checkpoint.h>
+#include <rocksdb/write_batch.h>
+#include <rocksdb/transaction_log.h>
+#include <faiss/clone_index.h>
+#include <faiss/index_factory.h>
+#include <faiss/index_io.h>
+#include <faiss/IndexHNSW.h>
+#include <faiss/IndexIVF.h>
+#include <faiss/IVFlib.h>
+#include <faiss/impl/FaissException.h>
+#include <faiss/impl/IDSelector.h>
+#include <faiss/utils/distances.h>
 #include <nlohmann/json.hpp>
 
 using json = nlohmann::json;
 
 namespace kb {
 
-KnowledgeBase::KnowledgeBase(const std::string& db_path, int dimension)
-  : dimension_(dimension), db_path_(db_path) {
+namespace {
 
-  // Initialize FAISS index
-  index_ = std::make_unique<faiss::IndexFlatL2>(dimension);
+const std::string kEmbeddingsColumnFamily = "embeddings";
+const std::string kIngestColumnFamily = "ingest";
+
+// Present once the store uses binary records; older stores kept one JSON
+// document (embedding included) per memory and are migrated on open.
+const std::string kFormatVersionKey = "meta:format_version";
+const std::string kFormatVersion = "2";
+
+// Encoding of the vectors in the embeddings column family; stores from
+// before the setting existed hold float32.
+const std::string kVectorEncodingKey = "meta:vector_encoding";
+
+// User preferences are stored under this prefix plus their key.
+const std::string kPreferencePrefix = "pref:";
+
+// On a replica, the next sequence number of the primary's WAL to apply.
+const std::string kReplicationPositionKey = "meta:replication_position";
+
+// Written through the WAL after each import, whose ingested files are not
+// in it, so replicas following the WAL can tell they missed data.
+const std::string kImportMarkerKey = "meta:last_import";
+
+// Imports stage their SST files here, under the store's directory, and
+// index what they ingested this many memories per exclusive lock.
+const char kImportDirectory[] = "import";
+constexpr size_t kImportChunkSize = 4096;
+
+// Legacy records are rewritten in batches of this many memories.
+constexpr int kMigrationBatchSize = 1000;
+
+// Compact once this many tombstones have accumulated and they make up at
+// least a quarter of the index; below that, filtering them is cheaper.
+constexpr size_t kMinTombstonesForCompaction = 1024;
+
+// Index types that need training serve exact search until this many
+// vectors are stored, train on at most kMaxTrainingVectors of them, and
+// retrain each time the corpus has grown kRetrainGrowth-fold.
+constexpr size_t kMinTrainingVectors = 1000;
+constexpr size_t kMaxTrainingVectors = 128 * 1024;
+constexpr size_t kRetrainGrowth = 4;
+
+// IVF list count: ~4 sqrt(n), with at least 39 training vectors per list
+// (FAISS warns below that).
+constexpr size_t kTrainingVectorsPerList = 39;
+constexpr size_t kMaxIvfLists = 65536;
+
+// Vectors per exact-search chunk when measuring recall.
+constexpr size_t kRebuildChunkSize = 16384;
+
+// Decoded vectors buffered across all loader threads before being added to
+// a rebuilt index, so loading peaks at about the index size plus this.
+constexpr size_t kRebuildBufferBytes = 64 << 20;
+constexpr size_t kMinRebuildChunk = 256;
+
+// Bulk scans at startup read ahead and skip the block cache.
+constexpr size_t kScanReadahead = 2 << 20;
+constexpr size_t kMaxLoadThreads = 16;
+
+// Fixed seed so training samples, and so the trained index, are reproducible.
+constexpr uint64_t kSampleSeed = 0x6b62;
+
+// Interval between background snapshots while there are unsaved writes.
+constexpr std::chrono::minutes kSnapshotInterval(5);
+
+// Archived WAL is kept for this many snapshot intervals, so a snapshot can
+// be brought up to date by replaying only the writes made after it even if
+// a save in between failed. StoreOptions::replication_wal_hours keeps it
+// longer for replicas to catch up.
+constexpr uint64_t kWalSnapshotIntervals = 3;
+constexpr uint64_t kWalSizeLimitMB = 1024;
+
+// Every key of the default column family that is not a memory id starts
+// with a prefix of this length ("pref:", "meta:").
+constexpr size_t kKeyPrefixLength = 5;
+
+// Snapshot file layout (host byte order, written and read on the same box):
+//   magic | u32 version | i32 dimension | u32 len + index type |
+//   u64 trained_size | u64 sequence | i64 next_label |
+//   u32 categories | categories x (u32 len + name) | u64 count |
+//   count x (i64 label | u32 len + id | u32 category | i64 timestamp) |
+//   u64 tombstones | tombstones x i64 | [LexicalIndex::save] | faiss::write_index blob
+// The lexical index is present when the index type names it ("+bm25").
+const char kSnapshotFile[] = "faiss.snapshot";
+const char kSnapshotMagic[8] = {'K', 'B', 'S', 'N', 'A', 'P', '\0', '\0'};
+constexpr uint32_t kSnapshotVersion = 4;
+
+template <typename T>
+bool writePod(FILE* f, const T& value) {
+  return std::fwrite(&value, sizeof(T), 1, f) == 1;
+}
+
+template <typename T>
+bool readPod(FILE* f, T* value) {
+  return std::fread(value, sizeof(T), 1, f) == 1;
+}
+
+// Index type recorded in snapshots, so one taken with other settings is
+// rebuilt rather than reused
+std::string snapshotIndexType(const IndexOptions& options) {
+  std::string type = options.storage == "f32" ? options.type : options.type + "/" + options.storage;
+  return options.lexical ? type + "+bm25" : type;
+}
+
+// Hybrid search fuses rankings by reciprocal rank: 1 / (kRrfK + rank), from
+// rank 1. Each ranking contributes this many times top_k candidates.
+constexpr float kRrfK = 60.0f;
+constexpr int kHybridCandidateFactor = 4;
+
+bool writeString(FILE* f, const std::string& value) {
+  return writePod(f, static_cast<uint32_t>(value.size())) &&
+         std::fwrite(value.data(), 1, value.size(), f) == value.size();
+}
+
+bool readString(FILE* f, std::string* value) {
+  uint32_t len;
+  if (!readPod(f, &len)) {
+    return false;
+  }
+  value->assign(len, '\0');
+  return len == 0 || std::fread(&(*value)[0], len, 1, f) == 1;
+}
+
+// Excludes tombstoned labels from a FAISS search.
+struct TombstoneFilter : faiss::IDSelector {
+  explicit TombstoneFilter(const std::unordered_set<faiss::idx_t>& dead) : dead_(dead) {}
+
+  bool is_member(faiss::idx_t id) const override {
+    return dead_.count(id) == 0;
+  }
+
+  const std::unordered_set<faiss::idx_t>& dead_;
+};
+
+// Adapts a label predicate to a FAISS search filter.
+template <typename Predicate>
+struct PredicateFilter : faiss::IDSelector {
+  explicit PredicateFilter(Predicate predicate) : predicate_(std::move(predicate)) {}
+
+  bool is_member(faiss::idx_t id) const override {
+    return predicate_(id);
+  }
+
+  Predicate predicate_;
+};
+
+// Feeds the embedding writes of replayed WAL batches back into the index,
+// and, when given on_record, the default column family's writes (a null
+// value for a delete) to it.
+class ReplayHandler : public rocksdb::WriteBatch::Handler {
+public:
+  using PutFn = std::function<void(const rocksdb::Slice&, const rocksdb::Slice&)>;
+  using DeleteFn = std::function<void(const rocksdb::Slice&)>;
+  using RecordFn = std::function<void(const rocksdb::Slice&, const rocksdb::Slice*)>;
+
+  ReplayHandler(uint32_t embeddings_cf_id, PutFn on_put, DeleteFn on_delete, RecordFn on_record = nullptr)
+    : embeddings_cf_id_(embeddings_cf_id), on_put_(std::move(on_put)), on_delete_(std::move(on_delete)),
+      on_record_(std::move(on_record)) {}
+
+  rocksdb::Status PutCF(uint32_t column_family_id, const rocksdb::Slice& key,
+                        const rocksdb::Slice& value) override {
+    if (column_family_id == embeddings_cf_id_) {
+      on_put_(key, value);
+    } else if (column_family_id == kDefaultColumnFamilyId && on_record_) {
+      on_record_(key, &value);
+    }
+    return rocksdb::Status::OK();
+  }
+
+  rocksdb::Status DeleteCF(uint32_t column_family_id, const rocksdb::Slice& key) override {
+    if (column_family_id == embeddings_cf_id_) {
+      on_delete_(key);
+    } else if (column_family_id == kDefaultColumnFamilyId && on_record_) {
+      on_record_(key, nullptr);
+    }
+    return rocksdb::Status::OK();
+  }
+
+private:
+  static constexpr uint32_t kDefaultColumnFamilyId = 0;
+
+  uint32_t embeddings_cf_id_;
+  PutFn on_put_;
+  DeleteFn on_delete_;
+  RecordFn on_record_;
+};
+
+// Runs fn(0) .. fn(n - 1), each on its own thread, and rethrows the first
+// exception any of them threw
+void parallelFor(size_t n, const std::function<void(size_t)>& fn) {
+  std::exception_ptr error;
+  std::mutex error_mutex;
+  auto run = [&](size_t i) {
+    try {
+      fn(i);
+    } catch (...) {
+      std::lock_guard<std::mutex> lock(error_mutex);
+      if (!error) {
+        error = std::current_exception();
+      }
+    }
+  };
+
+  std::vector<std::thread> threads;
+  for (size_t i = 1; i < n; ++i) {
+    threads.emplace_back(run, i);
+  }
+  run(0);
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  if (error) {
+    std::rethrow_exception(error);
+  }
+}
+
+// [first, last) of a column family's keys; "" leaves a bound open
+using KeyRange = std::pair<std::string, std::string>;
+
+// Up to `parts` contiguous ranges covering the column family, cut at SST
+// file boundaries so each holds about the same number of bytes on disk.
+// Files of different levels overlap, so the split is approximate; data
+// still in memtables goes to whichever range covers its key.
+std::vector<KeyRange> keyRanges(rocksdb::DB* db, const std::string& column_family, size_t parts) {
+  std::vector<std::pair<std::string, uint64_t>> files;
+  uint64_t total = 0;
+  if (parts > 1) {
+    std::vector<rocksdb::LiveFileMetaData> metadata;
+    db->GetLiveFilesMetaData(&metadata);
+    for (const auto& file : metadata) {
+      if (file.column_family_name == column_family) {
+        files.emplace_back(file.smallestkey, file.size);
+        total += file.size;
+      }
+    }
+    std::sort(files.begin(), files.end());
+  }
+
+  std::vector<KeyRange> ranges;
+  std::string first;
+  uint64_t before = 0;
+  for (const auto& [key, size] : files) {
+    if (ranges.size() + 1 < parts && before * parts >= total * (ranges.size() + 1) && key > first) {
+      ranges.emplace_back(first, key);
+      first = key;
+    }
+    before += size;
+  }
+  ranges.emplace_back(first, "");
+  return ranges;
+}
+
+// Iterator over one KeyRange for a bulk scan, of `snapshot` when given
+class RangeScan {
+public:
+  RangeScan(rocksdb::DB* db, rocksdb::ColumnFamilyHandle* column_family, const KeyRange& range,
+            const rocksdb::Snapshot* snapshot = nullptr)
+    : last_(range.second), upper_bound_(last_) {
+    rocksdb::ReadOptions options;
+    options.snapshot = snapshot;
+    options.fill_cache = false;
+    options.readahead_size = kScanReadahead;
+    options.total_order_seek = true;  // across prefixes, in the default column family
+    if (!last_.empty()) {
+      options.iterate_upper_bound = &upper_bound_;
+    }
+    it_.reset(db->NewIterator(options, column_family));
+    if (range.first.empty()) {
+      it_->SeekToFirst();
+    } else {
+      it_->Seek(range.first);
+    }
+  }
+
+  rocksdb::Iterator* operator->() const { return it_.get(); }
+
+private:
+  std::string last_;
+  rocksdb::Slice upper_bound_;  // must outlive the iterator
+  std::unique_ptr<rocksdb::Iterator> it_;
+};
+
+// Removes a directory, and everything in it, when going out of scope
+struct ScopedDirectory {
+  explicit ScopedDirectory(std::string directory) : path(std::move(directory)) {
+    std::error_code ec;
+    std::filesystem::remove_all(path, ec);
+    std::filesystem::create_directories(path, ec);
+  }
+  ~ScopedDirectory() {
+    std::error_code ec;
+    std::filesystem::remove_all(path, ec);
+  }
+
+  std::string path;
+};
+
+// Keys of the default column family that are not memories
+bool reservedKey(const std::string& key) {
+  return key.compare(0, kKeyPrefixLength, "meta:") == 0 || key.compare(0, kKeyPrefixLength, "pref:") == 0;
+}
+
+// Per-stage timings, shared by every store in the process
+struct StoreMetrics {
+  Histogram& index_search;
+  Histogram& index_add;
+  Histogram& rocksdb_get;
+  Histogram& rocksdb_multiget;
+  Histogram& rocksdb_write;
+  Histogram& lock_wait_shared;
+  Histogram& lock_wait_exclusive;
+  Counter& result_cache_hits;
+  Counter& result_cache_misses;
+};
+
+StoreMetrics& storeMetrics() {
+  static StoreMetrics metrics{
+    Metrics::global().histogram("kb_index_search_seconds", "FAISS search calls"),
+    Metrics::global().histogram("kb_index_add_seconds", "FAISS add calls"),
+    Metrics::global().histogram("kb_rocksdb_read_seconds", "RocksDB reads", {{"op", "get"}}),
+    Metrics::global().histogram("kb_rocksdb_read_seconds", "RocksDB reads", {{"op", "multiget"}}),
+    Metrics::global().histogram("kb_rocksdb_write_seconds", "RocksDB write batches"),
+    Metrics::global().histogram("kb_index_lock_wait_seconds", "Time spent waiting for the index lock",
+                                {{"mode", "shared"}}),
+    Metrics::global().histogram("kb_index_lock_wait_seconds", "Time spent waiting for the index lock",
+                                {{"mode", "exclusive"}}),
+    Metrics::global().counter("kb_search_cache_hits_total", "Searches answered from the result cache"),
+    Metrics::global().counter("kb_search_cache_misses_total", "Searches the result cache could not answer"),
+  };
+  return metrics;
+}
+
+// Index lock acquisition on the request paths, timed
+std::shared_lock<std::shared_mutex> lockShared(std::shared_mutex& mutex) {
+  auto start = std::chrono::steady_clock::now();
+  std::shared_lock<std::shared_mutex> lock(mutex);
+  storeMetrics().lock_wait_shared.observe(std::chrono::steady_clock::now() - start);
+  return lock;
+}
+
+std::unique_lock<std::shared_mutex> lockExclusive(std::shared_mutex& mutex) {
+  auto start = std::chrono::steady_clock::now();
+  std::unique_lock<std::shared_mutex> lock(mutex);
+  storeMetrics().lock_wait_exclusive.observe(std::chrono::steady_clock::now() - start);
+  return lock;
+}
+
+rocksdb::Status writeBatch(rocksdb::DB* db, const rocksdb::WriteOptions& options, rocksdb::WriteBatch* batch) {
+  ScopedTimer timer(storeMetrics().rocksdb_write);
+  return db->Write(options, batch);
+}
+
+// Bytes per vector code in the index; HNSW keeps its codes in a storage index
+size_t codeSize(const faiss::Index* index, size_t fallback) {
+  if (auto* hnsw = dynamic_cast<const faiss::IndexHNSW*>(index)) {
+    index = hnsw->storage;
+  }
+  try {
+    return index ? index->sa_code_size() : fallback;
+  } catch (const faiss::FaissException&) {
+    return fallback;
+  }
+}
+
+// Rough per-element cost of a node-based hash map entry beyond its payload
+constexpr size_t kHashNodeOverhead = 32;
+
+} // namespace
+
+KnowledgeBase::KnowledgeBase(const std::string& db_path, int dimension, const IndexOptions& index_options,
+                             const StoreOptions& store_options)
+  : embeddings_cf_(nullptr), ingest_cf_(nullptr), next_label_(0), writes_since_snapshot_(0), imports_(0),
+    replication_position_(0), generation_(0), dimension_(dimension),
+    db_path_(db_path), index_options_(index_options), metric_type_(faiss::METRIC_L2),
+    vector_encoding_(VectorEncoding::Float32), normalize_(false),
+    requires_training_(false), supports_removal_(true), trained_size_(0), rebuilding_(false),
+    stop_maintenance_(false) {
+
+  if (index_options_.metric == "ip" || index_options_.metric == "cosine") {
+    metric_type_ = faiss::METRIC_INNER_PRODUCT;
+    normalize_ = index_options_.metric == "cosine";
+  } else if (index_options_.metric != "l2") {
+    throw std::runtime_error("Invalid metric '" + index_options_.metric + "'");
+  }
+  if (!parseVectorEncoding(index_options_.storage, &vector_encoding_)) {
+    throw std::runtime_error("Invalid storage '" + index_options_.storage + "'");
+  }
+
+  try {
+    std::unique_ptr<faiss::Index> probe(
+      faiss::index_factory(dimension_, factoryString(kMinTrainingVectors).c_str(), metric_type_));
+    requires_training_ = !probe->is_trained;
+  } catch (const std::exception& e) {
+    throw std::runtime_error("Invalid index type '" + index_options_.type + "': " + e.what());
+  }
+
+  resetIndex();
+
+  // Open RocksDB: metadata and preferences in the default column family,
+  // raw embedding blobs in their own, memories awaiting embedding in a third
+  rocksdb::BlockBasedTableOptions table_options;
+  table_options.block_cache = store_options.block_cache
+    ? store_options.block_cache
+    : rocksdb::NewLRUCache(store_options.block_cache_mb << 20);
+  if (store_options.bloom_bits_per_key > 0) {
+    table_options.filter_policy.reset(rocksdb::NewBloomFilterPolicy(store_options.bloom_bits_per_key, false));
+  }
+  table_options.cache_index_and_filter_blocks = true;
+  table_options.pin_l0_filter_and_index_blocks_in_cache = true;
 
-  // Open RocksDB
   rocksdb::Options options;
   options.create_if_missing = true;
+  options.create_missing_column_families = true;
   options.compression = rocksdb::kSnappyCompression;
+  options.WAL_ttl_seconds = std::max<uint64_t>(
+    kWalSnapshotIntervals * std::chrono::duration_cast<std::chrono::seconds>(kSnapshotInterval).count(),
+    store_options.replication_wal_hours * 60 * 60);
+  options.WAL_size_limit_MB = kWalSizeLimitMB;
+  options.enable_pipelined_write = store_options.pipelined_writes;
+  if (store_options.env) {
+    options.env = store_options.env;
+  }
+  options.table_factory.reset(rocksdb::NewBlockBasedTableFactory(table_options));
+  write_options_.sync = store_options.sync_writes;
+
+  rocksdb::ColumnFamilyOptions record_options(options);
+  record_options.prefix_extractor.reset(rocksdb::NewFixedPrefixTransform(kKeyPrefixLength));
+  if (store_options.bloom_bits_per_key > 0) {
+    record_options.memtable_prefix_bloom_size_ratio = 0.02;
+  }
+
+  rocksdb::ColumnFamilyOptions embedding_options(options);
+  embedding_options.compression = rocksdb::kNoCompression;  // float noise does not compress
+
+  std::vector<rocksdb::ColumnFamilyDescriptor> column_families = {
+    rocksdb::ColumnFamilyDescriptor(rocksdb::kDefaultColumnFamilyName, record_options),
+    rocksdb::ColumnFamilyDescriptor(kEmbeddingsColumnFamily, embedding_options),
+    rocksdb::ColumnFamilyDescriptor(kIngestColumnFamily, rocksdb::ColumnFamilyOptions(options)),
+  };
 
   rocksdb::DB* db_ptr;
-  rocksdb::Status status = rocksdb::DB::Open(options, db_path, &db_ptr);
+  rocksdb::Status status = rocksdb::DB::Open(options, db_path, column_families, &cf_handles_, &db_ptr);
   if (!status.ok()) {
     throw std::runtime_error("Failed to open RocksDB: " + status.ToString());
   }
   db_.reset(db_ptr);
+  embeddings_cf_ = cf_handles_[1];
+  ingest_cf_ = cf_handles_[2];
+
+  migrateLegacyRecords();
+  migrateVectorEncoding();
+  loadPreferences();
+
+  if (index_options_.result_cache > 0) {
+    result_cache_ = std::make_unique<SearchResultCache>(index_options_.result_cache);
+  }
 
   // Load existing index from RocksDB
   loadIndex();
+  seedIdGenerator();
+  for (const auto& [ticket, memory] : queuedMemories()) {
+    queued_ids_.insert(memory.id);
+  }
+
+  // Replicas resume where they left off. A store without a position is
+  // either new, and follows its primary from the start, or seeded from a
+  // checkpoint of it, whose sequence numbers are the primary's.
+  std::string position;
+  if (db_->Get(rocksdb::ReadOptions(), kReplicationPositionKey, &position).ok()) {
+    replication_position_ = std::stoull(position);
+  } else {
+    replication_position_ = entries_.empty() ? 1 : db_->GetLatestSequenceNumber() + 1;
+  }
+
+  maintenance_thread_ = std::thread(&KnowledgeBase::maintenanceLoop, this);
 }
 
 KnowledgeBase::~KnowledgeBase() {
+  {
+    std::unique_lock<std::shared_mutex> lock(index_mutex_);
+    stop_maintenance_ = true;
+  }
+  maintenance_cv_.notify_all();
+  if (maintenance_thread_.joinable()) {
+    maintenance_thread_.join();
+  }
+
   saveIndex();
+
+  for (rocksdb::ColumnFamilyHandle* handle : cf_handles_) {
+    db_->DestroyColumnFamilyHandle(handle);
+  }
+  cf_handles_.clear();
 }
 
-void KnowledgeBase::loadIndex() {
-  rocksdb::Iterator* it = db_->NewIterator(rocksdb::ReadOptions());
+void KnowledgeBase::migrateLegacyRecords() {
+  std::string version;
+  if (db_->Get(rocksdb::ReadOptions(), kFormatVersionKey, &version).ok()) {
+    return;
+  }
 
-  std::vector<float> all_vectors;
-  id_map_.clear();
+  rocksdb::ReadOptions scan_options;
+  scan_options.total_order_seek = true;
+  std::unique_ptr<rocksdb::Iterator> it(db_->NewIterator(scan_options));
+  rocksdb::WriteBatch batch;
+  int pending = 0;
 
   for (it->SeekToFirst(); it->Valid(); it->Next()) {
-    std::string key = it->key().ToString();
-
-    // Skip metadata keys
-    if (key.rfind("meta:", 0) == 0) continue;
-    if (key.rfind("pref:", 0) == 0) continue;
+    rocksdb::Slice key = it->key();
+    rocksdb::Slice value = it->value();
 
-    std::string value = it->value().ToString();
+    if (key.starts_with("meta:") || key.starts_with("pref:")) continue;
+    if (value.empty() || value[0] != '{') continue;
 
     try {
-      json doc = json::parse(value);
-      if (doc.contains("embedding") && doc["embedding"].is_array()) {
-        id_map_.push_back(key);
-        for (const auto& v : doc["embedding"]) {
-          all_vectors.push_back(v.get<float>());
-        }
+      json doc = json::parse(value.data(), value.data() + value.size());
+      std::vector<float> embedding = doc.value("embedding", std::vector<float>());
+      if (embedding.size() != static_cast<size_t>(dimension_)) {
+        continue;
       }
+
+      batch.Put(key, encodeRecord(doc.value("content", ""), doc.value("category", ""),
+                                  doc.value("timestamp", int64_t(0))));
+      batch.Put(embeddings_cf_, key, encodeVector(embedding.data(), embedding.size()));
     } catch (...) {
       // Skip invalid entries
+      continue;
     }
-  }
 
-  delete it;
+    if (++pending == kMigrationBatchSize) {
+      db_->Write(rocksdb::WriteOptions(), &batch);
+      batch.Clear();
+      pending = 0;
+    }
+  }
 
-  // Add all vectors to FAISS index
-  if (!all_vectors.empty()) {
-    index_->add(id_map_.size(), all_vectors.data());
+  batch.Put(kFormatVersionKey, kFormatVersion);
+  rocksdb::Status status = db_->Write(rocksdb::WriteOptions(), &batch);
+  if (!status.ok()) {
+    throw std::runtime_error("Failed to migrate RocksDB records: " + status.ToString());
   }
 }
 
-void KnowledgeBase::saveIndex() {
-  // FAISS index is ephemeral, vectors are persisted in RocksDB
-  // No need to save separately
+void KnowledgeBase::migrateVectorEncoding() {
+  std::string name;
+  VectorEncoding stored = VectorEncoding::Float32;
+  if (db_->Get(rocksdb::ReadOptions(), kVectorEncodingKey, &name).ok() && !parseVectorEncoding(name, &stored)) {
+    throw std::runtime_error("Unknown vector encoding '" + name + "' in " + db_path_);
+  }
+  if (stored == vector_encoding_) {
+    return;
+  }
+
+  // The snapshot was taken with the old layout, and the rewrite below
+  // touches every vector anyway; the index is rebuilt from storage
+  std::remove(snapshotPath().c_str());
+
+  std::unique_ptr<rocksdb::Iterator> it(db_->NewIterator(rocksdb::ReadOptions(), embeddings_cf_));
+  std::vector<float> vector(dimension_);
+  rocksdb::WriteBatch batch;
+  int pending = 0;
+
+  for (it->SeekToFirst(); it->Valid(); it->Next()) {
+    if (!decodeVector(it->value(), dimension_, vector.data(), stored)) {
+      continue;
+    }
+    batch.Put(embeddings_cf_, it->key(), encodeVector(vector.data(), dimension_, vector_encoding_));
+
+    if (++pending == kMigrationBatchSize) {
+      db_->Write(rocksdb::WriteOptions(), &batch);
+      batch.Clear();
+      pending = 0;
+    }
+  }
+
+  batch.Put(kVectorEncodingKey, vectorEncodingName(vector_encoding_));
+  rocksdb::Status status = db_->Write(rocksdb::WriteOptions(), &batch);
+  if (!status.ok()) {
+    throw std::runtime_error("Failed to re-encode stored vectors: " + status.ToString());
+  }
 }
 
-std::string KnowledgeBase::generateId() {
-  auto now = std::chrono::system_clock::now();
-  auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(now.time_since_epoch()).count();
+std::string KnowledgeBase::factoryString(size_t corpus_size) const {
+  // Vector codes for the index types that hold full vectors
+  const char* codes = vector_encoding_ == VectorEncoding::Float16 ? "SQfp16"
+                    : vector_encoding_ == VectorEncoding::Int8 ? "SQ8" : "Flat";
+
+  const std::string& type = index_options_.type;
+  if (type == "flat") {
+    return codes;
+  }
+  if (type == "hnsw") {
+    return vector_encoding_ == VectorEncoding::Float32 ? "HNSW32" : std::string("HNSW32,") + codes;
+  }
+  if (type != "ivf" && type != "ivfpq") {
+    return type;
+  }
+
+  size_t training_size = std::min(corpus_size, kMaxTrainingVectors);
+  size_t lists = static_cast<size_t>(4 * std::sqrt(static_cast<double>(corpus_size)));
+  lists = std::max<size_t>(1, std::min({lists, training_size / kTrainingVectorsPerList, kMaxIvfLists}));
 
-  std::random_device rd;
-  std::mt19937 gen(rd());
-  std::uniform_int_distribution<> dis(1000, 9999);
+  std::string factory = "IVF" + std::to_string(lists);
+  if (type == "ivf") {
+    return factory + "," + codes;
+  }
 
-  std::ostringstream oss;
-  oss << "mem_" << ms << "_" << dis(gen);
-  return oss.str();
+  // 8-bit PQ codes of 16 (or 8) dimensions each
+  int subquantizers = dimension_ % 16 == 0 ? dimension_ / 16
+                    : dimension_ % 8 == 0 ? dimension_ / 8 : dimension_;
+  return factory + ",PQ" + std::to_string(subquantizers);
 }
 
-bool KnowledgeBase::add(const Memory& memory) {
-  return !addAndReturnId(memory).empty();
+std::string KnowledgeBase::untrainedFactory() const {
+  // Half floats need no training and keep a compressed store compressed
+  return vector_encoding_ == VectorEncoding::Float32 ? "Flat" : "SQfp16";
 }
 
-std::string KnowledgeBase::addAndReturnId(const Memory& memory) {
-  std::lock_guard<std::mutex> lock(index_mutex_);
+std::unique_ptr<faiss::IndexIDMap2> KnowledgeBase::makeIndex(const std::string& factory) const {
+  // FAISS index keyed by stable labels so single entries can be removed
+  // without renumbering the rest
+  auto index = std::make_unique<faiss::IndexIDMap2>(
+    faiss::index_factory(dimension_, factory.c_str(), metric_type_));
+  index->own_fields = true;
+  return index;
+}
 
-  std::string id = memory.id.empty() ? generateId() : memory.id;
+void KnowledgeBase::resetIndex() {
+  index_ = makeIndex(requires_training_ ? untrainedFactory() : factoryString(0));
+  entries_.clear();
+  id_to_label_.clear();
+  tombstones_.clear();
+  lexical_.clear();
+  categories_.clear();
+  category_ids_.clear();
+  next_label_ = 0;
+  trained_size_ = 0;
+}
 
-  // Check if already exists
-  if (exists(id)) {
-    return "";
+void KnowledgeBase::loadIndex() {
+  bool loaded = false;
+  try {
+    loaded = loadSnapshot();
+  } catch (const std::exception&) {
+    // Corrupt or incompatible snapshot; fall through to a full rebuild
   }
 
-  // Store in RocksDB
-  json doc;
-  doc["id"] = id;
-  doc["content"] = memory.content;
-  doc["category"] = memory.category;
-  doc["timestamp"] = memory.timestamp;
-  doc["embedding"] = memory.embedding;
-
-  std::string serialized = doc.dump();
-  rocksdb::Status status = db_->Put(rocksdb::WriteOptions(), id, serialized);
-  if (!status.ok()) {
-    return "";
+  if (!loaded) {
+    resetIndex();
+    buildIndexFromStorage();
   }
 
-  // Add to FAISS index
-  id_map_.push_back(id);
-  index_->add(1, memory.embedding.data());
+  // Train on the existing corpus now rather than serving exact search
+  // until the maintenance thread gets to it
+  if (trainingDue()) {
+    rebuildIndex();
+  }
+}
 
-  return id;
+std::string KnowledgeBase::snapshotPath() const {
+  return db_path_ + "/" + kSnapshotFile;
 }
 
-std::vector<SearchResult> KnowledgeBase::search(const std::vector<float>& query_embedding, int top_k) {
-  std::lock_guard<std::mutex> lock(index_mutex_);
+bool KnowledgeBase::loadSnapshot() {
+  FILE* f = std::fopen(snapshotPath().c_str(), "rb");
+  if (!f) {
+    return false;
+  }
+  std::unique_ptr<FILE, int (*)(FILE*)> file(f, &std::fclose);
 
-  std::vector<SearchResult> results;
+  char magic[sizeof(kSnapshotMagic)];
+  uint32_t version;
+  int32_t dimension;
+  std::string index_type;
+  uint64_t trained_size;
+  rocksdb::SequenceNumber sequence;
+  faiss::idx_t next_label;
+  uint64_t count;
 
-  if (index_->ntotal == 0) {
-    return results;
+  // A snapshot of a different index type is rebuilt rather than reused
+  if (std::fread(magic, sizeof(magic), 1, f) != 1 ||
+      std::memcmp(magic, kSnapshotMagic, sizeof(magic)) != 0 ||
+      !readPod(f, &version) || version != kSnapshotVersion ||
+      !readPod(f, &dimension) || dimension != dimension_ ||
+      !readString(f, &index_type) || index_type != snapshotIndexType(index_options_) ||
+      !readPod(f, &trained_size) || !readPod(f, &sequence) || !readPod(f, &next_label) ||
+      sequence > db_->GetLatestSequenceNumber()) {
+    return false;
   }
 
-  // FAISS search
-  top_k = std::min(top_k, static_cast<int>(index_->ntotal));
-  std::vector<float> distances(top_k);
-  std::vector<faiss::idx_t> indices(top_k);
+  uint32_t category_count;
+  if (!readPod(f, &category_count)) {
+    return false;
+  }
+  std::vector<std::string> categories(category_count);
+  std::unordered_map<std::string, uint32_t> category_ids;
+  for (uint32_t i = 0; i < category_count; ++i) {
+    if (!readString(f, &categories[i])) {
+      return false;
+    }
+    category_ids[categories[i]] = i;
+  }
 
-  index_->search(1, query_embedding.data(), top_k, distances.data(), indices.data());
+  if (!readPod(f, &count)) {
+    return false;
+  }
+  std::unordered_map<faiss::idx_t, IndexEntry> entries;
+  std::unordered_map<std::string, faiss::idx_t> id_to_label;
+  entries.reserve(count);
+  id_to_label.reserve(count);
 
-  // Retrieve full documents from RocksDB
-  for (int i = 0; i < top_k; ++i) {
-    if (indices[i] < 0 || indices[i] >= static_cast<int>(id_map_.size())) {
-      continue;
+  for (uint64_t i = 0; i < count; ++i) {
+    faiss::idx_t label;
+    IndexEntry entry;
+    if (!readPod(f, &label) || !readString(f, &entry.id) ||
+        !readPod(f, &entry.category) || entry.category >= category_count ||
+        !readPod(f, &entry.timestamp)) {
+      return false;
     }
+    id_to_label[entry.id] = label;
+    entries[label] = std::move(entry);
+  }
 
-    std::string id = id_map_[indices[i]];
-    std::string value;
-    rocksdb::Status status = db_->Get(rocksdb::ReadOptions(), id, &value);
-
-    if (status.ok()) {
-      try {
-        json doc = json::parse(value);
-        SearchResult result;
-        result.id = id;
-        result.content = doc.value("content", "");
-        result.category = doc.value("category", "");
-        result.score = distances[i];
-        result.timestamp = doc.value("timestamp", 0L);
-        results.push_back(result);
-      } catch (...) {
-        // Skip invalid entries
-      }
+  uint64_t tombstone_count;
+  if (!readPod(f, &tombstone_count)) {
+    return false;
+  }
+  std::unordered_set<faiss::idx_t> tombstones;
+  tombstones.reserve(tombstone_count);
+  for (uint64_t i = 0; i < tombstone_count; ++i) {
+    faiss::idx_t label;
+    if (!readPod(f, &label)) {
+      return false;
     }
+    tombstones.insert(label);
   }
 
-  return results;
-}
+  LexicalIndex lexical;
+  if (index_options_.lexical && !lexical.load(f)) {
+    return false;
+  }
 
-bool KnowledgeBase::update(const std::string& id, const std::string& content, const std::vector<float>& embedding) {
-  std::lock_guard<std::mutex> lock(index_mutex_);
+  // The index stays writable, so it is read into memory rather than mapped
+  std::unique_ptr<faiss::Index> loaded(faiss::read_index(f));
+  auto* id_map = dynamic_cast<faiss::IndexIDMap2*>(loaded.get());
+  if (!id_map || id_map->d != dimension_ || id_map->metric_type != metric_type_ ||
+      static_cast<uint64_t>(id_map->ntotal) != count + tombstone_count) {
+    return false;
+  }
+  loaded.release();
 
-  std::string value;
-  rocksdb::Status status = db_->Get(rocksdb::ReadOptions(), id, &value);
+  index_.reset(id_map);
+  entries_ = std::move(entries);
+  id_to_label_ = std::move(id_to_label);
+  tombstones_ = std::move(tombstones);
+  lexical_ = std::move(lexical);
+  categories_ = std::move(categories);
+  category_ids_ = std::move(category_ids);
+  next_label_ = next_label;
+  trained_size_ = trained_size;
 
-  if (!status.ok()) {
-    return false;
+  return replayWal(sequence);
+}
+
+bool KnowledgeBase::replayWal(rocksdb::SequenceNumber since) {
+  if (since == db_->GetLatestSequenceNumber()) {
+    return true;
   }
 
-  try {
-    json doc = json::parse(value);
-    doc["content"] = content;
-    doc["embedding"] = embedding;
-    doc["timestamp"] = std::chrono::duration_cast<std::chrono::milliseconds>(
-      std::chrono::system_clock::now().time_since_epoch()
-    ).count();
+  std::unique_ptr<rocksdb::TransactionLogIterator> updates;
+  if (!db_->GetUpdatesSince(since + 1, &updates).ok()) {
+    return false;
+  }
 
-    std::string serialized = doc.dump();
-    rocksdb::Status put_status = db_->Put(rocksdb::WriteOptions(), id, serialized);
+  std::vector<float> vector(dimension_);
+  ReplayHandler handler(
+    embeddings_cf_->GetID(),
+    [this, &vector](const rocksdb::Slice& key, const rocksdb::Slice& value) {
+      if (decodeVector(value, dimension_, vector.data(), vector_encoding_)) {
+        // Metadata as currently stored; if the memory is gone by now, a
+        // later batch in the log removes it again
+        std::string id = key.ToString();
+        std::string stored;
+        MemoryRecord record;
+        if (!db_->Get(rocksdb::ReadOptions(), id, &stored).ok() || !decodeRecord(stored, &record)) {
+          record = MemoryRecord();
+        }
+        tombstone(id);
+        insertVector(id, vector.data(), record.category, record.timestamp, lexicalTerms(record.content));
+      }
+    },
+    [this](const rocksdb::Slice& key) {
+      tombstone(key.ToString());
+    });
 
-    if (!put_status.ok()) {
+  rocksdb::SequenceNumber expected = since + 1;
+  for (; updates->Valid(); updates->Next()) {
+    rocksdb::BatchResult batch = updates->GetBatch();
+    if (batch.sequence > expected) {
+      // The WAL covering part of the gap has been purged
       return false;
     }
 
-    // Rebuild FAISS index
-    index_->reset();
-    id_map_.clear();
-    loadIndex();
+    rocksdb::SequenceNumber next = batch.sequence + batch.writeBatchPtr->Count();
+    if (next <= expected) {
+      // Already reflected in the snapshot
+      continue;
+    }
 
-    return true;
-  } catch (...) {
-    return false;
+    if (!batch.writeBatchPtr->Iterate(&handler).ok()) {
+      return false;
+    }
+    expected = next;
   }
+
+  return updates->status().ok() && expected > db_->GetLatestSequenceNumber();
 }
 
-bool KnowledgeBase::remove(const std::string& id) {
-  std::lock_guard<std::mutex> lock(index_mutex_);
+void KnowledgeBase::buildIndexFromStorage() {
+  // Assign labels first so the index can be sized and trained for the
+  // whole corpus before any vector is added. Both column families are
+  // sorted by key, so each range's metadata is read in the same pass.
+  struct Scanned {
+    std::string id;
+    std::string category;
+    int64_t timestamp;
+    std::vector<std::string> terms;
+  };
 
-  // Check if the key exists first
-  std::string value;
-  rocksdb::Status get_status = db_->Get(rocksdb::ReadOptions(), id, &value);
+  std::vector<KeyRange> ranges = keyRanges(db_.get(), kEmbeddingsColumnFamily, loadThreads());
+  std::vector<std::vector<Scanned>> scanned(ranges.size());
+  const size_t vector_size = encodedVectorSize(dimension_, vector_encoding_);
 
-  if (!get_status.ok()) {
-    return false;
+  parallelFor(ranges.size(), [&](size_t part) {
+    RangeScan it(db_.get(), embeddings_cf_, ranges[part]);
+    RangeScan records(db_.get(), db_->DefaultColumnFamily(), ranges[part]);
+
+    for (; it->Valid(); it->Next()) {
+      if (it->value().size() != vector_size) {
+        // Skip blobs written with a different dimension
+        continue;
+      }
+
+      while (records->Valid() && records->key().compare(it->key()) < 0) {
+        records->Next();
+      }
+      MemoryRecord record;
+      if (!records->Valid() || records->key() != it->key() || !decodeRecord(records->value(), &record)) {
+        record = MemoryRecord();
+      }
+      scanned[part].push_back(Scanned{it->key().ToString(), std::move(record.category), record.timestamp,
+                                      lexicalTerms(record.content)});
+    }
+  });
+
+  // Ranges are in key order, so labels come out as a single scan made them
+  size_t total = 0;
+  for (const auto& part : scanned) {
+    total += part.size();
   }
+  entries_.reserve(total);
+  id_to_label_.reserve(total);
 
-  rocksdb::Status status = db_->Delete(rocksdb::WriteOptions(), id);
+  for (auto& part : scanned) {
+    for (Scanned& memory : part) {
+      IndexEntry entry;
+      entry.id = std::move(memory.id);
+      entry.category = internCategory(memory.category);
+      entry.timestamp = memory.timestamp;
 
-  if (status.ok()) {
-    // Rebuild FAISS index
-    index_->reset();
-    id_map_.clear();
-    loadIndex();
-    return true;
+      faiss::idx_t label = next_label_++;
+      id_to_label_[entry.id] = label;
+      entries_[label] = std::move(entry);
+      lexical_.add(label, memory.terms);
+    }
+    part = std::vector<Scanned>();
   }
 
-  return false;
+  rebuildIndex();
 }
 
-bool KnowledgeBase::updateUserPreference(const std::string& key, const std::string& value) {
-  std::string pref_key = "pref:" + key;
-  rocksdb::Status status = db_->Put(rocksdb::WriteOptions(), pref_key, value);
-  return status.ok();
+void KnowledgeBase::rebuildIndex() {
+  size_t live = entries_.size();
+  bool trained = false;
+  std::unique_ptr<faiss::IndexIDMap2> index = buildIndex(id_to_label_, live, nullptr, &trained);
+
+  std::unique_lock<std::shared_mutex> lock(index_mutex_);
+  index_ = std::move(index);
+  tombstones_.clear();
+  trained_size_ = trained ? live : 0;
 }
 
-std::string KnowledgeBase::getUserPreference(const std::string& key) {
-  std::string pref_key = "pref:" + key;
-  std::string value;
-  rocksdb::Status status = db_->Get(rocksdb::ReadOptions(), pref_key, &value);
+void KnowledgeBase::rebuildIndexOnline() {
+  // Take the label map as of a RocksDB snapshot, then build without
+  // write_mutex_; writers record what they change meanwhile
+  std::unordered_map<std::string, faiss::idx_t> labels;
+  size_t live;
+  const rocksdb::Snapshot* snapshot;
+  {
+    std::lock_guard<std::mutex> write_lock(write_mutex_);
+    auto lock = lockExclusive(index_mutex_);
+    labels = id_to_label_;
+    live = entries_.size();
+    snapshot = db_->GetSnapshot();
+    rebuilding_ = true;
+  }
 
-  if (status.ok()) {
-    return value;
+  bool trained = false;
+  std::unique_ptr<faiss::IndexIDMap2> index = buildIndex(labels, live, snapshot, &trained);
+  db_->ReleaseSnapshot(snapshot);
+  labels = std::unordered_map<std::string, faiss::idx_t>();
+
+  // Replay the vectors added and removed since, then swap
+  std::lock_guard<std::mutex> write_lock(write_mutex_);
+  auto lock = lockExclusive(index_mutex_);
+  if (!rebuild_labels_.empty()) {
+    index->add_with_ids(rebuild_labels_.size(), rebuild_vectors_.data(), rebuild_labels_.data());
   }
-  return "";
+  index_ = std::move(index);
+  tombstones_ = std::move(rebuild_tombstones_);
+  trained_size_ = trained ? live : 0;
+
+  rebuilding_ = false;
+  rebuild_labels_ = std::vector<faiss::idx_t>();
+  rebuild_vectors_ = std::vector<float>();
+  rebuild_tombstones_ = std::unordered_set<faiss::idx_t>();
 }
 
-bool KnowledgeBase::exists(const std::string& id) {
-  std::string value;
-  rocksdb::Status status = db_->Get(rocksdb::ReadOptions(), id, &value);
-  return status.ok();
+std::unique_ptr<faiss::IndexIDMap2> KnowledgeBase::buildIndex(
+    const std::unordered_map<std::string, faiss::idx_t>& labels, size_t live, const rocksdb::Snapshot* snapshot,
+    bool* trained) {
+  bool train = requires_training_ && live >= kMinTrainingVectors;
+
+  std::unique_ptr<faiss::IndexIDMap2> index;
+  try {
+    index = makeIndex(requires_training_ && !train ? untrainedFactory() : factoryString(live));
+    if (!index->is_trained) {
+      std::vector<float> sample = sampleVectors(std::min(live, kMaxTrainingVectors), snapshot);
+      if (normalize_) {
+        faiss::fvec_renorm_L2(dimension_, sample.size() / dimension_, sample.data());
+      }
+      index->train(sample.size() / dimension_, sample.data());
+    }
+  } catch (const std::exception&) {
+    // Training failed (e.g. a raw factory string wanting more vectors than
+    // we have); serve exact search until the corpus has grown enough to retry
+    index = makeIndex(untrainedFactory());
+  }
+
+  // Threads decode their ranges into small chunks and add them in turn;
+  // FAISS parallelizes within an add where the index type allows
+  std::vector<KeyRange> ranges = keyRanges(db_.get(), kEmbeddingsColumnFamily, loadThreads());
+  const size_t chunk_size =
+    std::max(kMinRebuildChunk, kRebuildBufferBytes / (ranges.size() * dimension_ * sizeof(float)));
+  std::mutex add_mutex;
+
+  parallelFor(ranges.size(), [&](size_t part) {
+    std::vector<float> vectors;
+    std::vector<faiss::idx_t> chunk_labels;
+    vectors.reserve(std::min(live, chunk_size) * dimension_);
+
+    auto flush = [&]() {
+      if (chunk_labels.empty()) {
+        return;
+      }
+      if (normalize_) {
+        faiss::fvec_renorm_L2(dimension_, chunk_labels.size(), vectors.data());
+      }
+      std::lock_guard<std::mutex> lock(add_mutex);
+      index->add_with_ids(chunk_labels.size(), vectors.data(), chunk_labels.data());
+      vectors.clear();
+      chunk_labels.clear();
+    };
+
+    for (RangeScan it(db_.get(), embeddings_cf_, ranges[part], snapshot); it->Valid(); it->Next()) {
+      auto label_it = labels.find(it->key().ToString());
+      if (label_it == labels.end()) {
+        continue;
+      }
+
+      size_t offset = vectors.size();
+      vectors.resize(offset + dimension_);
+      if (!decodeVector(it->value(), dimension_, vectors.data() + offset, vector_encoding_)) {
+        vectors.resize(offset);
+        continue;
+      }
+      chunk_labels.push_back(label_it->second);
+
+      if (chunk_labels.size() == chunk_size) {
+        flush();
+      }
+    }
+    flush();
+  });
+
+  *trained = train;
+  return index;
 }
 
-size_t KnowledgeBase::size() const {
-  return index_->ntotal;
+size_t KnowledgeBase::loadThreads() const {
+  if (index_options_.load_threads > 0) {
+    return index_options_.load_threads;
+  }
+  return std::clamp<size_t>(std::thread::hardware_concurrency(), 1, kMaxLoadThreads);
+}
+
+std::vector<float> KnowledgeBase::sampleVectors(size_t count, const rocksdb::Snapshot* snapshot) {
+  // Reservoir sample over the embeddings column family
+  std::vector<float> sample;
+  sample.reserve(count * dimension_);
+  std::mt19937_64 gen(kSampleSeed);
+  size_t seen = 0;
+
+  // Only vectors that make it into the sample are decoded
+  const size_t vector_size = encodedVectorSize(dimension_, vector_encoding_);
+  KeyRange everything;
+  for (RangeScan it(db_.get(), embeddings_cf_, everything, snapshot); it->Valid() && count > 0; it->Next()) {
+    if (it->value().size() != vector_size) {
+      continue;
+    }
+
+    size_t slot = seen < count ? seen : std::uniform_int_distribution<size_t>(0, seen)(gen);
+    ++seen;
+    if (slot >= count) {
+      continue;
+    }
+    if (slot == sample.size() / dimension_) {
+      sample.resize(sample.size() + dimension_);
+    }
+    decodeVector(it->value(), dimension_, sample.data() + slot * dimension_, vector_encoding_);
+  }
+
+  return sample;
+}
+
+const float* KnowledgeBase::prepareVectors(const float* vectors, size_t n, std::vector<float>* buffer) const {
+  if (!normalize_) {
+    return vectors;
+  }
+  buffer->assign(vectors, vectors + n * dimension_);
+  faiss::fvec_renorm_L2(dimension_, n, buffer->data());
+  return buffer->data();
+}
+
+uint32_t KnowledgeBase::internCategory(const std::string& category) {
+  auto it = category_ids_.find(category);
+  if (it != category_ids_.end()) {
+    return it->second;
+  }
+
+  uint32_t category_id = static_cast<uint32_t>(categories_.size());
+  categories_.push_back(category);
+  category_ids_.emplace(category, category_id);
+  return category_id;
+}
+
+faiss::idx_t KnowledgeBase::insertVector(const std::string& id, const float* vector, const std::string& category,
+                                         int64_t timestamp, const std::vector<std::string>& terms) {
+  std::vector<float> normalized;
+  faiss::idx_t label = next_label_++;
+  const float* prepared = prepareVectors(vector, 1, &normalized);
+  {
+    ScopedTimer timer(storeMetrics().index_add);
+    index_->add_with_ids(1, prepared, &label);
+  }
+  if (rebuilding_) {
+    rebuild_labels_.push_back(label);
+    rebuild_vectors_.insert(rebuild_vectors_.end(), prepared, prepared + dimension_);
+  }
+  entries_[label] = IndexEntry{id, internCategory(category), timestamp};
+  id_to_label_[id] = label;
+  lexical_.add(label, terms);
+  generation_.fetch_add(1, std::memory_order_release);
+
+  if (trainingDue()) {
+    maintenance_cv_.notify_one();
+  }
+  return label;
+}
+
+void KnowledgeBase::insertVectors(const std::vector<std::string>& ids, const std::vector<const Memory*>& memories,
+                                  const float* vectors, const std::vector<std::vector<std::string>>& terms) {
+  std::vector<faiss::idx_t> labels(ids.size());
+  for (size_t i = 0; i < ids.size(); ++i) {
+    labels[i] = next_label_++;
+    entries_[labels[i]] = IndexEntry{ids[i], internCategory(memories[i]->category), memories[i]->timestamp};
+    id_to_label_[ids[i]] = labels[i];
+    lexical_.add(labels[i], terms[i]);
+  }
+  std::vector<float> normalized;
+  const float* prepared = prepareVectors(vectors, labels.size(), &normalized);
+  {
+    ScopedTimer timer(storeMetrics().index_add);
+    index_->add_with_ids(labels.size(), prepared, labels.data());
+  }
+  if (rebuilding_) {
+    rebuild_labels_.insert(rebuild_labels_.end(), labels.begin(), labels.end());
+    rebuild_vectors_.insert(rebuild_vectors_.end(), prepared, prepared + labels.size() * dimension_);
+  }
+  generation_.fetch_add(1, std::memory_order_release);
+
+  if (trainingDue()) {
+    maintenance_cv_.notify_one();
+  }
+}
+
+void KnowledgeBase::tombstone(const std::string& id) {
+  auto it = id_to_label_.find(id);
+  if (it == id_to_label_.end()) {
+    return;
+  }
+
+  tombstones_.insert(it->second);
+  if (rebuilding_) {
+    rebuild_tombstones_.insert(it->second);
+  }
+  entries_.erase(it->second);
+  lexical_.remove(it->second);
+  id_to_label_.erase(it);
+  generation_.fetch_add(1, std::memory_order_release);
+
+  if (compactionDue()) {
+    maintenance_cv_.notify_one();
+  }
+}
+
+bool KnowledgeBase::compactionDue() const {
+  return tombstones_.size() >= kMinTombstonesForCompaction &&
+         tombstones_.size() * 4 >= static_cast<size_t>(index_->ntotal);
+}
+
+bool KnowledgeBase::trainingDue() const {
+  if (!requires_training_) {
+    return false;
+  }
+
+  size_t live = entries_.size();
+  if (trained_size_ == 0) {
+    return live >= kMinTrainingVectors;
+  }
+  // Past a few multiples of the training cap, retraining no longer changes
+  // the sample or the list count much
+  return live >= trained_size_ * kRetrainGrowth && trained_size_ < kMaxTrainingVectors * kRetrainGrowth;
+}
+
+bool KnowledgeBase::compactTombstones() {
+  if (tombstones_.empty()) {
+    return true;
+  }
+
+  if (supports_removal_) {
+    std::vector<faiss::idx_t> dead(tombstones_.begin(), tombstones_.end());
+    faiss::IDSelectorBatch selector(dead.size(), dead.data());
+
+    std::unique_lock<std::shared_mutex> lock(index_mutex_);
+    try {
+      index_->remove_ids(selector);
+      tombstones_.clear();
+      return true;
+    } catch (const faiss::FaissException&) {
+      // HNSW graphs cannot drop nodes; rebuild without them instead
+      supports_removal_ = false;
+    }
+  }
+
+  return false;
+}
+
+void KnowledgeBase::maintenanceLoop() {
+  auto next_snapshot = std::chrono::steady_clock::now() + kSnapshotInterval;
+
+  while (true) {
+    {
+      std::unique_lock<std::shared_mutex> lock(index_mutex_);
+      maintenance_cv_.wait_until(lock, next_snapshot, [this]() {
+        return stop_maintenance_ || compactionDue() || trainingDue();
+      });
+
+      if (stop_maintenance_) {
+        return;
+      }
+    }
+
+    bool rebuild = false;
+    {
+      // Writers only touch the index under write_mutex_, so holding it is
+      // enough to read the tombstones and label maps here
+      std::lock_guard<std::mutex> write_lock(write_mutex_);
+      if (trainingDue()) {
+        rebuild = true;
+      } else if (compactionDue()) {
+        rebuild = !compactTombstones();
+      }
+    }
+    // Training and reindexing take long on a large corpus; writers carry on
+    if (rebuild) {
+      rebuildIndexOnline();
+    }
+
+    if (std::chrono::steady_clock::now() >= next_snapshot) {
+      if (writes_since_snapshot_ > 0) {
+        saveIndex();
+      }
+      next_snapshot = std::chrono::steady_clock::now() + kSnapshotInterval;
+    }
+  }
+}
+
+void KnowledgeBase::saveIndex() {
+  IndexCopy copy;
+  uint64_t imports;
+  {
+    std::lock_guard<std::mutex> write_lock(write_mutex_);
+    copy = copyIndex();
+    imports = imports_;
+    writes_since_snapshot_ = 0;
+  }
+
+  // Write to a temporary file and rename so a crash never leaves a torn snapshot
+  std::string path = snapshotPath();
+  std::string tmp_path = path + ".tmp";
+  bool ok = writeSnapshot(copy, tmp_path);
+
+  std::lock_guard<std::mutex> write_lock(write_mutex_);
+  if (!ok || imports != imports_ || std::rename(tmp_path.c_str(), path.c_str()) != 0) {
+    std::remove(tmp_path.c_str());
+  }
+}
+
+KnowledgeBase::IndexCopy KnowledgeBase::copyIndex() {
+  // Holding write_mutex_ keeps writers out, so the RocksDB sequence number
+  // matches the copied index exactly. Tombstones are copied as they are;
+  // compacting here would mean a full rebuild for index types that cannot
+  // remove vectors.
+  IndexCopy copy;
+
+  // Copying only reads the index, so searches keep running meanwhile
+  std::shared_lock<std::shared_mutex> lock(index_mutex_);
+  copy.index.reset(faiss::clone_index(index_.get()));
+  copy.labels.assign(entries_.begin(), entries_.end());
+  copy.tombstones.assign(tombstones_.begin(), tombstones_.end());
+  copy.lexical = lexical_;
+  copy.categories = categories_;
+  copy.sequence = db_->GetLatestSequenceNumber();
+  copy.next_label = next_label_;
+  copy.trained_size = trained_size_;
+  return copy;
+}
+
+bool KnowledgeBase::writeSnapshot(const IndexCopy& copy, const std::string& path) const {
+  FILE* f = std::fopen(path.c_str(), "wb");
+  if (!f) {
+    return false;
+  }
+
+  bool ok = std::fwrite(kSnapshotMagic, sizeof(kSnapshotMagic), 1, f) == 1 &&
+            writePod(f, kSnapshotVersion) &&
+            writePod(f, static_cast<int32_t>(dimension_)) &&
+            writeString(f, snapshotIndexType(index_options_)) &&
+            writePod(f, copy.trained_size) &&
+            writePod(f, copy.sequence) &&
+            writePod(f, copy.next_label) &&
+            writePod(f, static_cast<uint32_t>(copy.categories.size()));
+
+  for (size_t i = 0; ok && i < copy.categories.size(); ++i) {
+    ok = writeString(f, copy.categories[i]);
+  }
+
+  ok = ok && writePod(f, static_cast<uint64_t>(copy.labels.size()));
+  for (size_t i = 0; ok && i < copy.labels.size(); ++i) {
+    const IndexEntry& entry = copy.labels[i].second;
+    ok = writePod(f, copy.labels[i].first) && writeString(f, entry.id) &&
+         writePod(f, entry.category) && writePod(f, entry.timestamp);
+  }
+
+  ok = ok && writePod(f, static_cast<uint64_t>(copy.tombstones.size()));
+  for (size_t i = 0; ok && i < copy.tombstones.size(); ++i) {
+    ok = writePod(f, copy.tombstones[i]);
+  }
+  if (index_options_.lexical) {
+    ok = ok && copy.lexical.save(f);
+  }
+
+  try {
+    if (ok) {
+      faiss::write_index(copy.index.get(), f);
+    }
+  } catch (const std::exception&) {
+    ok = false;
+  }
+
+  return (std::fclose(f) == 0) && ok;
+}
+
+void KnowledgeBase::seedIdGenerator() {
+  for (const auto& [id, label] : id_to_label_) {
+    ids_.observe(id);
+  }
+  for (const auto& [ticket, memory] : queuedMemories()) {
+    ids_.observe(memory.id);
+  }
+}
+
+bool KnowledgeBase::add(const Memory& memory) {
+  return !addAndReturnId(memory).empty();
+}
+
+std::string KnowledgeBase::addAndReturnId(const Memory& memory) {
+  std::lock_guard<std::mutex> write_lock(write_mutex_);
+
+  if (memory.embedding.size() != static_cast<size_t>(dimension_)) {
+    return "";
+  }
+
+  std::string id = memory.id.empty() ? ids_.next() : memory.id;
+  if (exists(id) || queued_ids_.count(id)) {
+    return "";
+  }
+
+  // Store metadata and vector atomically
+  rocksdb::WriteBatch batch;
+  batch.Put(id, encodeRecord(memory.content, memory.category, memory.timestamp));
+  batch.Put(embeddings_cf_, id, encodeVector(memory.embedding.data(), memory.embedding.size(), vector_encoding_));
+
+  rocksdb::Status status = writeBatch(db_.get(), write_options_, &batch);
+  if (!status.ok()) {
+    return "";
+  }
+
+  // Add to FAISS index
+  std::vector<std::string> terms = lexicalTerms(memory.content);
+  {
+    auto lock = lockExclusive(index_mutex_);
+    insertVector(id, memory.embedding.data(), memory.category, memory.timestamp, terms);
+  }
+  ++writes_since_snapshot_;
+
+  return id;
+}
+
+std::vector<std::string> KnowledgeBase::addBatch(const std::vector<Memory>& memories) {
+  std::vector<std::string> ids = addBatch(memories, {});
+  ids.resize(memories.size());
+  return ids;
+}
+
+std::vector<std::string> KnowledgeBase::addBatch(const std::vector<Memory>& memories,
+                                                 const std::vector<uint64_t>& tickets) {
+  std::lock_guard<std::mutex> write_lock(write_mutex_);
+
+  std::vector<std::string> ids(memories.size());
+  std::vector<std::string> added_ids;
+  std::vector<const Memory*> added;
+  std::vector<float> vectors;
+  std::unordered_set<std::string> batch_ids;
+  rocksdb::WriteBatch batch;
+
+  // Skip ids already stored or repeated within this batch, and those
+  // queued for an asynchronous add unless this is that add
+  std::vector<std::string> candidates(memories.size());
+  {
+    auto lock = lockShared(index_mutex_);
+    for (size_t i = 0; i < memories.size(); ++i) {
+      if (memories[i].embedding.size() != static_cast<size_t>(dimension_)) {
+        continue;
+      }
+      std::string id = memories[i].id.empty() ? ids_.next() : memories[i].id;
+      bool queued = i >= tickets.size() && queued_ids_.count(id);
+      if (!queued && !id_to_label_.count(id) && batch_ids.insert(id).second) {
+        candidates[i] = std::move(id);
+      }
+    }
+  }
+
+  for (size_t i = 0; i < memories.size(); ++i) {
+    const Memory& memory = memories[i];
+    // Queued entries are dropped whether or not the memory makes it in
+    if (i < tickets.size()) {
+      batch.Delete(ingest_cf_, encodeTicket(tickets[i]));
+    }
+    if (candidates[i].empty()) {
+      continue;
+    }
+
+    std::string& id = candidates[i];
+    batch.Put(id, encodeRecord(memory.content, memory.category, memory.timestamp));
+    batch.Put(embeddings_cf_, id, encodeVector(memory.embedding.data(), memory.embedding.size(), vector_encoding_));
+    vectors.insert(vectors.end(), memory.embedding.begin(), memory.embedding.end());
+    added_ids.push_back(id);
+    added.push_back(&memory);
+    ids[i] = std::move(id);
+  }
+
+  if (batch.Count() == 0) {
+    return ids;
+  }
+
+  rocksdb::Status status = writeBatch(db_.get(), write_options_, &batch);
+  if (!status.ok()) {
+    return {};
+  }
+  for (size_t i = 0; i < tickets.size() && i < memories.size(); ++i) {
+    queued_ids_.erase(memories[i].id);
+  }
+  if (added_ids.empty()) {
+    return ids;
+  }
+
+  std::vector<std::vector<std::string>> terms(added.size());
+  for (size_t i = 0; i < added.size(); ++i) {
+    terms[i] = lexicalTerms(added[i]->content);
+  }
+  {
+    auto lock = lockExclusive(index_mutex_);
+    insertVectors(added_ids, added, vectors.data(), terms);
+  }
+  writes_since_snapshot_ += added_ids.size();
+
+  return ids;
+}
+
+std::string KnowledgeBase::enqueue(uint64_t ticket, const Memory& memory) {
+  std::string id = memory.id.empty() ? ids_.next() : memory.id;
+  {
+    // Adds hold write_mutex_ until the memory is indexed, so no add of
+    // this id is in flight once the check passes
+    std::lock_guard<std::mutex> write_lock(write_mutex_);
+    if (exists(id) || !queued_ids_.insert(id).second) {
+      return "";
+    }
+  }
+
+  // Synced so an acknowledged add survives a crash before it is embedded.
+  // Written outside write_mutex_ so concurrent enqueues share a group commit.
+  rocksdb::WriteOptions options;
+  options.sync = true;
+  rocksdb::Status status = db_->Put(options, ingest_cf_, encodeTicket(ticket),
+                                    encodeQueuedMemory(id, memory.content, memory.category, memory.timestamp));
+  if (!status.ok()) {
+    std::lock_guard<std::mutex> write_lock(write_mutex_);
+    queued_ids_.erase(id);
+    return "";
+  }
+  return id;
+}
+
+std::vector<std::pair<uint64_t, Memory>> KnowledgeBase::queuedMemories() {
+  std::vector<std::pair<uint64_t, Memory>> queued;
+  std::unique_ptr<rocksdb::Iterator> it(db_->NewIterator(rocksdb::ReadOptions(), ingest_cf_));
+  for (it->SeekToFirst(); it->Valid(); it->Next()) {
+    uint64_t ticket;
+    Memory memory;
+    MemoryRecord record;
+    if (!decodeTicket(it->key(), &ticket) || !decodeQueuedMemory(it->value(), &memory.id, &record)) {
+      continue;
+    }
+    memory.content = std::move(record.content);
+    memory.category = std::move(record.category);
+    memory.timestamp = record.timestamp;
+    queued.emplace_back(ticket, std::move(memory));
+  }
+  return queued;
+}
+
+std::vector<SearchResult> KnowledgeBase::search(const std::vector<float>& query_embedding, int top_k,
+                                                const SearchOptions& options) {
+  if (query_embedding.size() != static_cast<size_t>(dimension_)) {
+    return {};
+  }
+  return searchVectors(query_embedding.data(), 1, top_k, options)[0];
+}
+
+std::vector<std::vector<SearchResult>> KnowledgeBase::searchBatch(
+    const std::vector<std::vector<float>>& query_embeddings, int top_k, const SearchOptions& options) {
+  std::vector<float> queries;
+  queries.reserve(query_embeddings.size() * dimension_);
+  for (const auto& query : query_embeddings) {
+    if (query.size() != static_cast<size_t>(dimension_)) {
+      return std::vector<std::vector<SearchResult>>(query_embeddings.size());
+    }
+    queries.insert(queries.end(), query.begin(), query.end());
+  }
+
+  if (query_embeddings.empty()) {
+    return {};
+  }
+  return searchVectors(queries.data(), query_embeddings.size(), top_k, options);
+}
+
+std::vector<std::vector<SearchResult>> KnowledgeBase::searchVectors(const float* queries, size_t nq, int top_k,
+                                                                    const SearchOptions& options) {
+  if (!result_cache_) {
+    // Retrieve full documents from RocksDB without holding the index lock
+    return hydrate(findNeighbours(queries, nq, top_k, options));
+  }
+
+  // Read before searching, so results computed while a write lands are
+  // cached under the generation it replaced and never served
+  uint64_t generation = generation_.load(std::memory_order_acquire);
+  std::vector<std::vector<SearchResult>> results(nq);
+  std::vector<std::string> keys(nq);
+  std::vector<size_t> missed;
+  for (size_t q = 0; q < nq; ++q) {
+    keys[q] = SearchResultCache::key(queries + q * dimension_, dimension_, top_k, options);
+    if (!result_cache_->lookup(keys[q], generation, &results[q])) {
+      missed.push_back(q);
+    }
+  }
+  storeMetrics().result_cache_hits.add(nq - missed.size());
+  storeMetrics().result_cache_misses.add(missed.size());
+  if (missed.empty()) {
+    return results;
+  }
+
+  std::vector<float> missed_queries;
+  if (missed.size() < nq) {
+    missed_queries.reserve(missed.size() * dimension_);
+    for (size_t q : missed) {
+      missed_queries.insert(missed_queries.end(), queries + q * dimension_, queries + (q + 1) * dimension_);
+    }
+    queries = missed_queries.data();
+  }
+  std::vector<std::vector<SearchResult>> computed = hydrate(findNeighbours(queries, missed.size(), top_k, options));
+  for (size_t i = 0; i < missed.size(); ++i) {
+    result_cache_->insert(keys[missed[i]], generation, computed[i]);
+    results[missed[i]] = std::move(computed[i]);
+  }
+  return results;
+}
+
+std::vector<KnowledgeBase::Hits> KnowledgeBase::findNeighbours(const float* queries, size_t nq, int top_k,
+                                                               const SearchOptions& options) {
+  std::vector<Hits> hits(nq);
+
+  // Searches only read the index and run concurrently with each other
+  auto lock = lockShared(index_mutex_);
+
+  if (entries_.empty() || top_k <= 0) {
+    return hits;
+  }
+
+  uint32_t category = 0;
+  if (!options.category.empty()) {
+    auto category_it = category_ids_.find(options.category);
+    if (category_it == category_ids_.end()) {
+      return hits;
+    }
+    category = category_it->second;
+  }
+
+  // Filters are checked against the in-memory metadata while FAISS scans,
+  // so top_k is filled with matches only
+  auto matches = [this, &options, category](faiss::idx_t label) {
+    return matchesFilters(label, options, category);
+  };
+  PredicateFilter<decltype(matches)> metadata_filter(matches);
+  TombstoneFilter tombstone_filter(tombstones_);
+
+  faiss::IDSelector* selector = nullptr;
+  if (!options.category.empty() || options.since != 0 || options.until != 0) {
+    selector = &metadata_filter;
+  } else if (!tombstones_.empty()) {
+    selector = &tombstone_filter;
+  }
+
+  // One FAISS call for all queries lets it use matrix-matrix kernels
+  top_k = std::min(top_k, static_cast<int>(entries_.size()));
+  std::vector<float> distances(nq * top_k);
+  std::vector<faiss::idx_t> indices(nq * top_k);
+
+  // The parameter type has to match the index FAISS dispatches to
+  faiss::SearchParameters flat_params;
+  faiss::SearchParametersIVF ivf_params;
+  faiss::SearchParametersHNSW hnsw_params;
+  faiss::SearchParameters* params = selector ? &flat_params : nullptr;
+
+  if (faiss::ivflib::try_extract_index_ivf(index_->index)) {
+    ivf_params.nprobe = options.nprobe > 0 ? options.nprobe : index_options_.nprobe;
+    params = &ivf_params;
+  } else if (dynamic_cast<const faiss::IndexHNSW*>(index_->index)) {
+    hnsw_params.efSearch = std::max(top_k, options.ef_search > 0 ? options.ef_search : index_options_.ef_search);
+    params = &hnsw_params;
+  }
+  if (params) {
+    params->sel = selector;
+  }
+
+  std::vector<float> normalized;
+  {
+    ScopedTimer timer(storeMetrics().index_search);
+    index_->search(nq, prepareVectors(queries, nq, &normalized), top_k, distances.data(), indices.data(), params);
+  }
+
+  for (size_t q = 0; q < nq; ++q) {
+    hits[q].reserve(top_k);
+    for (int i = 0; i < top_k; ++i) {
+      size_t slot = q * top_k + i;
+      auto entry_it = entries_.find(indices[slot]);
+      if (entry_it != entries_.end()) {
+        hits[q].emplace_back(entry_it->second.id, distances[slot]);
+      }
+    }
+  }
+
+  return hits;
+}
+
+bool KnowledgeBase::matchesFilters(faiss::idx_t label, const SearchOptions& options, uint32_t category) const {
+  // Tombstoned labels have no entry
+  auto entry_it = entries_.find(label);
+  if (entry_it == entries_.end()) {
+    return false;
+  }
+  const IndexEntry& entry = entry_it->second;
+  return (options.category.empty() || entry.category == category) &&
+         (options.since == 0 || entry.timestamp >= options.since) &&
+         (options.until == 0 || entry.timestamp <= options.until);
+}
+
+std::vector<std::string> KnowledgeBase::lexicalTerms(const std::string& content) const {
+  return index_options_.lexical ? LexicalIndex::tokenize(content) : std::vector<std::string>();
+}
+
+KnowledgeBase::Hits KnowledgeBase::findLexical(const std::string& query, int top_k, const SearchOptions& options) {
+  std::vector<std::string> terms = LexicalIndex::tokenize(query);
+  Hits hits;
+
+  auto lock = lockShared(index_mutex_);
+  if (terms.empty() || top_k <= 0) {
+    return hits;
+  }
+
+  uint32_t category = 0;
+  if (!options.category.empty()) {
+    auto category_it = category_ids_.find(options.category);
+    if (category_it == category_ids_.end()) {
+      return hits;
+    }
+    category = category_it->second;
+  }
+
+  auto ranked = lexical_.search(terms, top_k, [this, &options, category](LexicalIndex::Label label) {
+    return matchesFilters(label, options, category);
+  });
+  hits.reserve(ranked.size());
+  for (const auto& [label, score] : ranked) {
+    hits.emplace_back(entries_.at(label).id, score);
+  }
+  return hits;
+}
+
+std::vector<SearchResult> KnowledgeBase::searchLexical(const std::string& query, int top_k,
+                                                       const SearchOptions& options) {
+  return hydrate({findLexical(query, top_k, options)})[0];
+}
+
+std::vector<SearchResult> KnowledgeBase::searchHybrid(const std::string& query,
+                                                      const std::vector<float>& query_embedding, int top_k,
+                                                      const SearchOptions& options) {
+  if (query_embedding.size() != static_cast<size_t>(dimension_) || top_k <= 0) {
+    return {};
+  }
+
+  // top_k may be as large as INT_MAX; both rankings clamp to the store size
+  int candidates = static_cast<int>(std::min<int64_t>(static_cast<int64_t>(top_k) * kHybridCandidateFactor,
+                                                      std::numeric_limits<int>::max()));
+  Hits rankings[] = {findNeighbours(query_embedding.data(), 1, candidates, options)[0],
+                     findLexical(query, candidates, options)};
+
+  std::unordered_map<std::string, float> fused;
+  for (const Hits& ranking : rankings) {
+    for (size_t rank = 0; rank < ranking.size(); ++rank) {
+      fused[ranking[rank].first] += 1.0f / (kRrfK + rank + 1);
+    }
+  }
+
+  Hits hits(fused.begin(), fused.end());
+  std::sort(hits.begin(), hits.end(), [](const auto& a, const auto& b) {
+    return a.second != b.second ? a.second > b.second : a.first < b.first;
+  });
+  if (hits.size() > static_cast<size_t>(top_k)) {
+    hits.resize(top_k);
+  }
+  return hydrate({hits})[0];
+}
+
+double KnowledgeBase::measureRecall(size_t num_queries, int top_k, const SearchOptions& options) {
+  // Queries are midpoints of pairs of stored vectors: near the data, but
+  // not trivially matched by a vector equal to the query
+  std::vector<float> sample = sampleVectors(num_queries * 2);
+  size_t nq = sample.size() / dimension_ / 2;
+  if (nq == 0 || top_k <= 0) {
+    return 1.0;
+  }
+
+  std::vector<float> queries(nq * dimension_);
+  for (size_t q = 0; q < nq; ++q) {
+    const float* a = sample.data() + (2 * q) * dimension_;
+    const float* b = a + dimension_;
+    for (int j = 0; j < dimension_; ++j) {
+      queries[q * dimension_ + j] = 0.5f * (a[j] + b[j]);
+    }
+  }
+
+  // Exact neighbours, brute force over the stored embeddings a chunk at a time
+  std::vector<std::vector<std::pair<float, std::string>>> exact(nq);
+  std::vector<float> chunk;
+  std::vector<std::string> chunk_ids;
+
+  auto search_chunk = [&]() {
+    if (chunk_ids.empty()) {
+      return;
+    }
+
+    faiss::IndexFlat flat(dimension_, metric_type_);
+    std::vector<float> normalized;
+    flat.add(chunk_ids.size(), prepareVectors(chunk.data(), chunk_ids.size(), &normalized));
+    int k = std::min(top_k, static_cast<int>(chunk_ids.size()));
+    std::vector<float> distances(nq * k);
+    std::vector<faiss::idx_t> labels(nq * k);
+    flat.search(nq, prepareVectors(queries.data(), nq, &normalized), k, distances.data(), labels.data());
+
+    for (size_t q = 0; q < nq; ++q) {
+      for (int i = 0; i < k; ++i) {
+        size_t slot = q * k + i;
+        if (labels[slot] >= 0) {
+          exact[q].emplace_back(distances[slot], chunk_ids[labels[slot]]);
+        }
+      }
+      if (metric_type_ == faiss::METRIC_INNER_PRODUCT) {
+        std::sort(exact[q].begin(), exact[q].end(), std::greater<>());
+      } else {
+        std::sort(exact[q].begin(), exact[q].end());
+      }
+      exact[q].resize(std::min(exact[q].size(), static_cast<size_t>(top_k)));
+    }
+
+    chunk.clear();
+    chunk_ids.clear();
+  };
+
+  std::unique_ptr<rocksdb::Iterator> it(db_->NewIterator(rocksdb::ReadOptions(), embeddings_cf_));
+  for (it->SeekToFirst(); it->Valid(); it->Next()) {
+    size_t offset = chunk.size();
+    chunk.resize(offset + dimension_);
+    if (!decodeVector(it->value(), dimension_, chunk.data() + offset, vector_encoding_)) {
+      chunk.resize(offset);
+      continue;
+    }
+    chunk_ids.push_back(it->key().ToString());
+
+    if (chunk_ids.size() == kRebuildChunkSize) {
+      search_chunk();
+    }
+  }
+  search_chunk();
+
+  // The exact baseline is unfiltered, so only the tuning options apply
+  SearchOptions tuning;
+  tuning.nprobe = options.nprobe;
+  tuning.ef_search = options.ef_search;
+  std::vector<Hits> approximate = findNeighbours(queries.data(), nq, top_k, tuning);
+
+  double total = 0.0;
+  for (size_t q = 0; q < nq; ++q) {
+    if (exact[q].empty()) {
+      total += 1.0;
+      continue;
+    }
+
+    std::unordered_set<std::string> expected;
+    for (const auto& entry : exact[q]) {
+      expected.insert(entry.second);
+    }
+
+    size_t found = 0;
+    for (const auto& hit : approximate[q]) {
+      found += expected.count(hit.first);
+    }
+    total += static_cast<double>(found) / expected.size();
+  }
+
+  return total / nq;
+}
+
+std::vector<std::vector<SearchResult>> KnowledgeBase::hydrate(const std::vector<Hits>& hits) {
+  // One MultiGet for the distinct ids of all queries: RocksDB batches the
+  // block lookups, and records are decoded straight from pinned blocks
+  std::unordered_map<std::string, size_t> slots;
+  std::vector<rocksdb::Slice> keys;
+  for (const Hits& query_hits : hits) {
+    for (const auto& hit : query_hits) {
+      if (slots.emplace(hit.first, keys.size()).second) {
+        keys.emplace_back(hit.first);
+      }
+    }
+  }
+
+  std::vector<rocksdb::PinnableSlice> values(keys.size());
+  std::vector<rocksdb::Status> statuses(keys.size());
+  if (!keys.empty()) {
+    ScopedTimer timer(storeMetrics().rocksdb_multiget);
+    db_->MultiGet(rocksdb::ReadOptions(), db_->DefaultColumnFamily(), keys.size(), keys.data(),
+                  values.data(), statuses.data());
+  }
+
+  std::vector<MemoryRecord> records(keys.size());
+  std::vector<bool> found(keys.size());
+  for (size_t i = 0; i < keys.size(); ++i) {
+    found[i] = statuses[i].ok() && decodeRecord(values[i], &records[i]);
+  }
+
+  std::vector<std::vector<SearchResult>> results(hits.size());
+  for (size_t q = 0; q < hits.size(); ++q) {
+    results[q].reserve(hits[q].size());
+    for (const auto& [id, score] : hits[q]) {
+      size_t slot = slots[id];
+      if (!found[slot]) {
+        continue;
+      }
+
+      const MemoryRecord& record = records[slot];
+      SearchResult result;
+      result.id = id;
+      result.content = record.content;
+      result.category = record.category;
+      result.score = score;
+      result.timestamp = record.timestamp;
+      results[q].push_back(std::move(result));
+    }
+  }
+
+  return results;
+}
+
+bool KnowledgeBase::update(const std::string& id, const std::string& content, const std::vector<float>& embedding) {
+  std::lock_guard<std::mutex> write_lock(write_mutex_);
+
+  if (embedding.size() != static_cast<size_t>(dimension_)) {
+    return false;
+  }
+
+  // The category is kept from the stored memory, which the index knows
+  std::string category;
+  {
+    auto lock = lockShared(index_mutex_);
+    auto it = id_to_label_.find(id);
+    if (it == id_to_label_.end()) {
+      return false;
+    }
+    category = categories_[entries_.at(it->second).category];
+  }
+
+  int64_t timestamp = std::chrono::duration_cast<std::chrono::milliseconds>(
+    std::chrono::system_clock::now().time_since_epoch()
+  ).count();
+
+  rocksdb::WriteBatch batch;
+  batch.Put(id, encodeRecord(content, category, timestamp));
+  batch.Put(embeddings_cf_, id, encodeVector(embedding.data(), embedding.size(), vector_encoding_));
+
+  rocksdb::Status put_status = writeBatch(db_.get(), write_options_, &batch);
+  if (!put_status.ok()) {
+    return false;
+  }
+
+  // Replace the vector in place under a fresh label
+  std::vector<std::string> terms = lexicalTerms(content);
+  {
+    auto lock = lockExclusive(index_mutex_);
+    tombstone(id);
+    insertVector(id, embedding.data(), category, timestamp, terms);
+  }
+  ++writes_since_snapshot_;
+
+  return true;
+}
+
+bool KnowledgeBase::remove(const std::string& id) {
+  std::lock_guard<std::mutex> write_lock(write_mutex_);
+
+  if (!exists(id)) {
+    return false;
+  }
+
+  rocksdb::WriteBatch batch;
+  batch.Delete(id);
+  batch.Delete(embeddings_cf_, id);
+
+  rocksdb::Status status = writeBatch(db_.get(), write_options_, &batch);
+
+  if (status.ok()) {
+    auto lock = lockExclusive(index_mutex_);
+    tombstone(id);
+    ++writes_since_snapshot_;
+    return true;
+  }
+
+  return false;
+}
+
+void KnowledgeBase::loadPreferences() {
+  rocksdb::ReadOptions options;
+  options.prefix_same_as_start = true;
+  std::unique_ptr<rocksdb::Iterator> it(db_->NewIterator(options));
+  for (it->Seek(kPreferencePrefix); it->Valid() && it->key().starts_with(kPreferencePrefix); it->Next()) {
+    preferences_.emplace_hint(preferences_.end(), it->key().ToString().substr(kPreferencePrefix.size()),
+                              it->value().ToString());
+  }
+}
+
+bool KnowledgeBase::updateUserPreference(const std::string& key, const std::string& value) {
+  // Held across the write so the map and storage agree on the last writer
+  std::unique_lock<std::shared_mutex> lock(preference_mutex_);
+  rocksdb::Status status = db_->Put(write_options_, kPreferencePrefix + key, value);
+  if (!status.ok()) {
+    return false;
+  }
+  preferences_[key] = value;
+  return true;
+}
+
+std::string KnowledgeBase::getUserPreference(const std::string& key) {
+  std::shared_lock<std::shared_mutex> lock(preference_mutex_);
+  auto it = preferences_.find(key);
+  return it != preferences_.end() ? it->second : "";
+}
+
+std::vector<std::string> KnowledgeBase::getUserPreferences(const std::vector<std::string>& keys) {
+  std::vector<std::string> values(keys.size());
+  std::shared_lock<std::shared_mutex> lock(preference_mutex_);
+  for (size_t i = 0; i < keys.size(); ++i) {
+    auto it = preferences_.find(keys[i]);
+    if (it != preferences_.end()) {
+      values[i] = it->second;
+    }
+  }
+  return values;
+}
+
+std::vector<std::pair<std::string, std::string>> KnowledgeBase::listUserPreferences(const std::string& prefix) {
+  std::vector<std::pair<std::string, std::string>> listed;
+  std::shared_lock<std::shared_mutex> lock(preference_mutex_);
+  for (auto it = preferences_.lower_bound(prefix);
+       it != preferences_.end() && it->first.compare(0, prefix.size(), prefix) == 0; ++it) {
+    listed.emplace_back(it->first, it->second);
+  }
+  return listed;
+}
+
+bool KnowledgeBase::exportTo(FILE* out, TransferCounts* counts) {
+  ExportWriter writer(out);
+  if (!writer.writeHeader(static_cast<uint32_t>(dimension_), vector_encoding_)) {
+    return false;
+  }
+
+  // Both column families at one snapshot, walked in step as they share keys
+  rocksdb::ManagedSnapshot snapshot(db_.get());
+  rocksdb::ReadOptions options;
+  options.snapshot = snapshot.snapshot();
+  options.fill_cache = false;
+  options.readahead_size = kScanReadahead;
+  options.total_order_seek = true;
+  std::unique_ptr<rocksdb::Iterator> vectors(db_->NewIterator(options, embeddings_cf_));
+  std::unique_ptr<rocksdb::Iterator> records(db_->NewIterator(options, db_->DefaultColumnFamily()));
+  const size_t vector_size = encodedVectorSize(dimension_, vector_encoding_);
+
+  TransferCounts exported;
+  ExportEntry entry;
+  records->SeekToFirst();
+  for (vectors->SeekToFirst(); vectors->Valid(); vectors->Next()) {
+    // Only memories that can be indexed and returned by a search
+    if (vectors->value().size() != vector_size) {
+      continue;
+    }
+    while (records->Valid() && records->key().compare(vectors->key()) < 0) {
+      records->Next();
+    }
+    if (!records->Valid() || records->key() != vectors->key()) {
+      continue;
+    }
+
+    entry.key = vectors->key().ToString();
+    entry.value = records->value().ToString();
+    entry.vector = vectors->value().ToString();
+    if (!writer.write(entry)) {
+      return false;
+    }
+    ++exported.memories;
+  }
+  if (!vectors->status().ok() || !records->status().ok()) {
+    return false;
+  }
+
+  entry.kind = ExportEntry::Kind::Preference;
+  entry.vector.clear();
+  for (records->Seek(kPreferencePrefix); records->Valid() && records->key().starts_with(kPreferencePrefix);
+       records->Next()) {
+    entry.key = records->key().ToString().substr(kPreferencePrefix.size());
+    entry.value = records->value().ToString();
+    if (!writer.write(entry)) {
+      return false;
+    }
+    ++exported.preferences;
+  }
+  if (!records->status().ok() || !writer.finish()) {
+    return false;
+  }
+
+  if (counts) {
+    *counts = exported;
+  }
+  return true;
+}
+
+bool KnowledgeBase::importFrom(FILE* in, TransferCounts* counts) {
+  ExportReader reader(in);
+  uint32_t dimension;
+  VectorEncoding encoding;
+  if (!reader.readHeader(&dimension, &encoding) || dimension != static_cast<uint32_t>(dimension_)) {
+    return false;
+  }
+
+  // Imports share the staging directory, so they run one at a time; writers
+  // only wait for the ingest and the indexing.
+  std::lock_guard<std::mutex> import_lock(import_mutex_);
+
+  // Memories are staged in one SST file per column family. Both take keys
+  // in strictly increasing order, which is how an export writes them.
+  ScopedDirectory staging(db_path_ + "/" + kImportDirectory);
+  std::string records_file = staging.path + "/records.sst";
+  std::string vectors_file = staging.path + "/embeddings.sst";
+  rocksdb::SstFileWriter records(rocksdb::EnvOptions(), db_->GetOptions(db_->DefaultColumnFamily()),
+                                 db_->DefaultColumnFamily());
+  rocksdb::SstFileWriter vectors(rocksdb::EnvOptions(), db_->GetOptions(embeddings_cf_), embeddings_cf_);
+  if (!records.Open(records_file).ok() || !vectors.Open(vectors_file).ok()) {
+    return false;
+  }
+
+  std::vector<std::string> ids;
+  std::vector<std::pair<std::string, std::string>> preferences;
+  std::vector<float> vector(dimension_);
+  MemoryRecord record;
+  ExportEntry entry;
+  while (reader.next(&entry)) {
+    if (entry.kind == ExportEntry::Kind::Preference) {
+      preferences.emplace_back(std::move(entry.key), std::move(entry.value));
+      continue;
+    }
+
+    if (entry.key.empty() || reservedKey(entry.key) || (!ids.empty() && entry.key <= ids.back()) ||
+        !decodeRecord(entry.value, &record) || !decodeVector(entry.vector, dimension_, vector.data(), encoding)) {
+      return false;
+    }
+    std::string stored = encoding == vector_encoding_
+      ? std::move(entry.vector)
+      : encodeVector(vector.data(), dimension_, vector_encoding_);
+    if (!records.Put(entry.key, entry.value).ok() || !vectors.Put(entry.key, stored).ok()) {
+      return false;
+    }
+    ids.push_back(std::move(entry.key));
+  }
+  if (!reader.complete()) {
+    return false;
+  }
+
+  if (!ids.empty() && (!records.Finish().ok() || !vectors.Finish().ok())) {
+    return false;
+  }
+
+  std::lock_guard<std::mutex> write_lock(write_mutex_);
+  bool marked = true;
+  bool preferences_written = true;
+  if (!ids.empty()) {
+    rocksdb::IngestExternalFileOptions options;
+    options.move_files = true;
+    std::vector<rocksdb::IngestExternalFileArg> files(2);
+    files[0].column_family = db_->DefaultColumnFamily();
+    files[0].external_files = {records_file};
+    files[0].options = options;
+    files[1].column_family = embeddings_cf_;
+    files[1].external_files = {vectors_file};
+    files[1].options = options;
+    if (!db_->IngestExternalFiles(files).ok()) {
+      return false;
+    }
+    // Ingested files bypass the WAL, so the snapshot could no longer be
+    // brought up to date by replaying it
+    ++imports_;
+    std::remove(snapshotPath().c_str());
+    // The memories are stored now and get indexed regardless; only
+    // replicas miss that they must be reseeded
+    marked = db_->Put(write_options_, kImportMarkerKey, std::to_string(imports_)).ok();
+  }
+
+  if (!preferences.empty()) {
+    rocksdb::WriteBatch batch;
+    for (const auto& [key, value] : preferences) {
+      batch.Put(kPreferencePrefix + key, value);
+    }
+    std::unique_lock<std::shared_mutex> lock(preference_mutex_);
+    preferences_written = writeBatch(db_.get(), write_options_, &batch).ok();
+    if (preferences_written) {
+      for (auto& [key, value] : preferences) {
+        preferences_[key] = std::move(value);
+      }
+    }
+  }
+
+  // Index what was ingested, reading it back in chunks so searches get
+  // the index lock in between
+  for (size_t begin = 0; begin < ids.size(); begin += kImportChunkSize) {
+    size_t n = std::min(kImportChunkSize, ids.size() - begin);
+    std::vector<rocksdb::Slice> keys(ids.begin() + begin, ids.begin() + begin + n);
+    std::vector<rocksdb::PinnableSlice> record_values(n);
+    std::vector<rocksdb::PinnableSlice> vector_values(n);
+    std::vector<rocksdb::Status> record_statuses(n);
+    std::vector<rocksdb::Status> vector_statuses(n);
+    db_->MultiGet(rocksdb::ReadOptions(), db_->DefaultColumnFamily(), n, keys.data(), record_values.data(),
+                  record_statuses.data(), true);
+    db_->MultiGet(rocksdb::ReadOptions(), embeddings_cf_, n, keys.data(), vector_values.data(),
+                  vector_statuses.data(), true);
+
+    std::vector<std::string> chunk_ids;
+    std::vector<Memory> memories;
+    std::vector<float> chunk_vectors;
+    std::vector<std::vector<std::string>> terms;
+    memories.reserve(n);
+    for (size_t i = 0; i < n; ++i) {
+      size_t offset = chunk_vectors.size();
+      chunk_vectors.resize(offset + dimension_);
+      if (!record_statuses[i].ok() || !vector_statuses[i].ok() || !decodeRecord(record_values[i], &record) ||
+          !decodeVector(vector_values[i], dimension_, chunk_vectors.data() + offset, vector_encoding_)) {
+        chunk_vectors.resize(offset);
+        continue;
+      }
+      Memory memory;
+      memory.id = ids[begin + i];
+      memory.category = std::move(record.category);
+      memory.timestamp = record.timestamp;
+      terms.push_back(lexicalTerms(record.content));
+      chunk_ids.push_back(memory.id);
+      memories.push_back(std::move(memory));
+    }
+    if (chunk_ids.empty()) {
+      continue;
+    }
+
+    std::vector<const Memory*> added;
+    for (const Memory& memory : memories) {
+      added.push_back(&memory);
+    }
+    {
+      auto lock = lockExclusive(index_mutex_);
+      for (const std::string& id : chunk_ids) {
+        tombstone(id);
+      }
+      insertVectors(chunk_ids, added, chunk_vectors.data(), terms);
+    }
+    writes_since_snapshot_ += chunk_ids.size();
+  }
+
+  // Generated ids continue past the imported ones
+  for (const std::string& id : ids) {
+    ids_.observe(id);
+  }
+
+  if (counts) {
+    counts->memories = ids.size();
+    counts->preferences = preferences_written ? preferences.size() : 0;
+    counts->unmarked = !marked;
+  }
+  return marked && preferences_written;
+}
+
+bool KnowledgeBase::checkpoint(const std::string& dir) {
+  rocksdb::Checkpoint* created = nullptr;
+  if (!rocksdb::Checkpoint::Create(db_.get(), &created).ok()) {
+    return false;
+  }
+  std::unique_ptr<rocksdb::Checkpoint> checkpoint(created);
+
+  // Flushed beforehand, little WAL is left to copy while writers wait
+  for (rocksdb::ColumnFamilyHandle* handle : cf_handles_) {
+    db_->Flush(rocksdb::FlushOptions(), handle);
+  }
+
+  IndexCopy copy;
+  {
+    std::lock_guard<std::mutex> write_lock(write_mutex_);
+    copy = copyIndex();
+    // Copying the WAL rather than flushing again keeps the checkpoint at
+    // about the copy's sequence number; its snapshot replays the rest
+    if (!checkpoint->CreateCheckpoint(dir, std::numeric_limits<uint64_t>::max()).ok()) {
+      return false;
+    }
+  }
+
+  // Without a snapshot the checkpoint still opens, rebuilding its index
+  std::string path = dir + "/" + kSnapshotFile;
+  std::string tmp_path = path + ".tmp";
+  if (!writeSnapshot(copy, tmp_path) || std::rename(tmp_path.c_str(), path.c_str()) != 0) {
+    std::remove(tmp_path.c_str());
+  }
+  return true;
+}
+
+bool KnowledgeBase::readWal(uint64_t since, size_t max_bytes, std::vector<WalBatch>* batches, uint64_t* latest) {
+  batches->clear();
+  *latest = db_->GetLatestSequenceNumber();
+  since = std::max<uint64_t>(since, 1);
+  if (since > *latest) {
+    return true;
+  }
+
+  std::unique_ptr<rocksdb::TransactionLogIterator> updates;
+  if (!db_->GetUpdatesSince(since, &updates).ok()) {
+    return false;
+  }
+
+  size_t bytes = 0;
+  rocksdb::SequenceNumber expected = since;
+  for (; updates->Valid() && bytes < max_bytes; updates->Next()) {
+    rocksdb::BatchResult batch = updates->GetBatch();
+    if (batch.sequence > expected) {
+      // The WAL covering part of the gap has been purged
+      return false;
+    }
+
+    rocksdb::SequenceNumber next = batch.sequence + batch.writeBatchPtr->Count();
+    if (next <= expected) {
+      continue;
+    }
+    bytes += batch.writeBatchPtr->GetDataSize();
+    batches->push_back(WalBatch{batch.sequence, batch.writeBatchPtr->Data()});
+    expected = next;
+  }
+
+  // The live end of the log may not be readable yet; what was read is
+  // contiguous either way
+  return updates->status().ok() || !batches->empty() || updates->status().IsTryAgain();
+}
+
+bool KnowledgeBase::applyWal(const std::vector<WalBatch>& batches) {
+  std::lock_guard<std::mutex> write_lock(write_mutex_);
+
+  // An embeddings or preference write of a batch, in batch order: the id
+  // and encoded vector, or the preference key and value
+  struct Change {
+    std::string key;
+    std::string value;
+    bool preference = false;
+    bool removed = false;
+  };
+
+  for (const WalBatch& shipped : batches) {
+    rocksdb::WriteBatch batch(shipped.data);
+    uint64_t position = replication_position_.load();
+    uint64_t next = shipped.sequence + batch.Count();
+    if (next <= position) {
+      continue;
+    }
+    if (shipped.sequence > position) {
+      return false;
+    }
+
+    std::vector<Change> changes;
+    bool imported = false;
+    ReplayHandler handler(
+      embeddings_cf_->GetID(),
+      [&changes](const rocksdb::Slice& key, const rocksdb::Slice& value) {
+        changes.push_back(Change{key.ToString(), value.ToString(), false, false});
+      },
+      [&changes](const rocksdb::Slice& key) {
+        changes.push_back(Change{key.ToString(), "", false, true});
+      },
+      [&changes, &imported](const rocksdb::Slice& key, const rocksdb::Slice* value) {
+        if (key.starts_with(kPreferencePrefix)) {
+          changes.push_back(Change{key.ToString().substr(kPreferencePrefix.size()), value ? value->ToString() : "",
+                                   true, value == nullptr});
+        } else if (key == kImportMarkerKey) {
+          imported = true;
+        }
+      });
+    if (!batch.Iterate(&handler).ok() || imported) {
+      // An import on the primary went around the WAL
+      return false;
+    }
+
+    batch.Put(kReplicationPositionKey, std::to_string(next));
+    if (!writeBatch(db_.get(), write_options_, &batch).ok()) {
+      return false;
+    }
+    replication_position_.store(next);
+
+    // Index the memories as the batch left them, with metadata as now
+    // stored; a memory removed again by a later batch leaves with it
+    struct Insert {
+      std::vector<float> vector;
+      MemoryRecord record;
+      std::vector<std::string> terms;
+    };
+    std::vector<Insert> inserts(changes.size());
+    for (size_t i = 0; i < changes.size(); ++i) {
+      Change& change = changes[i];
+      if (change.preference || change.removed) {
+        continue;
+      }
+      Insert& insert = inserts[i];
+      insert.vector.resize(dimension_);
+      if (!decodeVector(change.value, dimension_, insert.vector.data(), vector_encoding_)) {
+        // Written with another dimension or encoding; never indexed
+        change.removed = true;
+        continue;
+      }
+      std::string stored;
+      if (db_->Get(rocksdb::ReadOptions(), change.key, &stored).ok()) {
+        decodeRecord(stored, &insert.record);
+      }
+      insert.terms = lexicalTerms(insert.record.content);
+    }
+
+    {
+      auto lock = lockExclusive(index_mutex_);
+      for (size_t i = 0; i < changes.size(); ++i) {
+        if (changes[i].preference) {
+          continue;
+        }
+        tombstone(changes[i].key);
+        if (!changes[i].removed) {
+          const Insert& insert = inserts[i];
+          insertVector(changes[i].key, insert.vector.data(), insert.record.category, insert.record.timestamp,
+                       insert.terms);
+        }
+        ++writes_since_snapshot_;
+      }
+    }
+
+    std::unique_lock<std::shared_mutex> lock(preference_mutex_);
+    for (Change& change : changes) {
+      if (!change.preference) {
+        continue;
+      }
+      if (change.removed) {
+        preferences_.erase(change.key);
+      } else {
+        preferences_[change.key] = std::move(change.value);
+      }
+    }
+  }
+  return true;
+}
+
+uint64_t KnowledgeBase::replicationPosition() const {
+  return replication_position_.load();
+}
+
+bool KnowledgeBase::exists(const std::string& id) {
+  auto lock = lockShared(index_mutex_);
+  return id_to_label_.count(id) > 0;
+}
+
+bool KnowledgeBase::getEmbedding(const std::string& id, std::vector<float>* embedding) {
+  ScopedTimer timer(storeMetrics().rocksdb_get);
+  rocksdb::PinnableSlice value;
+  rocksdb::Status status = db_->Get(rocksdb::ReadOptions(), embeddings_cf_, id, &value);
+  if (!status.ok()) {
+    return false;
+  }
+  embedding->resize(dimension_);
+  return decodeVector(value, dimension_, embedding->data(), vector_encoding_);
+}
+
+size_t KnowledgeBase::size() const {
+  std::shared_lock<std::shared_mutex> lock(index_mutex_);
+  return entries_.size();
+}
+
+size_t KnowledgeBase::indexMemoryBytes() const {
+  std::shared_lock<std::shared_mutex> lock(index_mutex_);
+  size_t vectors = static_cast<size_t>(index_->ntotal);
+  size_t bytes = vectors * codeSize(index_->index, dimension_ * sizeof(float));
+  if (auto* hnsw = dynamic_cast<const faiss::IndexHNSW*>(index_->index)) {
+    bytes += hnsw->hnsw.neighbors.size() * sizeof(faiss::HNSW::storage_idx_t) +
+             hnsw->hnsw.levels.size() * sizeof(int) + hnsw->hnsw.offsets.size() * sizeof(size_t);
+  }
+  // IndexIDMap2's id_map and rev_map, then entries_ and id_to_label_
+  bytes += vectors * (3 * sizeof(faiss::idx_t) + kHashNodeOverhead);
+  bytes += entries_.size() * (sizeof(IndexEntry) + sizeof(std::string) + 2 * sizeof(faiss::idx_t) +
+                              2 * kHashNodeOverhead);
+  return bytes + lexical_.memoryBytes();
 }
 
 } // namespace kb
@@ -0,0 +1,310 @@
+#include "lexical_index.h"
+#include <algorithm>
+#include <cmath>
+
+namespace kb {
+
+namespace {
+
+// BM25 term frequency saturation and length normalization
+constexpr float kK1 = 1.2f;
+constexpr float kB = 0.75f;
+
+// Longer runs (hashes, base64) are not worth indexing
+constexpr size_t kMaxTermLength = 64;
+
+// Dead postings are purged once there are at least this many, and more
+// than live ones
+constexpr size_t kMinDeadPostingsToPurge = 4096;
+
+// Approximate per-entry overhead of the hash maps, as for the vector index
+constexpr size_t kHashNodeOverhead = 32;
+
+bool isWordByte(unsigned char c) {
+  return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c >= 0x80;
+}
+
+bool isJoiner(char c) {
+  return c == '_' || c == '.' || c == '-' || c == '/' || c == ':';
+}
+
+template <typename T>
+bool writePod(FILE* f, const T& value) {
+  return std::fwrite(&value, sizeof(T), 1, f) == 1;
+}
+
+template <typename T>
+bool readPod(FILE* f, T* value) {
+  return std::fread(value, sizeof(T), 1, f) == 1;
+}
+
+} // namespace
+
+std::vector<std::string> LexicalIndex::tokenize(const std::string& text) {
+  std::vector<std::string> terms;
+  auto emit = [&terms](std::string term) {
+    if (!term.empty() && term.size() <= kMaxTermLength) {
+      terms.push_back(std::move(term));
+    }
+  };
+
+  size_t i = 0;
+  while (i < text.size()) {
+    if (!isWordByte(text[i])) {
+      ++i;
+      continue;
+    }
+
+    // A word, with joiners allowed between its parts but not at its end
+    size_t end = i;
+    size_t last_word = i;
+    while (end < text.size() && (isWordByte(text[end]) || isJoiner(text[end]))) {
+      if (isWordByte(text[end])) {
+        last_word = end;
+      }
+      ++end;
+    }
+    std::string word = text.substr(i, last_word + 1 - i);
+    i = end;
+
+    bool joined = false;
+    for (char& c : word) {
+      if (c >= 'A' && c <= 'Z') {
+        c = static_cast<char>(c - 'A' + 'a');
+      }
+      joined = joined || isJoiner(c);
+    }
+
+    if (joined) {
+      size_t start = 0;
+      for (size_t j = 0; j <= word.size(); ++j) {
+        if (j == word.size() || isJoiner(word[j])) {
+          if (j > start) {
+            emit(word.substr(start, j - start));
+          }
+          start = j + 1;
+        }
+      }
+    }
+    emit(std::move(word));
+  }
+  return terms;
+}
+
+void LexicalIndex::add(Label label, const std::vector<std::string>& terms) {
+  if (terms.empty()) {
+    return;
+  }
+
+  std::unordered_map<std::string, uint32_t> frequencies;
+  for (const std::string& term : terms) {
+    ++frequencies[term];
+  }
+
+  Document document;
+  document.length = static_cast<uint32_t>(terms.size());
+  document.terms.reserve(frequencies.size());
+  for (const auto& [term, frequency] : frequencies) {
+    auto [it, inserted] = term_ids_.emplace(term, static_cast<uint32_t>(terms_.size()));
+    if (inserted) {
+      terms_.emplace_back();
+    }
+    Term& entry = terms_[it->second];
+    entry.postings.push_back(Posting{label, frequency});
+    ++entry.live;
+    document.terms.push_back(it->second);
+  }
+
+  total_length_ += document.length;
+  live_postings_ += document.terms.size();
+  documents_[label] = std::move(document);
+}
+
+void LexicalIndex::remove(Label label) {
+  auto it = documents_.find(label);
+  if (it == documents_.end()) {
+    return;
+  }
+
+  for (uint32_t term : it->second.terms) {
+    --terms_[term].live;
+  }
+  total_length_ -= it->second.length;
+  live_postings_ -= it->second.terms.size();
+  dead_postings_ += it->second.terms.size();
+  documents_.erase(it);
+
+  if (dead_postings_ >= kMinDeadPostingsToPurge && dead_postings_ > live_postings_) {
+    purgeDeadPostings();
+  }
+}
+
+void LexicalIndex::purgeDeadPostings() {
+  for (Term& term : terms_) {
+    if (term.postings.size() == term.live) {
+      continue;
+    }
+    term.postings.erase(std::remove_if(term.postings.begin(), term.postings.end(),
+                                       [this](const Posting& posting) {
+                                         return documents_.count(posting.label) == 0;
+                                       }),
+                        term.postings.end());
+    term.postings.shrink_to_fit();
+  }
+  dead_postings_ = 0;
+}
+
+void LexicalIndex::clear() {
+  term_ids_.clear();
+  terms_.clear();
+  documents_.clear();
+  total_length_ = 0;
+  live_postings_ = 0;
+  dead_postings_ = 0;
+}
+
+std::vector<std::pair<LexicalIndex::Label, float>> LexicalIndex::search(
+    const std::vector<std::string>& terms, size_t k, const std::function<bool(Label)>& accept) const {
+  if (documents_.empty() || k == 0) {
+    return {};
+  }
+
+  std::vector<std::string> distinct = terms;
+  std::sort(distinct.begin(), distinct.end());
+  distinct.erase(std::unique(distinct.begin(), distinct.end()), distinct.end());
+
+  const double documents = static_cast<double>(documents_.size());
+  const float average_length = static_cast<float>(total_length_ / documents);
+  std::unordered_map<Label, float> scores;
+
+  for (const std::string& term : distinct) {
+    auto term_it = term_ids_.find(term);
+    if (term_it == term_ids_.end() || terms_[term_it->second].live == 0) {
+      continue;
+    }
+    const Term& entry = terms_[term_it->second];
+    float idf = static_cast<float>(std::log(1.0 + (documents - entry.live + 0.5) / (entry.live + 0.5)));
+
+    for (const Posting& posting : entry.postings) {
+      auto document = documents_.find(posting.label);
+      if (document == documents_.end() || (accept && !accept(posting.label))) {
+        continue;
+      }
+      float frequency = static_cast<float>(posting.frequency);
+      float norm = kK1 * (1.0f - kB + kB * document->second.length / average_length);
+      scores[posting.label] += idf * frequency * (kK1 + 1.0f) / (frequency + norm);
+    }
+  }
+
+  std::vector<std::pair<Label, float>> ranked(scores.begin(), scores.end());
+  auto better = [](const std::pair<Label, float>& a, const std::pair<Label, float>& b) {
+    return a.second != b.second ? a.second > b.second : a.first < b.first;
+  };
+  if (ranked.size() > k) {
+    std::partial_sort(ranked.begin(), ranked.begin() + k, ranked.end(), better);
+    ranked.resize(k);
+  } else {
+    std::sort(ranked.begin(), ranked.end(), better);
+  }
+  return ranked;
+}
+
+size_t LexicalIndex::memoryBytes() const {
+  size_t postings = live_postings_ + dead_postings_;
+  return postings * sizeof(Posting) +
+         live_postings_ * sizeof(uint32_t) +
+         terms_.size() * (sizeof(Term) + sizeof(uint32_t) + sizeof(std::string) + kHashNodeOverhead) +
+         documents_.size() * (sizeof(Label) + sizeof(Document) + kHashNodeOverhead);
+}
+
+bool LexicalIndex::save(FILE* f) const {
+  uint64_t term_count = 0;
+  for (const Term& term : terms_) {
+    term_count += term.live > 0 ? 1 : 0;
+  }
+
+  bool ok = writePod(f, term_count);
+  for (auto it = term_ids_.begin(); ok && it != term_ids_.end(); ++it) {
+    const Term& term = terms_[it->second];
+    if (term.live == 0) {
+      continue;
+    }
+    ok = writePod(f, static_cast<uint32_t>(it->first.size())) &&
+         std::fwrite(it->first.data(), 1, it->first.size(), f) == it->first.size() &&
+         writePod(f, term.live);
+    for (size_t i = 0; ok && i < term.postings.size(); ++i) {
+      const Posting& posting = term.postings[i];
+      if (documents_.count(posting.label)) {
+        ok = writePod(f, posting.label) && writePod(f, posting.frequency);
+      }
+    }
+  }
+
+  ok = ok && writePod(f, static_cast<uint64_t>(documents_.size()));
+  for (auto it = documents_.begin(); ok && it != documents_.end(); ++it) {
+    ok = writePod(f, it->first) && writePod(f, it->second.length);
+  }
+  return ok;
+}
+
+bool LexicalIndex::load(FILE* f) {
+  LexicalIndex loaded;
+
+  uint64_t term_count;
+  if (!readPod(f, &term_count)) {
+    return false;
+  }
+  loaded.terms_.resize(term_count);
+  loaded.term_ids_.reserve(term_count);
+  for (uint64_t t = 0; t < term_count; ++t) {
+    uint32_t length;
+    std::string name;
+    Term& term = loaded.terms_[t];
+    if (!readPod(f, &length) || length > kMaxTermLength) {
+      return false;
+    }
+    name.resize(length);
+    if (std::fread(name.data(), 1, length, f) != length || !readPod(f, &term.live) ||
+        !loaded.term_ids_.emplace(std::move(name), static_cast<uint32_t>(t)).second) {
+      return false;
+    }
+    term.postings.resize(term.live);
+    for (Posting& posting : term.postings) {
+      if (!readPod(f, &posting.label) || !readPod(f, &posting.frequency)) {
+        return false;
+      }
+    }
+    loaded.live_postings_ += term.live;
+  }
+
+  uint64_t document_count;
+  if (!readPod(f, &document_count)) {
+    return false;
+  }
+  loaded.documents_.reserve(document_count);
+  for (uint64_t d = 0; d < document_count; ++d) {
+    Label label;
+    Document document;
+    if (!readPod(f, &label) || !readPod(f, &document.length)) {
+      return false;
+    }
+    loaded.total_length_ += document.length;
+    loaded.documents_[label] = std::move(document);
+  }
+
+  // Every posting must belong to a saved document
+  for (uint32_t t = 0; t < loaded.terms_.size(); ++t) {
+    for (const Posting& posting : loaded.terms_[t].postings) {
+      auto it = loaded.documents_.find(posting.label);
+      if (it == loaded.documents_.end()) {
+        return false;
+      }
+      it->second.terms.push_back(t);
+    }
+  }
+
+  *this = std::move(loaded);
+  return true;
+}
+
+} // namespace kb
@@ -1,28 +1,132 @@
 #include "server.h"
 #include "knowledge_base.h"
 #include "embedding_service.h"
+#include "embedding_batcher.h"
+#include "embedding_cache.h"
+#include "http_embedding_service.h"
+#include "ingest_pipeline.h"
+#include "metrics.h"
+#include "metrics_server.h"
+#include "namespace_registry.h"
+#include "replicator.h"
 #include "request_handler.h"
+#include "shard_router.h"
+#include <algorithm>
+#include <atomic>
 #include <iostream>
 #include <csignal>
+#include <cstdio>
 #include <memory>
 #include <cstdlib>
 #include <thread>
 #include <chrono>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <unistd.h>
 
-static std::unique_ptr<kb::TCPServer> g_server;
+// Set by signalHandler(); main() winds down once it is non-zero, so every
+// store is closed -- and its index snapshotted -- on the way out
+static std::atomic<int> g_signal{0};
 
-void signalHandler(int signal) {
-  std::cout << "\nReceived signal " << signal << ", shutting down..." << std::endl;
-  if (g_server) {
-    g_server->stop();
+static double residentBytes() {
+  std::ifstream statm("/proc/self/statm");
+  size_t size = 0, resident = 0;
+  statm >> size >> resident;
+  return static_cast<double>(resident) * sysconf(_SC_PAGESIZE);
+}
+
+// --import, --export and --checkpoint, in that order, against an open
+// store. "-" imports from stdin or exports to stdout, so stores can be
+// piped into each other; progress goes to stderr.
+static int runTransfer(kb::KnowledgeBase& kb, const std::string& import_path, const std::string& export_path,
+                       const std::string& checkpoint_dir) {
+  kb::TransferCounts counts;
+  if (!import_path.empty()) {
+    FILE* in = import_path == "-" ? stdin : std::fopen(import_path.c_str(), "rb");
+    bool ok = in && kb.importFrom(in, &counts);
+    if (in && in != stdin) {
+      std::fclose(in);
+    }
+    if (!ok && counts.memories == 0 && !counts.unmarked) {
+      std::cerr << "Import from " << import_path << " failed" << std::endl;
+      return 1;
+    }
+    if (!ok) {
+      std::cerr << "Import from " << import_path << " was indexed, but "
+                << (counts.unmarked ? "not recorded for replicas: reseed them" : "writing the preferences failed")
+                << std::endl;
+      return 1;
+    }
+    std::cerr << "Imported " << counts.memories << " memories and " << counts.preferences << " preferences"
+              << std::endl;
+  }
+
+  if (!export_path.empty()) {
+    FILE* out = export_path == "-" ? stdout : std::fopen(export_path.c_str(), "wb");
+    bool ok = out && kb.exportTo(out, &counts);
+    if (out && out != stdout) {
+      ok = std::fclose(out) == 0 && ok;
+    }
+    if (!ok) {
+      std::cerr << "Export to " << export_path << " failed" << std::endl;
+      return 1;
+    }
+    std::cerr << "Exported " << counts.memories << " memories and " << counts.preferences << " preferences"
+              << std::endl;
+  }
+
+  if (!checkpoint_dir.empty()) {
+    if (!kb.checkpoint(checkpoint_dir)) {
+      std::cerr << "Checkpoint to " << checkpoint_dir << " failed (it must not exist)" << std::endl;
+      return 1;
+    }
+    std::cerr << "Checkpoint written to " << checkpoint_dir << std::endl;
   }
-  exit(0);
+  return 0;
+}
+
+// host:port,host:port,...
+static std::vector<std::string> splitList(const std::string& list) {
+  std::vector<std::string> items;
+  std::stringstream stream(list);
+  std::string item;
+  while (std::getline(stream, item, ',')) {
+    if (!item.empty()) {
+      items.push_back(item);
+    }
+  }
+  return items;
+}
+
+void signalHandler(int signal) {
+  g_signal.store(signal);
 }
 
 int main(int argc, char* argv[]) {
   int port = 50051;
   std::string db_path = "/data/kb.db";
   int dimension = 1024;
+  kb::ServerOptions server_options;
+  kb::IndexOptions index_options;
+  kb::StoreOptions store_options;
+  size_t recall_queries = 0;
+  std::string embedder_type = "mock";
+  kb::HttpEmbeddingOptions http_options;
+  size_t embedding_batch = 32;
+  int embedding_window_us = 2000;
+  size_t embedding_cache = 10000;
+  bool async_ingest = false;
+  kb::IngestOptions ingest_options;
+  kb::NamespaceOptions namespace_options;
+  int metrics_port = 0;
+  std::string import_path;
+  std::string export_path;
+  std::string checkpoint_dir;
+  std::string export_dir;
+  std::string shards;
+  uint32_t router_id = 0;
+  kb::ReplicaOptions replica_options;
 
   // Parse command-line arguments
   for (int i = 1; i < argc; ++i) {
@@ -33,43 +137,301 @@ int main(int argc, char* argv[]) {
       db_path = argv[++i];
     } else if (arg == "--dim" && i + 1 < argc) {
       dimension = std::stoi(argv[++i]);
+    } else if (arg == "--bind" && i + 1 < argc) {
+      server_options.bind_address = argv[++i];
+    } else if (arg == "--backlog" && i + 1 < argc) {
+      server_options.backlog = std::stoi(argv[++i]);
+    } else if (arg == "--workers" && i + 1 < argc) {
+      server_options.worker_threads = std::stoi(argv[++i]);
+    } else if (arg == "--index" && i + 1 < argc) {
+      index_options.type = argv[++i];
+    } else if (arg == "--metric" && i + 1 < argc) {
+      index_options.metric = argv[++i];
+    } else if (arg == "--storage" && i + 1 < argc) {
+      index_options.storage = argv[++i];
+    } else if (arg == "--nprobe" && i + 1 < argc) {
+      index_options.nprobe = std::stoi(argv[++i]);
+    } else if (arg == "--ef-search" && i + 1 < argc) {
+      index_options.ef_search = std::stoi(argv[++i]);
+    } else if (arg == "--load-threads" && i + 1 < argc) {
+      index_options.load_threads = std::stoi(argv[++i]);
+    } else if (arg == "--result-cache" && i + 1 < argc) {
+      index_options.result_cache = std::stoul(argv[++i]);
+    } else if (arg == "--no-lexical") {
+      index_options.lexical = false;
+    } else if (arg == "--block-cache-mb" && i + 1 < argc) {
+      store_options.block_cache_mb = std::stoul(argv[++i]);
+    } else if (arg == "--bloom-bits" && i + 1 < argc) {
+      store_options.bloom_bits_per_key = std::stod(argv[++i]);
+    } else if (arg == "--wal-sync") {
+      store_options.sync_writes = true;
+    } else if (arg == "--no-pipelined-writes") {
+      store_options.pipelined_writes = false;
+    } else if (arg == "--replication-wal-hours" && i + 1 < argc) {
+      store_options.replication_wal_hours = std::stoul(argv[++i]);
+    } else if (arg == "--report-recall" && i + 1 < argc) {
+      recall_queries = std::stoul(argv[++i]);
+    } else if (arg == "--embedder" && i + 1 < argc) {
+      embedder_type = argv[++i];
+    } else if (arg == "--embedding-url" && i + 1 < argc) {
+      http_options.url = argv[++i];
+    } else if (arg == "--embedding-model" && i + 1 < argc) {
+      http_options.model = argv[++i];
+    } else if (arg == "--embedding-normalize") {
+      http_options.normalize = true;
+    } else if (arg == "--embedding-batch" && i + 1 < argc) {
+      embedding_batch = std::stoul(argv[++i]);
+    } else if (arg == "--embedding-window-us" && i + 1 < argc) {
+      embedding_window_us = std::stoi(argv[++i]);
+    } else if (arg == "--embedding-cache" && i + 1 < argc) {
+      embedding_cache = std::stoul(argv[++i]);
+    } else if (arg == "--async-ingest") {
+      async_ingest = true;
+    } else if (arg == "--ingest-batch" && i + 1 < argc) {
+      ingest_options.max_batch = std::stoul(argv[++i]);
+    } else if (arg == "--ingest-delay-ms" && i + 1 < argc) {
+      ingest_options.max_delay = std::chrono::milliseconds(std::stoi(argv[++i]));
+    } else if (arg == "--ingest-attempts" && i + 1 < argc) {
+      ingest_options.max_attempts = std::max(1, std::stoi(argv[++i]));
+    } else if (arg == "--max-namespaces" && i + 1 < argc) {
+      namespace_options.max_open = std::stoul(argv[++i]);
+    } else if (arg == "--namespace-idle-s" && i + 1 < argc) {
+      namespace_options.idle_timeout = std::chrono::seconds(std::stoi(argv[++i]));
+    } else if (arg == "--metrics-port" && i + 1 < argc) {
+      metrics_port = std::stoi(argv[++i]);
+    } else if (arg == "--import" && i + 1 < argc) {
+      import_path = argv[++i];
+    } else if (arg == "--export" && i + 1 < argc) {
+      export_path = argv[++i];
+    } else if (arg == "--checkpoint" && i + 1 < argc) {
+      checkpoint_dir = argv[++i];
+    } else if (arg == "--export-dir" && i + 1 < argc) {
+      export_dir = argv[++i];
+    } else if (arg == "--shards" && i + 1 < argc) {
+      shards = argv[++i];
+    } else if (arg == "--router-id" && i + 1 < argc) {
+      router_id = static_cast<uint32_t>(std::stoul(argv[++i]));
+    } else if (arg == "--replica-of" && i + 1 < argc) {
+      replica_options.primary = argv[++i];
+    } else if (arg == "--replica-poll-ms" && i + 1 < argc) {
+      replica_options.poll_interval = std::chrono::milliseconds(std::stoi(argv[++i]));
     } else if (arg == "--help") {
       std::cout << "Usage: " << argv[0] << " [options]\n"
                 << "Options:\n"
                 << "  --port PORT     TCP port to listen on (default: 50051)\n"
                 << "  --db PATH       RocksDB path (default: /data/kb.db)\n"
                 << "  --dim N         Embedding dimension (default: 1024)\n"
-                << "  --help          Show this help\n";
+                << "  --bind ADDR     IPv4 address to listen on, metrics included; 0.0.0.0 for all (default: 127.0.0.1)\n"
+                << "  --backlog N     TCP listen backlog (default: 128)\n"
+                << "  --workers N     Request worker threads (default: CPU count)\n"
+                << "  --index TYPE    flat, hnsw, ivf, ivfpq or a FAISS factory string (default: flat)\n"
+                << "  --metric M      l2 (distance), ip or cosine (similarity) (default: l2)\n"
+                << "  --storage S     Vectors kept as f32, f16 or sq8 (8-bit quantized) (default: f32)\n"
+                << "  --nprobe N      IVF lists probed per search (default: 16)\n"
+                << "  --ef-search N   HNSW candidate list size (default: 64)\n"
+                << "  --load-threads N  Threads rebuilding the index from storage at startup (default: CPU count, max 16)\n"
+                << "  --result-cache N  Cached search results per namespace, LRU; 0 disables (default: 0)\n"
+                << "  --no-lexical    Skip the keyword index: lexical search finds nothing, hybrid is vector-only\n"
+                << "  --block-cache-mb N  RocksDB block cache shared by all namespaces (default: 256)\n"
+                << "  --bloom-bits N  Bloom filter bits per key; 0 disables (default: 10)\n"
+                << "  --wal-sync      fsync the write-ahead log on every write\n"
+                << "  --no-pipelined-writes  Apply WAL and memtable writes in one serial step\n"
+                << "  --report-recall N  Measure recall@10 against exact search on N queries at startup\n"
+                << "  --embedder TYPE mock or http (default: mock)\n"
+                << "  --embedding-url URL    OpenAI-style embeddings endpoint for --embedder http\n"
+                << "  --embedding-model NAME Model name sent with each request\n"
+                << "  --embedding-normalize  Scale returned embeddings to unit length\n"
+                << "  --embedding-batch N    Max texts per embedding call (default: 32)\n"
+                << "  --embedding-window-us N  Wait for concurrent texts to batch (default: 2000)\n"
+                << "  --embedding-cache N    Cached embeddings, LRU; 0 disables (default: 10000)\n"
+                << "  --async-ingest  /add returns once the memory is queued; embed and index in the background\n"
+                << "  --ingest-batch N       Max memories per background batch (default: 64)\n"
+                << "  --ingest-delay-ms N    Wait for a background batch to fill (default: 5)\n"
+                << "  --ingest-attempts N    Embedder rejections before a queued add fails (default: 8)\n"
+                << "  --max-namespaces N     Namespaces kept loaded at once (default: 64)\n"
+                << "  --namespace-idle-s N   Close namespaces unused this long; 0 never (default: 600)\n"
+                << "  --metrics-port N       Serve Prometheus metrics over HTTP on this port (default: off)\n"
+                << "  --import FILE   Import an export (- for stdin) into --db and exit\n"
+                << "  --export FILE   Export --db (- for stdout) and exit\n"
+                << "  --checkpoint DIR  Write a consistent copy of --db to DIR and exit\n"
+                << "  --export-dir DIR  Directory the /export, /import and /checkpoint endpoints work in;\n"
+                << "                  without it they are refused\n"
+                << "  --shards LIST   Route to these host:port shards instead of serving a store; --metric and\n"
+                << "                  --embedder should match the shards'\n"
+                << "  --router-id N   0-255, different for every router of a cluster; tags generated ids (default: 0)\n"
+                << "  --replica-of HOST:PORT  Serve read-only copies of that primary's namespaces, following its WAL\n"
+                << "  --replica-poll-ms N    Wait between WAL polls once caught up (default: 100)\n"
+                << "  --replication-wal-hours N  On a primary, keep the WAL this long, up to 1 GB, for replicas\n"
+                << "                  that fall behind (default: 0, only the 15 minutes snapshots need)\n"
+                << "  --help          Show this help\n"
+                << "Environment:\n"
+                << "  KB_EMBEDDING_API_KEY   Bearer token for the embedding endpoint\n";
       return 0;
     }
   }
 
+  if (!import_path.empty() || !export_path.empty() || !checkpoint_dir.empty()) {
+    try {
+      kb::KnowledgeBase kb(db_path, dimension, index_options, store_options);
+      return runTransfer(kb, import_path, export_path, checkpoint_dir);
+    } catch (const std::exception& e) {
+      std::cerr << "Fatal error: " << e.what() << std::endl;
+      return 1;
+    }
+  }
+
   std::cout << "KB Service starting...\n"
             << "  Port: " << port << "\n"
-            << "  DB: " << db_path << "\n"
-            << "  Dimension: " << dimension << std::endl;
+            << (shards.empty() ? "  DB: " + db_path : "  Shards: " + shards) << "\n"
+            << "  Dimension: " << dimension << "\n"
+            << "  Index: " << index_options.type << " (" << index_options.metric << ", "
+            << index_options.storage << ")\n"
+            << "  Embedder: " << embedder_type << std::endl;
+  if (!replica_options.primary.empty()) {
+    std::cout << "  Replica of: " << replica_options.primary << std::endl;
+  }
 
   try {
-    // Initialize components
-    auto kb = std::make_shared<kb::KnowledgeBase>(db_path, dimension);
-    auto embedder = std::make_shared<kb::MockEmbeddingService>(dimension);
-    auto handler = std::make_shared<kb::RequestHandler>(kb, embedder);
+    std::shared_ptr<kb::EmbeddingService> embedder;
+    if (embedder_type == "http") {
+      if (const char* api_key = std::getenv("KB_EMBEDDING_API_KEY")) {
+        http_options.api_key = api_key;
+      }
+      embedder = std::make_shared<kb::BatchingEmbeddingService>(
+        std::make_shared<kb::HttpEmbeddingService>(http_options, dimension), embedding_batch,
+        std::chrono::microseconds(embedding_window_us));
+    } else if (embedder_type == "mock") {
+      embedder = std::make_shared<kb::MockEmbeddingService>(dimension);
+    } else {
+      throw std::runtime_error("Unknown embedder: " + embedder_type);
+    }
+    std::shared_ptr<kb::CachingEmbeddingService> cache;
+    if (embedding_cache > 0) {
+      cache = std::make_shared<kb::CachingEmbeddingService>(embedder, embedding_cache);
+      embedder = cache;
+    }
+
+    // A router holds no store: the shards do
+    std::shared_ptr<kb::KnowledgeBase> kb;
+    std::shared_ptr<kb::NamespaceRegistry> namespaces;
+    std::shared_ptr<kb::Replicator> replicator;
+    std::shared_ptr<kb::RequestHandler> handler;
+    if (!shards.empty()) {
+      kb::ShardRouterOptions router_options;
+      router_options.metric = index_options.metric;
+      router_options.router_id = router_id;
+      handler = std::make_shared<kb::RequestHandler>(
+        std::make_shared<kb::ShardRouter>(splitList(shards), embedder, router_options));
+    } else {
+      if (async_ingest && !replica_options.primary.empty()) {
+        throw std::runtime_error("A replica takes no adds, so --async-ingest does not apply");
+      }
+
+      // Initialize components. All namespaces share one block cache.
+      store_options.block_cache = rocksdb::NewLRUCache(store_options.block_cache_mb << 20);
+      kb = std::make_shared<kb::KnowledgeBase>(db_path, dimension, index_options, store_options);
+      if (recall_queries > 0) {
+        std::cout << "  Recall@10 vs exact: " << kb->measureRecall(recall_queries, 10) << std::endl;
+      }
+
+      std::shared_ptr<kb::IngestPipeline> ingest;
+      if (async_ingest) {
+        ingest = std::make_shared<kb::IngestPipeline>(kb, embedder, ingest_options);
+      }
+      if (!replica_options.primary.empty()) {
+        replicator = std::make_shared<kb::Replicator>(kb, "", replica_options);
+      }
+
+      // Every other namespace gets its own store, configured like the main
+      // one; on a replica, following the primary's namespace of that name
+      namespaces = std::make_shared<kb::NamespaceRegistry>(
+        kb::Tenant{kb, ingest, replicator}, db_path + "/namespaces",
+        [dimension, index_options, store_options, async_ingest, embedder, ingest_options,
+         replica_options](const std::string& path) {
+          kb::Tenant tenant;
+          tenant.kb = std::make_shared<kb::KnowledgeBase>(path, dimension, index_options, store_options);
+          if (async_ingest) {
+            tenant.ingest = std::make_shared<kb::IngestPipeline>(tenant.kb, embedder, ingest_options);
+          }
+          if (!replica_options.primary.empty()) {
+            tenant.replicator = std::make_shared<kb::Replicator>(tenant.kb, path.substr(path.rfind('/') + 1),
+                                                                 replica_options);
+          }
+          return tenant;
+        },
+        namespace_options);
+
+      handler = std::make_shared<kb::RequestHandler>(namespaces, embedder);
+      handler->setExportDirectory(export_dir);
+    }
 
     // Create server
-    g_server = std::make_unique<kb::TCPServer>(port, kb, handler);
+    auto tcp_server = std::make_unique<kb::TCPServer>(port, kb, handler, server_options);
+
+    // Gauges read when metrics are scraped; stage timings register themselves
+    kb::Metrics& metrics = kb::Metrics::global();
+    kb::TCPServer* server = tcp_server.get();
+    metrics.gauge("kb_active_connections", "Open client connections",
+                  [server] { return server->activeConnections(); });
+    if (kb) {
+      metrics.gauge("kb_memories", "Memories in the default namespace", [kb] { return kb->size(); });
+      metrics.gauge("kb_index_memory_bytes", "Approximate memory held by the default namespace's index",
+                    [kb] { return kb->indexMemoryBytes(); });
+      metrics.gauge("kb_namespaces_open", "Named namespaces loaded",
+                    [namespaces] { return namespaces->openCount(); });
+      std::shared_ptr<rocksdb::Cache> block_cache = store_options.block_cache;
+      metrics.gauge("kb_block_cache_usage_bytes", "Bytes held in the RocksDB block cache",
+                    [block_cache] { return block_cache->GetUsage(); });
+    }
+    if (replicator) {
+      metrics.gauge("kb_replication_lag", "Primary writes the default namespace has yet to apply",
+                    [replicator] { return replicator->lag(); });
+    }
+    metrics.gauge("kb_process_resident_bytes", "Resident set size of the service", residentBytes);
+    if (cache) {
+      metrics.gauge("kb_embedding_cache_hits_total", "Embedding cache hits", [cache] { return cache->hits(); }, {},
+                    true);
+      metrics.gauge("kb_embedding_cache_misses_total", "Embedding cache misses",
+                    [cache] { return cache->misses(); }, {}, true);
+    }
+
+    std::unique_ptr<kb::MetricsServer> metrics_server;
+    if (metrics_port > 0) {
+      metrics_server = std::make_unique<kb::MetricsServer>(metrics_port, server_options.bind_address);
+      metrics_server->start();
+    }
 
     // Set up signal handlers
     std::signal(SIGINT, signalHandler);
     std::signal(SIGTERM, signalHandler);
 
     // Start server
-    g_server->start();
+    tcp_server->start();
 
-    std::cout << "KB Service ready. Total memories: " << kb->size() << std::endl;
+    if (kb) {
+      std::cout << "KB Service ready. Total memories: " << kb->size() << std::endl;
+    } else {
+      std::cout << "KB Service ready. Routing to " << splitList(shards).size() << " shards" << std::endl;
+    }
 
     // Keep main thread alive
-    while (g_server->isRunning()) {
-      std::this_thread::sleep_for(std::chrono::seconds(1));
+    while (tcp_server->isRunning() && g_signal.load() == 0) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    }
+    if (g_signal.load() != 0) {
+      std::cout << "\nReceived signal " << g_signal.load() << ", shutting down..." << std::endl;
+    }
+
+    // Stop taking requests, then let the gauges go: they hold the stores,
+    // which save their index snapshots as they are destroyed below
+    if (metrics_server) {
+      metrics_server->stop();
+    }
+    tcp_server->stop();
+    for (const char* gauge : {"kb_active_connections", "kb_memories", "kb_index_memory_bytes", "kb_namespaces_open",
+                              "kb_block_cache_usage_bytes", "kb_replication_lag", "kb_process_resident_bytes",
+                              "kb_embedding_cache_hits_total", "kb_embedding_cache_misses_total"}) {
+      metrics.removeGauge(gauge);
     }
 
   } catch (const std::exception& e) {
@@ -0,0 +1,75 @@
+#include "memory_id.h"
+#include <algorithm>
+#include <chrono>
+#include <stdexcept>
+
+namespace kb {
+
+namespace {
+
+constexpr char kIdPrefix[] = "mem_";
+constexpr size_t kIdPrefixLength = sizeof(kIdPrefix) - 1;
+constexpr size_t kIdDigits = 16;
+constexpr int kIdSequenceBits = 20;  // ~1M ids per millisecond before borrowing from the next
+
+} // namespace
+
+std::string formatMemoryId(uint64_t value) {
+  static const char kHexDigits[] = "0123456789abcdef";
+  std::string id(kIdPrefix, kIdPrefixLength + kIdDigits);
+  for (size_t i = 0; i < kIdDigits; ++i) {
+    id[kIdPrefixLength + i] = kHexDigits[(value >> (4 * (kIdDigits - 1 - i))) & 0xf];
+  }
+  return id;
+}
+
+bool parseMemoryId(const std::string& id, uint64_t* value) {
+  if (id.size() != kIdPrefixLength + kIdDigits || id.compare(0, kIdPrefixLength, kIdPrefix) != 0) {
+    return false;
+  }
+  uint64_t parsed = 0;
+  for (size_t i = kIdPrefixLength; i < id.size(); ++i) {
+    char c = id[i];
+    int digit = c >= '0' && c <= '9' ? c - '0' : c >= 'a' && c <= 'f' ? c - 'a' + 10 : -1;
+    if (digit < 0) {
+      return false;
+    }
+    parsed = (parsed << 4) | static_cast<uint64_t>(digit);
+  }
+  *value = parsed;
+  return true;
+}
+
+MemoryIdGenerator::MemoryIdGenerator(uint32_t node) : node_(node), stride_(kMaxNodes) {
+  if (node >= kMaxNodes) {
+    throw std::runtime_error("Node number must be below " + std::to_string(kMaxNodes));
+  }
+}
+
+std::string MemoryIdGenerator::next() {
+  uint64_t ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+    std::chrono::system_clock::now().time_since_epoch()).count();
+
+  // The next value after the last one handed out, or the first of this
+  // millisecond if the clock has moved past it, rounded up to this node's
+  uint64_t last = last_.load(std::memory_order_relaxed);
+  uint64_t next;
+  do {
+    next = std::max(last + 1, ms << kIdSequenceBits);
+    next += (node_ - next) & (stride_ - 1);
+  } while (!last_.compare_exchange_weak(last, next, std::memory_order_relaxed));
+
+  return formatMemoryId(next);
+}
+
+void MemoryIdGenerator::observe(const std::string& id) {
+  uint64_t value;
+  if (!parseMemoryId(id, &value)) {
+    return;
+  }
+  uint64_t last = last_.load(std::memory_order_relaxed);
+  while (value > last && !last_.compare_exchange_weak(last, value, std::memory_order_relaxed)) {
+  }
+}
+
+} // namespace kb
@@ -0,0 +1,306 @@
+#include "metrics.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <limits>
+
+namespace kb {
+
+namespace detail {
+
+size_t metricShard() {
+  static std::atomic<size_t> next{0};
+  thread_local size_t shard = next.fetch_add(1, std::memory_order_relaxed) % kMetricShards;
+  return shard;
+}
+
+} // namespace detail
+
+namespace {
+
+constexpr double kFirstBoundSeconds = 1e-6;
+
+std::string formatDouble(double value) {
+  if (std::isinf(value)) {
+    return value > 0 ? "+Inf" : "-Inf";
+  }
+  if (std::isnan(value)) {
+    return "NaN";
+  }
+  char buffer[32];
+  std::snprintf(buffer, sizeof(buffer), "%.10g", value);
+  return buffer;
+}
+
+std::string escapeLabel(const std::string& value) {
+  std::string escaped;
+  for (char c : value) {
+    if (c == '\\' || c == '"') {
+      escaped += '\\';
+      escaped += c;
+    } else if (c == '\n') {
+      escaped += "\\n";
+    } else {
+      escaped += c;
+    }
+  }
+  return escaped;
+}
+
+// {a="x",b="y"} with `extra` appended, or "" when there are no labels
+std::string labelSet(const MetricLabels& labels, const std::string& extra = "") {
+  std::string out;
+  for (const auto& [key, value] : labels) {
+    out += out.empty() ? "{" : ",";
+    out += key + "=\"" + escapeLabel(value) + "\"";
+  }
+  if (!extra.empty()) {
+    out += out.empty() ? "{" : ",";
+    out += extra;
+  }
+  return out.empty() ? out : out + "}";
+}
+
+nlohmann::json labelObject(const MetricLabels& labels) {
+  nlohmann::json object = nlohmann::json::object();
+  for (const auto& [key, value] : labels) {
+    object[key] = value;
+  }
+  return object;
+}
+
+} // namespace
+
+uint64_t Counter::value() const {
+  uint64_t total = 0;
+  for (const auto& shard : shards_) {
+    total += shard.value.load(std::memory_order_relaxed);
+  }
+  return total;
+}
+
+double Histogram::bucketBound(size_t i) {
+  return i < kBuckets ? std::ldexp(kFirstBoundSeconds, static_cast<int>(i))
+                      : std::numeric_limits<double>::infinity();
+}
+
+void Histogram::observe(std::chrono::nanoseconds elapsed) {
+  uint64_t ns = elapsed.count() > 0 ? static_cast<uint64_t>(elapsed.count()) : 0;
+  // Smallest i with ns <= 1000 * 2^i
+  uint64_t micros = (ns + 999) / 1000;
+  size_t bucket = micros <= 1 ? 0 : 64 - __builtin_clzll(micros - 1);
+  bucket = std::min(bucket, kBuckets);
+
+  Shard& shard = shards_[detail::metricShard()];
+  shard.counts[bucket].fetch_add(1, std::memory_order_relaxed);
+  shard.sum_ns.fetch_add(ns, std::memory_order_relaxed);
+}
+
+Histogram::Snapshot Histogram::snapshot() const {
+  Snapshot snapshot;
+  uint64_t sum_ns = 0;
+  for (const auto& shard : shards_) {
+    for (size_t i = 0; i <= kBuckets; ++i) {
+      snapshot.counts[i] += shard.counts[i].load(std::memory_order_relaxed);
+    }
+    sum_ns += shard.sum_ns.load(std::memory_order_relaxed);
+  }
+  for (uint64_t count : snapshot.counts) {
+    snapshot.count += count;
+  }
+  snapshot.sum_seconds = sum_ns / 1e9;
+  return snapshot;
+}
+
+double Histogram::Snapshot::quantileSeconds(double q) const {
+  if (count == 0) {
+    return 0.0;
+  }
+  double rank = q * count;
+  uint64_t seen = 0;
+  for (size_t i = 0; i <= kBuckets; ++i) {
+    if (counts[i] == 0 || seen + counts[i] < rank) {
+      seen += counts[i];
+      continue;
+    }
+    double lower = i == 0 ? 0.0 : bucketBound(i - 1);
+    if (i == kBuckets) {
+      return lower;  // nothing better to say about the overflow bucket
+    }
+    return lower + (bucketBound(i) - lower) * ((rank - seen) / counts[i]);
+  }
+  return bucketBound(kBuckets - 1);
+}
+
+Metrics& Metrics::global() {
+  // Never destroyed, so threads still scraping or recording during exit()
+  // do not touch a dead registry
+  static Metrics* metrics = new Metrics();
+  return *metrics;
+}
+
+Metrics::Entry* Metrics::findLocked(const std::string& name, const MetricLabels& labels) {
+  for (const auto& entry : entries_) {
+    if (entry->name == name && entry->labels == labels) {
+      return entry.get();
+    }
+  }
+  return nullptr;
+}
+
+Counter& Metrics::counter(const std::string& name, const std::string& help, const MetricLabels& labels) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  Entry* entry = findLocked(name, labels);
+  if (!entry) {
+    entries_.push_back(std::make_unique<Entry>(Entry{name, help, labels, Type::Counter, nullptr, nullptr, {}}));
+    entry = entries_.back().get();
+    entry->counter = std::make_unique<Counter>();
+  }
+  return *entry->counter;
+}
+
+Histogram& Metrics::histogram(const std::string& name, const std::string& help, const MetricLabels& labels) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  Entry* entry = findLocked(name, labels);
+  if (!entry) {
+    entries_.push_back(std::make_unique<Entry>(Entry{name, help, labels, Type::Histogram, nullptr, nullptr, {}}));
+    entry = entries_.back().get();
+    entry->histogram = std::make_unique<Histogram>();
+  }
+  return *entry->histogram;
+}
+
+void Metrics::gauge(const std::string& name, const std::string& help, std::function<double()> read,
+                    const MetricLabels& labels, bool cumulative) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  Type type = cumulative ? Type::Counter : Type::Gauge;
+  if (Entry* entry = findLocked(name, labels)) {
+    entry->read = std::move(read);
+    return;
+  }
+  entries_.push_back(std::make_unique<Entry>(Entry{name, help, labels, type, nullptr, nullptr, std::move(read)}));
+}
+
+void Metrics::removeGauge(const std::string& name, const MetricLabels& labels) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  entries_.erase(std::remove_if(entries_.begin(), entries_.end(),
+                                [&](const std::unique_ptr<Entry>& entry) {
+                                  return entry->read && entry->name == name && entry->labels == labels;
+                                }),
+                 entries_.end());
+}
+
+namespace {
+
+// What rendering needs of an entry, copied out under the registry lock so
+// gauge callbacks -- which may take other locks -- run without it
+struct Sample {
+  std::string name;
+  std::string help;
+  MetricLabels labels;
+  const char* type;
+  bool histogram;
+  double value;
+  Histogram::Snapshot distribution;
+};
+
+} // namespace
+
+std::string Metrics::renderPrometheus() const {
+  std::vector<Sample> samples;
+  std::vector<std::function<double()>> reads;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (const auto& entry : entries_) {
+      Sample sample;
+      sample.name = entry->name;
+      sample.help = entry->help;
+      sample.labels = entry->labels;
+      sample.type = entry->type == Type::Counter ? "counter" : entry->type == Type::Gauge ? "gauge" : "histogram";
+      sample.histogram = entry->histogram != nullptr;
+      sample.value = entry->counter ? static_cast<double>(entry->counter->value()) : 0.0;
+      if (entry->histogram) {
+        sample.distribution = entry->histogram->snapshot();
+      }
+      reads.push_back(entry->read);
+      samples.push_back(std::move(sample));
+    }
+  }
+  for (size_t i = 0; i < samples.size(); ++i) {
+    if (reads[i]) {
+      samples[i].value = reads[i]();
+    }
+  }
+
+  // Series of one metric must be contiguous, under a single HELP/TYPE
+  std::stable_sort(samples.begin(), samples.end(),
+                   [](const Sample& a, const Sample& b) { return a.name < b.name; });
+
+  std::string out;
+  for (size_t i = 0; i < samples.size(); ++i) {
+    const Sample& sample = samples[i];
+    if (i == 0 || samples[i - 1].name != sample.name) {
+      out += "# HELP " + sample.name + " " + sample.help + "\n";
+      out += "# TYPE " + sample.name + " " + sample.type + "\n";
+    }
+    if (!sample.histogram) {
+      out += sample.name + labelSet(sample.labels) + " " + formatDouble(sample.value) + "\n";
+      continue;
+    }
+
+    uint64_t cumulative = 0;
+    for (size_t b = 0; b <= Histogram::kBuckets; ++b) {
+      cumulative += sample.distribution.counts[b];
+      out += sample.name + "_bucket" +
+             labelSet(sample.labels, "le=\"" + formatDouble(Histogram::bucketBound(b)) + "\"") + " " +
+             std::to_string(cumulative) + "\n";
+    }
+    out += sample.name + "_sum" + labelSet(sample.labels) + " " + formatDouble(sample.distribution.sum_seconds) +
+           "\n";
+    out += sample.name + "_count" + labelSet(sample.labels) + " " + std::to_string(sample.distribution.count) +
+           "\n";
+  }
+  return out;
+}
+
+nlohmann::json Metrics::toJson() const {
+  struct Item {
+    std::string name;
+    MetricLabels labels;
+    bool histogram;
+    double value;
+    Histogram::Snapshot distribution;
+    std::function<double()> read;
+  };
+  std::vector<Item> items;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (const auto& entry : entries_) {
+      Item item{entry->name, entry->labels, entry->histogram != nullptr,
+                entry->counter ? static_cast<double>(entry->counter->value()) : 0.0, {}, entry->read};
+      if (entry->histogram) {
+        item.distribution = entry->histogram->snapshot();
+      }
+      items.push_back(std::move(item));
+    }
+  }
+
+  nlohmann::json out = nlohmann::json::object();
+  for (const Item& item : items) {
+    nlohmann::json series = {{"labels", labelObject(item.labels)}};
+    if (item.histogram) {
+      const Histogram::Snapshot& d = item.distribution;
+      series["count"] = d.count;
+      series["mean_us"] = d.count ? d.sum_seconds * 1e6 / d.count : 0.0;
+      series["p50_us"] = d.quantileSeconds(0.50) * 1e6;
+      series["p99_us"] = d.quantileSeconds(0.99) * 1e6;
+      series["p999_us"] = d.quantileSeconds(0.999) * 1e6;
+    } else {
+      series["value"] = item.read ? item.read() : item.value;
+    }
+    out[item.name].push_back(std::move(series));
+  }
+  return out;
+}
+
+} // namespace kb
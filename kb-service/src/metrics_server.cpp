@@ -0,0 +1,120 @@
+#include "metrics_server.h"
+#include "metrics.h"
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <poll.h>
+#include <unistd.h>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+
+namespace kb {
+
+namespace {
+
+// Requests are a request line and headers; anything longer is not a scrape
+constexpr size_t kMaxRequestSize = 8192;
+
+// How often the accept loop checks for stop()
+constexpr int kPollIntervalMs = 200;
+
+void sendAll(int fd, const std::string& data) {
+  for (size_t sent = 0; sent < data.size();) {
+    ssize_t n = send(fd, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+    if (n <= 0) {
+      return;
+    }
+    sent += n;
+  }
+}
+
+std::string httpResponse(const char* status, const char* content_type, const std::string& body) {
+  return std::string("HTTP/1.1 ") + status + "\r\nContent-Type: " + content_type +
+         "\r\nContent-Length: " + std::to_string(body.size()) + "\r\nConnection: close\r\n\r\n" + body;
+}
+
+} // namespace
+
+MetricsServer::MetricsServer(int port, const std::string& bind_address)
+  : port_(port), bind_address_(bind_address), server_fd_(-1), running_(false) {}
+
+MetricsServer::~MetricsServer() {
+  stop();
+}
+
+void MetricsServer::start() {
+  server_fd_ = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (server_fd_ < 0) {
+    throw std::runtime_error("Failed to create metrics socket");
+  }
+
+  int opt = 1;
+  setsockopt(server_fd_, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+
+  struct sockaddr_in addr;
+  std::memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port_);
+
+  if (inet_pton(AF_INET, bind_address_.c_str(), &addr.sin_addr) != 1 ||
+      bind(server_fd_, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(server_fd_, 16) < 0) {
+    close(server_fd_);
+    server_fd_ = -1;
+    throw std::runtime_error("Failed to bind metrics port " + std::to_string(port_));
+  }
+
+  running_ = true;
+  std::cout << "Metrics on http://" << bind_address_ << ":" << port_ << "/metrics" << std::endl;
+  thread_ = std::thread(&MetricsServer::serveLoop, this);
+}
+
+void MetricsServer::stop() {
+  if (running_.exchange(false)) {
+    if (thread_.joinable()) {
+      thread_.join();
+    }
+    close(server_fd_);
+    server_fd_ = -1;
+  }
+}
+
+void MetricsServer::serveLoop() {
+  while (running_.load()) {
+    struct pollfd pfd = {server_fd_, POLLIN, 0};
+    if (poll(&pfd, 1, kPollIntervalMs) <= 0) {
+      continue;
+    }
+    int fd = accept4(server_fd_, nullptr, nullptr, SOCK_CLOEXEC);
+    if (fd >= 0) {
+      serveConnection(fd);
+      close(fd);
+    }
+  }
+}
+
+void MetricsServer::serveConnection(int fd) {
+  // A scraper that stalls mid-request must not wedge the endpoint
+  struct timeval timeout = {2, 0};
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+  std::string request;
+  char chunk[1024];
+  while (request.find("\r\n\r\n") == std::string::npos && request.size() < kMaxRequestSize) {
+    ssize_t n = recv(fd, chunk, sizeof(chunk), 0);
+    if (n <= 0) {
+      return;
+    }
+    request.append(chunk, n);
+  }
+
+  if (request.compare(0, 13, "GET /metrics ") == 0 || request.compare(0, 6, "GET / ") == 0) {
+    sendAll(fd, httpResponse("200 OK", "text/plain; version=0.0.4", Metrics::global().renderPrometheus()));
+  } else {
+    sendAll(fd, httpResponse("404 Not Found", "text/plain", "Not found\n"));
+  }
+}
+
+} // namespace kb
@@ -0,0 +1,160 @@
+#include "msgpack_writer.h"
+#include <cstring>
+
+namespace kb {
+
+namespace {
+
+template <typename T>
+void putBigEndian(std::string* out, T value) {
+  char bytes[sizeof(T)];
+  for (size_t i = 0; i < sizeof(T); ++i) {
+    bytes[sizeof(T) - 1 - i] = static_cast<char>(value & 0xff);
+    value = static_cast<T>(value >> 8);
+  }
+  out->append(bytes, sizeof(T));
+}
+
+void putMarker(std::string* out, uint8_t marker) {
+  out->push_back(static_cast<char>(marker));
+}
+
+} // namespace
+
+void MsgpackWriter::element() {
+  // Map entries are counted by key(); values inside them are not
+  if (!open_.empty() && open_.back().array) {
+    ++open_.back().count;
+  }
+}
+
+void MsgpackWriter::begin(uint8_t marker, bool array) {
+  element();
+  putMarker(out_, marker);
+  open_.push_back(Container{out_->size(), 0, array});
+  putBigEndian<uint32_t>(out_, 0);
+}
+
+void MsgpackWriter::end() {
+  Container container = open_.back();
+  open_.pop_back();
+  for (size_t i = 0; i < sizeof(uint32_t); ++i) {
+    (*out_)[container.header + i] = static_cast<char>(container.count >> (8 * (sizeof(uint32_t) - 1 - i)));
+  }
+}
+
+void MsgpackWriter::beginObject() {
+  begin(0xdf, false);  // map 32
+}
+
+void MsgpackWriter::endObject() {
+  end();
+}
+
+void MsgpackWriter::beginArray() {
+  begin(0xdd, true);  // array 32
+}
+
+void MsgpackWriter::endArray() {
+  end();
+}
+
+void MsgpackWriter::key(std::string_view name) {
+  ++open_.back().count;
+  string(name);
+}
+
+void MsgpackWriter::string(std::string_view value) {
+  element();
+  size_t size = value.size();
+  if (size < 32) {
+    putMarker(out_, static_cast<uint8_t>(0xa0 | size));
+  } else if (size <= 0xff) {
+    putMarker(out_, 0xd9);
+    putBigEndian<uint8_t>(out_, static_cast<uint8_t>(size));
+  } else if (size <= 0xffff) {
+    putMarker(out_, 0xda);
+    putBigEndian<uint16_t>(out_, static_cast<uint16_t>(size));
+  } else {
+    putMarker(out_, 0xdb);
+    putBigEndian<uint32_t>(out_, static_cast<uint32_t>(size));
+  }
+  out_->append(value.data(), size);
+}
+
+void MsgpackWriter::binary(const void* data, size_t size) {
+  element();
+  if (size <= 0xff) {
+    putMarker(out_, 0xc4);
+    putBigEndian<uint8_t>(out_, static_cast<uint8_t>(size));
+  } else if (size <= 0xffff) {
+    putMarker(out_, 0xc5);
+    putBigEndian<uint16_t>(out_, static_cast<uint16_t>(size));
+  } else {
+    putMarker(out_, 0xc6);
+    putBigEndian<uint32_t>(out_, static_cast<uint32_t>(size));
+  }
+  out_->append(static_cast<const char*>(data), size);
+}
+
+void MsgpackWriter::boolean(bool value) {
+  element();
+  putMarker(out_, value ? 0xc3 : 0xc2);
+}
+
+void MsgpackWriter::integer(int64_t value) {
+  if (value >= 0) {
+    unsignedInteger(static_cast<uint64_t>(value));
+    return;
+  }
+  element();
+  if (value >= -32) {
+    putMarker(out_, static_cast<uint8_t>(value));  // negative fixint
+  } else if (value >= INT8_MIN) {
+    putMarker(out_, 0xd0);
+    putBigEndian<uint8_t>(out_, static_cast<uint8_t>(value));
+  } else if (value >= INT16_MIN) {
+    putMarker(out_, 0xd1);
+    putBigEndian<uint16_t>(out_, static_cast<uint16_t>(value));
+  } else if (value >= INT32_MIN) {
+    putMarker(out_, 0xd2);
+    putBigEndian<uint32_t>(out_, static_cast<uint32_t>(value));
+  } else {
+    putMarker(out_, 0xd3);
+    putBigEndian<uint64_t>(out_, static_cast<uint64_t>(value));
+  }
+}
+
+void MsgpackWriter::unsignedInteger(uint64_t value) {
+  element();
+  if (value < 128) {
+    putMarker(out_, static_cast<uint8_t>(value));  // positive fixint
+  } else if (value <= UINT8_MAX) {
+    putMarker(out_, 0xcc);
+    putBigEndian<uint8_t>(out_, static_cast<uint8_t>(value));
+  } else if (value <= UINT16_MAX) {
+    putMarker(out_, 0xcd);
+    putBigEndian<uint16_t>(out_, static_cast<uint16_t>(value));
+  } else if (value <= UINT32_MAX) {
+    putMarker(out_, 0xce);
+    putBigEndian<uint32_t>(out_, static_cast<uint32_t>(value));
+  } else {
+    putMarker(out_, 0xcf);
+    putBigEndian<uint64_t>(out_, value);
+  }
+}
+
+void MsgpackWriter::real(float value) {
+  element();
+  uint32_t bits;
+  std::memcpy(&bits, &value, sizeof(bits));
+  putMarker(out_, 0xca);
+  putBigEndian<uint32_t>(out_, bits);
+}
+
+void MsgpackWriter::null() {
+  element();
+  putMarker(out_, 0xc0);
+}
+
+} // namespace kb
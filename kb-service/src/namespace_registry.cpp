@@ -0,0 +1,184 @@
+#include "namespace_registry.h"
+#include "knowledge_base.h"
+#include "ingest_pipeline.h"
+#include <algorithm>
+#include <filesystem>
+#include <stdexcept>
+
+namespace kb {
+
+namespace {
+
+constexpr size_t kMaxNameLength = 128;
+
+// Idle namespaces are looked for this often at most
+constexpr std::chrono::seconds kMaxReapInterval(30);
+
+} // namespace
+
+NamespaceRegistry::NamespaceRegistry(Tenant default_tenant, const std::string& root, OpenFn open,
+                                     const NamespaceOptions& options)
+  : default_tenant_(std::move(default_tenant)), root_(root), open_(std::move(open)), options_(options),
+    open_count_(0), stopping_(false) {
+  std::error_code ec;
+  std::filesystem::create_directories(root_, ec);
+  if (ec) {
+    throw std::runtime_error("Failed to create namespace directory " + root_ + ": " + ec.message());
+  }
+
+  if (options_.idle_timeout.count() > 0) {
+    reaper_ = std::thread(&NamespaceRegistry::reaperLoop, this);
+  }
+}
+
+NamespaceRegistry::~NamespaceRegistry() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stopping_ = true;
+  }
+  reaper_cv_.notify_all();
+  if (reaper_.joinable()) {
+    reaper_.join();
+  }
+}
+
+bool NamespaceRegistry::validName(const std::string& name) {
+  if (name.empty() || name.size() > kMaxNameLength || name[0] == '.') {
+    return false;
+  }
+  return std::all_of(name.begin(), name.end(), [](char c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') ||
+           c == '_' || c == '.' || c == '@' || c == '-';
+  });
+}
+
+bool NamespaceRegistry::acquire(const std::string& name, Tenant* tenant, std::string* error) {
+  if (name.empty()) {
+    *tenant = default_tenant_;
+    return true;
+  }
+  if (!validName(name)) {
+    *error = "Invalid namespace '" + name + "'";
+    return false;
+  }
+
+  std::unique_lock<std::mutex> lock(mutex_);
+  // Wait out an open or close in progress; a closed slot may be erased meanwhile
+  slot_cv_.wait(lock, [&] { return !slots_[name].busy; });
+  Slot& slot = slots_[name];
+  slot.last_used = std::chrono::steady_clock::now();
+  if (slot.tenant.kb) {
+    *tenant = slot.tenant;
+    return true;
+  }
+
+  // Open outside the lock so other namespaces are served meanwhile
+  slot.busy = true;
+  lock.unlock();
+  Tenant opened;
+  try {
+    opened = open_(root_ + "/" + name);
+  } catch (const std::exception& e) {
+    *error = "Failed to open namespace '" + name + "': " + e.what();
+  }
+  lock.lock();
+
+  Slot& reopened = slots_[name];
+  reopened.busy = false;
+  slot_cv_.notify_all();
+  if (!opened.kb) {
+    slots_.erase(name);
+    return false;
+  }
+
+  reopened.tenant = opened;
+  ++open_count_;
+  *tenant = std::move(opened);
+
+  Victims victims = evictLocked(name, false);
+  lock.unlock();
+  close(std::move(victims));
+  return true;
+}
+
+size_t NamespaceRegistry::openCount() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return open_count_;
+}
+
+bool NamespaceRegistry::inUseLocked(const Slot& slot) const {
+  // References to a tenant are only handed out under mutex_, so counts
+  // above the registry's own cannot grow while it is held. A pipeline or
+  // a replicator keeps its knowledge base alive, hence a reference each.
+  const Tenant& tenant = slot.tenant;
+  long expected = 1 + (tenant.ingest ? 1 : 0) + (tenant.replicator ? 1 : 0);
+  return tenant.kb.use_count() > expected || (tenant.ingest && tenant.ingest.use_count() > 1) ||
+         (tenant.replicator && tenant.replicator.use_count() > 1);
+}
+
+NamespaceRegistry::Victims NamespaceRegistry::evictLocked(const std::string& keep, bool expired_only) {
+  std::vector<std::pair<std::chrono::steady_clock::time_point, const std::string*>> candidates;
+  for (const auto& [name, slot] : slots_) {
+    if (slot.tenant.kb && !slot.busy && name != keep && !inUseLocked(slot)) {
+      candidates.emplace_back(slot.last_used, &name);
+    }
+  }
+  std::sort(candidates.begin(), candidates.end());
+
+  auto now = std::chrono::steady_clock::now();
+  size_t open = open_count_;
+  Victims victims;
+  for (const auto& [last_used, name] : candidates) {
+    bool expired = options_.idle_timeout.count() > 0 && now - last_used >= options_.idle_timeout;
+    if (!expired && (expired_only || open <= options_.max_open)) {
+      break;  // candidates are oldest first
+    }
+
+    Slot& slot = slots_[*name];
+    slot.busy = true;
+    victims.emplace_back(*name, std::move(slot.tenant));
+    slot.tenant = Tenant();
+    --open;
+  }
+  open_count_ = open;
+  return victims;
+}
+
+void NamespaceRegistry::close(Victims victims) {
+  if (victims.empty()) {
+    return;
+  }
+
+  // Stopping the replicator or pipeline and closing the store (which
+  // snapshots the index) can take a while, so no lock is held here. The
+  // replicator goes first so nothing is applied to a closing store.
+  for (auto& victim : victims) {
+    victim.second.replicator.reset();
+    victim.second = Tenant();
+  }
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  for (const auto& victim : victims) {
+    slots_.erase(victim.first);
+  }
+  slot_cv_.notify_all();
+}
+
+void NamespaceRegistry::reaperLoop() {
+  auto interval = std::clamp<std::chrono::seconds>(options_.idle_timeout / 2, std::chrono::seconds(1),
+                                                   kMaxReapInterval);
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (!stopping_) {
+    reaper_cv_.wait_for(lock, interval, [this] { return stopping_; });
+    if (stopping_) {
+      break;
+    }
+
+    Victims victims = evictLocked("", true);
+    lock.unlock();
+    close(std::move(victims));
+    lock.lock();
+  }
+}
+
+} // namespace kb
@@ -0,0 +1,229 @@
+#include "node_client.h"
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+
+using json = nlohmann::json;
+
+namespace kb {
+
+namespace {
+
+// Must match TCPServer's binary preamble and frame header
+constexpr char kBinaryPreamble[] = {'\xB1', 'K', 'B', '\x01'};
+constexpr size_t kFrameHeaderSize = 4;
+
+// Upper bound on a response; batched searches over many shards' worth of
+// results stay well below it.
+constexpr size_t kMaxResponseSize = 256 * 1024 * 1024;
+
+// The connection failed before any of the response arrived, so the request
+// can be retried on a fresh one (a pooled socket may have been closed by
+// the node in the meantime).
+class ConnectionError : public std::runtime_error {
+public:
+  using std::runtime_error::runtime_error;
+};
+
+void sendAll(int fd, const std::string& data) {
+  size_t sent = 0;
+  while (sent < data.size()) {
+    ssize_t n = ::send(fd, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      throw ConnectionError("Failed to send request: " + std::string(std::strerror(errno)));
+    }
+    sent += static_cast<size_t>(n);
+  }
+}
+
+// Reads exactly n bytes; `started` says whether any of the response has
+// been read before
+void receiveAll(int fd, char* data, size_t n, bool started) {
+  size_t received = 0;
+  while (received < n) {
+    ssize_t r = ::recv(fd, data + received, n - received, 0);
+    if (r < 0 && errno == EINTR) {
+      continue;
+    }
+    if (r < 0) {
+      std::string error = "Failed to read response: " + std::string(std::strerror(errno));
+      // A node that closed an idle connection usually resets it once the
+      // request arrives rather than ending it cleanly
+      if (!started && received == 0 && (errno == ECONNRESET || errno == EPIPE)) {
+        throw ConnectionError(error);
+      }
+      throw std::runtime_error(error);
+    }
+    if (r == 0) {
+      if (!started && received == 0) {
+        throw ConnectionError("Node closed the connection");
+      }
+      throw std::runtime_error("Response truncated");
+    }
+    received += static_cast<size_t>(r);
+  }
+}
+
+} // namespace
+
+NodeClient::NodeClient(const std::string& address, const NodeClientOptions& options)
+  : address_(address), options_(options) {
+  // host:port or [v6 address]:port
+  size_t colon = address.rfind(':');
+  size_t bracket = address.rfind(']');
+  if (colon == std::string::npos || colon + 1 == address.size() ||
+      (bracket != std::string::npos && bracket > colon)) {
+    throw std::runtime_error("Node address must be host:port: " + address);
+  }
+  host_ = address.substr(0, colon);
+  port_ = address.substr(colon + 1);
+  if (host_.size() >= 2 && host_.front() == '[' && host_.back() == ']') {
+    host_ = host_.substr(1, host_.size() - 2);
+  }
+  if (host_.empty()) {
+    throw std::runtime_error("Node address must be host:port: " + address);
+  }
+}
+
+NodeClient::~NodeClient() {
+  for (int fd : idle_) {
+    ::close(fd);
+  }
+}
+
+int NodeClient::connect() const {
+  addrinfo hints;
+  std::memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+
+  addrinfo* addresses = nullptr;
+  int rc = ::getaddrinfo(host_.c_str(), port_.c_str(), &hints, &addresses);
+  if (rc != 0) {
+    throw std::runtime_error("Failed to resolve node " + host_ + ": " + gai_strerror(rc));
+  }
+
+  timeval timeout;
+  timeout.tv_sec = options_.timeout_ms / 1000;
+  timeout.tv_usec = (options_.timeout_ms % 1000) * 1000;
+
+  int fd = -1;
+  for (addrinfo* address = addresses; address; address = address->ai_next) {
+    fd = ::socket(address->ai_family, address->ai_socktype | SOCK_CLOEXEC, address->ai_protocol);
+    if (fd < 0) {
+      continue;
+    }
+
+    // SO_SNDTIMEO also bounds connect() on Linux
+    ::setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    ::setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    if (::connect(fd, address->ai_addr, address->ai_addrlen) == 0) {
+      break;
+    }
+    ::close(fd);
+    fd = -1;
+  }
+  ::freeaddrinfo(addresses);
+
+  if (fd < 0) {
+    throw std::runtime_error("Failed to connect to node " + address_);
+  }
+
+  int one = 1;
+  ::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  try {
+    sendAll(fd, std::string(kBinaryPreamble, sizeof(kBinaryPreamble)));
+  } catch (const std::exception&) {
+    ::close(fd);
+    throw std::runtime_error("Failed to connect to node " + address_);
+  }
+  return fd;
+}
+
+int NodeClient::acquireConnection(bool* reused) {
+  {
+    std::lock_guard<std::mutex> lock(idle_mutex_);
+    if (!idle_.empty()) {
+      int fd = idle_.back();
+      idle_.pop_back();
+      *reused = true;
+      return fd;
+    }
+  }
+  *reused = false;
+  return connect();
+}
+
+void NodeClient::releaseConnection(int fd) {
+  {
+    std::lock_guard<std::mutex> lock(idle_mutex_);
+    if (idle_.size() < options_.max_idle_connections) {
+      idle_.push_back(fd);
+      return;
+    }
+  }
+  ::close(fd);
+}
+
+std::string NodeClient::roundTrip(int fd, const std::string& frame) {
+  sendAll(fd, frame);
+
+  char header[kFrameHeaderSize];
+  receiveAll(fd, header, sizeof(header), false);
+  uint32_t length = 0;
+  for (char byte : header) {
+    length = (length << 8) | static_cast<uint8_t>(byte);
+  }
+  if (length > kMaxResponseSize) {
+    throw std::runtime_error("Response from node " + address_ + " too large");
+  }
+
+  std::string body(length, '\0');
+  receiveAll(fd, body.data(), length, true);
+  return body;
+}
+
+json NodeClient::call(const std::string& endpoint, const json& params) {
+  json request;
+  request["endpoint"] = endpoint;
+  request["params"] = params;
+
+  std::string frame(kFrameHeaderSize, '\0');
+  json::to_msgpack(request, frame);
+  uint32_t length = static_cast<uint32_t>(frame.size() - kFrameHeaderSize);
+  for (size_t i = 0; i < kFrameHeaderSize; ++i) {
+    frame[i] = static_cast<char>(length >> (8 * (kFrameHeaderSize - 1 - i)));
+  }
+
+  // A pooled connection the node has since closed is retried once, fresh
+  for (int attempt = 0;; ++attempt) {
+    bool reused = false;
+    int fd = acquireConnection(&reused);
+    std::string body;
+    try {
+      body = roundTrip(fd, frame);
+    } catch (const ConnectionError& e) {
+      ::close(fd);
+      if (reused && attempt == 0) {
+        continue;
+      }
+      throw std::runtime_error("Node " + address_ + ": " + e.what());
+    } catch (const std::exception& e) {
+      ::close(fd);
+      throw std::runtime_error("Node " + address_ + ": " + e.what());
+    }
+    releaseConnection(fd);
+    return json::from_msgpack(body);
+  }
+}
+
+} // namespace kb
@@ -0,0 +1,272 @@
+#include "record_codec.h"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <utility>
+
+namespace kb {
+
+namespace {
+
+constexpr uint8_t kRecordVersion = 1;
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+constexpr bool kLittleEndian = false;
+#else
+constexpr bool kLittleEndian = true;
+#endif
+
+template <typename T>
+void putFixed(std::string* out, T value) {
+  char bytes[sizeof(T)];
+  std::memcpy(bytes, &value, sizeof(T));
+  if (!kLittleEndian) {
+    for (size_t i = 0; i < sizeof(T) / 2; ++i) {
+      std::swap(bytes[i], bytes[sizeof(T) - 1 - i]);
+    }
+  }
+  out->append(bytes, sizeof(T));
+}
+
+template <typename T>
+bool getFixed(const char*& p, const char* end, T* value) {
+  if (static_cast<size_t>(end - p) < sizeof(T)) {
+    return false;
+  }
+  char bytes[sizeof(T)];
+  std::memcpy(bytes, p, sizeof(T));
+  if (!kLittleEndian) {
+    for (size_t i = 0; i < sizeof(T) / 2; ++i) {
+      std::swap(bytes[i], bytes[sizeof(T) - 1 - i]);
+    }
+  }
+  std::memcpy(value, bytes, sizeof(T));
+  p += sizeof(T);
+  return true;
+}
+
+bool getString(const char*& p, const char* end, std::string* value) {
+  uint32_t len;
+  if (!getFixed(p, end, &len) || static_cast<size_t>(end - p) < len) {
+    return false;
+  }
+  value->assign(p, len);
+  p += len;
+  return true;
+}
+
+} // namespace
+
+std::string encodeRecord(const std::string& content, const std::string& category, int64_t timestamp) {
+  std::string out;
+  out.reserve(1 + sizeof(int64_t) + 2 * sizeof(uint32_t) + category.size() + content.size());
+  out.push_back(static_cast<char>(kRecordVersion));
+  putFixed(&out, timestamp);
+  putFixed(&out, static_cast<uint32_t>(category.size()));
+  out.append(category);
+  putFixed(&out, static_cast<uint32_t>(content.size()));
+  out.append(content);
+  return out;
+}
+
+bool decodeRecord(const rocksdb::Slice& value, MemoryRecord* record) {
+  const char* p = value.data();
+  const char* end = p + value.size();
+
+  if (p == end || static_cast<uint8_t>(*p) != kRecordVersion) {
+    return false;
+  }
+  ++p;
+
+  return getFixed(p, end, &record->timestamp) &&
+         getString(p, end, &record->category) &&
+         getString(p, end, &record->content);
+}
+
+const char* vectorEncodingName(VectorEncoding encoding) {
+  switch (encoding) {
+    case VectorEncoding::Float16: return "f16";
+    case VectorEncoding::Int8: return "sq8";
+    default: return "f32";
+  }
+}
+
+bool parseVectorEncoding(const std::string& name, VectorEncoding* encoding) {
+  for (VectorEncoding candidate : {VectorEncoding::Float32, VectorEncoding::Float16, VectorEncoding::Int8}) {
+    if (name == vectorEncodingName(candidate)) {
+      *encoding = candidate;
+      return true;
+    }
+  }
+  return false;
+}
+
+size_t encodedVectorSize(size_t dimension, VectorEncoding encoding) {
+  switch (encoding) {
+    case VectorEncoding::Float16: return dimension * sizeof(uint16_t);
+    case VectorEncoding::Int8: return 2 * sizeof(float) + dimension;
+    default: return dimension * sizeof(float);
+  }
+}
+
+uint16_t floatToHalf(float value) {
+  uint32_t bits;
+  std::memcpy(&bits, &value, sizeof(bits));
+  uint16_t sign = static_cast<uint16_t>((bits >> 16) & 0x8000);
+  uint32_t magnitude = bits & 0x7FFFFFFF;
+
+  if (magnitude > 0x7F800000) {
+    return sign | 0x7E00;  // NaN
+  }
+  if (magnitude >= 0x47800000) {
+    return sign | 0x7C00;  // 65536 and up overflow to infinity
+  }
+  if (magnitude < 0x38800000) {
+    // Below the smallest normal half (2^-14): a multiple of 2^-24, exact
+    // to scale and rounded to nearest even by the default rounding mode
+    float scaled;
+    std::memcpy(&scaled, &magnitude, sizeof(scaled));
+    return sign | static_cast<uint16_t>(std::nearbyint(scaled * 16777216.0f));
+  }
+
+  // Rebias the exponent (127 -> 15) and drop 13 mantissa bits; a carry
+  // out of the mantissa correctly bumps the exponent, up to infinity
+  uint32_t half = (magnitude - 0x38000000) >> 13;
+  uint32_t dropped = magnitude & 0x1FFF;
+  if (dropped > 0x1000 || (dropped == 0x1000 && (half & 1))) {
+    ++half;
+  }
+  return sign | static_cast<uint16_t>(half);
+}
+
+float halfToFloat(uint16_t value) {
+  uint32_t sign = static_cast<uint32_t>(value & 0x8000) << 16;
+  uint32_t exponent = (value >> 10) & 0x1F;
+  uint32_t mantissa = value & 0x3FF;
+
+  if (exponent == 0) {
+    float magnitude = std::ldexp(static_cast<float>(mantissa), -24);
+    return sign ? -magnitude : magnitude;
+  }
+
+  uint32_t bits = exponent == 0x1F ? sign | 0x7F800000 | (mantissa << 13)
+                                   : sign | ((exponent + 112) << 23) | (mantissa << 13);
+  float result;
+  std::memcpy(&result, &bits, sizeof(result));
+  return result;
+}
+
+std::string encodeVector(const float* vector, size_t dimension, VectorEncoding encoding) {
+  std::string out;
+  out.reserve(encodedVectorSize(dimension, encoding));
+
+  if (encoding == VectorEncoding::Float16) {
+    for (size_t i = 0; i < dimension; ++i) {
+      putFixed(&out, floatToHalf(vector[i]));
+    }
+    return out;
+  }
+
+  if (encoding == VectorEncoding::Int8) {
+    float min = dimension > 0 ? vector[0] : 0.0f;
+    float max = min;
+    for (size_t i = 1; i < dimension; ++i) {
+      min = std::min(min, vector[i]);
+      max = std::max(max, vector[i]);
+    }
+    float step = (max - min) / 255.0f;
+    putFixed(&out, min);
+    putFixed(&out, step);
+    for (size_t i = 0; i < dimension; ++i) {
+      float code = step > 0.0f ? (vector[i] - min) / step + 0.5f : 0.0f;
+      out.push_back(static_cast<char>(code >= 255.0f ? 255 : code > 0.0f ? static_cast<uint8_t>(code) : 0));
+    }
+    return out;
+  }
+
+  if (kLittleEndian) {
+    out.assign(reinterpret_cast<const char*>(vector), dimension * sizeof(float));
+  } else {
+    for (size_t i = 0; i < dimension; ++i) {
+      putFixed(&out, vector[i]);
+    }
+  }
+  return out;
+}
+
+bool decodeVector(const rocksdb::Slice& value, size_t dimension, float* out, VectorEncoding encoding) {
+  if (value.size() != encodedVectorSize(dimension, encoding)) {
+    return false;
+  }
+  const char* p = value.data();
+  const char* end = p + value.size();
+
+  if (encoding == VectorEncoding::Float16) {
+    for (size_t i = 0; i < dimension; ++i) {
+      uint16_t half;
+      getFixed(p, end, &half);
+      out[i] = halfToFloat(half);
+    }
+    return true;
+  }
+
+  if (encoding == VectorEncoding::Int8) {
+    float min, step;
+    getFixed(p, end, &min);
+    getFixed(p, end, &step);
+    const auto* codes = reinterpret_cast<const uint8_t*>(p);
+    for (size_t i = 0; i < dimension; ++i) {
+      out[i] = min + static_cast<float>(codes[i]) * step;
+    }
+    return true;
+  }
+
+  if (kLittleEndian) {
+    std::memcpy(out, p, value.size());
+  } else {
+    for (size_t i = 0; i < dimension; ++i) {
+      getFixed(p, end, &out[i]);
+    }
+  }
+  return true;
+}
+
+std::string encodeTicket(uint64_t ticket) {
+  std::string out(sizeof(ticket), '\0');
+  for (size_t i = 0; i < sizeof(ticket); ++i) {
+    out[sizeof(ticket) - 1 - i] = static_cast<char>(ticket & 0xff);
+    ticket >>= 8;
+  }
+  return out;
+}
+
+bool decodeTicket(const rocksdb::Slice& key, uint64_t* ticket) {
+  if (key.size() != sizeof(*ticket)) {
+    return false;
+  }
+  *ticket = 0;
+  for (size_t i = 0; i < key.size(); ++i) {
+    *ticket = (*ticket << 8) | static_cast<uint8_t>(key[i]);
+  }
+  return true;
+}
+
+std::string encodeQueuedMemory(const std::string& id, const std::string& content,
+                               const std::string& category, int64_t timestamp) {
+  std::string out;
+  putFixed(&out, static_cast<uint32_t>(id.size()));
+  out.append(id);
+  out.append(encodeRecord(content, category, timestamp));
+  return out;
+}
+
+bool decodeQueuedMemory(const rocksdb::Slice& value, std::string* id, MemoryRecord* record) {
+  const char* p = value.data();
+  const char* end = p + value.size();
+  if (!getString(p, end, id)) {
+    return false;
+  }
+  return decodeRecord(rocksdb::Slice(p, static_cast<size_t>(end - p)), record);
+}
+
+} // namespace kb
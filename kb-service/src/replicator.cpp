@@ -0,0 +1,86 @@
+#include "replicator.h"
+#include "knowledge_base.h"
+#include <iostream>
+#include <vector>
+
+using json = nlohmann::json;
+
+namespace kb {
+
+Replicator::Replicator(std::shared_ptr<KnowledgeBase> kb, const std::string& name_space,
+                       const ReplicaOptions& options)
+  : kb_(std::move(kb)), name_space_(name_space), options_(options), primary_(options.primary), lag_(0),
+    seeded_(kb_->replicationPosition() > 1), stopping_(false) {
+  thread_ = std::thread(&Replicator::run, this);
+}
+
+Replicator::~Replicator() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stopping_ = true;
+  }
+  cv_.notify_all();
+  thread_.join();
+}
+
+void Replicator::run() {
+  while (true) {
+    bool more = false;
+    std::string error;
+    try {
+      more = poll();
+    } catch (const std::exception& e) {
+      error = e.what();
+    }
+
+    if (error != last_error_) {
+      std::string source = options_.primary + (name_space_.empty() ? "" : " namespace " + name_space_);
+      std::cerr << "Replica of " << source << ": " << (error.empty() ? "replicating again" : error) << std::endl;
+      last_error_ = error;
+    }
+
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (!more) {
+      cv_.wait_for(lock, options_.poll_interval, [this] { return stopping_; });
+    }
+    if (stopping_) {
+      return;
+    }
+  }
+}
+
+bool Replicator::poll() {
+  uint64_t position = kb_->replicationPosition();
+  json params;
+  params["namespace"] = name_space_;
+  params["since"] = position;
+  params["max_bytes"] = options_.max_batch_bytes;
+  json response = primary_.call("/replicate", params);
+  if (!response.value("success", false)) {
+    if (response.value("reseed", false)) {
+      seeded_.store(false, std::memory_order_release);
+    }
+    throw std::runtime_error(response.value("error", std::string("replication failed")));
+  }
+
+  std::vector<WalBatch> batches;
+  for (const json& item : response.at("batches")) {
+    const json::binary_t& data = item.at("data").get_binary();
+    batches.push_back(WalBatch{item.at("sequence").get<uint64_t>(), std::string(data.begin(), data.end())});
+  }
+  if (!kb_->applyWal(batches)) {
+    seeded_.store(false, std::memory_order_release);
+    throw std::runtime_error("cannot apply the primary's WAL from sequence " + std::to_string(position) +
+                             " (an import on the primary, or a gap); seed the replica afresh from a checkpoint");
+  }
+
+  uint64_t latest = response.at("latest").get<uint64_t>();
+  uint64_t applied = kb_->replicationPosition();
+  lag_.store(latest + 1 > applied ? latest + 1 - applied : 0, std::memory_order_relaxed);
+  if (applied > latest) {
+    seeded_.store(true, std::memory_order_release);
+  }
+  return !batches.empty() && applied <= latest;
+}
+
+} // namespace kb
@@ -1,129 +1,1078 @@
 #include "request_handler.h"
 #include "knowledge_base.h"
 #include "embedding_service.h"
+#include "ingest_pipeline.h"
+#include "json_writer.h"
+#include "metrics.h"
+#include "msgpack_writer.h"
+#include "record_codec.h"
+#include "replicator.h"
+#include "shard_router.h"
+#include <algorithm>
 #include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <iterator>
+#include <limits>
+#include <memory>
+#include <unordered_map>
 
 using json = nlohmann::json;
 
 namespace kb {
 
-RequestHandler::RequestHandler(std::shared_ptr<KnowledgeBase> kb, std::shared_ptr<EmbeddingService> embedder)
-  : kb_(kb), embedder_(embedder) {}
+namespace {
+
+// How long /wait, and /add with "wait", block by default
+constexpr int kDefaultWaitMs = 5000;
+
+// WAL handed to a replica per /replicate call, by default and at most
+constexpr size_t kDefaultReplicationBytes = 4 << 20;
+constexpr size_t kMaxReplicationBytes = 32 << 20;
+
+constexpr char kReadOnlyError[] = "Read-only replica: send writes to the primary";
+constexpr char kNotSeededError[] =
+  "Replica not seeded: it has not caught up with the primary yet, or fell off its WAL and must be seeded "
+  "from a checkpoint";
+
+// Resolves a client's path against the export directory. Clients name
+// files inside it only: absolute paths and ".." components are refused, as
+// the protocol carries no credentials.
+bool resolveExportPath(const std::string& dir, const std::string& path, std::string* resolved,
+                       std::string* error) {
+  if (dir.empty()) {
+    *error = "File transfer is disabled; start the service with --export-dir";
+    return false;
+  }
+  if (path.empty()) {
+    *error = "Path is required";
+    return false;
+  }
+  if (path.front() == '/') {
+    *error = "Path must be relative to the export directory";
+    return false;
+  }
+  size_t start = 0;
+  while (start <= path.size()) {
+    size_t end = path.find('/', start);
+    if (end == std::string::npos) {
+      end = path.size();
+    }
+    if (path.compare(start, end - start, "..") == 0) {
+      *error = "Path must not contain '..'";
+      return false;
+    }
+    start = end + 1;
+  }
+  *resolved = dir.back() == '/' ? dir + path : dir + "/" + path;
+  return true;
+}
+
+int64_t nowMillis() {
+  return std::chrono::duration_cast<std::chrono::milliseconds>(
+    std::chrono::system_clock::now().time_since_epoch()
+  ).count();
+}
+
+void writeError(ResponseWriter& writer, const char* message) {
+  writer.beginObject();
+  writer.key("success");
+  writer.boolean(false);
+  writer.key("error");
+  writer.string(message);
+  writer.endObject();
+}
+
+void writeResults(ResponseWriter& writer, const std::vector<SearchResult>& results) {
+  writer.beginArray();
+  for (const auto& result : results) {
+    writer.beginObject();
+    writer.key("id");
+    writer.string(result.id);
+    writer.key("content");
+    writer.string(result.content);
+    writer.key("category");
+    writer.string(result.category);
+    writer.key("score");
+    writer.real(result.score);
+    writer.key("timestamp");
+    writer.integer(result.timestamp);
+    writer.endObject();
+  }
+  writer.endArray();
+}
+
+} // namespace
+
+// Fields of the hot endpoints. Kept thread_local by the fast path, so
+// reset() clears values without giving up string capacity.
+struct RequestParams {
+  std::string content;
+  std::string id;
+  std::string category;
+  bool has_category;
+  bool async;
+  bool wait;
+  int timeout_ms;
+
+  std::string name_space;        // "" for the default namespace
+
+  std::vector<float> embedding;  // precomputed vector, bypassing the embedder
+  bool has_embedding;
+
+  std::string query;
+  std::string mode;              // /search: "vector" (or ""), "lexical" or "hybrid"
+  std::vector<std::string> queries;
+  int top_k;
+  int nprobe;
+  int ef_search;
+  int64_t since;
+  int64_t until;
+
+  RequestParams() { reset(); }
+
+  void reset() {
+    content.clear();
+    id.clear();
+    category.clear();
+    has_category = false;
+    async = true;
+    wait = false;
+    timeout_ms = kDefaultWaitMs;
+    name_space.clear();
+    embedding.clear();
+    has_embedding = false;
+    query.clear();
+    mode.clear();
+    queries.clear();
+    top_k = 5;
+    nprobe = 0;
+    ef_search = 0;
+    since = 0;
+    until = 0;
+  }
+
+  // Optional index tuning and filters shared by the search endpoints
+  SearchOptions searchOptions() const {
+    SearchOptions options;
+    options.nprobe = nprobe;
+    options.ef_search = ef_search;
+    options.category = category;
+    options.since = since;
+    options.until = until;
+    return options;
+  }
+};
+
+namespace {
+
+// Vectors are arrays of numbers, or in MessagePack a bin value holding
+// little-endian float32. Anything else yields an empty vector, which fails
+// the dimension check.
+std::vector<float> vectorFromJson(const json& value) {
+  std::vector<float> vector;
+  if (value.is_binary()) {
+    const auto& bytes = value.get_binary();
+    if (bytes.size() % sizeof(float) == 0) {
+      vector.resize(bytes.size() / sizeof(float));
+      decodeVector(rocksdb::Slice(reinterpret_cast<const char*>(bytes.data()), bytes.size()), vector.size(),
+                   vector.data());
+    }
+  } else if (value.is_array()) {
+    vector.reserve(value.size());
+    for (const auto& element : value) {
+      if (!element.is_number()) {
+        return {};
+      }
+      vector.push_back(element.get<float>());
+    }
+  }
+  return vector;
+}
+
+bool validEmbedding(const std::vector<float>& embedding, int dimension) {
+  if (embedding.size() != static_cast<size_t>(dimension)) {
+    return false;
+  }
+  return std::all_of(embedding.begin(), embedding.end(), [](float x) { return std::isfinite(x); });
+}
+
+std::string embeddingError(int dimension) {
+  return "Embedding must be " + std::to_string(dimension) + " finite numbers";
+}
+
+// Integer fields saturate at their type's range instead of wrapping or,
+// for floats, overflowing the cast; floats are truncated, as nlohmann does
+template <typename Int>
+Int saturate(int64_t value) {
+  return static_cast<Int>(std::clamp<int64_t>(value, std::numeric_limits<Int>::min(),
+                                              std::numeric_limits<Int>::max()));
+}
+
+int64_t saturate(uint64_t value) {
+  return static_cast<int64_t>(std::min<uint64_t>(value, std::numeric_limits<int64_t>::max()));
+}
+
+// Callers reject NaN and infinity first
+int64_t saturate(double value) {
+  // 2^63, the first double past int64_t's range
+  constexpr double kLimit = 9223372036854775808.0;
+  if (value >= kLimit) {
+    return std::numeric_limits<int64_t>::max();
+  }
+  if (value < -kLimit) {
+    return std::numeric_limits<int64_t>::min();
+  }
+  return static_cast<int64_t>(value);
+}
+
+template <typename Int>
+Int integerParam(const json& params, const char* name, Int fallback) {
+  auto it = params.find(name);
+  if (it == params.end()) {
+    return fallback;
+  }
+  if (it->is_number_float()) {
+    double value = it->get<double>();
+    if (!std::isfinite(value)) {
+      throw std::invalid_argument(std::string(name) + " must be a finite number");
+    }
+    return saturate<Int>(saturate(value));
+  }
+  if (it->is_number_unsigned()) {
+    return saturate<Int>(saturate(it->get<uint64_t>()));
+  }
+  return saturate<Int>(it->get<int64_t>());  // throws for non-numbers, like value()
+}
+
+// DOM path: the same fields, with nlohmann's own type checks
+void paramsFromJson(const std::string& endpoint, const json& params, RequestParams* out) {
+  out->reset();
+  out->name_space = params.value("namespace", "");
+  if (params.contains("embedding")) {
+    out->has_embedding = true;
+    out->embedding = vectorFromJson(params["embedding"]);
+  }
+
+  if (endpoint == "/add") {
+    out->content = params.value("content", "");
+    out->id = params.value("id", "");
+    out->has_category = params.contains("category");
+    out->category = params.value("category", "general");
+    out->async = params.value("async", true);
+    out->wait = params.value("wait", false);
+    out->timeout_ms = integerParam(params, "timeout_ms", kDefaultWaitMs);
+    return;
+  }
+
+  if (endpoint == "/search") {
+    out->query = params.value("query", "");
+    out->mode = params.value("mode", "");
+  } else if (endpoint == "/search_by_id") {
+    out->id = params.value("id", "");
+  } else {
+    json queries = params.value("queries", json::array());
+    if (queries.is_array()) {
+      for (const auto& query : queries) {
+        out->queries.push_back(query.is_string() ? query.get<std::string>() : std::string());
+      }
+    }
+  }
+  out->top_k = integerParam(params, "top_k", 5);
+  out->nprobe = integerParam(params, "nprobe", 0);
+  out->ef_search = integerParam(params, "ef_search", 0);
+  out->category = params.value("category", "");
+  out->since = integerParam(params, "since", int64_t(0));
+  out->until = integerParam(params, "until", int64_t(0));
+}
+
+bool isFastEndpoint(const std::string& endpoint) {
+  return endpoint == "/add" || endpoint == "/search" || endpoint == "/search_batch" ||
+         endpoint == "/search_by_id";
+}
+
+const char* const kEndpoints[] = {"/add", "/search", "/search_batch", "/search_by_id", "/add_batch", "/wait",
+                                  "/update", "/remove", "/update_preference", "/get_preference",
+                                  "/get_preferences", "/list_preferences", "/stats", "/export", "/import",
+                                  "/checkpoint", "/get_embedding", "/replicate"};
+
+bool isKnownEndpoint(const std::string& endpoint) {
+  return std::find(std::begin(kEndpoints), std::end(kEndpoints), endpoint) != std::end(kEndpoints);
+}
+
+// Endpoints a replica refuses
+bool isWriteEndpoint(const std::string& endpoint) {
+  return endpoint == "/add" || endpoint == "/add_batch" || endpoint == "/update" || endpoint == "/remove" ||
+         endpoint == "/update_preference" || endpoint == "/import";
+}
+
+// Whole-request latency by endpoint; anything unrecognized counts as "other"
+Histogram& requestHistogram(const std::string& endpoint) {
+  static const char* const kHelp = "Request handling time by endpoint";
+  static const auto* histograms = [] {
+    auto* map = new std::unordered_map<std::string, Histogram*>();
+    for (const char* name : kEndpoints) {
+      (*map)[name] = &Metrics::global().histogram("kb_request_seconds", kHelp, {{"endpoint", name}});
+    }
+    return map;
+  }();
+  static Histogram& other = Metrics::global().histogram("kb_request_seconds", kHelp, {{"endpoint", "other"}});
+
+  auto it = histograms->find(endpoint);
+  return it != histograms->end() ? *it->second : other;
+}
+
+// Stages of request handling outside the store, which times its own
+struct StageMetrics {
+  Histogram& parse;      // request decoding, SAX attempt and DOM fallback
+  Histogram& resolve;    // namespace lookup, opening it if needed
+  Histogram& embed;      // embedding service calls
+  Histogram& serialize;  // DOM responses; streamed ones are written as results are produced
+};
+
+StageMetrics& stageMetrics() {
+  static const char* const kHelp = "Request handling time by stage";
+  static StageMetrics metrics{
+    Metrics::global().histogram("kb_request_stage_seconds", kHelp, {{"stage", "parse"}}),
+    Metrics::global().histogram("kb_request_stage_seconds", kHelp, {{"stage", "resolve"}}),
+    Metrics::global().histogram("kb_request_stage_seconds", kHelp, {{"stage", "embed"}}),
+    Metrics::global().histogram("kb_request_stage_seconds", kHelp, {{"stage", "serialize"}}),
+  };
+  return metrics;
+}
+
+// Observes a whole request once it goes out of scope, under the endpoint
+// set last
+class RequestTimer {
+public:
+  RequestTimer() : histogram_(&requestHistogram("")), start_(std::chrono::steady_clock::now()) {}
+  ~RequestTimer() { histogram_->observe(std::chrono::steady_clock::now() - start_); }
+
+  void setEndpoint(const std::string& endpoint) { histogram_ = &requestHistogram(endpoint); }
+
+private:
+  Histogram* histogram_;
+  std::chrono::steady_clock::time_point start_;
+};
+
+std::vector<float> embedText(EmbeddingService& embedder, const std::string& text) {
+  ScopedTimer timer(stageMetrics().embed);
+  return embedder.embed(text);
+}
+
+std::vector<std::vector<float>> embedTexts(EmbeddingService& embedder, const std::vector<std::string>& texts) {
+  ScopedTimer timer(stageMetrics().embed);
+  return embedder.embedBatch(texts);
+}
+
+// SAX consumer for {"endpoint": "...", "params": {...}} requests to the hot
+// endpoints, in JSON or MessagePack. It gives up -- and the DOM path takes
+// over -- on any other endpoint, a malformed document, or a field whose type
+// the DOM path would reject, so error responses are unchanged. Unknown
+// fields are skipped.
+class FastRequestParser {
+public:
+  FastRequestParser(RequestParams* params, std::string* endpoint)
+    : params_(params), endpoint_(endpoint), depth_(0), skip_(0), field_(Field::None), array_(Field::None) {
+    params_->reset();
+    endpoint_->clear();
+  }
+
+  bool null() {
+    if (skipping()) {
+      return true;
+    }
+    return array_ == Field::None && field_ == Field::None;
+  }
+
+  bool boolean(bool value) {
+    if (skipping()) {
+      return true;
+    }
+    if (array_ != Field::None) {
+      return false;
+    }
+    switch (field_) {
+      case Field::None: return true;
+      case Field::Async: params_->async = value; return true;
+      case Field::Wait: params_->wait = value; return true;
+      default: return false;
+    }
+  }
+
+  bool number_integer(json::number_integer_t value) { return number(value, static_cast<float>(value)); }
+  bool number_unsigned(json::number_unsigned_t value) {
+    return number(saturate(static_cast<uint64_t>(value)), static_cast<float>(value));
+  }
+  // Truncated like nlohmann does; NaN and infinity (MessagePack can carry
+  // them) go to the DOM path, which reports them
+  bool number_float(json::number_float_t value, const std::string&) {
+    if (!std::isfinite(value) && array_ != Field::Embedding) {
+      return false;
+    }
+    return number(std::isfinite(value) ? saturate(static_cast<double>(value)) : 0, static_cast<float>(value));
+  }
+
+  bool string(std::string& value) {
+    if (skipping()) {
+      return true;
+    }
+    if (array_ == Field::Queries) {
+      params_->queries.push_back(value);
+      return true;
+    }
+    if (array_ != Field::None) {
+      return false;
+    }
+    switch (field_) {
+      case Field::None: return true;
+      case Field::Endpoint:
+        *endpoint_ = value;
+        return isFastEndpoint(value);
+      case Field::Content: params_->content = value; return true;
+      case Field::Id: params_->id = value; return true;
+      case Field::Category: params_->category = value; return true;
+      case Field::Query: params_->query = value; return true;
+      case Field::Mode: params_->mode = value; return true;
+      case Field::Namespace: params_->name_space = value; return true;
+      default: return false;
+    }
+  }
+
+  // MessagePack bin: a raw little-endian float32 embedding
+  bool binary(json::binary_t& value) {
+    if (skipping()) {
+      return true;
+    }
+    if (array_ != Field::None || field_ != Field::Embedding || value.size() % sizeof(float) != 0) {
+      return false;
+    }
+    params_->embedding.resize(value.size() / sizeof(float));
+    return decodeVector(rocksdb::Slice(reinterpret_cast<const char*>(value.data()), value.size()),
+                        params_->embedding.size(), params_->embedding.data());
+  }
+
+  bool start_object(std::size_t) {
+    if (skipping()) {
+      return enterSkipped();
+    }
+    if (array_ != Field::None) {
+      return false;
+    }
+    if (depth_ == 0 || (depth_ == 1 && field_ == Field::Params)) {
+      ++depth_;
+      field_ = Field::None;
+      return true;
+    }
+    return field_ == Field::None && enterSkipped();
+  }
+
+  bool end_object() {
+    if (skip_ > 0) {
+      --skip_;
+      return true;
+    }
+    --depth_;
+    field_ = Field::None;
+    return true;
+  }
+
+  bool start_array(std::size_t elements) {
+    if (skipping()) {
+      return enterSkipped();
+    }
+    if (array_ != Field::None) {
+      return false;
+    }
+    if (depth_ == 2 && (field_ == Field::Queries || field_ == Field::Embedding)) {
+      ++depth_;
+      array_ = field_;
+      if (array_ == Field::Embedding && elements != static_cast<std::size_t>(-1)) {
+        params_->embedding.reserve(elements);  // MessagePack announces the size
+      }
+      return true;
+    }
+    return depth_ > 0 && field_ == Field::None && enterSkipped();
+  }
+
+  bool end_array() {
+    if (skip_ > 0) {
+      --skip_;
+      return true;
+    }
+    --depth_;
+    array_ = Field::None;
+    field_ = Field::None;
+    return true;
+  }
+
+  bool key(std::string& name) {
+    if (skip_ > 0) {
+      return true;
+    }
+    field_ = depth_ == 1 ? topLevelField(name) : paramsField(name);
+    if (field_ == Field::Category) {
+      params_->has_category = true;
+    } else if (field_ == Field::Embedding) {
+      params_->has_embedding = true;
+      params_->embedding.clear();
+    } else if (field_ == Field::Queries) {
+      params_->queries.clear();  // a repeated key replaces, as in the DOM
+    }
+    return true;
+  }
+
+  bool parse_error(std::size_t, const std::string&, const nlohmann::detail::exception&) { return false; }
+
+private:
+  enum class Field {
+    None, Endpoint, Params, Namespace, Content, Id, Category, Async, Wait, TimeoutMs, Embedding,
+    Query, Mode, Queries, TopK, Nprobe, EfSearch, Since, Until
+  };
+
+  static Field topLevelField(const std::string& name) {
+    if (name == "endpoint") return Field::Endpoint;
+    if (name == "params") return Field::Params;
+    return Field::None;
+  }
+
+  static Field paramsField(const std::string& name) {
+    if (name == "namespace") return Field::Namespace;
+    if (name == "content") return Field::Content;
+    if (name == "id") return Field::Id;
+    if (name == "category") return Field::Category;
+    if (name == "async") return Field::Async;
+    if (name == "wait") return Field::Wait;
+    if (name == "timeout_ms") return Field::TimeoutMs;
+    if (name == "embedding") return Field::Embedding;
+    if (name == "query") return Field::Query;
+    if (name == "mode") return Field::Mode;
+    if (name == "queries") return Field::Queries;
+    if (name == "top_k") return Field::TopK;
+    if (name == "nprobe") return Field::Nprobe;
+    if (name == "ef_search") return Field::EfSearch;
+    if (name == "since") return Field::Since;
+    if (name == "until") return Field::Until;
+    return Field::None;
+  }
+
+  bool skipping() const { return skip_ > 0; }
+
+  bool enterSkipped() {
+    ++skip_;
+    return true;
+  }
+
+  bool number(int64_t value, float real) {
+    if (skipping()) {
+      return true;
+    }
+    if (array_ == Field::Embedding) {
+      params_->embedding.push_back(real);
+      return true;
+    }
+    if (array_ != Field::None) {
+      return false;  // the DOM path reports non-string queries
+    }
+    switch (field_) {
+      case Field::None: return true;
+      case Field::TimeoutMs: params_->timeout_ms = saturate<int>(value); return true;
+      case Field::TopK: params_->top_k = saturate<int>(value); return true;
+      case Field::Nprobe: params_->nprobe = saturate<int>(value); return true;
+      case Field::EfSearch: params_->ef_search = saturate<int>(value); return true;
+      case Field::Since: params_->since = value; return true;
+      case Field::Until: params_->until = value; return true;
+      default: return false;
+    }
+  }
+
+  RequestParams* params_;
+  std::string* endpoint_;
+  int depth_;     // 1 inside the request object, 2 inside params, 3 inside an array field
+  int skip_;      // nesting depth inside an ignored container
+  Field field_;   // field the next value belongs to
+  Field array_;   // array field being read (Queries or Embedding), or None
+};
+
+} // namespace
+
+RequestHandler::RequestHandler(std::shared_ptr<KnowledgeBase> kb, std::shared_ptr<EmbeddingService> embedder,
+                               std::shared_ptr<IngestPipeline> ingest)
+  : default_tenant_{kb, ingest}, embedder_(embedder) {}
+
+RequestHandler::RequestHandler(std::shared_ptr<NamespaceRegistry> namespaces,
+                               std::shared_ptr<EmbeddingService> embedder)
+  : namespaces_(namespaces), embedder_(embedder) {
+  std::string error;
+  namespaces_->acquire("", &default_tenant_, &error);
+}
+
+RequestHandler::RequestHandler(std::shared_ptr<ShardRouter> router) : router_(router) {}
 
 std::string RequestHandler::handle(const std::string& request_json) {
+  std::string response;
+  handle(request_json, &response);
+  return response;
+}
+
+void RequestHandler::handle(const std::string& request_json, std::string* out) {
+  process(request_json, false, out);
+}
+
+void RequestHandler::handleMessagePack(const std::string& request, std::string* out) {
+  process(request, true, out);
+}
+
+void RequestHandler::process(const std::string& request_data, bool msgpack, std::string* out) {
+  const size_t start = out->size();
+  JsonWriter json_writer(out);
+  MsgpackWriter msgpack_writer(out);
+  ResponseWriter& writer = msgpack ? static_cast<ResponseWriter&>(msgpack_writer) : json_writer;
+
+  RequestTimer request_timer;
+  auto respond = [&](const json& response) {
+    ScopedTimer timer(stageMetrics().serialize);
+    if (msgpack) {
+      json::to_msgpack(response, *out);
+    } else {
+      out->append(response.dump());
+    }
+  };
+
   try {
-    json request = json::parse(request_json);
+    if (router_) {
+      json request = msgpack ? json::from_msgpack(request_data) : json::parse(request_data);
+      std::string endpoint = request.value("endpoint", "");
+      request_timer.setEndpoint(endpoint);
+      if (!isKnownEndpoint(endpoint)) {
+        respond({{"success", false}, {"error", "Unknown endpoint: " + endpoint}});
+        return;
+      }
+      respond(router_->route(endpoint, request.value("params", json::object())));
+      return;
+    }
+
+    thread_local RequestParams fast_params;
+    thread_local std::string fast_endpoint;
+    FastRequestParser parser(&fast_params, &fast_endpoint);
+    auto parse_start = std::chrono::steady_clock::now();
+    bool parsed = msgpack
+      ? json::sax_parse(request_data.begin(), request_data.end(), &parser, json::input_format_t::msgpack)
+      : json::sax_parse(request_data, &parser);
+    if (parsed && isFastEndpoint(fast_endpoint)) {
+      stageMetrics().parse.observe(std::chrono::steady_clock::now() - parse_start);
+      request_timer.setEndpoint(fast_endpoint);
+      Tenant tenant;
+      std::string error;
+      if (!resolveTenant(fast_params.name_space, &tenant, &error)) {
+        writeError(writer, error.c_str());
+        return;
+      }
+      if (tenant.replicator && isWriteEndpoint(fast_endpoint)) {
+        writeError(writer, kReadOnlyError);
+        return;
+      }
+      if (tenant.replicator && !tenant.replicator->seeded()) {
+        writeError(writer, kNotSeededError);
+        return;
+      }
+      dispatchFast(fast_endpoint, fast_params, tenant, writer);
+      return;
+    }
+
+    json request = msgpack ? json::from_msgpack(request_data) : json::parse(request_data);
+    stageMetrics().parse.observe(std::chrono::steady_clock::now() - parse_start);
 
     std::string endpoint = request.value("endpoint", "");
     json params = request.value("params", json::object());
+    request_timer.setEndpoint(endpoint);
 
     json response;
+    Tenant tenant;
+    std::string error;
 
-    if (endpoint == "/add") {
-      response = handleAdd(params);
-    } else if (endpoint == "/search") {
-      response = handleSearch(params);
+    if (!isKnownEndpoint(endpoint)) {
+      response["success"] = false;
+      response["error"] = "Unknown endpoint: " + endpoint;
+    } else if (!resolveTenant(params.value("namespace", ""), &tenant, &error)) {
+      response["success"] = false;
+      response["error"] = error;
+    } else if (tenant.replicator && isWriteEndpoint(endpoint)) {
+      response["success"] = false;
+      response["error"] = kReadOnlyError;
+    } else if (tenant.replicator && !tenant.replicator->seeded() && endpoint != "/stats") {
+      // Whatever it holds is not the primary's data; /stats shows the lag
+      response["success"] = false;
+      response["error"] = kNotSeededError;
+    } else if (isFastEndpoint(endpoint)) {
+      RequestParams fields;
+      paramsFromJson(endpoint, params, &fields);
+      dispatchFast(endpoint, fields, tenant, writer);
+      return;
+    } else if (endpoint == "/add_batch") {
+      response = handleAddBatch(params, tenant);
+    } else if (endpoint == "/wait") {
+      response = handleWait(params, tenant);
     } else if (endpoint == "/update") {
-      response = handleUpdate(params);
+      response = handleUpdate(params, tenant);
     } else if (endpoint == "/remove") {
-      response = handleRemove(params);
+      response = handleRemove(params, tenant);
     } else if (endpoint == "/update_preference") {
-      response = handleUpdatePreference(params);
-    } else if (endpoint == "/get_preference") {
-      response = handleGetPreference(params);
+      response = handleUpdatePreference(params, tenant);
+    } else if (endpoint == "/get_preferences") {
+      response = handleGetPreferences(params, tenant);
+    } else if (endpoint == "/list_preferences") {
+      response = handleListPreferences(params, tenant);
+    } else if (endpoint == "/stats") {
+      response = handleStats(tenant);
+    } else if (endpoint == "/export") {
+      response = handleExport(params, tenant);
+    } else if (endpoint == "/import") {
+      response = handleImport(params, tenant);
+    } else if (endpoint == "/checkpoint") {
+      response = handleCheckpoint(params, tenant);
+    } else if (endpoint == "/get_embedding") {
+      response = handleGetEmbedding(params, tenant);
+    } else if (endpoint == "/replicate") {
+      response = handleReplicate(params, tenant);
     } else {
-      response["success"] = false;
-      response["error"] = "Unknown endpoint: " + endpoint;
+      response = handleGetPreference(params, tenant);
     }
 
-    return response.dump();
+    respond(response);
 
   } catch (const json::exception& e) {
     json error_response;
     error_response["success"] = false;
     error_response["error"] = "JSON parse error: " + std::string(e.what());
-    return error_response.dump();
+    out->resize(start);
+    respond(error_response);
   } catch (const std::exception& e) {
     json error_response;
     error_response["success"] = false;
     error_response["error"] = "Error: " + std::string(e.what());
-    return error_response.dump();
+    out->resize(start);
+    respond(error_response);
   }
 }
 
-json RequestHandler::handleAdd(const json& params) {
-  std::string content = params.value("content", "");
-  std::string category = params.value("category", "general");
-  std::string id = params.value("id", "");
+bool RequestHandler::resolveTenant(const std::string& name, Tenant* tenant, std::string* error) {
+  if (name.empty()) {
+    *tenant = default_tenant_;
+    return true;
+  }
+  if (!namespaces_) {
+    *error = "Namespaces are not enabled";
+    return false;
+  }
+  ScopedTimer timer(stageMetrics().resolve);
+  return namespaces_->acquire(name, tenant, error);
+}
 
-  if (content.empty()) {
-    json response;
-    response["success"] = false;
-    response["error"] = "Content is required";
-    return response;
+bool RequestHandler::dispatchFast(const std::string& endpoint, const RequestParams& params, const Tenant& tenant,
+                                  ResponseWriter& writer) {
+  if (endpoint == "/add") {
+    handleAdd(params, tenant, writer);
+  } else if (endpoint == "/search") {
+    handleSearch(params, tenant, writer);
+  } else if (endpoint == "/search_batch") {
+    handleSearchBatch(params, tenant, writer);
+  } else if (endpoint == "/search_by_id") {
+    handleSearchById(params, tenant, writer);
+  } else {
+    return false;
   }
+  return true;
+}
 
-  // Generate embedding
-  std::vector<float> embedding = embedder_->embed(content);
+void RequestHandler::handleAdd(const RequestParams& params, const Tenant& tenant, ResponseWriter& writer) {
+  if (params.content.empty()) {
+    writeError(writer, "Content is required");
+    return;
+  }
+
+  if (params.has_embedding && !validEmbedding(params.embedding, tenant.kb->dimension())) {
+    writeError(writer, embeddingError(tenant.kb->dimension()).c_str());
+    return;
+  }
 
   Memory memory;
-  memory.id = id;
-  memory.content = content;
-  memory.category = category;
-  memory.timestamp = std::chrono::duration_cast<std::chrono::milliseconds>(
-    std::chrono::system_clock::now().time_since_epoch()
-  ).count();
-  memory.embedding = embedding;
+  memory.id = params.id;
+  memory.content = params.content;
+  memory.category = params.has_category ? params.category : "general";
+  memory.timestamp = nowMillis();
 
-  std::string generated_id = kb_->addAndReturnId(memory);
-  bool success = !generated_id.empty();
+  // With a precomputed vector there is nothing slow left to defer
+  if (tenant.ingest && params.async && !params.has_embedding) {
+    handleAddAsync(params, memory, tenant, writer);
+    return;
+  }
+
+  // Generate embedding unless the client sent one
+  memory.embedding = params.has_embedding ? params.embedding : embedText(*embedder_, memory.content);
+
+  std::string generated_id = tenant.kb->addAndReturnId(memory);
+  if (generated_id.empty()) {
+    writeError(writer, "Failed to add memory (may already exist)");
+    return;
+  }
+
+  writer.beginObject();
+  writer.key("success");
+  writer.boolean(true);
+  writer.key("id");
+  writer.string(generated_id);
+  writer.endObject();
+}
+
+void RequestHandler::handleAddAsync(const RequestParams& params, const Memory& memory, const Tenant& tenant,
+                                    ResponseWriter& writer) {
+  uint64_t ticket = 0;
+  std::string id = tenant.ingest->submit(memory, &ticket);
+  if (id.empty()) {
+    writeError(writer, "Failed to add memory (may already exist)");
+    return;
+  }
+
+  bool visible = false;
+  if (params.wait) {
+    visible = tenant.ingest->waitFor(ticket, std::chrono::milliseconds(params.timeout_ms));
+    std::vector<IngestFailure> failed = visible ? tenant.ingest->failures(ticket - 1, ticket)
+                                                : std::vector<IngestFailure>();
+    if (!failed.empty()) {
+      writeError(writer, ("Failed to add memory: " + failed.front().error).c_str());
+      return;
+    }
+  }
 
+  writer.beginObject();
+  writer.key("success");
+  writer.boolean(true);
+  writer.key("id");
+  writer.string(id);
+  writer.key("ticket");
+  writer.unsignedInteger(ticket);
+  writer.key("pending");
+  writer.boolean(!visible);
+  writer.endObject();
+}
+
+json RequestHandler::handleWait(const json& params, const Tenant& tenant) {
   json response;
-  response["success"] = success;
-  if (success) {
-    response["id"] = generated_id;
-  } else {
-    response["error"] = "Failed to add memory (may already exist)";
+  if (!tenant.ingest) {
+    // Adds are synchronous, so everything acknowledged is searchable
+    response["success"] = true;
+    response["pending"] = 0;
+    return response;
   }
 
+  // A given ticket is waited for alone, so a memory that is being retried
+  // does not hold up waiters on later ones
+  uint64_t ticket = params.value("ticket", tenant.ingest->lastTicket());
+  uint64_t since = params.value("since", static_cast<uint64_t>(0));
+  std::chrono::milliseconds timeout(params.value("timeout_ms", kDefaultWaitMs));
+  bool visible = params.contains("ticket") ? tenant.ingest->waitFor(ticket, timeout)
+                                           : tenant.ingest->waitForAll(ticket, timeout);
+  std::vector<IngestFailure> failed = tenant.ingest->failures(since, ticket);
+
+  response["success"] = visible && failed.empty();
+  response["pending"] = tenant.ingest->pending();
+  if (!visible) {
+    response["error"] = "Timed out waiting for ingestion";
+  } else if (!failed.empty()) {
+    response["error"] = std::to_string(failed.size()) + " adds failed";
+  }
+  if (!failed.empty()) {
+    json& items = response["failed"];
+    items = json::array();
+    for (const IngestFailure& failure : failed) {
+      items.push_back({{"ticket", failure.ticket}, {"id", failure.id}, {"error", failure.error}});
+    }
+  }
   return response;
 }
 
-json RequestHandler::handleSearch(const json& params) {
-  std::string query = params.value("query", "");
-  int top_k = params.value("top_k", 5);
+void RequestHandler::handleSearch(const RequestParams& params, const Tenant& tenant, ResponseWriter& writer) {
+  std::vector<SearchResult> results;
+  bool lexical = params.mode == "lexical";
+  bool hybrid = params.mode == "hybrid";
+  if (!lexical && !hybrid && !params.mode.empty() && params.mode != "vector") {
+    writeError(writer, ("Unknown search mode: " + params.mode).c_str());
+    return;
+  }
 
-  if (query.empty()) {
+  if (lexical || hybrid) {
+    if (params.query.empty()) {
+      writeError(writer, "Query is required");
+      return;
+    }
+    if (params.has_embedding && !validEmbedding(params.embedding, tenant.kb->dimension())) {
+      writeError(writer, embeddingError(tenant.kb->dimension()).c_str());
+      return;
+    }
+
+    // Lexical search needs no embedding; hybrid embeds the query unless given one
+    if (lexical) {
+      results = tenant.kb->searchLexical(params.query, params.top_k, params.searchOptions());
+    } else {
+      std::vector<float> query_embedding = params.has_embedding ? params.embedding
+                                                                : embedText(*embedder_, params.query);
+      results = tenant.kb->searchHybrid(params.query, query_embedding, params.top_k, params.searchOptions());
+    }
+  } else if (params.has_embedding) {
+    if (!validEmbedding(params.embedding, tenant.kb->dimension())) {
+      writeError(writer, embeddingError(tenant.kb->dimension()).c_str());
+      return;
+    }
+    results = tenant.kb->search(params.embedding, params.top_k, params.searchOptions());
+  } else {
+    if (params.query.empty()) {
+      writeError(writer, "Query is required");
+      return;
+    }
+
+    // Generate query embedding
+    std::vector<float> query_embedding = embedText(*embedder_, params.query);
+    results = tenant.kb->search(query_embedding, params.top_k, params.searchOptions());
+  }
+
+  writer.beginObject();
+  writer.key("success");
+  writer.boolean(true);
+  writer.key("results");
+  writeResults(writer, results);
+  writer.endObject();
+}
+
+void RequestHandler::handleSearchById(const RequestParams& params, const Tenant& tenant, ResponseWriter& writer) {
+  if (params.id.empty()) {
+    writeError(writer, "ID is required");
+    return;
+  }
+
+  // Reuse the stored vector; the memory itself is left out of its results
+  std::vector<float> embedding;
+  if (!tenant.kb->getEmbedding(params.id, &embedding)) {
+    writeError(writer, "Memory not found");
+    return;
+  }
+
+  // Clamped first, so asking for one extra cannot overflow
+  size_t top_k = std::min(static_cast<size_t>(std::max(params.top_k, 0)), tenant.kb->size());
+  std::vector<SearchResult> results =
+    tenant.kb->search(embedding, static_cast<int>(top_k + 1), params.searchOptions());
+  results.erase(std::remove_if(results.begin(), results.end(),
+                               [&](const SearchResult& result) { return result.id == params.id; }),
+                results.end());
+  if (results.size() > top_k) {
+    results.resize(top_k);
+  }
+
+  writer.beginObject();
+  writer.key("success");
+  writer.boolean(true);
+  writer.key("results");
+  writeResults(writer, results);
+  writer.endObject();
+}
+
+json RequestHandler::handleAddBatch(const json& params, const Tenant& tenant) {
+  json items = params.value("memories", json::array());
+
+  if (!items.is_array() || items.empty()) {
     json response;
     response["success"] = false;
-    response["error"] = "Query is required";
+    response["error"] = "Memories array is required";
     return response;
   }
 
-  // Generate query embedding
-  std::vector<float> query_embedding = embedder_->embed(query);
+  int64_t timestamp = nowMillis();
+  std::vector<Memory> memories;
+  std::vector<std::string> contents;  // texts still to embed
+  std::vector<size_t> to_embed;       // their positions in memories
+  memories.reserve(items.size());
 
-  // Search
-  std::vector<SearchResult> results = kb_->search(query_embedding, top_k);
+  for (const auto& item : items) {
+    std::string content = item.value("content", "");
+    if (content.empty()) {
+      json response;
+      response["success"] = false;
+      response["error"] = "Content is required for every memory";
+      return response;
+    }
 
-  json response;
-  response["success"] = true;
-  response["results"] = json::array();
+    Memory memory;
+    memory.id = item.value("id", "");
+    memory.content = content;
+    memory.category = item.value("category", "general");
+    memory.timestamp = timestamp;
+    if (item.contains("embedding")) {
+      memory.embedding = vectorFromJson(item["embedding"]);
+      if (!validEmbedding(memory.embedding, tenant.kb->dimension())) {
+        json response;
+        response["success"] = false;
+        response["error"] = embeddingError(tenant.kb->dimension());
+        return response;
+      }
+    } else {
+      to_embed.push_back(memories.size());
+      contents.push_back(std::move(content));
+    }
+    memories.push_back(std::move(memory));
+  }
 
-  for (const auto& result : results) {
-    json item;
-    item["id"] = result.id;
-    item["content"] = result.content;
-    item["category"] = result.category;
-    item["score"] = result.score;
-    item["timestamp"] = result.timestamp;
-    response["results"].push_back(item);
+  // One embedding call for everything without a precomputed vector
+  if (!contents.empty()) {
+    std::vector<std::vector<float>> embeddings = embedTexts(*embedder_, contents);
+    for (size_t i = 0; i < to_embed.size(); ++i) {
+      memories[to_embed[i]].embedding = std::move(embeddings[i]);
+    }
+  }
+
+  std::vector<std::string> ids = tenant.kb->addBatch(memories);
+  size_t failed = std::count(ids.begin(), ids.end(), std::string());
+
+  json response;
+  response["success"] = failed == 0;
+  response["ids"] = ids;
+  if (failed > 0) {
+    response["error"] = std::to_string(failed) + " memories failed to add (may already exist)";
   }
 
   return response;
 }
 
-json RequestHandler::handleUpdate(const json& params) {
+void RequestHandler::handleSearchBatch(const RequestParams& params, const Tenant& tenant, ResponseWriter& writer) {
+  if (params.queries.empty()) {
+    writeError(writer, "Queries array is required");
+    return;
+  }
+
+  for (const auto& query : params.queries) {
+    if (query.empty()) {
+      writeError(writer, "Every query must be a non-empty string");
+      return;
+    }
+  }
+
+  std::vector<std::vector<float>> query_embeddings = embedTexts(*embedder_, params.queries);
+
+  std::vector<std::vector<SearchResult>> results =
+    tenant.kb->searchBatch(query_embeddings, params.top_k, params.searchOptions());
+
+  writer.beginObject();
+  writer.key("success");
+  writer.boolean(true);
+  writer.key("results");
+  writer.beginArray();
+  for (const auto& query_results : results) {
+    writeResults(writer, query_results);
+  }
+  writer.endArray();
+  writer.endObject();
+}
+
+json RequestHandler::handleUpdate(const json& params, const Tenant& tenant) {
   std::string id = params.value("id", "");
   std::string content = params.value("content", "");
 
@@ -134,10 +1083,21 @@ json RequestHandler::handleUpdate(const json& params) {
     return response;
   }
 
-  // Generate new embedding
-  std::vector<float> embedding = embedder_->embed(content);
+  // Generate new embedding unless the client sent one
+  std::vector<float> embedding;
+  if (params.contains("embedding")) {
+    embedding = vectorFromJson(params["embedding"]);
+    if (!validEmbedding(embedding, tenant.kb->dimension())) {
+      json response;
+      response["success"] = false;
+      response["error"] = embeddingError(tenant.kb->dimension());
+      return response;
+    }
+  } else {
+    embedding = embedText(*embedder_, content);
+  }
 
-  bool success = kb_->update(id, content, embedding);
+  bool success = tenant.kb->update(id, content, embedding);
 
   json response;
   response["success"] = success;
@@ -148,7 +1108,7 @@ json RequestHandler::handleUpdate(const json& params) {
   return response;
 }
 
-json RequestHandler::handleRemove(const json& params) {
+json RequestHandler::handleRemove(const json& params, const Tenant& tenant) {
   std::string id = params.value("id", "");
 
   if (id.empty()) {
@@ -158,7 +1118,7 @@ json RequestHandler::handleRemove(const json& params) {
     return response;
   }
 
-  bool success = kb_->remove(id);
+  bool success = tenant.kb->remove(id);
 
   json response;
   response["success"] = success;
@@ -169,7 +1129,7 @@ json RequestHandler::handleRemove(const json& params) {
   return response;
 }
 
-json RequestHandler::handleUpdatePreference(const json& params) {
+json RequestHandler::handleUpdatePreference(const json& params, const Tenant& tenant) {
   std::string key = params.value("key", "");
   std::string value = params.value("value", "");
 
@@ -180,7 +1140,7 @@ json RequestHandler::handleUpdatePreference(const json& params) {
     return response;
   }
 
-  bool success = kb_->updateUserPreference(key, value);
+  bool success = tenant.kb->updateUserPreference(key, value);
 
   json response;
   response["success"] = success;
@@ -191,7 +1151,7 @@ json RequestHandler::handleUpdatePreference(const json& params) {
   return response;
 }
 
-json RequestHandler::handleGetPreference(const json& params) {
+json RequestHandler::handleGetPreference(const json& params, const Tenant& tenant) {
   std::string key = params.value("key", "");
 
   if (key.empty()) {
@@ -201,7 +1161,7 @@ json RequestHandler::handleGetPreference(const json& params) {
     return response;
   }
 
-  std::string value = kb_->getUserPreference(key);
+  std::string value = tenant.kb->getUserPreference(key);
 
   json response;
   response["success"] = true;
@@ -210,4 +1170,215 @@ json RequestHandler::handleGetPreference(const json& params) {
   return response;
 }
 
+json RequestHandler::handleGetPreferences(const json& params, const Tenant& tenant) {
+  json items = params.value("keys", json::array());
+
+  if (!items.is_array() || items.empty()) {
+    json response;
+    response["success"] = false;
+    response["error"] = "Keys array is required";
+    return response;
+  }
+
+  std::vector<std::string> keys;
+  keys.reserve(items.size());
+  for (const json& item : items) {
+    if (!item.is_string()) {
+      json response;
+      response["success"] = false;
+      response["error"] = "keys must be an array of strings";
+      return response;
+    }
+    keys.push_back(item.get<std::string>());
+  }
+  std::vector<std::string> values = tenant.kb->getUserPreferences(keys);
+
+  json response;
+  response["success"] = true;
+  response["values"] = json::object();
+  for (size_t i = 0; i < keys.size(); ++i) {
+    response["values"][keys[i]] = values[i];
+  }
+
+  return response;
+}
+
+json RequestHandler::handleListPreferences(const json& params, const Tenant& tenant) {
+  json response;
+  if (params.contains("prefix") && !params["prefix"].is_string()) {
+    response["success"] = false;
+    response["error"] = "prefix must be a string";
+    return response;
+  }
+  std::string prefix = params.value("prefix", "");
+
+  response["success"] = true;
+  response["preferences"] = json::object();
+  for (const auto& [key, value] : tenant.kb->listUserPreferences(prefix)) {
+    response["preferences"][key] = value;
+  }
+
+  return response;
+}
+
+json RequestHandler::handleExport(const json& params, const Tenant& tenant) {
+  std::string name = params.value("path", "");
+
+  json response;
+  std::string path;
+  std::string error;
+  if (!resolveExportPath(export_dir_, name, &path, &error)) {
+    response["success"] = false;
+    response["error"] = error;
+    return response;
+  }
+
+  std::unique_ptr<FILE, int (*)(FILE*)> file(std::fopen(path.c_str(), "wb"), &std::fclose);
+  if (!file) {
+    response["success"] = false;
+    response["error"] = "Cannot open " + name;
+    return response;
+  }
+
+  TransferCounts counts;
+  bool success = tenant.kb->exportTo(file.get(), &counts);
+  success = std::fclose(file.release()) == 0 && success;
+  if (!success) {
+    std::remove(path.c_str());
+    response["success"] = false;
+    response["error"] = "Export failed";
+    return response;
+  }
+
+  response["success"] = true;
+  response["memories"] = counts.memories;
+  response["preferences"] = counts.preferences;
+  return response;
+}
+
+json RequestHandler::handleImport(const json& params, const Tenant& tenant) {
+  std::string name = params.value("path", "");
+
+  json response;
+  std::string path;
+  std::string error;
+  if (!resolveExportPath(export_dir_, name, &path, &error)) {
+    response["success"] = false;
+    response["error"] = error;
+    return response;
+  }
+
+  std::unique_ptr<FILE, int (*)(FILE*)> file(std::fopen(path.c_str(), "rb"), &std::fclose);
+  if (!file) {
+    response["success"] = false;
+    response["error"] = "Cannot open " + name;
+    return response;
+  }
+
+  TransferCounts counts;
+  if (!tenant.kb->importFrom(file.get(), &counts)) {
+    response["success"] = false;
+    if (counts.memories == 0 && !counts.unmarked) {
+      response["error"] = "Import failed: not a complete export of this dimension, or the store rejected it";
+      return response;
+    }
+    response["error"] = counts.unmarked
+      ? "Imported and indexed, but the import was not recorded for replicas: reseed them"
+      : "Imported and indexed the memories, but writing the preferences failed";
+    response["memories"] = counts.memories;
+    response["preferences"] = counts.preferences;
+    return response;
+  }
+
+  response["success"] = true;
+  response["memories"] = counts.memories;
+  response["preferences"] = counts.preferences;
+  return response;
+}
+
+json RequestHandler::handleCheckpoint(const json& params, const Tenant& tenant) {
+  std::string name = params.value("path", "");
+
+  json response;
+  std::string path;
+  std::string error;
+  if (!resolveExportPath(export_dir_, name, &path, &error)) {
+    response["success"] = false;
+    response["error"] = error;
+    return response;
+  }
+
+  bool success = tenant.kb->checkpoint(path);
+  response["success"] = success;
+  if (!success) {
+    response["error"] = "Failed to create checkpoint (the path must not exist)";
+  }
+  return response;
+}
+
+json RequestHandler::handleGetEmbedding(const json& params, const Tenant& tenant) {
+  std::string id = params.value("id", "");
+
+  json response;
+  if (id.empty()) {
+    response["success"] = false;
+    response["error"] = "ID is required";
+    return response;
+  }
+
+  std::vector<float> embedding;
+  if (!tenant.kb->getEmbedding(id, &embedding)) {
+    response["success"] = false;
+    response["error"] = "Memory not found";
+    return response;
+  }
+
+  response["success"] = true;
+  response["embedding"] = embedding;
+  return response;
+}
+
+json RequestHandler::handleReplicate(const json& params, const Tenant& tenant) {
+  uint64_t since = params.value("since", uint64_t(1));
+  size_t max_bytes = std::min(params.value("max_bytes", kDefaultReplicationBytes), kMaxReplicationBytes);
+
+  json response;
+  std::vector<WalBatch> batches;
+  uint64_t latest = 0;
+  if (!tenant.kb->readWal(since, max_bytes, &batches, &latest)) {
+    response["success"] = false;
+    response["error"] = "The WAL no longer reaches back to sequence " + std::to_string(since) +
+                        "; seed the replica from a checkpoint";
+    response["reseed"] = true;
+    return response;
+  }
+
+  // Batches travel as MessagePack bin values
+  response["success"] = true;
+  response["latest"] = latest;
+  response["batches"] = json::array();
+  for (const WalBatch& batch : batches) {
+    json item;
+    item["sequence"] = batch.sequence;
+    item["data"] = json::binary(std::vector<uint8_t>(batch.data.begin(), batch.data.end()));
+    response["batches"].push_back(std::move(item));
+  }
+  return response;
+}
+
+json RequestHandler::handleStats(const Tenant& tenant) {
+  json response;
+  response["success"] = true;
+  response["memories"] = tenant.kb->size();
+  response["index_memory_bytes"] = tenant.kb->indexMemoryBytes();
+  if (tenant.replicator) {
+    response["replication_lag"] = tenant.replicator->lag();
+  }
+  if (namespaces_) {
+    response["namespaces_open"] = namespaces_->openCount();
+  }
+  response["metrics"] = Metrics::global().toJson();
+  return response;
+}
+
 } // namespace kb
@@ -0,0 +1,74 @@
+#include "search_cache.h"
+#include <openssl/sha.h>
+
+namespace kb {
+
+namespace {
+
+template <typename T>
+void appendValue(std::string* buffer, const T& value) {
+  buffer->append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+} // namespace
+
+SearchResultCache::SearchResultCache(size_t capacity)
+  : capacity_(capacity) {}
+
+std::string SearchResultCache::key(const float* query, size_t dimension, int top_k, const SearchOptions& options) {
+  std::string buffer(reinterpret_cast<const char*>(query), dimension * sizeof(float));
+  appendValue(&buffer, top_k);
+  appendValue(&buffer, options.nprobe);
+  appendValue(&buffer, options.ef_search);
+  appendValue(&buffer, options.since);
+  appendValue(&buffer, options.until);
+  // Last, so its length cannot run into the fixed-size fields
+  buffer += options.category;
+
+  unsigned char hash[SHA256_DIGEST_LENGTH];
+  SHA256(reinterpret_cast<const unsigned char*>(buffer.data()), buffer.size(), hash);
+  return std::string(reinterpret_cast<const char*>(hash), sizeof(hash));
+}
+
+bool SearchResultCache::lookup(const std::string& key, uint64_t generation, std::vector<SearchResult>* results) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto it = entries_.find(key);
+  if (it == entries_.end() || it->second->generation != generation) {
+    if (it != entries_.end()) {
+      lru_.erase(it->second);
+      entries_.erase(it);
+    }
+    return false;
+  }
+
+  lru_.splice(lru_.begin(), lru_, it->second);
+  *results = it->second->results;
+  return true;
+}
+
+void SearchResultCache::insert(const std::string& key, uint64_t generation, const std::vector<SearchResult>& results) {
+  if (capacity_ == 0) {
+    return;
+  }
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto it = entries_.find(key);
+  if (it != entries_.end()) {
+    // Another caller ran the same search meanwhile; keep the newer one
+    if (it->second->generation < generation) {
+      it->second->generation = generation;
+      it->second->results = results;
+    }
+    lru_.splice(lru_.begin(), lru_, it->second);
+    return;
+  }
+
+  lru_.push_front(Entry{key, generation, results});
+  entries_[key] = lru_.begin();
+  if (lru_.size() > capacity_) {
+    entries_.erase(lru_.back().key);
+    lru_.pop_back();
+  }
+}
+
+} // namespace kb
@@ -2,19 +2,73 @@
 #include "knowledge_base.h"
 #include "request_handler.h"
 #include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <algorithm>
 #include <iostream>
+#include <cerrno>
 #include <cstring>
-#include <thread>
-#include <chrono>
+#include <deque>
 
 namespace kb {
 
-TCPServer::TCPServer(int port, std::shared_ptr<KnowledgeBase> kb, std::shared_ptr<RequestHandler> handler)
-  : port_(port), kb_(kb), handler_(handler), server_fd_(-1), running_(false), active_connections_(0) {}
+namespace {
+
+constexpr size_t kReadChunkSize = 65536;
+constexpr int kMaxEvents = 256;
+
+// Per-worker response buffers larger than this are released after use.
+constexpr size_t kMaxRetainedResponseSize = 1024 * 1024;
+
+// Opens a binary-protocol connection; no JSON request can start with 0xB1.
+constexpr char kBinaryPreamble[] = {'\xB1', 'K', 'B', '\x01'};
+constexpr size_t kFrameHeaderSize = 4;
+
+uint32_t readFrameLength(const std::string& data, size_t offset) {
+  uint32_t length = 0;
+  for (size_t i = 0; i < kFrameHeaderSize; ++i) {
+    length = (length << 8) | static_cast<uint8_t>(data[offset + i]);
+  }
+  return length;
+}
+
+void writeFrameLength(std::string* data, size_t offset, uint32_t length) {
+  for (size_t i = 0; i < kFrameHeaderSize; ++i) {
+    (*data)[offset + i] = static_cast<char>(length >> (8 * (kFrameHeaderSize - 1 - i)));
+  }
+}
+
+} // namespace
+
+// Requests and responses are newline-delimited JSON (serialized JSON never
+// contains a raw newline), and one connection carries any number of them.
+// A peer that half-closes after a final unterminated request -- the
+// original one-request-per-connection protocol -- still gets its reply.
+struct TCPServer::Connection {
+  explicit Connection(int fd) : fd(fd) {}
+
+  const int fd;
+  std::mutex mutex;
+  std::string input;                 // bytes not yet split into requests
+  size_t scanned = 0;                // prefix of input known to hold no newline
+  std::deque<std::string> requests;  // complete requests awaiting a worker
+  std::string output;                // response bytes not yet written
+  bool negotiated = false;           // protocol chosen from the first bytes
+  bool binary = false;               // length-prefixed MessagePack frames
+  bool busy = false;                 // a worker is draining requests
+  bool peer_closed = false;          // read side reached EOF
+  bool closed = false;
+};
+
+TCPServer::TCPServer(int port, std::shared_ptr<KnowledgeBase> kb, std::shared_ptr<RequestHandler> handler,
+                     const ServerOptions& options)
+  : port_(port), kb_(kb), handler_(handler), options_(options), server_fd_(-1), epoll_fd_(-1), wake_fd_(-1),
+    running_(false), active_connections_(0) {}
 
 TCPServer::~TCPServer() {
   stop();
@@ -22,7 +76,7 @@ TCPServer::~TCPServer() {
 
 void TCPServer::start() {
   // Create socket
-  server_fd_ = socket(AF_INET, SOCK_STREAM, 0);
+  server_fd_ = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
   if (server_fd_ < 0) {
     throw std::runtime_error("Failed to create socket");
   }
@@ -38,110 +92,396 @@ void TCPServer::start() {
   struct sockaddr_in addr;
   std::memset(&addr, 0, sizeof(addr));
   addr.sin_family = AF_INET;
-  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
   addr.sin_port = htons(port_);
+  if (inet_pton(AF_INET, options_.bind_address.c_str(), &addr.sin_addr) != 1) {
+    close(server_fd_);
+    throw std::runtime_error("Invalid bind address " + options_.bind_address);
+  }
 
   if (bind(server_fd_, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
     close(server_fd_);
     throw std::runtime_error("Failed to bind socket to port " + std::to_string(port_));
   }
+  socklen_t addr_len = sizeof(addr);
+  if (port_ == 0 && getsockname(server_fd_, (struct sockaddr*)&addr, &addr_len) == 0) {
+    port_ = ntohs(addr.sin_port);
+  }
 
   // Listen
-  if (listen(server_fd_, 10) < 0) {
+  if (listen(server_fd_, options_.backlog) < 0) {
     close(server_fd_);
     throw std::runtime_error("Failed to listen on socket");
   }
 
+  // Event loop: listening socket, wake-up eventfd for stop(), and clients
+  epoll_fd_ = epoll_create1(EPOLL_CLOEXEC);
+  wake_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (epoll_fd_ < 0 || wake_fd_ < 0) {
+    close(server_fd_);
+    throw std::runtime_error("Failed to create event loop");
+  }
+
+  struct epoll_event ev;
+  std::memset(&ev, 0, sizeof(ev));
+  ev.events = EPOLLIN;
+  ev.data.fd = server_fd_;
+  epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, server_fd_, &ev);
+  ev.data.fd = wake_fd_;
+  epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, wake_fd_, &ev);
+
+  size_t num_workers = options_.worker_threads > 0
+    ? options_.worker_threads
+    : std::max(1u, std::thread::hardware_concurrency());
+  workers_ = std::make_unique<ThreadPool>(num_workers);
+
   running_ = true;
-  std::cout << "KB Service listening on 127.0.0.1:" << port_ << std::endl;
+  std::cout << "KB Service listening on " << options_.bind_address << ":" << port_
+            << " (" << num_workers << " workers, backlog " << options_.backlog << ")" << std::endl;
 
-  // Accept connections in a separate thread
-  accept_thread_ = std::thread(&TCPServer::acceptLoop, this);
+  event_thread_ = std::thread(&TCPServer::eventLoop, this);
 }
 
 void TCPServer::stop() {
   if (running_.exchange(false)) {
-    // Close server socket to unblock accept()
-    if (server_fd_ >= 0) {
-      shutdown(server_fd_, SHUT_RDWR);
-      close(server_fd_);
-      server_fd_ = -1;
-    }
+    // Wake the event loop so it notices running_ and exits
+    uint64_t one = 1;
+    ssize_t ignored = write(wake_fd_, &one, sizeof(one));
+    (void)ignored;
 
-    // Join accept thread
-    if (accept_thread_.joinable()) {
-      accept_thread_.join();
+    if (event_thread_.joinable()) {
+      event_thread_.join();
     }
 
-    // Wait for all client connections to finish
-    while (active_connections_.load() > 0) {
-      std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    // Let workers finish the requests they already accepted
+    workers_->shutdown();
+
+    std::unordered_map<int, std::shared_ptr<Connection>> remaining;
+    {
+      std::lock_guard<std::mutex> lock(connections_mutex_);
+      remaining.swap(connections_);
+    }
+    for (auto& entry : remaining) {
+      std::lock_guard<std::mutex> lock(entry.second->mutex);
+      if (!entry.second->closed) {
+        entry.second->closed = true;
+        close(entry.second->fd);
+        active_connections_.fetch_sub(1);
+      }
     }
 
-    // Join all client threads
-    joinAllThreads();
+    close(server_fd_);
+    close(wake_fd_);
+    close(epoll_fd_);
+    server_fd_ = wake_fd_ = epoll_fd_ = -1;
   }
 }
 
-void TCPServer::acceptLoop() {
+void TCPServer::eventLoop() {
+  struct epoll_event events[kMaxEvents];
+
   while (running_.load()) {
-    // Check if still running before blocking on accept
-    if (!running_.load()) {
+    int n = epoll_wait(epoll_fd_, events, kMaxEvents, -1);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      std::cerr << "epoll_wait failed: " << std::strerror(errno) << std::endl;
       break;
     }
 
-    int client_fd = accept(server_fd_, nullptr, nullptr);
+    for (int i = 0; i < n; ++i) {
+      int fd = events[i].data.fd;
+
+      if (fd == wake_fd_) {
+        continue;
+      }
+      if (fd == server_fd_) {
+        acceptConnections();
+        continue;
+      }
+
+      std::shared_ptr<Connection> conn = findConnection(fd);
+      if (!conn) {
+        continue;
+      }
+
+      if (events[i].events & (EPOLLHUP | EPOLLERR)) {
+        // Both directions are gone; nothing more can be sent
+        std::lock_guard<std::mutex> lock(conn->mutex);
+        closeLocked(*conn);
+        continue;
+      }
+      if (events[i].events & (EPOLLIN | EPOLLRDHUP)) {
+        readFromConnection(conn);
+      }
+      if (events[i].events & EPOLLOUT) {
+        std::lock_guard<std::mutex> lock(conn->mutex);
+        flushLocked(*conn);
+        scheduleLocked(conn);
+      }
+    }
+  }
+}
+
+void TCPServer::acceptConnections() {
+  while (true) {
+    int client_fd = accept4(server_fd_, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
     if (client_fd < 0) {
-      if (running_.load()) {
-        std::cerr << "Accept failed" << std::endl;
+      if (errno == EINTR) continue;
+      if (errno != EAGAIN && errno != EWOULDBLOCK && running_.load()) {
+        std::cerr << "Accept failed: " << std::strerror(errno) << std::endl;
       }
-      break;
+      return;
     }
 
-    // Handle client in a separate thread
+    int opt = 1;
+    setsockopt(client_fd, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+
+    auto conn = std::make_shared<Connection>(client_fd);
+    {
+      std::lock_guard<std::mutex> lock(connections_mutex_);
+      connections_[client_fd] = conn;
+    }
     active_connections_.fetch_add(1);
-    auto thread_ptr = std::make_shared<std::thread>([this, client_fd]() {
-      this->handleClient(client_fd);
-      active_connections_.fetch_sub(1);
-    });
 
+    struct epoll_event ev;
+    std::memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN | EPOLLRDHUP;
+    ev.data.fd = client_fd;
+    epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, client_fd, &ev);
+  }
+}
+
+std::shared_ptr<TCPServer::Connection> TCPServer::findConnection(int fd) {
+  std::lock_guard<std::mutex> lock(connections_mutex_);
+  auto it = connections_.find(fd);
+  return it == connections_.end() ? nullptr : it->second;
+}
+
+void TCPServer::readFromConnection(const std::shared_ptr<Connection>& conn) {
+  std::lock_guard<std::mutex> lock(conn->mutex);
+  if (conn->closed || conn->peer_closed) {
+    return;
+  }
+
+  // Splitting after every chunk bounds the input buffer by the request size
+  // limit, and stops reading as soon as enough requests are waiting
+  char chunk[kReadChunkSize];
+  while (!readPausedLocked(*conn)) {
+    ssize_t bytes_read = recv(conn->fd, chunk, sizeof(chunk), 0);
+    if (bytes_read > 0) {
+      conn->input.append(chunk, bytes_read);
+      if (!splitRequestsLocked(*conn)) {
+        return;
+      }
+      continue;
+    }
+    if (bytes_read < 0 && errno == EINTR) {
+      continue;
+    }
+    if (bytes_read < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      break;
+    }
+    if (bytes_read < 0) {
+      closeLocked(*conn);
+      return;
+    }
+    conn->peer_closed = true;
+    break;
+  }
+
+  if (conn->peer_closed && !conn->negotiated && !conn->input.empty()) {
+    // Part of a preamble, then EOF
+    closeLocked(*conn);
+    return;
+  }
+  if (conn->peer_closed && conn->binary) {
+    // A partial frame can never complete
+    conn->input.clear();
+  } else if (conn->peer_closed) {
+    // Trailing request without a newline from a peer that closed its side
+    if (conn->input.find_first_not_of(" \t\r") != std::string::npos) {
+      conn->requests.push_back(std::move(conn->input));
+    }
+    conn->input.clear();
+  }
+
+  scheduleLocked(conn);
+  updateInterestLocked(*conn);
+}
+
+bool TCPServer::splitRequestsLocked(Connection& conn) {
+  if (!conn.negotiated) {
+    if (conn.input[0] == kBinaryPreamble[0]) {
+      if (conn.input.size() < sizeof(kBinaryPreamble)) {
+        return true;
+      }
+      if (conn.input.compare(0, sizeof(kBinaryPreamble), kBinaryPreamble, sizeof(kBinaryPreamble)) != 0) {
+        closeLocked(conn);
+        return false;
+      }
+      conn.input.erase(0, sizeof(kBinaryPreamble));
+      conn.binary = true;
+    }
+    conn.negotiated = true;
+  }
+
+  size_t start = 0;
+  if (conn.binary) {
+    while (conn.input.size() - start >= kFrameHeaderSize) {
+      size_t length = readFrameLength(conn.input, start);
+      if (length > options_.max_request_bytes) {
+        std::cerr << "Request exceeds " << options_.max_request_bytes << " bytes, closing connection" << std::endl;
+        closeLocked(conn);
+        return false;
+      }
+      if (conn.input.size() - start - kFrameHeaderSize < length) {
+        break;
+      }
+      conn.requests.emplace_back(conn.input, start + kFrameHeaderSize, length);
+      start += kFrameHeaderSize + length;
+    }
+    conn.input.erase(0, start);
+  } else {
+    size_t newline;
+    while ((newline = conn.input.find('\n', conn.scanned)) != std::string::npos) {
+      conn.requests.emplace_back(conn.input, start, newline - start);
+      start = newline + 1;
+      conn.scanned = start;
+    }
+    conn.input.erase(0, start);
+    conn.scanned = conn.input.size();
+  }
+
+  if (conn.input.size() > options_.max_request_bytes + kFrameHeaderSize) {
+    std::cerr << "Request exceeds " << options_.max_request_bytes << " bytes, closing connection" << std::endl;
+    closeLocked(conn);
+    return false;
+  }
+  return true;
+}
+
+bool TCPServer::readPausedLocked(const Connection& conn) const {
+  return conn.requests.size() >= options_.max_queued_requests || conn.output.size() >= options_.max_pending_output;
+}
+
+void TCPServer::scheduleLocked(const std::shared_ptr<Connection>& conn) {
+  if (!conn->closed && !conn->busy && !conn->requests.empty() &&
+      conn->output.size() < options_.max_pending_output) {
+    conn->busy = true;
+    workers_->submit([this, conn]() { processRequests(conn); });
+  }
+}
+
+void TCPServer::processRequests(const std::shared_ptr<Connection>& conn) {
+  while (true) {
+    std::string request;
+    bool binary;
     {
-      std::lock_guard<std::mutex> lock(threads_mutex_);
-      client_threads_.push_back(thread_ptr);
+      std::lock_guard<std::mutex> lock(conn->mutex);
+      // With too much output unsent, the next flush reschedules the rest
+      if (conn->closed || conn->requests.empty() || conn->output.size() >= options_.max_pending_output) {
+        conn->busy = false;
+        if (!conn->closed) {
+          updateInterestLocked(*conn);
+        }
+        return;
+      }
+      request = std::move(conn->requests.front());
+      conn->requests.pop_front();
+      binary = conn->binary;
     }
+
+    // Reused across requests on this worker so serialization rarely allocates
+    thread_local std::string response;
+    response.clear();
+    if (binary) {
+      response.resize(kFrameHeaderSize);
+      handler_->handleMessagePack(request, &response);
+      writeFrameLength(&response, 0, static_cast<uint32_t>(response.size() - kFrameHeaderSize));
+    } else {
+      handler_->handle(request, &response);
+      response.push_back('\n');
+    }
+
+    std::lock_guard<std::mutex> lock(conn->mutex);
+    if (conn->closed) {
+      conn->busy = false;
+      return;
+    }
+    conn->output.append(response);
+    if (response.capacity() > kMaxRetainedResponseSize) {
+      std::string().swap(response);
+    }
+    flushLocked(*conn);
   }
 }
 
-void TCPServer::joinAllThreads() {
-  std::lock_guard<std::mutex> lock(threads_mutex_);
-  for (auto& thread_ptr : client_threads_) {
-    if (thread_ptr && thread_ptr->joinable()) {
-      thread_ptr->join();
+void TCPServer::flushLocked(Connection& conn) {
+  if (conn.closed) {
+    return;
+  }
+
+  size_t written = 0;
+  while (written < conn.output.size()) {
+    ssize_t sent = send(conn.fd, conn.output.data() + written, conn.output.size() - written, MSG_NOSIGNAL);
+    if (sent > 0) {
+      written += sent;
+      continue;
+    }
+    if (sent < 0 && errno == EINTR) {
+      continue;
+    }
+    if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      break;
     }
+    closeLocked(conn);
+    return;
   }
-  client_threads_.clear();
+  conn.output.erase(0, written);
+
+  updateInterestLocked(conn);
 }
 
-void TCPServer::handleClient(int client_fd) {
-  // Read request
-  char buffer[65536];
-  ssize_t bytes_read = recv(client_fd, buffer, sizeof(buffer) - 1, 0);
+void TCPServer::updateInterestLocked(Connection& conn) {
+  if (conn.closed) {
+    return;
+  }
 
-  if (bytes_read <= 0) {
-    close(client_fd);
+  // A half-closed peer is done once everything it asked for has been sent
+  if (conn.peer_closed && !conn.busy && conn.requests.empty() && conn.output.empty()) {
+    closeLocked(conn);
     return;
   }
 
-  buffer[bytes_read] = '\0';
-  std::string request(buffer);
+  // Reading resumes once the peer has taken enough of its replies
+  bool want_write = !conn.output.empty();
+  struct epoll_event ev;
+  std::memset(&ev, 0, sizeof(ev));
+  bool want_read = !conn.peer_closed && !readPausedLocked(conn);
+  uint32_t read_events = want_read ? static_cast<uint32_t>(EPOLLIN | EPOLLRDHUP) : 0u;
+  ev.events = read_events | (want_write ? static_cast<uint32_t>(EPOLLOUT) : 0u);
+  ev.data.fd = conn.fd;
+  epoll_ctl(epoll_fd_, EPOLL_CTL_MOD, conn.fd, &ev);
+}
 
-  // Handle request
-  std::string response = handler_->handle(request);
+void TCPServer::closeLocked(Connection& conn) {
+  if (conn.closed) {
+    return;
+  }
+  conn.closed = true;
 
-  // Send response
-  send(client_fd, response.c_str(), response.length(), 0);
+  // Drop the map entry before closing so a reused fd number is never
+  // mistaken for this connection
+  {
+    std::lock_guard<std::mutex> lock(connections_mutex_);
+    auto it = connections_.find(conn.fd);
+    if (it != connections_.end() && it->second.get() == &conn) {
+      connections_.erase(it);
+    }
+  }
 
-  close(client_fd);
+  epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, conn.fd, nullptr);
+  close(conn.fd);
+  active_connections_.fetch_sub(1);
 }
 
 } // namespace kb
@@ -0,0 +1,415 @@
+#include "shard_router.h"
+#include "embedding_service.h"
+#include "metrics.h"
+#include "record_codec.h"
+#include <algorithm>
+#include <condition_variable>
+#include <exception>
+#include <mutex>
+#include <stdexcept>
+#include <unordered_map>
+
+using json = nlohmann::json;
+
+namespace kb {
+
+namespace {
+
+constexpr size_t kFanoutThreadsPerShard = 4;
+constexpr int kDefaultTopK = 5;
+// Tries for an add with a generated id that shards keep refusing
+constexpr int kMaxIdAttempts = 3;
+
+constexpr uint64_t kFnvOffsetBasis = 14695981039346656037ull;
+constexpr uint64_t kFnvPrime = 1099511628211ull;
+
+json failure(const std::string& error) {
+  json response;
+  response["success"] = false;
+  response["error"] = error;
+  return response;
+}
+
+// A shard's error response, naming the shard
+json shardFailure(const NodeClient& shard, const json& response) {
+  return failure("Shard " + shard.address() + ": " + response.value("error", std::string("request failed")));
+}
+
+bool succeeded(const json& response) {
+  return response.is_object() && response.value("success", false);
+}
+
+// A shard refused an add, possibly because the id is taken
+bool maybeDuplicate(const json& response) {
+  return response.is_object() && response.value("error", std::string()).find("may already exist") != std::string::npos;
+}
+
+// Top `top_k` of the shards' result lists, best first; equal scores are
+// ordered by id so the merge does not depend on which shard answered first
+json mergeResults(const std::vector<const json*>& lists, size_t top_k, bool lower_is_better) {
+  std::vector<const json*> results;
+  for (const json* list : lists) {
+    for (const json& result : *list) {
+      results.push_back(&result);
+    }
+  }
+
+  auto better = [lower_is_better](const json* a, const json* b) {
+    float score_a = a->value("score", 0.0f);
+    float score_b = b->value("score", 0.0f);
+    if (score_a != score_b) {
+      return lower_is_better ? score_a < score_b : score_a > score_b;
+    }
+    return a->value("id", std::string()) < b->value("id", std::string());
+  };
+  size_t keep = std::min(top_k, results.size());
+  std::partial_sort(results.begin(), results.begin() + keep, results.end(), better);
+
+  json merged = json::array();
+  for (size_t i = 0; i < keep; ++i) {
+    merged.push_back(*results[i]);
+  }
+  return merged;
+}
+
+size_t topK(const json& params) {
+  return static_cast<size_t>(std::max(params.value("top_k", kDefaultTopK), 0));
+}
+
+} // namespace
+
+ShardRouter::ShardRouter(const std::vector<std::string>& shards, std::shared_ptr<EmbeddingService> embedder,
+                         const ShardRouterOptions& options)
+  : embedder_(std::move(embedder)), options_(options), ids_(options.router_id),
+    pool_(options.fanout_threads > 0 ? options.fanout_threads : kFanoutThreadsPerShard * shards.size()) {
+  if (shards.empty()) {
+    throw std::runtime_error("A shard router needs at least one shard");
+  }
+  for (const std::string& address : shards) {
+    shards_.push_back(std::make_unique<NodeClient>(address, options_.client));
+  }
+}
+
+size_t ShardRouter::shardFor(const std::string& id) const {
+  uint64_t hash = kFnvOffsetBasis;
+  for (unsigned char c : id) {
+    hash = (hash ^ c) * kFnvPrime;
+  }
+  return static_cast<size_t>(hash % shards_.size());
+}
+
+std::vector<json> ShardRouter::fanOut(const std::string& endpoint, const std::vector<std::pair<size_t, json>>& calls) {
+  std::vector<json> responses(calls.size());
+  std::vector<std::exception_ptr> errors(calls.size());
+  std::mutex mutex;
+  std::condition_variable done;
+  size_t remaining = calls.size();
+
+  // The last call runs here rather than waiting for a pool thread
+  auto run = [&](size_t i) {
+    try {
+      responses[i] = shards_[calls[i].first]->call(endpoint, calls[i].second);
+    } catch (...) {
+      errors[i] = std::current_exception();
+    }
+    std::lock_guard<std::mutex> lock(mutex);
+    if (--remaining == 0) {
+      done.notify_one();
+    }
+  };
+  for (size_t i = 0; i + 1 < calls.size(); ++i) {
+    pool_.submit([&run, i] { run(i); });
+  }
+  if (!calls.empty()) {
+    run(calls.size() - 1);
+  }
+
+  std::unique_lock<std::mutex> lock(mutex);
+  done.wait(lock, [&remaining] { return remaining == 0; });
+  for (const std::exception_ptr& error : errors) {
+    if (error) {
+      std::rethrow_exception(error);
+    }
+  }
+  return responses;
+}
+
+std::vector<json> ShardRouter::scatter(const std::string& endpoint, const json& params) {
+  std::vector<std::pair<size_t, json>> calls;
+  calls.reserve(shards_.size());
+  for (size_t shard = 0; shard < shards_.size(); ++shard) {
+    calls.emplace_back(shard, params);
+  }
+  return fanOut(endpoint, calls);
+}
+
+json ShardRouter::route(const std::string& endpoint, const json& params) {
+  if (endpoint == "/add") {
+    return routeAdd(params);
+  }
+  if (endpoint == "/update" || endpoint == "/remove" || endpoint == "/get_embedding") {
+    // Without an id any shard gives the usual error
+    return shards_[shardFor(params.value("id", ""))]->call(endpoint, params);
+  }
+  if (endpoint == "/add_batch") {
+    return routeAddBatch(params);
+  }
+  if (endpoint == "/search") {
+    return routeSearch(params);
+  }
+  if (endpoint == "/search_batch") {
+    return routeSearchBatch(params);
+  }
+  if (endpoint == "/search_by_id") {
+    return routeSearchById(params);
+  }
+  if (endpoint == "/wait") {
+    return routeWait(params);
+  }
+  if (endpoint == "/stats") {
+    return routeStats(params);
+  }
+  if (endpoint == "/update_preference" || endpoint == "/get_preference" || endpoint == "/get_preferences" ||
+      endpoint == "/list_preferences") {
+    return shards_[0]->call(endpoint, params);
+  }
+  return failure(endpoint + " is not available through a shard router; send it to each shard");
+}
+
+json ShardRouter::routeAdd(const json& params) {
+  std::string id = params.value("id", "");
+  if (!id.empty()) {
+    return shards_[shardFor(id)]->call("/add", params);
+  }
+
+  json forwarded = params;
+  json response;
+  for (int attempt = 0; attempt < kMaxIdAttempts; ++attempt) {
+    id = ids_.next();
+    forwarded["id"] = id;
+    response = shards_[shardFor(id)]->call("/add", forwarded);
+    if (!maybeDuplicate(response)) {
+      break;
+    }
+  }
+  return response;
+}
+
+json ShardRouter::routeAddBatch(const json& params) {
+  json items = params.value("memories", json::array());
+  if (!items.is_array() || items.empty()) {
+    return failure("Memories array is required");
+  }
+  std::vector<bool> generated(items.size());
+  for (size_t i = 0; i < items.size(); ++i) {
+    if (!items[i].is_object() || items[i].value("content", "").empty()) {
+      return failure("Content is required for every memory");
+    }
+    generated[i] = items[i].value("id", "").empty();
+  }
+
+  json base = params;
+  base.erase("memories");
+  std::vector<std::string> ids(items.size());
+  std::string error;
+  std::vector<size_t> pending(items.size());
+  for (size_t i = 0; i < pending.size(); ++i) {
+    pending[i] = i;
+  }
+
+  // Memories with generated ids that a shard refused go round again with
+  // fresh ids, in case the refused id was taken
+  for (int attempt = 0; attempt < kMaxIdAttempts && !pending.empty() && error.empty(); ++attempt) {
+    // Split by owner, remembering where each memory came from
+    std::unordered_map<size_t, json> batches;
+    std::unordered_map<size_t, std::vector<size_t>> positions;
+    for (size_t i : pending) {
+      if (generated[i]) {
+        items[i]["id"] = ids_.next();
+      }
+      size_t shard = shardFor(items[i]["id"].get<std::string>());
+      batches[shard].push_back(items[i]);
+      positions[shard].push_back(i);
+    }
+
+    std::vector<std::pair<size_t, json>> calls;
+    for (auto& [shard, batch] : batches) {
+      json forwarded = base;
+      forwarded["memories"] = std::move(batch);
+      calls.emplace_back(shard, std::move(forwarded));
+    }
+    std::vector<json> responses = fanOut("/add_batch", calls);
+
+    pending.clear();
+    for (size_t c = 0; c < calls.size(); ++c) {
+      const std::vector<size_t>& placed = positions[calls[c].first];
+      const json& response = responses[c];
+      if (response.contains("ids") && response["ids"].size() == placed.size()) {
+        for (size_t j = 0; j < placed.size(); ++j) {
+          ids[placed[j]] = response["ids"][j].get<std::string>();
+          if (ids[placed[j]].empty() && generated[placed[j]]) {
+            pending.push_back(placed[j]);
+          }
+        }
+      } else if (error.empty()) {
+        error = shardFailure(*shards_[calls[c].first], response)["error"].get<std::string>();
+      }
+    }
+  }
+
+  size_t failed = std::count(ids.begin(), ids.end(), std::string());
+  json response;
+  response["success"] = failed == 0;
+  response["ids"] = ids;
+  if (!error.empty()) {
+    response["error"] = error;
+  } else if (failed > 0) {
+    response["error"] = std::to_string(failed) + " memories failed to add (may already exist)";
+  }
+  return response;
+}
+
+json ShardRouter::routeSearch(const json& params) {
+  std::string mode = params.value("mode", "");
+  json forwarded = params;
+
+  // Embed once here instead of once per shard; lexical search needs no vector
+  if (embedder_ && mode != "lexical" && !params.contains("embedding") && !params.value("query", "").empty()) {
+    static Histogram& embed_time =
+      Metrics::global().histogram("kb_request_stage_seconds", "Request handling time by stage", {{"stage", "embed"}});
+    std::vector<float> embedding;
+    {
+      ScopedTimer timer(embed_time);
+      embedding = embedder_->embed(params["query"].get<std::string>());
+    }
+    std::string bytes = encodeVector(embedding.data(), embedding.size(), VectorEncoding::Float32);
+    forwarded["embedding"] = json::binary(std::vector<uint8_t>(bytes.begin(), bytes.end()));
+  }
+
+  std::vector<json> responses = scatter("/search", forwarded);
+  std::vector<const json*> lists;
+  for (size_t shard = 0; shard < responses.size(); ++shard) {
+    if (!succeeded(responses[shard])) {
+      return shardFailure(*shards_[shard], responses[shard]);
+    }
+    lists.push_back(&responses[shard]["results"]);
+  }
+
+  // Distances rank lowest first; similarities, BM25 and fused scores highest
+  bool lower_is_better = options_.metric == "l2" && (mode.empty() || mode == "vector");
+  json response;
+  response["success"] = true;
+  response["results"] = mergeResults(lists, topK(params), lower_is_better);
+  return response;
+}
+
+json ShardRouter::routeSearchBatch(const json& params) {
+  std::vector<json> responses = scatter("/search_batch", params);
+  for (size_t shard = 0; shard < responses.size(); ++shard) {
+    if (!succeeded(responses[shard])) {
+      return shardFailure(*shards_[shard], responses[shard]);
+    }
+  }
+
+  json results = json::array();
+  size_t queries = responses[0]["results"].size();
+  for (size_t q = 0; q < queries; ++q) {
+    std::vector<const json*> lists;
+    for (const json& response : responses) {
+      lists.push_back(&response["results"].at(q));
+    }
+    results.push_back(mergeResults(lists, topK(params), options_.metric == "l2"));
+  }
+
+  json response;
+  response["success"] = true;
+  response["results"] = std::move(results);
+  return response;
+}
+
+json ShardRouter::routeSearchById(const json& params) {
+  std::string id = params.value("id", "");
+  if (id.empty()) {
+    return failure("ID is required");
+  }
+
+  json lookup;
+  lookup["namespace"] = params.value("namespace", "");
+  lookup["id"] = id;
+  NodeClient& owner = *shards_[shardFor(id)];
+  json stored = owner.call("/get_embedding", lookup);
+  if (!succeeded(stored)) {
+    return stored;
+  }
+
+  // One more than asked for, as the memory itself is among its neighbours
+  size_t top_k = topK(params);
+  json forwarded = params;
+  forwarded.erase("id");
+  forwarded.erase("mode");
+  forwarded["embedding"] = std::move(stored["embedding"]);
+  forwarded["top_k"] = top_k + 1;
+  json response = routeSearch(forwarded);
+  if (!succeeded(response)) {
+    return response;
+  }
+
+  json& results = response["results"];
+  results.erase(std::remove_if(results.begin(), results.end(),
+                               [&id](const json& result) { return result.value("id", "") == id; }),
+                results.end());
+  if (results.size() > top_k) {
+    results.erase(results.begin() + top_k, results.end());
+  }
+  return response;
+}
+
+json ShardRouter::routeWait(const json& params) {
+  // Tickets are per shard, so wait for everything each shard has queued
+  json forwarded = params;
+  forwarded.erase("ticket");
+  forwarded.erase("since");
+  std::vector<json> responses = scatter("/wait", forwarded);
+
+  json response;
+  response["success"] = true;
+  uint64_t pending = 0;
+  for (size_t shard = 0; shard < responses.size(); ++shard) {
+    pending += responses[shard].value("pending", uint64_t(0));
+    if (!succeeded(responses[shard]) && response["success"].get<bool>()) {
+      response = shardFailure(*shards_[shard], responses[shard]);
+    }
+  }
+  response["pending"] = pending;
+  return response;
+}
+
+json ShardRouter::routeStats(const json& params) {
+  std::vector<json> responses = scatter("/stats", params);
+
+  uint64_t memories = 0;
+  uint64_t index_memory_bytes = 0;
+  json shards = json::array();
+  for (size_t shard = 0; shard < responses.size(); ++shard) {
+    if (!succeeded(responses[shard])) {
+      return shardFailure(*shards_[shard], responses[shard]);
+    }
+    json entry;
+    entry["address"] = shards_[shard]->address();
+    entry["memories"] = responses[shard].value("memories", uint64_t(0));
+    entry["index_memory_bytes"] = responses[shard].value("index_memory_bytes", uint64_t(0));
+    memories += entry["memories"].get<uint64_t>();
+    index_memory_bytes += entry["index_memory_bytes"].get<uint64_t>();
+    shards.push_back(std::move(entry));
+  }
+
+  json response;
+  response["success"] = true;
+  response["memories"] = memories;
+  response["index_memory_bytes"] = index_memory_bytes;
+  response["shards"] = std::move(shards);
+  response["metrics"] = Metrics::global().toJson();
+  return response;
+}
+
+} // namespace kb
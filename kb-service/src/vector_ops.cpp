@@ -0,0 +1,199 @@
+#include "vector_ops.h"
+#include <cmath>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define KB_VECTOR_OPS_AVX2 1
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#define KB_VECTOR_OPS_NEON 1
+#endif
+
+namespace kb {
+
+namespace {
+
+constexpr size_t kLanes = 8;
+
+// The fold every path uses for its eight partial sums
+inline float foldLanes(const float* acc) {
+  float s0 = acc[0] + acc[4];
+  float s1 = acc[1] + acc[5];
+  float s2 = acc[2] + acc[6];
+  float s3 = acc[3] + acc[7];
+  return (s0 + s2) + (s1 + s3);
+}
+
+[[maybe_unused]] float dotScalar(const float* a, const float* b, size_t n) {
+  float acc[kLanes] = {};
+  size_t i = 0;
+  for (; i + kLanes <= n; i += kLanes) {
+    for (size_t lane = 0; lane < kLanes; ++lane) {
+      acc[lane] += a[i + lane] * b[i + lane];
+    }
+  }
+  float sum = foldLanes(acc);
+  for (; i < n; ++i) {
+    sum += a[i] * b[i];
+  }
+  return sum;
+}
+
+[[maybe_unused]] void divideScalar(float* v, size_t n, float divisor) {
+  for (size_t i = 0; i < n; ++i) {
+    v[i] /= divisor;
+  }
+}
+
+[[maybe_unused]] void bytesToUnitRangeScalar(const unsigned char* bytes, size_t n, float* out) {
+  for (size_t i = 0; i < n; ++i) {
+    out[i] = (static_cast<float>(bytes[i]) / 255.0f) * 2.0f - 1.0f;
+  }
+}
+
+#if defined(KB_VECTOR_OPS_AVX2)
+
+// Plain AVX2 without FMA, so products round exactly as in the scalar code
+__attribute__((target("avx2"))) float dotAvx2(const float* a, const float* b, size_t n) {
+  __m256 acc = _mm256_setzero_ps();
+  size_t i = 0;
+  for (; i + kLanes <= n; i += kLanes) {
+    acc = _mm256_add_ps(acc, _mm256_mul_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i)));
+  }
+  alignas(32) float lanes[kLanes];
+  _mm256_store_ps(lanes, acc);
+  float sum = foldLanes(lanes);
+  for (; i < n; ++i) {
+    sum += a[i] * b[i];
+  }
+  return sum;
+}
+
+__attribute__((target("avx2"))) void divideAvx2(float* v, size_t n, float divisor) {
+  __m256 d = _mm256_set1_ps(divisor);
+  size_t i = 0;
+  for (; i + kLanes <= n; i += kLanes) {
+    _mm256_storeu_ps(v + i, _mm256_div_ps(_mm256_loadu_ps(v + i), d));
+  }
+  for (; i < n; ++i) {
+    v[i] /= divisor;
+  }
+}
+
+__attribute__((target("avx2"))) void bytesToUnitRangeAvx2(const unsigned char* bytes, size_t n, float* out) {
+  const __m256 scale = _mm256_set1_ps(255.0f);
+  const __m256 two = _mm256_set1_ps(2.0f);
+  const __m256 one = _mm256_set1_ps(1.0f);
+  size_t i = 0;
+  for (; i + kLanes <= n; i += kLanes) {
+    __m128i packed = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(bytes + i));
+    __m256 values = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(packed));
+    _mm256_storeu_ps(out + i, _mm256_sub_ps(_mm256_mul_ps(_mm256_div_ps(values, scale), two), one));
+  }
+  bytesToUnitRangeScalar(bytes + i, n - i, out + i);
+}
+
+bool hasAvx2() {
+  static const bool supported = (__builtin_cpu_init(), __builtin_cpu_supports("avx2"));
+  return supported;
+}
+
+#elif defined(KB_VECTOR_OPS_NEON)
+
+float dotNeon(const float* a, const float* b, size_t n) {
+  float32x4_t low = vdupq_n_f32(0.0f);
+  float32x4_t high = vdupq_n_f32(0.0f);
+  size_t i = 0;
+  for (; i + kLanes <= n; i += kLanes) {
+    low = vaddq_f32(low, vmulq_f32(vld1q_f32(a + i), vld1q_f32(b + i)));
+    high = vaddq_f32(high, vmulq_f32(vld1q_f32(a + i + 4), vld1q_f32(b + i + 4)));
+  }
+  float lanes[kLanes];
+  vst1q_f32(lanes, low);
+  vst1q_f32(lanes + 4, high);
+  float sum = foldLanes(lanes);
+  for (; i < n; ++i) {
+    sum += a[i] * b[i];
+  }
+  return sum;
+}
+
+void divideNeon(float* v, size_t n, float divisor) {
+  float32x4_t d = vdupq_n_f32(divisor);
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    vst1q_f32(v + i, vdivq_f32(vld1q_f32(v + i), d));
+  }
+  divideScalar(v + i, n - i, divisor);
+}
+
+void bytesToUnitRangeNeon(const unsigned char* bytes, size_t n, float* out) {
+  const float32x4_t scale = vdupq_n_f32(255.0f);
+  const float32x4_t two = vdupq_n_f32(2.0f);
+  const float32x4_t one = vdupq_n_f32(1.0f);
+  size_t i = 0;
+  for (; i + kLanes <= n; i += kLanes) {
+    uint16x8_t wide = vmovl_u8(vld1_u8(bytes + i));
+    float32x4_t low = vcvtq_f32_u32(vmovl_u16(vget_low_u16(wide)));
+    float32x4_t high = vcvtq_f32_u32(vmovl_u16(vget_high_u16(wide)));
+    vst1q_f32(out + i, vsubq_f32(vmulq_f32(vdivq_f32(low, scale), two), one));
+    vst1q_f32(out + i + 4, vsubq_f32(vmulq_f32(vdivq_f32(high, scale), two), one));
+  }
+  bytesToUnitRangeScalar(bytes + i, n - i, out + i);
+}
+
+#endif
+
+void divide(float* v, size_t n, float divisor) {
+#if defined(KB_VECTOR_OPS_AVX2)
+  if (hasAvx2()) {
+    divideAvx2(v, n, divisor);
+    return;
+  }
+  divideScalar(v, n, divisor);
+#elif defined(KB_VECTOR_OPS_NEON)
+  divideNeon(v, n, divisor);
+#else
+  divideScalar(v, n, divisor);
+#endif
+}
+
+} // namespace
+
+float dot(const float* a, const float* b, size_t n) {
+#if defined(KB_VECTOR_OPS_AVX2)
+  return hasAvx2() ? dotAvx2(a, b, n) : dotScalar(a, b, n);
+#elif defined(KB_VECTOR_OPS_NEON)
+  return dotNeon(a, b, n);
+#else
+  return dotScalar(a, b, n);
+#endif
+}
+
+float squaredNorm(const float* v, size_t n) {
+  return dot(v, v, n);
+}
+
+float normalize(float* v, size_t n) {
+  float norm = std::sqrt(squaredNorm(v, n));
+  if (norm > 0.0f) {
+    divide(v, n, norm);
+  }
+  return norm;
+}
+
+void bytesToUnitRange(const unsigned char* bytes, size_t n, float* out) {
+#if defined(KB_VECTOR_OPS_AVX2)
+  if (hasAvx2()) {
+    bytesToUnitRangeAvx2(bytes, n, out);
+    return;
+  }
+  bytesToUnitRangeScalar(bytes, n, out);
+#elif defined(KB_VECTOR_OPS_NEON)
+  bytesToUnitRangeNeon(bytes, n, out);
+#else
+  bytesToUnitRangeScalar(bytes, n, out);
+#endif
+}
+
+} // namespace kb
@@ -1,9 +1,45 @@
 #include <gtest/gtest.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
 #include <filesystem>
+#include <fstream>
+#include <mutex>
 #include <thread>
+#include <atomic>
+#include <cerrno>
 #include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <random>
+#include <set>
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <openssl/sha.h>
+#include <rocksdb/db.h>
+#include <rocksdb/env.h>
+#include <nlohmann/json.hpp>
 #include "knowledge_base.h"
 #include "embedding_service.h"
+#include "embedding_batcher.h"
+#include "embedding_cache.h"
+#include "http_embedding_service.h"
+#include "ingest_pipeline.h"
+#include "namespace_registry.h"
+#include "json_writer.h"
+#include "metrics.h"
+#include "msgpack_writer.h"
+#include "record_codec.h"
+#include "replicator.h"
+#include "request_handler.h"
+#include "server.h"
+#include "shard_router.h"
+#include "vector_ops.h"
 
 namespace fs = std::filesystem;
 
@@ -463,6 +499,3399 @@ TEST_F(KnowledgeBaseTest, SearchScoreOrdering) {
   EXPECT_EQ(results[0].content, exact_match);
 }
 
+// Test 26: Removed Memories Never Appear in Search
+TEST_F(KnowledgeBaseTest, RemovedMemoriesExcludedFromSearch) {
+  std::vector<std::string> ids;
+  for (int i = 0; i < 5; ++i) {
+    kb::Memory mem;
+    mem.content = "Removable memory " + std::to_string(i);
+    mem.category = "test";
+    mem.timestamp = 1234567890000 + i;
+    mem.embedding = embedding_service_->embed(mem.content);
+    ids.push_back(kb_->addAndReturnId(mem));
+  }
+
+  EXPECT_TRUE(kb_->remove(ids[1]));
+  EXPECT_TRUE(kb_->remove(ids[3]));
+  EXPECT_EQ(kb_->size(), 3);
+
+  // Exact-match query for a removed memory must not return it
+  auto results = kb_->search(embedding_service_->embed("Removable memory 1"), 5);
+  EXPECT_EQ(results.size(), 3);
+  for (const auto& result : results) {
+    EXPECT_NE(result.id, ids[1]);
+    EXPECT_NE(result.id, ids[3]);
+  }
+}
+
+// Test 27: Update Replaces Vector Without Duplicating Entry
+TEST_F(KnowledgeBaseTest, UpdateReplacesVectorInPlace) {
+  kb::Memory mem;
+  mem.id = "replace_test";
+  mem.content = "Before update";
+  mem.category = "test";
+  mem.timestamp = 1234567890000;
+  mem.embedding = embedding_service_->embed(mem.content);
+  kb_->addAndReturnId(mem);
+
+  for (int i = 0; i < 3; ++i) {
+    std::string content = "After update " + std::to_string(i);
+    EXPECT_TRUE(kb_->update("replace_test", content, embedding_service_->embed(content)));
+  }
+
+  EXPECT_EQ(kb_->size(), 1);
+  auto results = kb_->search(embedding_service_->embed("Before update"), 5);
+  ASSERT_EQ(results.size(), 1);
+  EXPECT_EQ(results[0].content, "After update 2");
+}
+
+// Test 28: Search Stays Correct Across Compaction
+TEST_F(KnowledgeBaseTest, SearchCorrectAfterManyRemovals) {
+  const int total = 1500;
+  std::vector<std::string> ids;
+  for (int i = 0; i < total; ++i) {
+    kb::Memory mem;
+    mem.id = "compact_" + std::to_string(i);
+    mem.content = "Compaction memory " + std::to_string(i);
+    mem.category = "test";
+    mem.timestamp = 1234567890000 + i;
+    mem.embedding = embedding_service_->embed(mem.content);
+    ids.push_back(kb_->addAndReturnId(mem));
+  }
+
+  // Remove enough entries to cross the compaction threshold
+  for (int i = 0; i < 1200; ++i) {
+    EXPECT_TRUE(kb_->remove(ids[i]));
+  }
+  EXPECT_EQ(kb_->size(), total - 1200);
+
+  // Give the background compactor a chance to run
+  std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+  auto results = kb_->search(embedding_service_->embed("Compaction memory 1300"), 1);
+  ASSERT_EQ(results.size(), 1);
+  EXPECT_EQ(results[0].id, "compact_1300");
+
+  results = kb_->search(embedding_service_->embed("Compaction memory 5"), 10);
+  for (const auto& result : results) {
+    EXPECT_GE(std::stoi(result.id.substr(8)), 1200);
+  }
+}
+
+// Test 29: Legacy JSON Records Are Migrated On Open
+TEST_F(KnowledgeBaseTest, LegacyJsonRecordsMigrated) {
+  kb_.reset();
+  fs::remove_all(test_db_path_);
+
+  // Write a store in the old one-JSON-document-per-memory layout
+  {
+    rocksdb::Options options;
+    options.create_if_missing = true;
+    rocksdb::DB* raw_db;
+    ASSERT_TRUE(rocksdb::DB::Open(options, test_db_path_, &raw_db).ok());
+    std::unique_ptr<rocksdb::DB> db(raw_db);
+
+    nlohmann::json doc;
+    doc["id"] = "legacy_1";
+    doc["content"] = "Legacy memory";
+    doc["category"] = "old";
+    doc["timestamp"] = 1234567890000;
+    doc["embedding"] = embedding_service_->embed("Legacy memory");
+    ASSERT_TRUE(db->Put(rocksdb::WriteOptions(), "legacy_1", doc.dump()).ok());
+    ASSERT_TRUE(db->Put(rocksdb::WriteOptions(), "pref:theme", "dark").ok());
+  }
+
+  kb_ = std::make_unique<kb::KnowledgeBase>(test_db_path_, 128);
+  EXPECT_EQ(kb_->size(), 1);
+  EXPECT_EQ(kb_->getUserPreference("theme"), "dark");
+
+  auto results = kb_->search(embedding_service_->embed("Legacy memory"), 1);
+  ASSERT_EQ(results.size(), 1);
+  EXPECT_EQ(results[0].id, "legacy_1");
+  EXPECT_EQ(results[0].content, "Legacy memory");
+  EXPECT_EQ(results[0].category, "old");
+  EXPECT_EQ(results[0].timestamp, 1234567890000);
+
+  // Migrated records keep working across another reopen
+  kb_.reset();
+  kb_ = std::make_unique<kb::KnowledgeBase>(test_db_path_, 128);
+  EXPECT_EQ(kb_->size(), 1);
+}
+
+// Test 30: Record and Vector Encoding Round Trip
+TEST_F(KnowledgeBaseTest, RecordCodecRoundTrip) {
+  std::string encoded = kb::encodeRecord("some content", "a category", 1234567890123);
+  kb::MemoryRecord record;
+  ASSERT_TRUE(kb::decodeRecord(encoded, &record));
+  EXPECT_EQ(record.content, "some content");
+  EXPECT_EQ(record.category, "a category");
+  EXPECT_EQ(record.timestamp, 1234567890123);
+
+  // Truncated records are rejected
+  EXPECT_FALSE(kb::decodeRecord(rocksdb::Slice(encoded.data(), encoded.size() - 1), &record));
+
+  auto embedding = embedding_service_->embed("vector round trip");
+  std::string blob = kb::encodeVector(embedding.data(), embedding.size());
+  EXPECT_EQ(blob.size(), embedding.size() * sizeof(float));
+
+  std::vector<float> decoded(embedding.size());
+  ASSERT_TRUE(kb::decodeVector(blob, decoded.size(), decoded.data()));
+  EXPECT_EQ(decoded, embedding);
+
+  // Blobs of the wrong dimension are rejected
+  EXPECT_FALSE(kb::decodeVector(blob, decoded.size() + 1, decoded.data()));
+}
+
+// Test 31: Index Snapshot Written On Shutdown
+TEST_F(KnowledgeBaseTest, SnapshotWrittenOnShutdown) {
+  for (int i = 0; i < 3; ++i) {
+    kb::Memory mem;
+    mem.id = "snap_" + std::to_string(i);
+    mem.content = "Snapshot memory " + std::to_string(i);
+    mem.category = "test";
+    mem.timestamp = 1234567890000 + i;
+    mem.embedding = embedding_service_->embed(mem.content);
+    kb_->add(mem);
+  }
+  kb_->remove("snap_1");
+
+  kb_.reset();
+  EXPECT_TRUE(fs::exists(test_db_path_ + "/faiss.snapshot"));
+
+  kb_ = std::make_unique<kb::KnowledgeBase>(test_db_path_, 128);
+  EXPECT_EQ(kb_->size(), 2);
+
+  auto results = kb_->search(embedding_service_->embed("Snapshot memory 2"), 3);
+  ASSERT_EQ(results.size(), 2);
+  EXPECT_EQ(results[0].id, "snap_2");
+  EXPECT_EQ(results[1].id, "snap_0");
+}
+
+// Test 32: Writes After A Stale Snapshot Are Replayed From The WAL
+TEST_F(KnowledgeBaseTest, StaleSnapshotReplaysWal) {
+  kb::Memory first;
+  first.id = "before_snapshot";
+  first.content = "Written before the snapshot";
+  first.category = "test";
+  first.timestamp = 1234567890000;
+  first.embedding = embedding_service_->embed(first.content);
+  kb_->add(first);
+
+  kb_.reset();
+  std::string snapshot = test_db_path_ + "/faiss.snapshot";
+  fs::copy_file(snapshot, snapshot + ".stale");
+
+  // More writes, then pretend the process died before snapshotting them
+  kb_ = std::make_unique<kb::KnowledgeBase>(test_db_path_, 128);
+  kb::Memory second;
+  second.id = "after_snapshot";
+  second.content = "Written after the snapshot";
+  second.category = "test";
+  second.timestamp = 1234567890001;
+  second.embedding = embedding_service_->embed(second.content);
+  kb_->add(second);
+  kb_->update("before_snapshot", "Rewritten after the snapshot",
+              embedding_service_->embed("Rewritten after the snapshot"));
+  kb_.reset();
+
+  fs::rename(snapshot + ".stale", snapshot);
+  kb_ = std::make_unique<kb::KnowledgeBase>(test_db_path_, 128);
+  EXPECT_EQ(kb_->size(), 2);
+
+  auto results = kb_->search(embedding_service_->embed("Written after the snapshot"), 1);
+  ASSERT_EQ(results.size(), 1);
+  EXPECT_EQ(results[0].id, "after_snapshot");
+
+  results = kb_->search(embedding_service_->embed("Rewritten after the snapshot"), 1);
+  ASSERT_EQ(results.size(), 1);
+  EXPECT_EQ(results[0].id, "before_snapshot");
+  EXPECT_EQ(results[0].content, "Rewritten after the snapshot");
+}
+
+// Test 33: Corrupt Snapshot Falls Back To A Full Rebuild
+TEST_F(KnowledgeBaseTest, CorruptSnapshotFallsBackToRebuild) {
+  kb::Memory mem;
+  mem.id = "rebuild_test";
+  mem.content = "Survives a corrupt snapshot";
+  mem.category = "test";
+  mem.timestamp = 1234567890000;
+  mem.embedding = embedding_service_->embed(mem.content);
+  kb_->add(mem);
+  kb_.reset();
+
+  {
+    std::ofstream out(test_db_path_ + "/faiss.snapshot", std::ios::binary | std::ios::trunc);
+    out << "not a snapshot";
+  }
+
+  kb_ = std::make_unique<kb::KnowledgeBase>(test_db_path_, 128);
+  EXPECT_EQ(kb_->size(), 1);
+  auto results = kb_->search(mem.embedding, 1);
+  ASSERT_EQ(results.size(), 1);
+  EXPECT_EQ(results[0].id, "rebuild_test");
+}
+
+// Test 34: Thread Safety - Searches Run Alongside Writers
+TEST_F(KnowledgeBaseTest, ThreadSafetyConcurrentSearchAndWrite) {
+  for (int i = 0; i < 50; ++i) {
+    kb::Memory mem;
+    mem.id = "stable_" + std::to_string(i);
+    mem.content = "Stable memory " + std::to_string(i);
+    mem.category = "test";
+    mem.timestamp = 1234567890000 + i;
+    mem.embedding = embedding_service_->embed(mem.content);
+    kb_->add(mem);
+  }
+
+  std::atomic<bool> done(false);
+  std::atomic<int> missed(0);
+  std::vector<std::thread> readers;
+
+  for (int t = 0; t < 4; ++t) {
+    readers.emplace_back([this, &done, &missed, t]() {
+      auto query = embedding_service_->embed("Stable memory " + std::to_string(t));
+      while (!done.load()) {
+        auto results = kb_->search(query, 1);
+        if (results.empty() || results[0].id != "stable_" + std::to_string(t)) {
+          missed.fetch_add(1);
+        }
+      }
+    });
+  }
+
+  // Churn unrelated entries while the readers search
+  for (int i = 0; i < 200; ++i) {
+    kb::Memory mem;
+    mem.id = "churn_" + std::to_string(i);
+    mem.content = "Churn memory " + std::to_string(i);
+    mem.category = "test";
+    mem.timestamp = 1234567890000;
+    mem.embedding = embedding_service_->embed(mem.content);
+    kb_->add(mem);
+    if (i % 2 == 0) {
+      kb_->remove(mem.id);
+    }
+  }
+
+  done = true;
+  for (auto& reader : readers) {
+    reader.join();
+  }
+
+  EXPECT_EQ(missed.load(), 0);
+  EXPECT_EQ(kb_->size(), 150);
+}
+
+// Test 35: Batch Add
+TEST_F(KnowledgeBaseTest, AddBatchStoresAllMemories) {
+  std::vector<kb::Memory> memories;
+  for (int i = 0; i < 20; ++i) {
+    kb::Memory mem;
+    mem.content = "Batched memory " + std::to_string(i);
+    mem.category = "batch";
+    mem.timestamp = 1234567890000 + i;
+    mem.embedding = embedding_service_->embed(mem.content);
+    memories.push_back(mem);
+  }
+  memories[5].id = "batch_custom";
+
+  auto ids = kb_->addBatch(memories);
+  ASSERT_EQ(ids.size(), memories.size());
+  EXPECT_EQ(ids[5], "batch_custom");
+  for (const auto& id : ids) {
+    EXPECT_FALSE(id.empty());
+    EXPECT_TRUE(kb_->exists(id));
+  }
+  EXPECT_EQ(kb_->size(), 20);
+
+  auto results = kb_->search(embedding_service_->embed("Batched memory 7"), 1);
+  ASSERT_EQ(results.size(), 1);
+  EXPECT_EQ(results[0].id, ids[7]);
+}
+
+// Test 36: Batch Add Rejects Duplicates Per Entry
+TEST_F(KnowledgeBaseTest, AddBatchSkipsDuplicateIds) {
+  kb::Memory existing;
+  existing.id = "already_there";
+  existing.content = "Existing memory";
+  existing.category = "test";
+  existing.timestamp = 1234567890000;
+  existing.embedding = embedding_service_->embed(existing.content);
+  kb_->add(existing);
+
+  std::vector<kb::Memory> memories(3, existing);
+  memories[1].id = "fresh";
+  memories[2].id = "fresh";
+
+  auto ids = kb_->addBatch(memories);
+  ASSERT_EQ(ids.size(), 3);
+  EXPECT_EQ(ids[0], "");
+  EXPECT_EQ(ids[1], "fresh");
+  EXPECT_EQ(ids[2], "");
+  EXPECT_EQ(kb_->size(), 2);
+}
+
+// Test 37: Batch Search Matches Individual Searches
+TEST_F(KnowledgeBaseTest, SearchBatchMatchesSingleSearch) {
+  for (int i = 0; i < 10; ++i) {
+    kb::Memory mem;
+    mem.content = "Searchable memory " + std::to_string(i);
+    mem.category = "test";
+    mem.timestamp = 1234567890000 + i;
+    mem.embedding = embedding_service_->embed(mem.content);
+    kb_->add(mem);
+  }
+
+  std::vector<std::vector<float>> queries;
+  for (int i = 0; i < 4; ++i) {
+    queries.push_back(embedding_service_->embed("Searchable memory " + std::to_string(i * 2)));
+  }
+
+  auto batched = kb_->searchBatch(queries, 3);
+  ASSERT_EQ(batched.size(), queries.size());
+  for (size_t q = 0; q < queries.size(); ++q) {
+    auto single = kb_->search(queries[q], 3);
+    ASSERT_EQ(batched[q].size(), single.size());
+    for (size_t i = 0; i < single.size(); ++i) {
+      EXPECT_EQ(batched[q][i].id, single[i].id);
+      EXPECT_FLOAT_EQ(batched[q][i].score, single[i].score);
+    }
+    EXPECT_EQ(batched[q][0].content, "Searchable memory " + std::to_string(q * 2));
+  }
+}
+
+// Test 38: HNSW Index Serves Searches, Removals and Restarts
+TEST_F(KnowledgeBaseTest, HnswIndexSearchRemoveAndReload) {
+  kb_.reset();
+  fs::remove_all(test_db_path_);
+  kb::IndexOptions options;
+  options.type = "hnsw";
+  kb_ = std::make_unique<kb::KnowledgeBase>(test_db_path_, 128, options);
+
+  std::vector<kb::Memory> memories;
+  for (int i = 0; i < 200; ++i) {
+    kb::Memory mem;
+    mem.id = "hnsw_" + std::to_string(i);
+    mem.content = "HNSW memory " + std::to_string(i);
+    mem.category = "test";
+    mem.timestamp = 1234567890000 + i;
+    mem.embedding = embedding_service_->embed(mem.content);
+    memories.push_back(mem);
+  }
+  kb_->addBatch(memories);
+  kb_->remove("hnsw_7");
+
+  kb::SearchOptions search_options;
+  search_options.ef_search = 128;
+  auto results = kb_->search(memories[42].embedding, 1, search_options);
+  ASSERT_EQ(results.size(), 1);
+  EXPECT_EQ(results[0].id, "hnsw_42");
+
+  results = kb_->search(memories[7].embedding, 5);
+  for (const auto& result : results) {
+    EXPECT_NE(result.id, "hnsw_7");
+  }
+
+  kb_.reset();
+  kb_ = std::make_unique<kb::KnowledgeBase>(test_db_path_, 128, options);
+  EXPECT_EQ(kb_->size(), 199);
+  results = kb_->search(memories[100].embedding, 1);
+  ASSERT_EQ(results.size(), 1);
+  EXPECT_EQ(results[0].id, "hnsw_100");
+}
+
+// Test 39: IVF Index Trains On The Stored Corpus
+TEST_F(KnowledgeBaseTest, IvfIndexTrainsOnExistingCorpus) {
+  std::vector<kb::Memory> memories;
+  for (int i = 0; i < 2000; ++i) {
+    kb::Memory mem;
+    mem.id = "ivf_" + std::to_string(i);
+    mem.content = "IVF memory " + std::to_string(i);
+    mem.category = "test";
+    mem.timestamp = 1234567890000 + i;
+    mem.embedding = embedding_service_->embed(mem.content);
+    memories.push_back(mem);
+  }
+  kb_->addBatch(memories);
+  EXPECT_GE(kb_->measureRecall(20, 10), 0.99);
+  kb_.reset();
+
+  kb::IndexOptions options;
+  options.type = "ivf";
+  kb_ = std::make_unique<kb::KnowledgeBase>(test_db_path_, 128, options);
+  EXPECT_EQ(kb_->size(), 2000);
+
+  // Probing every list is exhaustive, so recall matches the flat baseline
+  kb::SearchOptions exhaustive;
+  exhaustive.nprobe = 4096;
+  EXPECT_GE(kb_->measureRecall(50, 10, exhaustive), 0.99);
+
+  auto results = kb_->search(memories[1234].embedding, 1, exhaustive);
+  ASSERT_EQ(results.size(), 1);
+  EXPECT_EQ(results[0].id, "ivf_1234");
+}
+
+// Test 40: Unknown Index Type Is Rejected
+TEST_F(KnowledgeBaseTest, InvalidIndexTypeThrows) {
+  kb_.reset();
+  fs::remove_all(test_db_path_);
+  kb::IndexOptions options;
+  options.type = "not-an-index";
+  EXPECT_THROW(kb::KnowledgeBase(test_db_path_, 128, options), std::runtime_error);
+}
+
+// Test 41: Snapshot Of Another Index Type Is Rebuilt
+TEST_F(KnowledgeBaseTest, SnapshotOfOtherIndexTypeRebuilt) {
+  kb::Memory mem;
+  mem.id = "switch_index";
+  mem.content = "Survives an index type change";
+  mem.category = "test";
+  mem.timestamp = 1234567890000;
+  mem.embedding = embedding_service_->embed(mem.content);
+  kb_->add(mem);
+  kb_.reset();
+
+  kb::IndexOptions options;
+  options.type = "hnsw";
+  kb_ = std::make_unique<kb::KnowledgeBase>(test_db_path_, 128, options);
+  EXPECT_EQ(kb_->size(), 1);
+  auto results = kb_->search(mem.embedding, 1);
+  ASSERT_EQ(results.size(), 1);
+  EXPECT_EQ(results[0].id, "switch_index");
+}
+
+// Test 42: Inner Product Metric Scores Similarity, Higher Is Closer
+TEST_F(KnowledgeBaseTest, InnerProductScoresAreSimilarities) {
+  kb_.reset();
+  fs::remove_all(test_db_path_);
+  kb::IndexOptions options;
+  options.metric = "ip";
+  kb_ = std::make_unique<kb::KnowledgeBase>(test_db_path_, 128, options);
+
+  for (int i = 0; i < 10; ++i) {
+    kb::Memory mem;
+    mem.id = "ip_" + std::to_string(i);
+    mem.content = "Inner product memory " + std::to_string(i);
+    mem.category = "test";
+    mem.timestamp = 1234567890000 + i;
+    mem.embedding = embedding_service_->embed(mem.content);
+    kb_->add(mem);
+  }
+
+  auto results = kb_->search(embedding_service_->embed("Inner product memory 3"), 5);
+  ASSERT_EQ(results.size(), 5);
+  EXPECT_EQ(results[0].id, "ip_3");
+  EXPECT_NEAR(results[0].score, 1.0f, 1e-4f);
+  for (size_t i = 1; i < results.size(); ++i) {
+    EXPECT_GE(results[i - 1].score, results[i].score);
+  }
+}
+
+// Test 43: Cosine Metric Ignores Vector Length
+TEST_F(KnowledgeBaseTest, CosineMetricNormalizesVectors) {
+  kb_.reset();
+  fs::remove_all(test_db_path_);
+  kb::IndexOptions options;
+  options.metric = "cosine";
+  kb_ = std::make_unique<kb::KnowledgeBase>(test_db_path_, 128, options);
+
+  std::vector<float> direction = embedding_service_->embed("Cosine direction");
+  kb::Memory mem;
+  mem.id = "cosine_long";
+  mem.content = "Long vector";
+  mem.category = "test";
+  mem.timestamp = 1234567890000;
+  for (float v : direction) {
+    mem.embedding.push_back(v * 5.0f);
+  }
+  kb_->add(mem);
+
+  mem.id = "cosine_other";
+  mem.content = "Other direction";
+  mem.embedding = embedding_service_->embed("Something unrelated");
+  kb_->add(mem);
+
+  std::vector<float> query;
+  for (float v : direction) {
+    query.push_back(v * 0.25f);
+  }
+  auto results = kb_->search(query, 2);
+  ASSERT_EQ(results.size(), 2);
+  EXPECT_EQ(results[0].id, "cosine_long");
+  EXPECT_NEAR(results[0].score, 1.0f, 1e-4f);
+
+  // Switching metric discards the snapshot and rebuilds from RocksDB
+  kb_.reset();
+  kb_ = std::make_unique<kb::KnowledgeBase>(test_db_path_, 128);
+  EXPECT_EQ(kb_->size(), 2);
+}
+
+// Test 44: Category Filter Fills top_k With Matches Only
+TEST_F(KnowledgeBaseTest, SearchFiltersByCategory) {
+  for (int i = 0; i < 30; ++i) {
+    kb::Memory mem;
+    mem.id = "filter_" + std::to_string(i);
+    mem.content = "Filtered memory " + std::to_string(i);
+    mem.category = i % 10 == 0 ? "rare" : "common";
+    mem.timestamp = 1234567890000 + i;
+    mem.embedding = embedding_service_->embed(mem.content);
+    kb_->add(mem);
+  }
+
+  kb::SearchOptions options;
+  options.category = "rare";
+  auto results = kb_->search(embedding_service_->embed("Filtered memory 5"), 5, options);
+  ASSERT_EQ(results.size(), 3);
+  for (const auto& result : results) {
+    EXPECT_EQ(result.category, "rare");
+  }
+
+  options.category = "missing";
+  EXPECT_TRUE(kb_->search(embedding_service_->embed("Filtered memory 5"), 5, options).empty());
+}
+
+// Test 45: Time Range Filter Is Inclusive
+TEST_F(KnowledgeBaseTest, SearchFiltersByTimeRange) {
+  for (int i = 0; i < 10; ++i) {
+    kb::Memory mem;
+    mem.id = "time_" + std::to_string(i);
+    mem.content = "Timed memory " + std::to_string(i);
+    mem.category = "test";
+    mem.timestamp = 1000 + i;
+    mem.embedding = embedding_service_->embed(mem.content);
+    kb_->add(mem);
+  }
+  kb_->remove("time_4");
+
+  kb::SearchOptions options;
+  options.since = 1003;
+  options.until = 1005;
+  auto results = kb_->search(embedding_service_->embed("Timed memory 0"), 10, options);
+  ASSERT_EQ(results.size(), 2);
+  for (const auto& result : results) {
+    EXPECT_TRUE(result.id == "time_3" || result.id == "time_5");
+  }
+
+  options.until = 0;
+  EXPECT_EQ(kb_->search(embedding_service_->embed("Timed memory 0"), 10, options).size(), 6);
+}
+
+// Test 46: Filter Metadata Survives Snapshot And Rebuild
+TEST_F(KnowledgeBaseTest, FilterMetadataSurvivesRestart) {
+  kb::Memory mem;
+  mem.id = "persisted_filter";
+  mem.content = "Persisted filter metadata";
+  mem.category = "kept";
+  mem.timestamp = 42;
+  mem.embedding = embedding_service_->embed(mem.content);
+  kb_->add(mem);
+
+  mem.id = "other_filter";
+  mem.category = "other";
+  mem.timestamp = 43;
+  kb_->add(mem);
+
+  kb::SearchOptions options;
+  options.category = "kept";
+  options.until = 42;
+
+  for (int pass = 0; pass < 2; ++pass) {
+    kb_.reset();
+    if (pass == 1) {
+      fs::remove(test_db_path_ + "/faiss.snapshot");
+    }
+    kb_ = std::make_unique<kb::KnowledgeBase>(test_db_path_, 128);
+
+    auto results = kb_->search(mem.embedding, 5, options);
+    ASSERT_EQ(results.size(), 1);
+    EXPECT_EQ(results[0].id, "persisted_filter");
+  }
+}
+
+// Test 47: Hits Shared Between Queries Are Hydrated For Each Query
+TEST_F(KnowledgeBaseTest, SearchBatchHydratesSharedHits) {
+  for (int i = 0; i < 60; ++i) {
+    kb::Memory mem;
+    mem.id = "hydrate_" + std::to_string(i);
+    mem.content = "Hydrated memory " + std::to_string(i);
+    mem.category = "cat_" + std::to_string(i % 3);
+    mem.timestamp = 1234567890000 + i;
+    mem.embedding = embedding_service_->embed(mem.content);
+    kb_->add(mem);
+  }
+
+  std::vector<float> query = embedding_service_->embed("Hydrated memory 7");
+  auto batched = kb_->searchBatch({query, query}, 50);
+  ASSERT_EQ(batched.size(), 2);
+  ASSERT_EQ(batched[0].size(), 50);
+  ASSERT_EQ(batched[1].size(), 50);
+
+  for (size_t i = 0; i < 50; ++i) {
+    EXPECT_EQ(batched[0][i].id, batched[1][i].id);
+    EXPECT_EQ(batched[0][i].content, batched[1][i].content);
+    int n = std::stoi(batched[0][i].id.substr(std::string("hydrate_").size()));
+    EXPECT_EQ(batched[0][i].content, "Hydrated memory " + std::to_string(n));
+    EXPECT_EQ(batched[0][i].category, "cat_" + std::to_string(n % 3));
+    EXPECT_EQ(batched[0][i].timestamp, 1234567890000 + n);
+  }
+}
+
+// Counts calls into a mock embedder, optionally failing them
+class CountingEmbeddingService : public kb::EmbeddingService {
+public:
+  explicit CountingEmbeddingService(int dim) : mock_(dim) {}
+
+  std::vector<float> embed(const std::string& text) override {
+    return embedBatch({text})[0];
+  }
+
+  std::vector<std::vector<float>> embedBatch(const std::vector<std::string>& texts) override {
+    ++calls;
+    texts_seen += texts.size();
+    if (fail) {
+      throw std::runtime_error("model unavailable");
+    }
+    return mock_.embedBatch(texts);
+  }
+
+  int dimension() const override { return mock_.dimension(); }
+
+  std::atomic<int> calls{0};
+  std::atomic<size_t> texts_seen{0};
+  std::atomic<bool> fail{false};
+
+private:
+  kb::MockEmbeddingService mock_;
+};
+
+// Test 48: Embedding Cache Serves Repeated Texts And Evicts LRU
+TEST_F(KnowledgeBaseTest, EmbeddingCacheServesRepeatedTexts) {
+  auto inner = std::make_shared<CountingEmbeddingService>(128);
+  kb::CachingEmbeddingService cache(inner, 2);
+
+  auto first = cache.embed("user preferences");
+  auto second = cache.embed("user preferences");
+  EXPECT_EQ(first, second);
+  EXPECT_EQ(first, embedding_service_->embed("user preferences"));
+  EXPECT_EQ(inner->calls, 1);
+  EXPECT_EQ(cache.hits(), 1u);
+
+  cache.embed("b");
+  cache.embed("c");  // evicts "user preferences"
+  cache.embed("user preferences");
+  EXPECT_EQ(inner->calls, 4);
+
+  // Only uncached texts, once each, reach the inner service
+  inner->texts_seen = 0;
+  auto batch = cache.embedBatch({"c", "d", "d", "user preferences"});
+  ASSERT_EQ(batch.size(), 4);
+  EXPECT_EQ(inner->texts_seen, 1u);
+  EXPECT_EQ(batch[1], embedding_service_->embed("d"));
+  EXPECT_EQ(batch[1], batch[2]);
+}
+
+// Test 49: Concurrent Embeddings Are Coalesced Into Batches
+TEST_F(KnowledgeBaseTest, EmbeddingBatcherCoalescesConcurrentCalls) {
+  auto inner = std::make_shared<CountingEmbeddingService>(128);
+  kb::BatchingEmbeddingService batcher(inner, 64, std::chrono::milliseconds(50), 1);
+
+  const int num_threads = 8;
+  std::vector<std::vector<float>> results(num_threads);
+  std::vector<std::thread> threads;
+  for (int t = 0; t < num_threads; ++t) {
+    threads.emplace_back([&, t]() {
+      results[t] = batcher.embed("concurrent text " + std::to_string(t));
+    });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+
+  EXPECT_LT(inner->calls, num_threads);
+  EXPECT_EQ(inner->texts_seen, static_cast<size_t>(num_threads));
+  for (int t = 0; t < num_threads; ++t) {
+    EXPECT_EQ(results[t], embedding_service_->embed("concurrent text " + std::to_string(t)));
+  }
+
+  auto batch = batcher.embedBatch({"x", "y"});
+  ASSERT_EQ(batch.size(), 2);
+  EXPECT_EQ(batch[1], embedding_service_->embed("y"));
+}
+
+// Test 50: Embedding Failures Reach Every Caller In The Batch
+TEST_F(KnowledgeBaseTest, EmbeddingBatcherPropagatesErrors) {
+  auto inner = std::make_shared<CountingEmbeddingService>(128);
+  inner->fail = true;
+  kb::BatchingEmbeddingService batcher(inner, 8, std::chrono::microseconds(100));
+
+  EXPECT_THROW(batcher.embed("fails"), std::runtime_error);
+  EXPECT_THROW(batcher.embedBatch({"also", "fails"}), std::runtime_error);
+
+  inner->fail = false;
+  EXPECT_EQ(batcher.embed("recovers"), embedding_service_->embed("recovers"));
+}
+
+// Test 51: Queued Adds Become Searchable Once Waited For
+TEST_F(KnowledgeBaseTest, IngestPipelineMakesAddsSearchable) {
+  kb_.reset();
+  auto kb = std::make_shared<kb::KnowledgeBase>(test_db_path_, 128);
+  auto embedder = std::make_shared<CountingEmbeddingService>(128);
+  kb::IngestPipeline ingest(kb, embedder);
+
+  uint64_t ticket = 0;
+  for (int i = 0; i < 20; ++i) {
+    kb::Memory memory;
+    memory.content = "queued memory " + std::to_string(i);
+    memory.category = "async";
+    memory.timestamp = i;
+    ASSERT_FALSE(ingest.submit(memory, &ticket).empty());
+  }
+  EXPECT_EQ(ticket, 20u);
+  EXPECT_EQ(ingest.lastTicket(), 20u);
+
+  ASSERT_TRUE(ingest.waitFor(ticket, std::chrono::seconds(10)));
+  EXPECT_EQ(ingest.pending(), 0u);
+  EXPECT_EQ(kb->size(), 20);
+  EXPECT_LT(embedder->calls, 20);  // embedded in batches
+
+  auto results = kb->search(embedding_service_->embed("queued memory 7"), 1);
+  ASSERT_EQ(results.size(), 1);
+  EXPECT_EQ(results[0].content, "queued memory 7");
+  EXPECT_EQ(results[0].category, "async");
+  EXPECT_TRUE(kb->queuedMemories().empty());
+}
+
+// Test 52: Duplicate Ids Are Rejected While Queued Or Stored
+TEST_F(KnowledgeBaseTest, IngestPipelineRejectsDuplicateIds) {
+  kb_.reset();
+  auto kb = std::make_shared<kb::KnowledgeBase>(test_db_path_, 128);
+  auto embedder = std::make_shared<CountingEmbeddingService>(128);
+  embedder->fail = true;  // keep submissions queued
+  kb::IngestOptions options;
+  options.retry_delay = std::chrono::milliseconds(10);
+  kb::IngestPipeline ingest(kb, embedder, options);
+
+  kb::Memory memory;
+  memory.id = "same";
+  memory.content = "first";
+  memory.category = "general";
+  memory.timestamp = 0;
+  uint64_t ticket = 0;
+  EXPECT_EQ(ingest.submit(memory, &ticket), "same");
+  EXPECT_TRUE(ingest.submit(memory, &ticket).empty());
+  EXPECT_FALSE(ingest.waitFor(ticket, std::chrono::milliseconds(50)));
+
+  embedder->fail = false;
+  ASSERT_TRUE(ingest.waitFor(ticket, std::chrono::seconds(10)));
+  EXPECT_TRUE(kb->exists("same"));
+  EXPECT_TRUE(ingest.submit(memory, &ticket).empty());
+}
+
+// Test 53: Queued Adds Survive A Restart And Are Resumed
+TEST_F(KnowledgeBaseTest, IngestQueueResumedAfterRestart) {
+  for (uint64_t ticket = 1; ticket <= 5; ++ticket) {
+    kb::Memory memory;
+    memory.content = "pending " + std::to_string(ticket);
+    memory.category = "general";
+    memory.timestamp = static_cast<int64_t>(ticket);
+    ASSERT_FALSE(kb_->enqueue(ticket, memory).empty());
+  }
+  EXPECT_EQ(kb_->size(), 0);
+
+  kb_.reset();
+  auto kb = std::make_shared<kb::KnowledgeBase>(test_db_path_, 128);
+  auto queued = kb->queuedMemories();
+  ASSERT_EQ(queued.size(), 5);
+  EXPECT_EQ(queued[0].first, 1u);
+  EXPECT_EQ(queued[4].second.content, "pending 5");
+
+  auto embedder = std::make_shared<CountingEmbeddingService>(128);
+  kb::IngestPipeline ingest(kb, embedder);
+  EXPECT_EQ(ingest.lastTicket(), 5u);
+  ASSERT_TRUE(ingest.waitFor(ingest.lastTicket(), std::chrono::seconds(10)));
+  EXPECT_EQ(kb->size(), 5);
+  EXPECT_TRUE(kb->queuedMemories().empty());
+
+  auto results = kb->search(embedding_service_->embed("pending 3"), 1);
+  ASSERT_EQ(results.size(), 1);
+  EXPECT_EQ(results[0].content, "pending 3");
+}
+
+// Test 54: Streamed JSON Matches nlohmann Parsing And Escaping
+TEST_F(KnowledgeBaseTest, JsonWriterProducesValidJson) {
+  std::string out = "prefix";
+  kb::JsonWriter writer(&out);
+  writer.beginObject();
+  writer.key("text");
+  writer.string("quote\" backslash\\ newline\n tab\t ctrl\x01 caf\xC3\xA9");
+  writer.key("invalid");
+  writer.string("bad\xFF\xC3");
+  writer.key("numbers");
+  writer.beginArray();
+  writer.integer(-42);
+  writer.unsignedInteger(18446744073709551615ull);
+  writer.real(0.1f);
+  writer.real(std::nanf(""));
+  writer.endArray();
+  writer.key("empty");
+  writer.beginObject();
+  writer.endObject();
+  writer.key("flag");
+  writer.boolean(false);
+  writer.key("nothing");
+  writer.null();
+  writer.endObject();
+
+  ASSERT_EQ(out.compare(0, 6, "prefix"), 0);
+  auto doc = nlohmann::json::parse(out.substr(6));
+  EXPECT_EQ(doc["text"], "quote\" backslash\\ newline\n tab\t ctrl\x01 caf\xC3\xA9");
+  EXPECT_EQ(doc["invalid"], "bad\xEF\xBF\xBD\xEF\xBF\xBD");
+  EXPECT_EQ(doc["numbers"][0], -42);
+  EXPECT_EQ(doc["numbers"][1].get<uint64_t>(), 18446744073709551615ull);
+  EXPECT_EQ(doc["numbers"][2].get<float>(), 0.1f);
+  EXPECT_TRUE(doc["numbers"][3].is_null());
+  EXPECT_TRUE(doc["empty"].is_object());
+  EXPECT_EQ(doc["flag"], false);
+  EXPECT_TRUE(doc["nothing"].is_null());
+  EXPECT_NE(out.find("ctrl\\u0001"), std::string::npos);  // escaped like dump()
+}
+
+// Test 55: Streamed MessagePack Decodes With nlohmann
+TEST_F(KnowledgeBaseTest, MsgpackWriterProducesValidMessagePack) {
+  std::vector<float> vector = embedding_service_->embed("vector");
+  std::string long_text(70000, 'x');
+
+  std::string out;
+  kb::MsgpackWriter writer(&out);
+  writer.beginObject();
+  writer.key("success");
+  writer.boolean(true);
+  writer.key("numbers");
+  writer.beginArray();
+  for (int64_t value : {int64_t(0), int64_t(127), int64_t(-1), int64_t(-33), int64_t(-40000),
+                        int64_t(1) << 40, -(int64_t(1) << 40)}) {
+    writer.integer(value);
+  }
+  writer.unsignedInteger(18446744073709551615ull);
+  writer.real(0.25f);
+  writer.null();
+  writer.endArray();
+  writer.key("short");
+  writer.string("caf\xC3\xA9");
+  writer.key("long");
+  writer.string(long_text);
+  writer.key("vector");
+  writer.binary(vector.data(), vector.size() * sizeof(float));
+  writer.key("empty");
+  writer.beginArray();
+  writer.endArray();
+  writer.endObject();
+
+  auto doc = nlohmann::json::from_msgpack(out);
+  EXPECT_EQ(doc.size(), 6);
+  EXPECT_EQ(doc["success"], true);
+  ASSERT_EQ(doc["numbers"].size(), 10);
+  EXPECT_EQ(doc["numbers"][1], 127);
+  EXPECT_EQ(doc["numbers"][2], -1);
+  EXPECT_EQ(doc["numbers"][3], -33);
+  EXPECT_EQ(doc["numbers"][4], -40000);
+  EXPECT_EQ(doc["numbers"][5], int64_t(1) << 40);
+  EXPECT_EQ(doc["numbers"][6], -(int64_t(1) << 40));
+  EXPECT_EQ(doc["numbers"][7].get<uint64_t>(), 18446744073709551615ull);
+  EXPECT_EQ(doc["numbers"][8].get<float>(), 0.25f);
+  EXPECT_TRUE(doc["numbers"][9].is_null());
+  EXPECT_EQ(doc["short"], "caf\xC3\xA9");
+  EXPECT_EQ(doc["long"], long_text);
+  ASSERT_TRUE(doc["vector"].is_binary());
+  ASSERT_EQ(doc["vector"].get_binary().size(), vector.size() * sizeof(float));
+  EXPECT_EQ(std::memcmp(doc["vector"].get_binary().data(), vector.data(), vector.size() * sizeof(float)), 0);
+  EXPECT_TRUE(doc["empty"].is_array());
+  EXPECT_TRUE(doc["empty"].empty());
+}
+
+// Test 56: Stored Embeddings Can Be Read Back By Id
+TEST_F(KnowledgeBaseTest, GetEmbeddingReturnsStoredVector) {
+  EXPECT_EQ(kb_->dimension(), 128);
+
+  kb::Memory memory;
+  memory.id = "precomputed";
+  memory.content = "caller supplied vector";
+  memory.embedding = embedding_service_->embed("something else entirely");
+  ASSERT_TRUE(kb_->add(memory));
+
+  std::vector<float> stored;
+  ASSERT_TRUE(kb_->getEmbedding("precomputed", &stored));
+  EXPECT_EQ(stored, memory.embedding);
+  EXPECT_FALSE(kb_->getEmbedding("missing", &stored));
+
+  // Searching by the stored vector finds the memory itself first
+  auto results = kb_->search(stored, 1);
+  ASSERT_EQ(results.size(), 1);
+  EXPECT_EQ(results[0].id, "precomputed");
+
+  // The vector follows updates and disappears with the memory
+  auto updated = embedding_service_->embed("updated vector");
+  ASSERT_TRUE(kb_->update("precomputed", "new content", updated));
+  ASSERT_TRUE(kb_->getEmbedding("precomputed", &stored));
+  EXPECT_EQ(stored, updated);
+  ASSERT_TRUE(kb_->remove("precomputed"));
+  EXPECT_FALSE(kb_->getEmbedding("precomputed", &stored));
+}
+
+// Test 57: Vector Kernels Agree With Plain Loops On Every Length
+TEST_F(KnowledgeBaseTest, VectorOpsMatchScalarReference) {
+  // Lengths around the 8-lane width exercise the vector body and the tail
+  for (size_t n = 0; n <= 40; ++n) {
+    std::vector<float> a(n), b(n);
+    double expected = 0.0;
+    for (size_t i = 0; i < n; ++i) {
+      a[i] = std::sin(static_cast<float>(i) + 1.0f);
+      b[i] = std::cos(static_cast<float>(i) * 0.5f);
+      expected += static_cast<double>(a[i]) * b[i];
+    }
+    EXPECT_NEAR(kb::dot(a.data(), b.data(), n), expected, 1e-5) << "n=" << n;
+
+    float norm = kb::normalize(a.data(), n);
+    if (n > 0) {
+      EXPECT_GT(norm, 0.0f);
+      EXPECT_NEAR(kb::squaredNorm(a.data(), n), 1.0f, 1e-5) << "n=" << n;
+    }
+  }
+
+  std::vector<float> zero(13, 0.0f);
+  EXPECT_EQ(kb::normalize(zero.data(), zero.size()), 0.0f);
+  EXPECT_EQ(zero, std::vector<float>(13, 0.0f));
+
+  unsigned char bytes[] = {0, 255, 51, 204, 1, 2, 3, 4, 5, 128, 127};
+  std::vector<float> unit(sizeof(bytes));
+  kb::bytesToUnitRange(bytes, sizeof(bytes), unit.data());
+  for (size_t i = 0; i < sizeof(bytes); ++i) {
+    EXPECT_EQ(unit[i], (static_cast<float>(bytes[i]) / 255.0f) * 2.0f - 1.0f);
+  }
+
+  // The mock embedder still follows its documented construction: element i
+  // is hash[i % 32] ^ hash[(i / 32) % 32] mapped onto [-1, 1], normalized
+  for (int dim : {7, 128, 1000}) {
+    kb::MockEmbeddingService embedder(dim);
+    std::string text = "simd mock embedding";
+    unsigned char hash[SHA256_DIGEST_LENGTH];
+    SHA256(reinterpret_cast<const unsigned char*>(text.data()), text.size(), hash);
+
+    std::vector<double> expected(dim);
+    double norm = 0.0;
+    for (int i = 0; i < dim; ++i) {
+      unsigned char combined = hash[i % SHA256_DIGEST_LENGTH] ^ hash[(i / SHA256_DIGEST_LENGTH) % SHA256_DIGEST_LENGTH];
+      expected[i] = (combined / 255.0) * 2.0 - 1.0;
+      norm += expected[i] * expected[i];
+    }
+
+    auto embedding = embedder.embed(text);
+    ASSERT_EQ(embedding.size(), static_cast<size_t>(dim));
+    for (int i = 0; i < dim; ++i) {
+      EXPECT_NEAR(embedding[i], expected[i] / std::sqrt(norm), 1e-6) << "dim=" << dim << " i=" << i;
+    }
+    EXPECT_EQ(embedding, embedder.embed(text));
+  }
+}
+
+// Test 58: Half-Float And 8-Bit Vector Encodings Round Trip
+TEST_F(KnowledgeBaseTest, CompressedVectorEncodingsRoundTrip) {
+  kb::VectorEncoding encoding;
+  ASSERT_TRUE(kb::parseVectorEncoding("sq8", &encoding));
+  EXPECT_EQ(encoding, kb::VectorEncoding::Int8);
+  EXPECT_FALSE(kb::parseVectorEncoding("f64", &encoding));
+
+  // Values a half float holds exactly survive, others round to nearest
+  for (float value : {0.0f, -0.0f, 1.0f, -2.5f, 65504.0f, 6.1035156e-05f, 5.9604645e-08f}) {
+    EXPECT_EQ(kb::halfToFloat(kb::floatToHalf(value)), value);
+  }
+  EXPECT_EQ(kb::halfToFloat(kb::floatToHalf(1.0f + 1.0f / 2048)), 1.0f);  // tie, rounds to even
+  EXPECT_TRUE(std::isinf(kb::halfToFloat(kb::floatToHalf(70000.0f))));
+
+  auto embedding = embedding_service_->embed("compressed round trip");
+  std::vector<float> decoded(embedding.size());
+
+  std::string half = kb::encodeVector(embedding.data(), embedding.size(), kb::VectorEncoding::Float16);
+  EXPECT_EQ(half.size(), embedding.size() * 2);
+  ASSERT_TRUE(kb::decodeVector(half, decoded.size(), decoded.data(), kb::VectorEncoding::Float16));
+  for (size_t i = 0; i < embedding.size(); ++i) {
+    EXPECT_NEAR(decoded[i], embedding[i], std::fabs(embedding[i]) / 1024 + 1e-7f);
+  }
+
+  std::string codes = kb::encodeVector(embedding.data(), embedding.size(), kb::VectorEncoding::Int8);
+  EXPECT_EQ(codes.size(), embedding.size() + 8);
+  ASSERT_TRUE(kb::decodeVector(codes, decoded.size(), decoded.data(), kb::VectorEncoding::Int8));
+  auto [min, max] = std::minmax_element(embedding.begin(), embedding.end());
+  float step = (*max - *min) / 255;
+  for (size_t i = 0; i < embedding.size(); ++i) {
+    EXPECT_NEAR(decoded[i], embedding[i], step / 2 + 1e-6f);
+  }
+
+  // Blobs of another encoding or dimension are rejected
+  EXPECT_FALSE(kb::decodeVector(codes, decoded.size(), decoded.data(), kb::VectorEncoding::Float16));
+  EXPECT_FALSE(kb::decodeVector(half, decoded.size() + 1, decoded.data(), kb::VectorEncoding::Float16));
+
+  std::vector<float> constant(16, 0.25f);
+  codes = kb::encodeVector(constant.data(), constant.size(), kb::VectorEncoding::Int8);
+  ASSERT_TRUE(kb::decodeVector(codes, 16, decoded.data(), kb::VectorEncoding::Int8));
+  EXPECT_EQ(std::vector<float>(decoded.begin(), decoded.begin() + 16), constant);
+}
+
+// Test 59: Compressed Storage Keeps Recall And Re-Encodes On Reopen
+TEST_F(KnowledgeBaseTest, CompressedStorageKeepsRecall) {
+  // Random unit vectors, which spread neighbours more evenly than the mock
+  // embedder, with exact float32 neighbours computed by brute force
+  const int n = 2000, nq = 50, k = 10, dim = 128;
+  std::mt19937 gen(42);
+  std::normal_distribution<float> normal;
+  std::vector<kb::Memory> memories(n);
+  for (int i = 0; i < n; ++i) {
+    memories[i].id = "sq_" + std::to_string(i);
+    memories[i].content = "vector " + std::to_string(i);
+    memories[i].timestamp = i;
+    memories[i].embedding.resize(dim);
+    for (float& x : memories[i].embedding) {
+      x = normal(gen);
+    }
+    kb::normalize(memories[i].embedding.data(), dim);
+  }
+
+  std::vector<std::vector<float>> queries(nq, std::vector<float>(dim));
+  std::vector<std::set<std::string>> exact(nq);
+  for (int q = 0; q < nq; ++q) {
+    for (int j = 0; j < dim; ++j) {
+      queries[q][j] = 0.5f * (memories[2 * q].embedding[j] + memories[2 * q + 1].embedding[j]);
+    }
+    std::vector<std::pair<float, int>> distances;
+    for (int i = 0; i < n; ++i) {
+      float distance = 0.0f;
+      for (int j = 0; j < dim; ++j) {
+        float diff = queries[q][j] - memories[i].embedding[j];
+        distance += diff * diff;
+      }
+      distances.emplace_back(distance, i);
+    }
+    std::partial_sort(distances.begin(), distances.begin() + k, distances.end());
+    for (int i = 0; i < k; ++i) {
+      exact[q].insert(memories[distances[i].second].id);
+    }
+  }
+
+  auto recall = [&]() {
+    double found = 0;
+    for (int q = 0; q < nq; ++q) {
+      for (const auto& result : kb_->search(queries[q], k)) {
+        found += exact[q].count(result.id);
+      }
+    }
+    return found / (nq * k);
+  };
+
+  kb_->addBatch(memories);
+  kb_.reset();
+
+  // The f32 store is re-encoded on open; sq8 trains its index at startup
+  for (const char* storage : {"f16", "sq8"}) {
+    kb::IndexOptions options;
+    options.storage = storage;
+    kb_ = std::make_unique<kb::KnowledgeBase>(test_db_path_, dim, options);
+    EXPECT_EQ(kb_->size(), static_cast<size_t>(n));
+
+    double measured = recall();
+    EXPECT_GE(measured, std::string(storage) == "f16" ? 0.98 : 0.9) << storage;
+
+    std::vector<float> stored;
+    ASSERT_TRUE(kb_->getEmbedding("sq_7", &stored));
+    for (int j = 0; j < dim; ++j) {
+      EXPECT_NEAR(stored[j], memories[7].embedding[j], 0.01f) << storage;
+    }
+    kb_.reset();
+  }
+
+  kb::IndexOptions options;
+  options.storage = "f8";
+  EXPECT_THROW(kb::KnowledgeBase(test_db_path_, dim, options), std::runtime_error);
+}
+
+// Test 60: Namespaces are isolated and reopen with their data
+TEST_F(KnowledgeBaseTest, NamespacesAreIsolated) {
+  auto main_kb = std::make_shared<kb::KnowledgeBase>(test_db_path_ + "_main", 128);
+  kb::NamespaceOptions options;
+  options.max_open = 1;
+  options.idle_timeout = std::chrono::seconds(0);
+  auto registry = std::make_unique<kb::NamespaceRegistry>(
+    kb::Tenant{main_kb, nullptr}, test_db_path_ + "_ns",
+    [](const std::string& path) { return kb::Tenant{std::make_shared<kb::KnowledgeBase>(path, 128), nullptr}; },
+    options);
+
+  std::string error;
+  {
+    kb::Tenant tenant;
+    ASSERT_TRUE(registry->acquire("alice", &tenant, &error)) << error;
+    kb::Memory mem;
+    mem.content = "Alice likes tea";
+    mem.embedding = embedding_service_->embed(mem.content);
+    ASSERT_TRUE(tenant.kb->add(mem));
+
+    kb::Tenant main_tenant;
+    ASSERT_TRUE(registry->acquire("", &main_tenant, &error));
+    EXPECT_EQ(main_tenant.kb, main_kb);
+    EXPECT_EQ(main_kb->size(), 0u);
+  }
+
+  {
+    kb::Tenant tenant;
+    ASSERT_TRUE(registry->acquire("bob", &tenant, &error)) << error;
+    EXPECT_EQ(tenant.kb->size(), 0u);
+  }
+  // Opening bob closed alice, the least recently used
+  EXPECT_EQ(registry->openCount(), 1u);
+
+  {
+    kb::Tenant tenant;
+    ASSERT_TRUE(registry->acquire("alice", &tenant, &error)) << error;
+    EXPECT_EQ(tenant.kb->size(), 1u);
+  }
+
+  kb::Tenant tenant;
+  EXPECT_FALSE(registry->acquire("../escape", &tenant, &error));
+  EXPECT_FALSE(error.empty());
+  EXPECT_FALSE(registry->acquire(".hidden", &tenant, &error));
+
+  tenant = kb::Tenant();
+  registry.reset();
+  main_kb.reset();
+  fs::remove_all(test_db_path_ + "_main");
+  fs::remove_all(test_db_path_ + "_ns");
+}
+
+// Test 61: Metrics histograms, Prometheus rendering and store timings
+TEST_F(KnowledgeBaseTest, MetricsRecordAndRender) {
+  kb::Metrics& metrics = kb::Metrics::global();
+  kb::Histogram& histogram = metrics.histogram("kb_test_seconds", "Test histogram", {{"case", "a"}});
+  EXPECT_EQ(&histogram, &metrics.histogram("kb_test_seconds", "Test histogram", {{"case", "a"}}));
+
+  std::vector<std::thread> threads;
+  for (int t = 0; t < 4; ++t) {
+    threads.emplace_back([&histogram]() {
+      for (int i = 1; i <= 1000; ++i) {
+        histogram.observe(std::chrono::microseconds(i));
+      }
+    });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+
+  kb::Histogram::Snapshot snapshot = histogram.snapshot();
+  EXPECT_EQ(snapshot.count, 4000u);
+  EXPECT_NEAR(snapshot.sum_seconds, 4 * 500500e-6, 1e-9);
+  // Estimates land within the power-of-two bucket of the true value
+  EXPECT_GE(snapshot.quantileSeconds(0.5), 256e-6);
+  EXPECT_LE(snapshot.quantileSeconds(0.5), 512e-6);
+  EXPECT_GE(snapshot.quantileSeconds(0.99), 512e-6);
+  EXPECT_LE(snapshot.quantileSeconds(0.99), 1024e-6);
+
+  metrics.counter("kb_test_total", "Test counter").add(3);
+  metrics.gauge("kb_test_gauge", "Test gauge", []() { return 2.5; });
+
+  std::string text = metrics.renderPrometheus();
+  EXPECT_NE(text.find("# TYPE kb_test_seconds histogram"), std::string::npos);
+  EXPECT_NE(text.find("kb_test_seconds_bucket{case=\"a\",le=\"+Inf\"} 4000"), std::string::npos);
+  EXPECT_NE(text.find("kb_test_seconds_count{case=\"a\"} 4000"), std::string::npos);
+  EXPECT_NE(text.find("kb_test_total 3"), std::string::npos);
+  EXPECT_NE(text.find("kb_test_gauge 2.5"), std::string::npos);
+
+  metrics.removeGauge("kb_test_gauge");
+  EXPECT_EQ(metrics.renderPrometheus().find("kb_test_gauge"), std::string::npos);
+
+  // Store operations time themselves
+  kb::Histogram& search = metrics.histogram("kb_index_search_seconds", "FAISS search calls");
+  uint64_t searches = search.snapshot().count;
+  kb::Memory mem;
+  mem.content = "Metrics are recorded";
+  mem.embedding = embedding_service_->embed(mem.content);
+  ASSERT_TRUE(kb_->add(mem));
+  kb_->search(mem.embedding, 1);
+  EXPECT_EQ(search.snapshot().count, searches + 1);
+
+  nlohmann::json stats = metrics.toJson();
+  ASSERT_TRUE(stats.contains("kb_test_seconds"));
+  EXPECT_EQ(stats["kb_test_seconds"][0]["count"], 4000);
+  EXPECT_GT(kb_->indexMemoryBytes(), 128 * sizeof(float));
+}
+
+// Test 62: Index Built From Storage In Parallel
+TEST_F(KnowledgeBaseTest, ParallelLoadRebuildsIndex) {
+  // Written over several opens so the embeddings span several SST files
+  const int rounds = 4;
+  const int per_round = 500;
+  for (int round = 0; round < rounds; ++round) {
+    std::vector<kb::Memory> memories(per_round);
+    for (int i = 0; i < per_round; ++i) {
+      int n = round * per_round + i;
+      memories[i].id = "load_" + std::to_string(n);
+      memories[i].content = "Parallel load memory " + std::to_string(n);
+      memories[i].category = "cat_" + std::to_string(n % 3);
+      memories[i].timestamp = 1000 + n;
+      memories[i].embedding = embedding_service_->embed(memories[i].content);
+    }
+    kb_->addBatch(memories);
+    kb_.reset();
+    kb_ = std::make_unique<kb::KnowledgeBase>(test_db_path_, 128);
+  }
+  kb_->remove("load_7");
+
+  for (int threads : {1, 4}) {
+    kb_.reset();
+    fs::remove(test_db_path_ + "/faiss.snapshot");
+    kb::IndexOptions options;
+    options.load_threads = threads;
+    kb_ = std::make_unique<kb::KnowledgeBase>(test_db_path_, 128, options);
+    EXPECT_EQ(kb_->size(), static_cast<size_t>(rounds * per_round - 1)) << threads;
+    EXPECT_FALSE(kb_->exists("load_7"));
+
+    for (int n = 0; n < rounds * per_round; n += 97) {
+      auto embedding = embedding_service_->embed("Parallel load memory " + std::to_string(n));
+      kb::SearchOptions filter;
+      filter.category = "cat_" + std::to_string(n % 3);
+      filter.since = 1000 + n;
+      filter.until = 1000 + n;
+      auto results = kb_->search(embedding, 1, filter);
+      ASSERT_EQ(results.size(), 1u) << n;
+      EXPECT_EQ(results[0].id, "load_" + std::to_string(n));
+    }
+  }
+}
+
+// Test 63: Tuned Stores Share A Block Cache
+TEST_F(KnowledgeBaseTest, StoreOptionsShareBlockCache) {
+  kb_.reset();
+  kb::StoreOptions store_options;
+  store_options.block_cache = rocksdb::NewLRUCache(8 << 20);
+  store_options.sync_writes = true;
+  store_options.pipelined_writes = false;
+
+  std::string other_path = test_db_path_ + "_other";
+  {
+    kb::KnowledgeBase first(test_db_path_, 128, kb::IndexOptions(), store_options);
+    store_options.bloom_bits_per_key = 0;
+    kb::KnowledgeBase second(other_path, 128, kb::IndexOptions(), store_options);
+
+    for (int i = 0; i < 50; ++i) {
+      kb::Memory memory;
+      memory.id = "tuned_" + std::to_string(i);
+      memory.content = "Tuned store memory " + std::to_string(i);
+      memory.category = "general";
+      memory.embedding = embedding_service_->embed(memory.content);
+      ASSERT_TRUE(first.add(memory));
+      memory.content = "Other store memory " + std::to_string(i);
+      ASSERT_TRUE(second.add(memory));
+    }
+    ASSERT_TRUE(first.updateUserPreference("theme", "dark"));
+    ASSERT_TRUE(second.updateUserPreference("theme", "light"));
+
+    EXPECT_TRUE(first.exists("tuned_7"));
+    EXPECT_FALSE(first.exists("tuned_70"));
+    EXPECT_EQ(first.getUserPreference("theme"), "dark");
+    EXPECT_EQ(second.getUserPreference("theme"), "light");
+    auto hits = second.search(embedding_service_->embed("Other store memory 7"), 1);
+    ASSERT_EQ(hits.size(), 1u);
+    EXPECT_EQ(hits[0].content, "Other store memory 7");
+    EXPECT_GT(store_options.block_cache->GetUsage(), 0u);
+  }
+
+  // Reopened with defaults and without a snapshot, the index reloads by
+  // scanning across the prefixed keys
+  fs::remove(test_db_path_ + "/faiss.snapshot");
+  kb_ = std::make_unique<kb::KnowledgeBase>(test_db_path_, 128);
+  EXPECT_EQ(kb_->size(), 50u);
+  EXPECT_EQ(kb_->getUserPreference("theme"), "dark");
+  auto results = kb_->search(embedding_service_->embed("Tuned store memory 7"), 1);
+  ASSERT_EQ(results.size(), 1u);
+  EXPECT_EQ(results[0].id, "tuned_7");
+
+  fs::remove_all(other_path);
+}
+
+// Test 64: Write Path Checks Ids In Memory
+TEST_F(KnowledgeBaseTest, WritePathChecksIdsInMemory) {
+  auto memoryFor = [this](const std::string& id, const std::string& category) {
+    kb::Memory memory;
+    memory.id = id;
+    memory.content = "Write path memory " + id;
+    memory.category = category;
+    memory.embedding = embedding_service_->embed(memory.content);
+    return memory;
+  };
+  ASSERT_TRUE(kb_->add(memoryFor("wp_a", "notes")));
+  ASSERT_TRUE(kb_->add(memoryFor("wp_b", "notes")));
+
+  // Ids survive a reopen both from the snapshot and from a rebuild
+  for (bool keep_snapshot : {true, false}) {
+    kb_.reset();
+    if (!keep_snapshot) {
+      fs::remove(test_db_path_ + "/faiss.snapshot");
+    }
+    kb_ = std::make_unique<kb::KnowledgeBase>(test_db_path_, 128);
+    EXPECT_TRUE(kb_->exists("wp_a")) << keep_snapshot;
+    EXPECT_FALSE(kb_->add(memoryFor("wp_a", "other"))) << keep_snapshot;
+  }
+
+  auto ids = kb_->addBatch({memoryFor("wp_b", "other"), memoryFor("wp_c", "other"), memoryFor("wp_c", "other")});
+  ASSERT_EQ(ids.size(), 3u);
+  EXPECT_EQ(ids[0], "");
+  EXPECT_EQ(ids[1], "wp_c");
+  EXPECT_EQ(ids[2], "");
+
+  // update() keeps the stored category without reading the record
+  ASSERT_TRUE(kb_->update("wp_a", "Rewritten", embedding_service_->embed("Rewritten")));
+  kb::SearchOptions filter;
+  filter.category = "notes";
+  auto results = kb_->search(embedding_service_->embed("Rewritten"), 1, filter);
+  ASSERT_EQ(results.size(), 1u);
+  EXPECT_EQ(results[0].id, "wp_a");
+  EXPECT_EQ(results[0].category, "notes");
+  EXPECT_EQ(results[0].content, "Rewritten");
+
+  EXPECT_TRUE(kb_->remove("wp_a"));
+  EXPECT_FALSE(kb_->exists("wp_a"));
+  EXPECT_FALSE(kb_->remove("wp_a"));
+  EXPECT_FALSE(kb_->update("wp_a", "Gone", embedding_service_->embed("Gone")));
+  EXPECT_TRUE(kb_->add(memoryFor("wp_a", "other")));
+}
+
+// Test 65: Generated Ids Are Unique And Time-Ordered
+TEST_F(KnowledgeBaseTest, GeneratedIdsAreUniqueAndOrdered) {
+  const int num_threads = 4;
+  const int per_thread = 200;
+  std::vector<std::vector<std::string>> ids(num_threads);
+  std::vector<std::thread> threads;
+  for (int t = 0; t < num_threads; ++t) {
+    threads.emplace_back([this, t, &ids] {
+      for (int i = 0; i < per_thread; ++i) {
+        kb::Memory memory;
+        memory.content = "Generated id " + std::to_string(t) + "_" + std::to_string(i);
+        memory.category = "general";
+        memory.embedding = embedding_service_->embed(memory.content);
+        ids[t].push_back(kb_->addAndReturnId(memory));
+      }
+    });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+
+  std::set<std::string> all;
+  for (const auto& thread_ids : ids) {
+    EXPECT_TRUE(std::is_sorted(thread_ids.begin(), thread_ids.end()));
+    for (const std::string& id : thread_ids) {
+      EXPECT_EQ(id.size(), 20u) << id;
+      EXPECT_EQ(id.rfind("mem_", 0), 0u) << id;
+      all.insert(id);
+    }
+  }
+  EXPECT_EQ(all.size(), static_cast<size_t>(num_threads * per_thread));
+  EXPECT_EQ(kb_->size(), all.size());
+
+  // A reopened store continues past every id it holds
+  kb_.reset();
+  kb_ = std::make_unique<kb::KnowledgeBase>(test_db_path_, 128);
+  kb::Memory memory;
+  memory.content = "After reopen";
+  memory.category = "general";
+  memory.embedding = embedding_service_->embed(memory.content);
+  std::string id = kb_->addAndReturnId(memory);
+  EXPECT_GT(id, *all.rbegin());
+}
+
+// Test 66: Search Result Cache Follows Writes
+TEST_F(KnowledgeBaseTest, ResultCacheInvalidatedByWrites) {
+  kb_.reset();
+  kb::IndexOptions options;
+  options.result_cache = 16;
+  kb_ = std::make_unique<kb::KnowledgeBase>(test_db_path_, 128, options);
+
+  kb::Metrics& metrics = kb::Metrics::global();
+  kb::Counter& hits = metrics.counter("kb_search_cache_hits_total", "Searches answered from the result cache");
+  kb::Counter& misses = metrics.counter("kb_search_cache_misses_total", "Searches the result cache could not answer");
+
+  kb::Memory memory;
+  memory.id = "cached_1";
+  memory.content = "Cached search memory";
+  memory.category = "general";
+  memory.embedding = embedding_service_->embed(memory.content);
+  ASSERT_TRUE(kb_->add(memory));
+
+  auto query = embedding_service_->embed("Cached search memory");
+  uint64_t hits_before = hits.value();
+  uint64_t misses_before = misses.value();
+  auto first = kb_->search(query, 5);
+  auto second = kb_->search(query, 5);
+  ASSERT_EQ(first.size(), 1u);
+  ASSERT_EQ(second.size(), 1u);
+  EXPECT_EQ(second[0].id, first[0].id);
+  EXPECT_EQ(second[0].score, first[0].score);
+  EXPECT_EQ(hits.value() - hits_before, 1u);
+  EXPECT_EQ(misses.value() - misses_before, 1u);
+
+  // top_k and filters are part of the key
+  kb::SearchOptions filter;
+  filter.category = "other";
+  EXPECT_TRUE(kb_->search(query, 5, filter).empty());
+  EXPECT_EQ(kb_->search(query, 0).size(), 0u);
+
+  // Each kind of write is seen by the next search
+  memory.id = "cached_2";
+  ASSERT_TRUE(kb_->add(memory));
+  EXPECT_EQ(kb_->search(query, 5).size(), 2u);
+
+  ASSERT_TRUE(kb_->update("cached_1", "Rewritten content", embedding_service_->embed("Rewritten content")));
+  auto updated = kb_->search(embedding_service_->embed("Rewritten content"), 1);
+  ASSERT_EQ(updated.size(), 1u);
+  EXPECT_EQ(updated[0].content, "Rewritten content");
+  EXPECT_EQ(kb_->search(embedding_service_->embed("Rewritten content"), 1)[0].content, "Rewritten content");
+
+  ASSERT_TRUE(kb_->remove("cached_2"));
+  auto remaining = kb_->search(query, 5);
+  ASSERT_EQ(remaining.size(), 1u);
+  EXPECT_EQ(remaining[0].id, "cached_1");
+
+  // Batches hit and miss per query
+  hits_before = hits.value();
+  auto batch = kb_->searchBatch({query, embedding_service_->embed("Never searched before")}, 5);
+  ASSERT_EQ(batch.size(), 2u);
+  EXPECT_EQ(batch[0].size(), 1u);
+  EXPECT_EQ(hits.value() - hits_before, 1u);
+}
+
+// Test 67: Preferences Served From Memory
+TEST_F(KnowledgeBaseTest, PreferencesServedFromMemory) {
+  ASSERT_TRUE(kb_->updateUserPreference("editor.indent", "2"));
+  ASSERT_TRUE(kb_->updateUserPreference("editor.theme", "dark"));
+  ASSERT_TRUE(kb_->updateUserPreference("language", "en"));
+  ASSERT_TRUE(kb_->updateUserPreference("editor.theme", "light"));
+
+  auto values = kb_->getUserPreferences({"language", "missing", "editor.theme"});
+  ASSERT_EQ(values.size(), 3u);
+  EXPECT_EQ(values[0], "en");
+  EXPECT_EQ(values[1], "");
+  EXPECT_EQ(values[2], "light");
+
+  using Listed = std::vector<std::pair<std::string, std::string>>;
+  EXPECT_EQ(kb_->listUserPreferences("editor."), (Listed{{"editor.indent", "2"}, {"editor.theme", "light"}}));
+  EXPECT_EQ(kb_->listUserPreferences().size(), 3u);
+  EXPECT_TRUE(kb_->listUserPreferences("zzz").empty());
+
+  // Writes went through to storage: a reopened store loads them back,
+  // and memories stored alongside are not mistaken for preferences
+  kb::Memory memory;
+  memory.id = "pref_neighbour";
+  memory.content = "Not a preference";
+  memory.category = "general";
+  memory.embedding = embedding_service_->embed(memory.content);
+  ASSERT_TRUE(kb_->add(memory));
+  kb_.reset();
+  kb_ = std::make_unique<kb::KnowledgeBase>(test_db_path_, 128);
+  EXPECT_EQ(kb_->getUserPreference("editor.theme"), "light");
+  EXPECT_EQ(kb_->listUserPreferences(), (Listed{{"editor.indent", "2"}, {"editor.theme", "light"}, {"language", "en"}}));
+}
+
+// Test 68: Lexical And Hybrid Search
+TEST_F(KnowledgeBaseTest, LexicalAndHybridSearch) {
+  const std::vector<std::pair<std::string, std::string>> memories = {
+      {"lex_handler", "Fixed the crash in src/request_handler.cpp when params are missing"},
+      {"lex_rust", "cargo build fails with error E0432: unresolved import"},
+      {"lex_food", "User likes spicy food and green tea"},
+      {"lex_tabs", "User prefers tabs in the request parser"},
+  };
+  for (const auto& [id, content] : memories) {
+    kb::Memory memory;
+    memory.id = id;
+    memory.content = content;
+    memory.category = id == "lex_rust" ? "error" : "note";
+    memory.timestamp = 1234567890000;
+    memory.embedding = embedding_service_->embed(content);
+    ASSERT_TRUE(kb_->add(memory));
+  }
+
+  // Joined words match whole and by their parts, case-insensitively
+  auto results = kb_->searchLexical("request_handler.cpp", 5);
+  ASSERT_FALSE(results.empty());
+  EXPECT_EQ(results[0].id, "lex_handler");
+  EXPECT_EQ(results[0].content, memories[0].second);
+  EXPECT_GT(results[0].score, 0.0f);
+
+  results = kb_->searchLexical("e0432", 5);
+  ASSERT_EQ(results.size(), 1u);
+  EXPECT_EQ(results[0].id, "lex_rust");
+
+  results = kb_->searchLexical("request", 5);
+  ASSERT_EQ(results.size(), 2u);
+  EXPECT_TRUE(kb_->searchLexical("nonexistentword", 5).empty());
+
+  kb::SearchOptions errors_only;
+  errors_only.category = "error";
+  EXPECT_TRUE(kb_->searchLexical("request", 5, errors_only).empty());
+  EXPECT_EQ(kb_->searchLexical("E0432", 5, errors_only).size(), 1u);
+
+  // The exact keyword match leads the fused ranking even for an unrelated
+  // query embedding
+  results = kb_->searchHybrid("E0432", embedding_service_->embed("spicy food"), 3);
+  ASSERT_FALSE(results.empty());
+  EXPECT_EQ(results[0].id, "lex_rust");
+
+  // Updates and removals are reflected
+  ASSERT_TRUE(kb_->update("lex_food", "User likes sushi", embedding_service_->embed("User likes sushi")));
+  ASSERT_TRUE(kb_->remove("lex_tabs"));
+  EXPECT_TRUE(kb_->searchLexical("spicy", 5).empty());
+  EXPECT_EQ(kb_->searchLexical("sushi", 5).size(), 1u);
+  EXPECT_EQ(kb_->searchLexical("request", 5).size(), 1u);
+
+  // Restored from the snapshot, and rebuilt from storage without one
+  kb_.reset();
+  kb_ = std::make_unique<kb::KnowledgeBase>(test_db_path_, 128);
+  EXPECT_EQ(kb_->searchLexical("sushi", 5).size(), 1u);
+  EXPECT_EQ(kb_->searchLexical("request", 5).size(), 1u);
+
+  kb_.reset();
+  fs::remove(test_db_path_ + "/faiss.snapshot");
+  kb_ = std::make_unique<kb::KnowledgeBase>(test_db_path_, 128);
+  EXPECT_EQ(kb_->searchLexical("sushi", 5).size(), 1u);
+  EXPECT_TRUE(kb_->searchLexical("tabs", 5).empty());
+  results = kb_->searchLexical("E0432", 5);
+  ASSERT_EQ(results.size(), 1u);
+  EXPECT_EQ(results[0].id, "lex_rust");
+}
+
+// Test 69: Export, Import And Checkpoint
+TEST_F(KnowledgeBaseTest, ExportImportAndCheckpoint) {
+  for (int i = 0; i < 20; ++i) {
+    kb::Memory memory;
+    memory.id = "transfer_" + std::to_string(i);
+    memory.content = "Transfer memory " + std::to_string(i);
+    memory.category = i % 2 ? "odd" : "even";
+    memory.timestamp = 1234567890000 + i;
+    memory.embedding = embedding_service_->embed(memory.content);
+    ASSERT_TRUE(kb_->add(memory));
+  }
+  kb::Memory generated;
+  generated.content = "Transfer memory with a generated id";
+  generated.category = "generated";
+  generated.timestamp = 1234567890100;
+  generated.embedding = embedding_service_->embed(generated.content);
+  std::string generated_id = kb_->addAndReturnId(generated);
+  ASSERT_FALSE(generated_id.empty());
+  ASSERT_TRUE(kb_->updateUserPreference("theme", "dark"));
+  ASSERT_TRUE(kb_->updateUserPreference("language", "en"));
+
+  std::string export_file = test_db_path_ + "_export.bin";
+  std::string copy_path = test_db_path_ + "_copy";
+  std::string checkpoint_path = test_db_path_ + "_checkpoint";
+  kb::TransferCounts counts;
+  {
+    std::unique_ptr<FILE, int (*)(FILE*)> out(std::fopen(export_file.c_str(), "wb"), &std::fclose);
+    ASSERT_TRUE(out);
+    ASSERT_TRUE(kb_->exportTo(out.get(), &counts));
+  }
+  EXPECT_EQ(counts.memories, 21u);
+  EXPECT_EQ(counts.preferences, 2u);
+
+  // Into a store that encodes vectors differently and already holds one of the ids
+  kb::IndexOptions f16_options;
+  f16_options.storage = "f16";
+  {
+    kb::KnowledgeBase copy(copy_path, 128, f16_options);
+    kb::Memory stale;
+    stale.id = "transfer_3";
+    stale.content = "Stale copy";
+    stale.category = "stale";
+    stale.timestamp = 0;
+    stale.embedding = embedding_service_->embed(stale.content);
+    ASSERT_TRUE(copy.add(stale));
+
+    std::unique_ptr<FILE, int (*)(FILE*)> in(std::fopen(export_file.c_str(), "rb"), &std::fclose);
+    ASSERT_TRUE(copy.importFrom(in.get(), &counts));
+    EXPECT_EQ(counts.memories, 21u);
+    EXPECT_EQ(counts.preferences, 2u);
+    EXPECT_EQ(copy.size(), 21u);
+
+    auto results = copy.search(embedding_service_->embed("Transfer memory 3"), 1);
+    ASSERT_EQ(results.size(), 1u);
+    EXPECT_EQ(results[0].id, "transfer_3");
+    EXPECT_EQ(results[0].content, "Transfer memory 3");
+    EXPECT_EQ(results[0].category, "odd");
+    EXPECT_EQ(results[0].timestamp, 1234567890003);
+
+    kb::SearchOptions even;
+    even.category = "even";
+    EXPECT_EQ(copy.search(embedding_service_->embed("Transfer memory"), 30, even).size(), 10u);
+    EXPECT_TRUE(copy.searchLexical("stale", 5).empty());
+    EXPECT_EQ(copy.searchLexical("transfer", 30).size(), 21u);
+    EXPECT_EQ(copy.getUserPreference("theme"), "dark");
+    EXPECT_EQ(copy.getUserPreference("language"), "en");
+
+    // Ids generated afterwards still sort after the imported ones
+    generated.content = "Generated after the import";
+    generated.embedding = embedding_service_->embed(generated.content);
+    std::string next_id = copy.addAndReturnId(generated);
+    EXPECT_GT(next_id, generated_id);
+  }
+
+  // Truncated streams, and streams of another dimension, change nothing
+  std::string bytes;
+  {
+    std::ifstream in(export_file, std::ios::binary);
+    bytes.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+  }
+  {
+    std::ofstream out(export_file, std::ios::binary | std::ios::trunc);
+    out.write(bytes.data(), bytes.size() - 1);
+  }
+  {
+    kb::KnowledgeBase copy(copy_path, 128, f16_options);
+    EXPECT_EQ(copy.size(), 22u);
+    std::unique_ptr<FILE, int (*)(FILE*)> in(std::fopen(export_file.c_str(), "rb"), &std::fclose);
+    EXPECT_FALSE(copy.importFrom(in.get()));
+    EXPECT_EQ(copy.size(), 22u);
+  }
+  {
+    kb::KnowledgeBase narrow(copy_path + "_narrow", 64);
+    std::unique_ptr<FILE, int (*)(FILE*)> in(std::fopen(export_file.c_str(), "rb"), &std::fclose);
+    EXPECT_FALSE(narrow.importFrom(in.get()));
+    EXPECT_EQ(narrow.size(), 0u);
+  }
+
+  // A checkpoint of the open store opens as a store of its own
+  ASSERT_TRUE(kb_->checkpoint(checkpoint_path));
+  EXPECT_TRUE(fs::exists(checkpoint_path + "/faiss.snapshot"));
+  EXPECT_FALSE(kb_->checkpoint(checkpoint_path));
+  ASSERT_TRUE(kb_->remove("transfer_0"));
+  {
+    kb::KnowledgeBase restored(checkpoint_path, 128);
+    EXPECT_EQ(restored.size(), 21u);
+    EXPECT_TRUE(restored.exists("transfer_0"));
+    EXPECT_EQ(restored.getUserPreference("theme"), "dark");
+    auto results = restored.search(embedding_service_->embed("Transfer memory 7"), 1);
+    ASSERT_EQ(results.size(), 1u);
+    EXPECT_EQ(results[0].id, "transfer_7");
+  }
+
+  fs::remove(export_file);
+  fs::remove_all(copy_path);
+  fs::remove_all(copy_path + "_narrow");
+  fs::remove_all(checkpoint_path);
+}
+
+// Test 70: WAL Replication
+TEST_F(KnowledgeBaseTest, WalReplication) {
+  for (int i = 0; i < 10; ++i) {
+    kb::Memory memory;
+    memory.id = "replicated_" + std::to_string(i);
+    memory.content = "Replicated memory " + std::to_string(i);
+    memory.category = i % 2 ? "odd" : "even";
+    memory.timestamp = 1234567890000 + i;
+    memory.embedding = embedding_service_->embed(memory.content);
+    ASSERT_TRUE(kb_->add(memory));
+  }
+  ASSERT_TRUE(kb_->update("replicated_4", "Rewritten on the primary",
+                          embedding_service_->embed("Rewritten on the primary")));
+  ASSERT_TRUE(kb_->remove("replicated_9"));
+  ASSERT_TRUE(kb_->updateUserPreference("theme", "dark"));
+
+  std::string replica_path = test_db_path_ + "_replica";
+  auto catchUp = [this](kb::KnowledgeBase& replica, size_t max_bytes) {
+    std::vector<kb::WalBatch> batches;
+    uint64_t latest = 0;
+    do {
+      ASSERT_TRUE(kb_->readWal(replica.replicationPosition(), max_bytes, &batches, &latest));
+      ASSERT_TRUE(replica.applyWal(batches));
+    } while (replica.replicationPosition() <= latest);
+  };
+
+  std::vector<kb::WalBatch> first;
+  {
+    kb::KnowledgeBase replica(replica_path, 128);
+    EXPECT_EQ(replica.replicationPosition(), 1u);
+
+    // A tiny limit still makes progress, a batch at a time
+    uint64_t latest = 0;
+    ASSERT_TRUE(kb_->readWal(1, 1, &first, &latest));
+    ASSERT_EQ(first.size(), 1u);
+    catchUp(replica, 1);
+
+    EXPECT_EQ(replica.size(), 9u);
+    EXPECT_FALSE(replica.exists("replicated_9"));
+    EXPECT_EQ(replica.getUserPreference("theme"), "dark");
+    auto results = replica.search(embedding_service_->embed("Rewritten on the primary"), 1);
+    ASSERT_EQ(results.size(), 1u);
+    EXPECT_EQ(results[0].id, "replicated_4");
+    EXPECT_EQ(results[0].content, "Rewritten on the primary");
+    EXPECT_EQ(replica.searchLexical("rewritten", 5).size(), 1u);
+    kb::SearchOptions odd;
+    odd.category = "odd";
+    EXPECT_EQ(replica.search(embedding_service_->embed("Replicated memory"), 10, odd).size(), 4u);
+
+    // Batches already applied are skipped
+    ASSERT_TRUE(replica.applyWal(first));
+    EXPECT_EQ(replica.size(), 9u);
+  }
+
+  // A reopened replica resumes from where it stopped
+  kb::Memory later;
+  later.id = "replicated_later";
+  later.content = "Written while the replica was down";
+  later.category = "later";
+  later.timestamp = 1234567890100;
+  later.embedding = embedding_service_->embed(later.content);
+  ASSERT_TRUE(kb_->add(later));
+  ASSERT_TRUE(kb_->remove("replicated_0"));
+  {
+    kb::KnowledgeBase replica(replica_path, 128);
+    EXPECT_EQ(replica.size(), 9u);
+    uint64_t position = replica.replicationPosition();
+    EXPECT_GT(position, first[0].sequence);
+
+    std::vector<kb::WalBatch> batches;
+    uint64_t latest = 0;
+    ASSERT_TRUE(kb_->readWal(position, 1 << 20, &batches, &latest));
+    ASSERT_EQ(batches.size(), 2u);
+    ASSERT_TRUE(replica.applyWal(batches));
+    EXPECT_EQ(replica.replicationPosition(), latest + 1);
+    EXPECT_EQ(replica.size(), 9u);
+    EXPECT_TRUE(replica.exists("replicated_later"));
+    EXPECT_FALSE(replica.exists("replicated_0"));
+
+    // Nothing new: no batches, still consistent
+    ASSERT_TRUE(kb_->readWal(replica.replicationPosition(), 1 << 20, &batches, &latest));
+    EXPECT_TRUE(batches.empty());
+
+    // A gap is refused
+    kb::WalBatch ahead;
+    ahead.sequence = replica.replicationPosition() + 10;
+    ahead.data = first[0].data;
+    EXPECT_FALSE(replica.applyWal({ahead}));
+  }
+
+  // An import bypasses the WAL, which replicas following it must notice
+  std::string export_file = test_db_path_ + "_replication_export.bin";
+  {
+    std::unique_ptr<FILE, int (*)(FILE*)> out(std::fopen(export_file.c_str(), "wb"), &std::fclose);
+    ASSERT_TRUE(kb_->exportTo(out.get()));
+  }
+  {
+    std::unique_ptr<FILE, int (*)(FILE*)> in(std::fopen(export_file.c_str(), "rb"), &std::fclose);
+    ASSERT_TRUE(kb_->importFrom(in.get()));
+  }
+  {
+    kb::KnowledgeBase replica(replica_path, 128);
+    std::vector<kb::WalBatch> batches;
+    uint64_t latest = 0;
+    bool readable = kb_->readWal(replica.replicationPosition(), 1 << 20, &batches, &latest);
+    EXPECT_FALSE(readable && replica.applyWal(batches));
+  }
+
+  fs::remove(export_file);
+  fs::remove_all(replica_path);
+}
+
+// Test 71: A Memory That Never Embeds Fails Alone And Is Reported
+class PoisonEmbeddingService : public CountingEmbeddingService {
+public:
+  using CountingEmbeddingService::CountingEmbeddingService;
+
+  std::vector<std::vector<float>> embedBatch(const std::vector<std::string>& texts) override {
+    for (const std::string& text : texts) {
+      if (text == "poison") {
+        ++calls;
+        throw kb::EmbeddingInputError("input rejected");
+      }
+    }
+    return CountingEmbeddingService::embedBatch(texts);
+  }
+};
+
+TEST_F(KnowledgeBaseTest, IngestPipelineIsolatesFailingMemories) {
+  kb_.reset();
+  auto kb = std::make_shared<kb::KnowledgeBase>(test_db_path_, 128);
+  auto embedder = std::make_shared<PoisonEmbeddingService>(128);
+  kb::IngestOptions options;
+  options.max_delay = std::chrono::milliseconds(50);  // one batch for all of them
+  options.retry_delay = std::chrono::milliseconds(1);
+  options.max_attempts = 3;
+  uint64_t ticket = 0;
+  {
+    kb::IngestPipeline ingest(kb, embedder, options);
+    uint64_t poison_ticket = 0;
+    for (int i = 0; i < 16; ++i) {
+      kb::Memory memory;
+      memory.content = i == 5 ? "poison" : "healthy memory " + std::to_string(i);
+      memory.category = "general";
+      memory.timestamp = i;
+      ASSERT_FALSE(ingest.submit(memory, &ticket).empty());
+      if (i == 5) {
+        poison_ticket = ticket;
+      }
+    }
+
+    ASSERT_TRUE(ingest.waitForAll(ticket, std::chrono::seconds(10)));
+    EXPECT_EQ(kb->size(), 15);
+    EXPECT_TRUE(kb->queuedMemories().empty());
+    auto failed = ingest.failures(0, ticket);
+    ASSERT_EQ(failed.size(), 1);
+    EXPECT_EQ(failed[0].ticket, poison_ticket);
+    EXPECT_NE(failed[0].error.find("input rejected"), std::string::npos);
+    EXPECT_TRUE(ingest.failures(poison_ticket, ticket).empty());
+  }
+
+  // A queued id is taken: neither a synchronous add nor a second enqueue
+  // gets it, so the queued add cannot be skipped as a duplicate
+  kb::Memory memory;
+  memory.id = "queued";
+  memory.content = "queued first";
+  memory.category = "general";
+  memory.timestamp = 0;
+  ASSERT_EQ(kb->enqueue(ticket + 1, memory), "queued");
+  memory.embedding = embedding_service_->embed(memory.content);
+  EXPECT_FALSE(kb->add(memory));
+  EXPECT_TRUE(kb->addBatch({memory})[0].empty());
+  EXPECT_TRUE(kb->enqueue(ticket + 2, memory).empty());
+
+  kb::IngestPipeline ingest(kb, embedder, options);
+  ASSERT_TRUE(ingest.waitFor(ingest.lastTicket(), std::chrono::seconds(10)));
+  EXPECT_TRUE(ingest.failures(0, ingest.lastTicket()).empty());
+  EXPECT_TRUE(kb->exists("queued"));
+}
+
+// Test 72: Replica Namespaces Are Closed Like Any Other
+TEST_F(KnowledgeBaseTest, ReplicaNamespacesAreEvicted) {
+  auto main_kb = std::make_shared<kb::KnowledgeBase>(test_db_path_ + "_main", 128);
+  kb::NamespaceOptions options;
+  options.max_open = 1;
+  options.idle_timeout = std::chrono::seconds(0);
+  kb::ReplicaOptions replica_options;
+  replica_options.primary = "127.0.0.1:1";  // nothing listens; the replicas just retry
+  replica_options.poll_interval = std::chrono::seconds(10);
+  auto registry = std::make_unique<kb::NamespaceRegistry>(
+    kb::Tenant{main_kb, nullptr}, test_db_path_ + "_ns",
+    [replica_options](const std::string& path) {
+      kb::Tenant tenant;
+      tenant.kb = std::make_shared<kb::KnowledgeBase>(path, 128);
+      tenant.replicator = std::make_shared<kb::Replicator>(tenant.kb, "", replica_options);
+      return tenant;
+    },
+    options);
+
+  std::string error;
+  std::weak_ptr<kb::KnowledgeBase> alice;
+  {
+    kb::Tenant tenant;
+    ASSERT_TRUE(registry->acquire("alice", &tenant, &error)) << error;
+    alice = tenant.kb;
+  }
+  {
+    kb::Tenant tenant;
+    ASSERT_TRUE(registry->acquire("bob", &tenant, &error)) << error;
+  }
+  // Opening bob closed alice, replicator and all
+  EXPECT_EQ(registry->openCount(), 1u);
+  EXPECT_TRUE(alice.expired());
+
+  registry.reset();
+  main_kb.reset();
+  fs::remove_all(test_db_path_ + "_main");
+  fs::remove_all(test_db_path_ + "_ns");
+}
+
+// Test 73: A Memory Being Retried Does Not Hold Up Later Adds
+TEST_F(KnowledgeBaseTest, IngestRetriesDoNotStallTheQueue) {
+  kb_.reset();
+  auto kb = std::make_shared<kb::KnowledgeBase>(test_db_path_, 128);
+  auto embedder = std::make_shared<PoisonEmbeddingService>(128);
+  kb::IngestPipeline ingest(kb, embedder);  // default backoff: 1s, then 2s, 4s, ...
+
+  kb::Memory memory;
+  memory.content = "poison";
+  memory.category = "general";
+  memory.timestamp = 0;
+  uint64_t poison_ticket = 0;
+  ASSERT_FALSE(ingest.submit(memory, &poison_ticket).empty());
+  auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+  while (embedder->calls == 0 && std::chrono::steady_clock::now() < deadline) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  ASSERT_GT(embedder->calls, 0);
+
+  memory.content = "healthy after poison";
+  uint64_t ticket = 0;
+  std::string id = ingest.submit(memory, &ticket);
+  ASSERT_FALSE(id.empty());
+  ASSERT_TRUE(ingest.waitFor(ticket, std::chrono::milliseconds(500)));
+  EXPECT_TRUE(kb->exists(id));
+  EXPECT_TRUE(ingest.failures(0, ticket).empty());
+
+  EXPECT_FALSE(ingest.waitFor(poison_ticket, std::chrono::milliseconds(10)));
+  EXPECT_FALSE(ingest.waitForAll(ticket, std::chrono::milliseconds(10)));
+  EXPECT_EQ(ingest.pending(), 1u);
+}
+
+// Test 74: A Batch The Embedder Fails On Is Retried Whole, Not Bisected
+TEST_F(KnowledgeBaseTest, IngestRetriesTransientFailuresWhole) {
+  kb_.reset();
+  auto kb = std::make_shared<kb::KnowledgeBase>(test_db_path_, 128);
+  auto embedder = std::make_shared<CountingEmbeddingService>(128);
+  embedder->fail = true;  // "model unavailable", not a rejection
+  kb::IngestOptions options;
+  options.max_delay = std::chrono::milliseconds(50);  // one batch for all of them
+  options.retry_delay = std::chrono::milliseconds(1);
+  options.max_retry_delay = std::chrono::milliseconds(1);
+  options.max_attempts = 2;
+  kb::IngestPipeline ingest(kb, embedder, options);
+
+  uint64_t ticket = 0;
+  for (int i = 0; i < 8; ++i) {
+    kb::Memory memory;
+    memory.content = "outage memory " + std::to_string(i);
+    memory.category = "general";
+    memory.timestamp = i;
+    ASSERT_FALSE(ingest.submit(memory, &ticket).empty());
+  }
+  auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+  while (embedder->calls < 5 && std::chrono::steady_clock::now() < deadline) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  ASSERT_GE(embedder->calls, 5);  // more than max_attempts
+  EXPECT_EQ(ingest.pending(), 8u);
+
+  embedder->fail = false;
+  ASSERT_TRUE(ingest.waitForAll(ticket, std::chrono::seconds(10)));
+  EXPECT_EQ(kb->size(), 8);
+  EXPECT_TRUE(ingest.failures(0, ticket).empty());
+  EXPECT_EQ(embedder->texts_seen, 8u * embedder->calls);  // every call had the whole batch
+}
+
+// Blocking client for the socket-level TCPServer tests
+class TestClient {
+public:
+  explicit TestClient(int port, int receive_buffer = 0) : fd_(socket(AF_INET, SOCK_STREAM, 0)) {
+    if (receive_buffer > 0) {
+      setsockopt(fd_, SOL_SOCKET, SO_RCVBUF, &receive_buffer, sizeof(receive_buffer));
+    }
+    timeval timeout{10, 0};
+    setsockopt(fd_, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    inet_pton(AF_INET, "127.0.0.1", &addr.sin_addr);
+    connected_ = connect(fd_, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == 0;
+  }
+  ~TestClient() { close(fd_); }
+
+  bool connected() const { return connected_; }
+  int fd() const { return fd_; }
+
+  bool send(const std::string& data) {
+    size_t sent = 0;
+    while (sent < data.size()) {
+      ssize_t n = ::send(fd_, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+      if (n <= 0) {
+        return false;
+      }
+      sent += n;
+    }
+    return true;
+  }
+
+  // Next newline-terminated response without the newline; "" once the
+  // server closed the connection (or after the 10s timeout)
+  std::string readLine() {
+    size_t newline;
+    while ((newline = buffered_.find('\n')) == std::string::npos) {
+      if (!fill()) {
+        return "";
+      }
+    }
+    std::string line = buffered_.substr(0, newline);
+    buffered_.erase(0, newline + 1);
+    return line;
+  }
+
+  // Next length-prefixed binary-protocol frame; "" once closed
+  std::string readFrame() {
+    while (buffered_.size() < 4 || buffered_.size() - 4 < frameLength()) {
+      if (!fill()) {
+        return "";
+      }
+    }
+    std::string frame = buffered_.substr(4, frameLength());
+    buffered_.erase(0, 4 + frame.size());
+    return frame;
+  }
+
+  // True once the server has closed its side, with nothing left to read
+  bool closedByServer() {
+    while (fill()) {
+    }
+    return buffered_.empty() && eof_;
+  }
+
+private:
+  bool fill() {
+    char chunk[65536];
+    ssize_t n = recv(fd_, chunk, sizeof(chunk), 0);
+    if (n > 0) {
+      buffered_.append(chunk, n);
+      return true;
+    }
+    eof_ = n == 0 || errno == ECONNRESET;
+    return false;
+  }
+
+  size_t frameLength() const {
+    size_t length = 0;
+    for (size_t i = 0; i < 4; ++i) {
+      length = (length << 8) | static_cast<uint8_t>(buffered_[i]);
+    }
+    return length;
+  }
+
+  int fd_;
+  bool connected_ = false;
+  bool eof_ = false;
+  std::string buffered_;
+};
+
+// Test 75: A Request Split Across Reads Is Framed By Its Newline
+TEST_F(KnowledgeBaseTest, ServerFramesRequestsAcrossReads) {
+  kb_.reset();
+  auto kb = std::make_shared<kb::KnowledgeBase>(test_db_path_, 128);
+  kb->updateUserPreference("indentation", "2 spaces");
+  kb->updateUserPreference("language", "C++");
+  auto handler = std::make_shared<kb::RequestHandler>(kb, std::make_shared<kb::MockEmbeddingService>(128));
+  kb::TCPServer server(0, kb, handler);
+  server.start();
+  ASSERT_GT(server.port(), 0);
+
+  TestClient client(server.port());
+  ASSERT_TRUE(client.connected());
+  ASSERT_TRUE(client.send("{\"endpoint\": \"/get_preference\", "));
+  std::this_thread::sleep_for(std::chrono::milliseconds(20));
+  ASSERT_TRUE(client.send("\"params\": {\"key\": \"indentation\"}}\n{\"endpoint\": \"/get_pref"));
+  EXPECT_EQ(nlohmann::json::parse(client.readLine())["value"], "2 spaces");
+  std::this_thread::sleep_for(std::chrono::milliseconds(20));
+  ASSERT_TRUE(client.send("erence\", \"params\": {\"key\": \"language\"}}\r\n"));
+  EXPECT_EQ(nlohmann::json::parse(client.readLine())["value"], "C++");
+
+  // One byte at a time, and the connection stays open for more
+  std::string request = "{\"endpoint\": \"/get_preference\", \"params\": {\"key\": \"language\"}}\n";
+  for (char c : request) {
+    ASSERT_TRUE(client.send(std::string(1, c)));
+  }
+  EXPECT_EQ(nlohmann::json::parse(client.readLine())["value"], "C++");
+  EXPECT_EQ(server.activeConnections(), 1);
+}
+
+// Test 76: Pipelined Requests Are Answered In Order
+TEST_F(KnowledgeBaseTest, ServerAnswersPipelinedRequestsInOrder) {
+  kb_.reset();
+  auto kb = std::make_shared<kb::KnowledgeBase>(test_db_path_, 128);
+  for (int i = 0; i < 200; ++i) {
+    kb->updateUserPreference("key" + std::to_string(i), "value" + std::to_string(i));
+  }
+  auto handler = std::make_shared<kb::RequestHandler>(kb, std::make_shared<kb::MockEmbeddingService>(128));
+  kb::ServerOptions options;
+  options.worker_threads = 4;
+  kb::TCPServer server(0, kb, handler, options);
+  server.start();
+
+  TestClient client(server.port());
+  ASSERT_TRUE(client.connected());
+  std::string requests;
+  for (int i = 0; i < 200; ++i) {
+    requests += "{\"endpoint\": \"/get_preference\", \"params\": {\"key\": \"key" + std::to_string(i) + "\"}}\n";
+  }
+  ASSERT_TRUE(client.send(requests));
+  for (int i = 0; i < 200; ++i) {
+    std::string line = client.readLine();
+    ASSERT_FALSE(line.empty()) << "response " << i;
+    EXPECT_EQ(nlohmann::json::parse(line)["value"], "value" + std::to_string(i));
+  }
+
+  // Malformed requests get an error in their place and do not end the stream
+  ASSERT_TRUE(client.send("not json\n{\"endpoint\": \"/get_preference\", \"params\": {\"key\": \"key7\"}}\n"));
+  EXPECT_FALSE(nlohmann::json::parse(client.readLine())["success"]);
+  EXPECT_EQ(nlohmann::json::parse(client.readLine())["value"], "value7");
+}
+
+// Test 77: A Peer That Half-Closes Still Gets Its Replies
+TEST_F(KnowledgeBaseTest, ServerAnswersHalfClosedPeers) {
+  kb_.reset();
+  auto kb = std::make_shared<kb::KnowledgeBase>(test_db_path_, 128);
+  kb->updateUserPreference("indentation", "2 spaces");
+  auto handler = std::make_shared<kb::RequestHandler>(kb, std::make_shared<kb::MockEmbeddingService>(128));
+  kb::TCPServer server(0, kb, handler);
+  server.start();
+
+  // The original one-request-per-connection protocol: no trailing newline
+  {
+    TestClient client(server.port());
+    ASSERT_TRUE(client.connected());
+    ASSERT_TRUE(client.send("{\"endpoint\": \"/get_preference\", \"params\": {\"key\": \"indentation\"}}"));
+    shutdown(client.fd(), SHUT_WR);
+    EXPECT_EQ(nlohmann::json::parse(client.readLine())["value"], "2 spaces");
+    EXPECT_TRUE(client.closedByServer());
+  }
+
+  // Several pipelined requests, then EOF: every one is answered first
+  {
+    TestClient client(server.port());
+    ASSERT_TRUE(client.connected());
+    std::string request = "{\"endpoint\": \"/get_preference\", \"params\": {\"key\": \"indentation\"}}\n";
+    ASSERT_TRUE(client.send(request + request + request));
+    shutdown(client.fd(), SHUT_WR);
+    for (int i = 0; i < 3; ++i) {
+      EXPECT_EQ(nlohmann::json::parse(client.readLine())["value"], "2 spaces");
+    }
+    EXPECT_TRUE(client.closedByServer());
+  }
+
+  // Nothing sent at all
+  {
+    TestClient client(server.port());
+    ASSERT_TRUE(client.connected());
+    shutdown(client.fd(), SHUT_WR);
+    EXPECT_TRUE(client.closedByServer());
+  }
+}
+
+// Test 78: A Request Over The Size Limit Closes The Connection
+TEST_F(KnowledgeBaseTest, ServerClosesOverlongRequests) {
+  kb_.reset();
+  auto kb = std::make_shared<kb::KnowledgeBase>(test_db_path_, 128);
+  kb->updateUserPreference("indentation", "2 spaces");
+  auto handler = std::make_shared<kb::RequestHandler>(kb, std::make_shared<kb::MockEmbeddingService>(128));
+  kb::ServerOptions options;
+  options.max_request_bytes = 1024;
+  kb::TCPServer server(0, kb, handler, options);
+  server.start();
+
+  std::string request = "{\"endpoint\": \"/get_preference\", \"params\": {\"key\": \"indentation\", \"pad\": \"" +
+                        std::string(900, 'x') + "\"}}\n";
+  {
+    TestClient client(server.port());
+    ASSERT_TRUE(client.connected());
+    ASSERT_TRUE(client.send(request));
+    EXPECT_EQ(nlohmann::json::parse(client.readLine())["value"], "2 spaces");
+  }
+
+  // A line that never ends is cut off once it passes the limit
+  {
+    TestClient client(server.port());
+    ASSERT_TRUE(client.connected());
+    client.send("{\"endpoint\": \"" + std::string(4096, 'x'));
+    EXPECT_TRUE(client.closedByServer());
+  }
+
+  // So is a binary frame announcing more than the limit
+  {
+    TestClient client(server.port());
+    ASSERT_TRUE(client.connected());
+    client.send(std::string("\xB1KB\x01\x00\x10\x00\x00", 8));
+    EXPECT_TRUE(client.closedByServer());
+  }
+
+  auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+  while (server.activeConnections() > 0 && std::chrono::steady_clock::now() < deadline) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  EXPECT_EQ(server.activeConnections(), 0);
+}
+
+// Test 79: A Client That Does Not Read Its Replies Is Held Back
+TEST_F(KnowledgeBaseTest, ServerAppliesBackPressure) {
+  kb_.reset();
+  auto kb = std::make_shared<kb::KnowledgeBase>(test_db_path_, 128);
+  for (int i = 0; i < 200; ++i) {
+    kb->updateUserPreference("key" + std::to_string(i), "value" + std::to_string(i));
+  }
+  for (int i = 0; i < 10; ++i) {
+    kb->updateUserPreference("bulk" + std::to_string(i), std::string(100, 'v'));
+  }
+  auto handler = std::make_shared<kb::RequestHandler>(kb, std::make_shared<kb::MockEmbeddingService>(128));
+  kb::ServerOptions options;
+  options.worker_threads = 4;
+  options.max_queued_requests = 2;
+  options.max_pending_output = 256;
+  kb::TCPServer server(0, kb, handler, options);
+  server.start();
+
+  // Far more than the limits pipelined: reading pauses and resumes, and
+  // every reply still comes back in order
+  {
+    TestClient client(server.port());
+    ASSERT_TRUE(client.connected());
+    std::string requests;
+    for (int i = 0; i < 200; ++i) {
+      requests += "{\"endpoint\": \"/get_preference\", \"params\": {\"key\": \"key" + std::to_string(i) + "\"}}\n";
+    }
+    ASSERT_TRUE(client.send(requests));
+    for (int i = 0; i < 200; ++i) {
+      std::string line = client.readLine();
+      ASSERT_FALSE(line.empty()) << "response " << i;
+      EXPECT_EQ(nlohmann::json::parse(line)["value"], "value" + std::to_string(i));
+    }
+  }
+
+  // A flood of requests with large replies, none of them read: once the
+  // socket buffers fill the server stops reading, so the sender stalls
+  // long before the flood is through
+  auto flood = std::make_unique<TestClient>(server.port(), 4096);
+  ASSERT_TRUE(flood->connected());
+  fcntl(flood->fd(), F_SETFL, fcntl(flood->fd(), F_GETFL) | O_NONBLOCK);
+  std::string request = "{\"endpoint\": \"/list_preferences\", \"params\": {\"prefix\": \"bulk\"}}\n";
+  std::string chunk;
+  while (chunk.size() < 65536) {
+    chunk += request;
+  }
+  const size_t total = 64 << 20;
+  size_t sent = 0;
+  while (sent < total) {
+    ssize_t n = ::send(flood->fd(), chunk.data(), chunk.size(), MSG_NOSIGNAL);
+    if (n > 0) {
+      sent += n;
+      continue;
+    }
+    ASSERT_TRUE(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK));
+    pollfd writable{flood->fd(), POLLOUT, 0};
+    if (poll(&writable, 1, 500) == 0) {
+      break;  // stalled
+    }
+  }
+  EXPECT_LT(sent, total / 4);
+
+  // Other connections are unaffected, and the stalled one is still closed
+  // when its peer goes away
+  {
+    TestClient client(server.port());
+    ASSERT_TRUE(client.connected());
+    ASSERT_TRUE(client.send("{\"endpoint\": \"/get_preference\", \"params\": {\"key\": \"key1\"}}\n"));
+    EXPECT_EQ(nlohmann::json::parse(client.readLine())["value"], "value1");
+  }
+  flood.reset();
+  auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+  while (server.activeConnections() > 0 && std::chrono::steady_clock::now() < deadline) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  EXPECT_EQ(server.activeConnections(), 0);
+}
+
+// Test 80: An Embedder Of The Wrong Dimension Does Not Lose Queued Adds
+class MisconfiguredEmbeddingService : public CountingEmbeddingService {
+public:
+  using CountingEmbeddingService::CountingEmbeddingService;
+
+  std::vector<std::vector<float>> embedBatch(const std::vector<std::string>& texts) override {
+    std::vector<std::vector<float>> embeddings = CountingEmbeddingService::embedBatch(texts);
+    if (calls <= wrong_calls) {
+      for (auto& embedding : embeddings) {
+        embedding.resize(64);
+      }
+    }
+    return embeddings;
+  }
+
+  int wrong_calls = 4;
+};
+
+TEST_F(KnowledgeBaseTest, IngestPipelineRetriesMisconfiguredEmbedder) {
+  kb_.reset();
+  auto kb = std::make_shared<kb::KnowledgeBase>(test_db_path_, 128);
+  auto embedder = std::make_shared<MisconfiguredEmbeddingService>(128);
+  kb::IngestOptions options;
+  options.retry_delay = std::chrono::milliseconds(1);
+  options.max_attempts = 1;  // a single rejection would give the memory up
+  kb::IngestPipeline ingest(kb, embedder, options);
+
+  kb::Memory memory;
+  memory.content = "acknowledged while the model was wrong";
+  memory.category = "general";
+  memory.timestamp = 0;
+  uint64_t ticket = 0;
+  std::string id = ingest.submit(memory, &ticket);
+  ASSERT_FALSE(id.empty());
+
+  // Retried whole until the embedder answers in the store's dimension
+  ASSERT_TRUE(ingest.waitFor(ticket, std::chrono::seconds(10)));
+  EXPECT_GT(embedder->calls, embedder->wrong_calls);
+  EXPECT_TRUE(ingest.failures(0, ticket).empty());
+  EXPECT_TRUE(kb->exists(id));
+  EXPECT_TRUE(kb->queuedMemories().empty());
+}
+
+// Test 81: A Rejected Text Fails Only Its Own Caller In A Shared Batch
+TEST_F(KnowledgeBaseTest, EmbeddingBatcherIsolatesRejectedTexts) {
+  auto inner = std::make_shared<PoisonEmbeddingService>(128);
+  kb::BatchingEmbeddingService batcher(inner, 64, std::chrono::milliseconds(50), 1);
+
+  const int num_threads = 8;
+  std::vector<std::vector<float>> results(num_threads);
+  std::vector<int> rejected(num_threads, 0);
+  std::vector<std::thread> threads;
+  for (int t = 0; t < num_threads; ++t) {
+    threads.emplace_back([&, t]() {
+      try {
+        results[t] = batcher.embed(t == 3 ? "poison" : "concurrent text " + std::to_string(t));
+      } catch (const kb::EmbeddingInputError&) {
+        rejected[t] = 1;
+      }
+    });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+
+  for (int t = 0; t < num_threads; ++t) {
+    if (t == 3) {
+      EXPECT_EQ(rejected[t], 1);
+    } else {
+      EXPECT_EQ(rejected[t], 0) << "caller " << t;
+      EXPECT_EQ(results[t], embedding_service_->embed("concurrent text " + std::to_string(t)));
+    }
+  }
+
+  // A caller's own batch with a rejected text still fails as a whole
+  EXPECT_THROW(batcher.embedBatch({"fine", "poison"}), kb::EmbeddingInputError);
+}
+
+// Test 82: Writes During A Background Retrain Land In The New Index
+TEST_F(KnowledgeBaseTest, WritesDuringRetrainAreKept) {
+  kb_.reset();
+  fs::remove_all(test_db_path_);
+  kb::IndexOptions options;
+  options.type = "ivf";
+  kb_ = std::make_unique<kb::KnowledgeBase>(test_db_path_, 128, options);
+
+  auto memoryAt = [this](int i) {
+    kb::Memory mem;
+    mem.id = "retrain_" + std::to_string(i);
+    mem.content = "Retrain memory " + std::to_string(i);
+    mem.category = "test";
+    mem.timestamp = 1234567890000 + i;
+    mem.embedding = embedding_service_->embed(mem.content);
+    return mem;
+  };
+
+  // Crossing the training threshold starts a rebuild in the background;
+  // adds, updates and removes keep coming while it trains
+  std::vector<kb::Memory> memories;
+  for (int i = 0; i < 1200; ++i) {
+    memories.push_back(memoryAt(i));
+  }
+  kb_->addBatch(memories);
+  for (int i = 1200; i < 1600; ++i) {
+    ASSERT_TRUE(kb_->add(memoryAt(i)));
+    if (i % 10 == 0) {
+      ASSERT_TRUE(kb_->remove("retrain_" + std::to_string(i - 1000)));
+    }
+    if (i % 10 == 5) {
+      kb::Memory moved = memoryAt(i + 10000);
+      ASSERT_TRUE(kb_->update("retrain_" + std::to_string(i - 1000), moved.content, moved.embedding));
+    }
+  }
+
+  auto check = [this, &memoryAt]() {
+    EXPECT_EQ(kb_->size(), 1560);
+    kb::SearchOptions exhaustive;
+    exhaustive.nprobe = 4096;
+    for (int i = 200; i < 1600; i += 5) {
+      bool removed = i < 600 && i % 10 == 0;
+      bool updated = i < 600 && i % 10 == 5;
+      auto query = memoryAt(updated ? i + 11000 : i).embedding;
+      auto results = kb_->search(query, 1, exhaustive);
+      ASSERT_EQ(results.size(), 1);
+      if (removed) {
+        EXPECT_NE(results[0].id, "retrain_" + std::to_string(i));
+      } else {
+        EXPECT_EQ(results[0].id, "retrain_" + std::to_string(i)) << "memory " << i;
+      }
+    }
+  };
+  check();
+
+  // Once the rebuild has been swapped in (the destructor waits for it) the
+  // store reopens with everything in place
+  kb_.reset();
+  kb_ = std::make_unique<kb::KnowledgeBase>(test_db_path_, 128, options);
+  check();
+}
+
+// Test 83: A Replica Refuses Reads Until It Has Caught Up
+TEST_F(KnowledgeBaseTest, UnseededReplicaRefusesReads) {
+  for (int i = 0; i < 5; ++i) {
+    kb::Memory memory;
+    memory.id = "seeded_" + std::to_string(i);
+    memory.content = "Replicated memory " + std::to_string(i);
+    memory.category = "test";
+    memory.timestamp = i;
+    memory.embedding = embedding_service_->embed(memory.content);
+    ASSERT_TRUE(kb_->add(memory));
+  }
+  std::shared_ptr<kb::KnowledgeBase> primary_kb(std::move(kb_));
+  auto embedder = std::make_shared<kb::MockEmbeddingService>(128);
+  auto primary_handler = std::make_shared<kb::RequestHandler>(primary_kb, embedder);
+  kb::TCPServer primary(0, primary_kb, primary_handler, kb::ServerOptions());
+  primary.start();
+
+  std::string search = "{\"endpoint\": \"/search\", \"params\": {\"query\": \"Replicated memory 3\", "
+                       "\"top_k\": 1}}";
+  auto openReplica = [embedder](const std::string& path, const std::string& address) {
+    auto replica_kb = std::make_shared<kb::KnowledgeBase>(path, 128);
+    kb::ReplicaOptions options;
+    options.primary = address;
+    options.poll_interval = std::chrono::milliseconds(10);
+    auto replicator = std::make_shared<kb::Replicator>(replica_kb, "", options);
+    auto registry = std::make_shared<kb::NamespaceRegistry>(kb::Tenant{replica_kb, nullptr, replicator},
+                                                             path + "_ns", [](const std::string&) {
+                                                               return kb::Tenant();
+                                                             });
+    return std::make_shared<kb::RequestHandler>(registry, embedder);
+  };
+
+  // Nothing to follow: searches fail instead of answering from an empty store
+  std::string lonely_path = test_db_path_ + "_lonely_replica";
+  {
+    auto handler = openReplica(lonely_path, "127.0.0.1:1");
+    auto response = nlohmann::json::parse(handler->handle(search));
+    EXPECT_EQ(response["success"], false);
+    EXPECT_NE(response["error"].get<std::string>().find("Replica not seeded"), std::string::npos);
+    response = nlohmann::json::parse(handler->handle("{\"endpoint\": \"/stats\"}"));
+    EXPECT_EQ(response["success"], true);
+  }
+
+  // Following a live primary, they succeed once it has caught up
+  std::string replica_path = test_db_path_ + "_seeded_replica";
+  {
+    auto handler = openReplica(replica_path, "127.0.0.1:" + std::to_string(primary.port()));
+    nlohmann::json response;
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+    do {
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+      response = nlohmann::json::parse(handler->handle(search));
+    } while (!response["success"].get<bool>() && std::chrono::steady_clock::now() < deadline);
+    ASSERT_EQ(response["success"], true) << response.dump();
+    ASSERT_EQ(response["results"].size(), 1u);
+    EXPECT_EQ(response["results"][0]["id"], "seeded_3");
+  }
+
+  primary.stop();
+  for (const std::string& path : {lonely_path, replica_path}) {
+    fs::remove_all(path);
+    fs::remove_all(path + "_ns");
+  }
+}
+
+// Test 84: Generators Of Different Nodes Never Hand Out The Same Id
+TEST_F(KnowledgeBaseTest, NodeIdGeneratorsDoNotCollide) {
+  kb::MemoryIdGenerator first(1);
+  kb::MemoryIdGenerator second(2);
+  std::set<std::string> all;
+  std::string last;
+  for (int i = 0; i < 10000; ++i) {
+    std::string id = first.next();
+    EXPECT_GT(id, last);
+    last = id;
+    all.insert(id);
+    all.insert(second.next());
+  }
+  EXPECT_EQ(all.size(), 20000u);
+
+  // Still this node's after observing another node's id
+  uint64_t value = 0;
+  ASSERT_TRUE(kb::parseMemoryId(second.next(), &value));
+  first.observe(kb::formatMemoryId(value + 1000));
+  ASSERT_TRUE(kb::parseMemoryId(first.next(), &value));
+  EXPECT_EQ(value % kb::MemoryIdGenerator::kMaxNodes, 1u);
+
+  EXPECT_THROW(kb::MemoryIdGenerator generator(kb::MemoryIdGenerator::kMaxNodes), std::runtime_error);
+}
+
+// A kb-service node on a free port, for shard routers to route to
+class TestShard {
+public:
+  TestShard(const std::string& path, int dimension, const kb::IndexOptions& options = kb::IndexOptions())
+    : path_(path), kb_(std::make_shared<kb::KnowledgeBase>(path, dimension, options)) {
+    auto handler = std::make_shared<kb::RequestHandler>(kb_, std::make_shared<kb::MockEmbeddingService>(dimension));
+    server_ = std::make_unique<kb::TCPServer>(0, kb_, handler, kb::ServerOptions());
+    server_->start();
+  }
+
+  ~TestShard() {
+    server_.reset();
+    kb_.reset();
+    fs::remove_all(path_);
+  }
+
+  kb::KnowledgeBase& kb() { return *kb_; }
+  std::string address() const { return "127.0.0.1:" + std::to_string(server_->port()); }
+
+private:
+  std::string path_;
+  std::shared_ptr<kb::KnowledgeBase> kb_;
+  std::unique_ptr<kb::TCPServer> server_;
+};
+
+// Unit vector along `axis`, scaled
+std::vector<float> axisVector(int axis, float length, int dimension = 128) {
+  std::vector<float> vector(dimension, 0.0f);
+  vector[axis] = length;
+  return vector;
+}
+
+// Test 85: Routed Searches Merge Shard Results By The Metric's Order
+TEST_F(KnowledgeBaseTest, ShardRouterMergesByMetric) {
+  for (const std::string metric : {"l2", "ip"}) {
+    SCOPED_TRACE(metric);
+    kb::IndexOptions options;
+    options.metric = metric;
+    std::vector<std::unique_ptr<TestShard>> shards;
+    std::vector<std::string> addresses;
+    for (int i = 0; i < 2; ++i) {
+      shards.push_back(std::make_unique<TestShard>(test_db_path_ + "_" + metric + "_shard" + std::to_string(i),
+                                                   128, options));
+      addresses.push_back(shards.back()->address());
+    }
+    kb::ShardRouterOptions router_options;
+    router_options.metric = metric;
+    kb::ShardRouter router(addresses, std::make_shared<kb::MockEmbeddingService>(128), router_options);
+
+    // m1..m6 lie along one axis at distance 1..6 from the origin
+    std::set<size_t> owners;
+    for (int k = 1; k <= 6; ++k) {
+      nlohmann::json params;
+      params["id"] = "m" + std::to_string(k);
+      params["content"] = "Axis memory " + std::to_string(k);
+      params["embedding"] = axisVector(0, static_cast<float>(k));
+      ASSERT_EQ(router.route("/add", params)["success"], true);
+      owners.insert(router.shardFor(params["id"].get<std::string>()));
+    }
+    ASSERT_EQ(owners.size(), 2u);  // both shards contribute to the merge
+    EXPECT_EQ(shards[0]->kb().size() + shards[1]->kb().size(), 6u);
+
+    // Nearest to the unit vector by distance is m1; by inner product, m6
+    nlohmann::json search;
+    search["embedding"] = axisVector(0, 1.0f);
+    search["top_k"] = 3;
+    nlohmann::json response = router.route("/search", search);
+    ASSERT_EQ(response["success"], true) << response.dump();
+    ASSERT_EQ(response["results"].size(), 3u);
+    std::vector<std::string> expected = metric == "l2" ? std::vector<std::string>{"m1", "m2", "m3"}
+                                                       : std::vector<std::string>{"m6", "m5", "m4"};
+    for (size_t i = 0; i < expected.size(); ++i) {
+      EXPECT_EQ(response["results"][i]["id"], expected[i]);
+    }
+
+    // /search_by_id searches every shard with the memory's own vector and
+    // leaves the memory itself out
+    nlohmann::json by_id;
+    by_id["id"] = "m3";
+    by_id["top_k"] = 2;
+    response = router.route("/search_by_id", by_id);
+    ASSERT_EQ(response["success"], true) << response.dump();
+    ASSERT_EQ(response["results"].size(), 2u);
+    for (const auto& result : response["results"]) {
+      EXPECT_NE(result["id"], "m3");
+    }
+    if (metric == "l2") {
+      std::set<std::string> neighbours{response["results"][0]["id"].get<std::string>(),
+                                       response["results"][1]["id"].get<std::string>()};
+      EXPECT_EQ(neighbours, (std::set<std::string>{"m2", "m4"}));
+    } else {
+      EXPECT_EQ(response["results"][0]["id"], "m6");
+    }
+
+    // Equal vectors score alike on every shard; ties go by id, whichever
+    // shard answered first
+    owners.clear();
+    for (const std::string id : {"tie_d", "tie_b", "tie_a", "tie_c", "tie_e"}) {
+      nlohmann::json params;
+      params["id"] = id;
+      params["content"] = "Tied memory " + id;
+      params["embedding"] = axisVector(2, 1.0f);
+      ASSERT_EQ(router.route("/add", params)["success"], true);
+      owners.insert(router.shardFor(id));
+    }
+    ASSERT_EQ(owners.size(), 2u);
+    search["embedding"] = axisVector(2, 1.0f);
+    response = router.route("/search", search);
+    ASSERT_EQ(response["success"], true) << response.dump();
+    ASSERT_EQ(response["results"].size(), 3u);
+    EXPECT_EQ(response["results"][0]["id"], "tie_a");
+    EXPECT_EQ(response["results"][1]["id"], "tie_b");
+    EXPECT_EQ(response["results"][2]["id"], "tie_c");
+  }
+}
+
+// Test 86: Routed Batches Come Back In The Order They Were Sent
+TEST_F(KnowledgeBaseTest, ShardRouterReassemblesAddBatch) {
+  std::vector<std::unique_ptr<TestShard>> shards;
+  std::vector<std::string> addresses;
+  for (int i = 0; i < 3; ++i) {
+    shards.push_back(std::make_unique<TestShard>(test_db_path_ + "_batch_shard" + std::to_string(i), 128));
+    addresses.push_back(shards.back()->address());
+  }
+  kb::ShardRouter router(addresses, std::make_shared<kb::MockEmbeddingService>(128));
+
+  nlohmann::json memories = nlohmann::json::array();
+  for (int i = 0; i < 12; ++i) {
+    nlohmann::json memory;
+    memory["content"] = "Batched memory " + std::to_string(i);
+    if (i % 3 == 0) {
+      memory["id"] = "batched_" + std::to_string(i);
+    }
+    memories.push_back(memory);
+  }
+  nlohmann::json params;
+  params["memories"] = memories;
+  nlohmann::json response = router.route("/add_batch", params);
+  ASSERT_EQ(response["success"], true) << response.dump();
+  ASSERT_EQ(response["ids"].size(), 12u);
+
+  // Every id is at its position and names the memory sent there, stored
+  // on the shard that owns it
+  std::set<std::string> unique;
+  for (int i = 0; i < 12; ++i) {
+    std::string id = response["ids"][i].get<std::string>();
+    unique.insert(id);
+    if (i % 3 == 0) {
+      EXPECT_EQ(id, "batched_" + std::to_string(i));
+    }
+    kb::KnowledgeBase& owner = shards[router.shardFor(id)]->kb();
+    ASSERT_TRUE(owner.exists(id)) << id;
+    auto results = owner.search(embedding_service_->embed("Batched memory " + std::to_string(i)), 1);
+    ASSERT_EQ(results.size(), 1u);
+    EXPECT_EQ(results[0].id, id);
+    EXPECT_EQ(results[0].content, "Batched memory " + std::to_string(i));
+  }
+  EXPECT_EQ(unique.size(), 12u);
+
+  // A refused memory leaves a gap at its own position only
+  memories = nlohmann::json::array();
+  for (int i = 0; i < 4; ++i) {
+    nlohmann::json memory;
+    memory["content"] = "Second batch " + std::to_string(i);
+    memory["id"] = i == 2 ? std::string("batched_3") : "second_" + std::to_string(i);
+    memories.push_back(memory);
+  }
+  params["memories"] = memories;
+  response = router.route("/add_batch", params);
+  EXPECT_EQ(response["success"], false);
+  ASSERT_EQ(response["ids"].size(), 4u);
+  for (int i = 0; i < 4; ++i) {
+    EXPECT_EQ(response["ids"][i], i == 2 ? std::string() : "second_" + std::to_string(i));
+  }
+}
+
+// Test 87: A Shard's Error Is Returned Naming The Shard
+TEST_F(KnowledgeBaseTest, ShardRouterReportsShardErrors) {
+  // The second shard holds vectors of another dimension, so it refuses
+  // the router's 128-dimensional query
+  TestShard good(test_db_path_ + "_good_shard", 128);
+  TestShard bad(test_db_path_ + "_bad_shard", 64);
+  kb::ShardRouter router({good.address(), bad.address()}, std::make_shared<kb::MockEmbeddingService>(128));
+
+  nlohmann::json search;
+  search["query"] = "anything";
+  nlohmann::json response = router.route("/search", search);
+  EXPECT_EQ(response["success"], false);
+  std::string error = response.value("error", "");
+  EXPECT_EQ(error.rfind("Shard " + bad.address() + ": ", 0), 0u) << error;
+  EXPECT_NE(error.find("64"), std::string::npos) << error;
+
+  response = router.route("/stats", nlohmann::json::object());
+  EXPECT_EQ(response["success"], true);
+  response = router.route("/checkpoint", nlohmann::json::object());
+  EXPECT_EQ(response["success"], false);
+
+  // A shard that cannot be reached throws; the server turns that into an
+  // error response
+  kb::ShardRouter unreachable({good.address(), "127.0.0.1:1"}, std::make_shared<kb::MockEmbeddingService>(128));
+  EXPECT_THROW(unreachable.route("/search", search), std::runtime_error);
+}
+
+// Test 88: search_by_id Clamps top_k Before Asking For One Extra Result
+TEST_F(KnowledgeBaseTest, SearchByIdClampsTopK) {
+  kb_.reset();
+  auto kb = std::make_shared<kb::KnowledgeBase>(test_db_path_, 128);
+  for (int i = 0; i < 5; ++i) {
+    kb::Memory memory;
+    memory.id = "neighbor_" + std::to_string(i);
+    memory.content = "Neighboring memory " + std::to_string(i);
+    memory.category = "test";
+    memory.timestamp = i;
+    memory.embedding = embedding_service_->embed(memory.content);
+    ASSERT_TRUE(kb->add(memory));
+  }
+  kb::RequestHandler handler(kb, std::make_shared<kb::MockEmbeddingService>(128));
+
+  auto searchById = [&handler](long long top_k) {
+    return nlohmann::json::parse(handler.handle("{\"endpoint\": \"/search_by_id\", \"params\": "
+                                                "{\"id\": \"neighbor_0\", \"top_k\": " +
+                                                std::to_string(top_k) + "}}"));
+  };
+
+  // Every other memory, and never the memory itself
+  nlohmann::json response = searchById(std::numeric_limits<int>::max());
+  ASSERT_EQ(response["success"], true) << response.dump();
+  ASSERT_EQ(response["results"].size(), 4u);
+  for (const auto& result : response["results"]) {
+    EXPECT_NE(result["id"], "neighbor_0");
+  }
+
+  response = searchById(2);
+  ASSERT_EQ(response["success"], true);
+  EXPECT_EQ(response["results"].size(), 2u);
+
+  response = searchById(-1);
+  ASSERT_EQ(response["success"], true);
+  EXPECT_TRUE(response["results"].empty());
+}
+
+// Test 89: The Fast Parser Treats Repeated And Out-Of-Range Fields Like The DOM
+TEST_F(KnowledgeBaseTest, FastParserSaturatesAndReplacesFields) {
+  kb_.reset();
+  auto kb = std::make_shared<kb::KnowledgeBase>(test_db_path_, 128);
+  for (int i = 0; i < 8; ++i) {
+    kb::Memory memory;
+    memory.id = "field_" + std::to_string(i);
+    memory.content = "Parsed memory " + std::to_string(i);
+    memory.category = "test";
+    memory.timestamp = i;
+    memory.embedding = embedding_service_->embed(memory.content);
+    ASSERT_TRUE(kb->add(memory));
+  }
+  kb::RequestHandler handler(kb, std::make_shared<kb::MockEmbeddingService>(128));
+
+  // A repeated key keeps only its last value
+  auto response = nlohmann::json::parse(handler.handle(
+    "{\"endpoint\": \"/search_batch\", \"params\": {\"queries\": [\"Parsed memory 1\"], "
+    "\"queries\": [\"Parsed memory 2\", \"Parsed memory 3\"], \"top_k\": 1}}"));
+  ASSERT_EQ(response["success"], true) << response.dump();
+  ASSERT_EQ(response["results"].size(), 2u);
+  EXPECT_EQ(response["results"][0][0]["id"], "field_2");
+  EXPECT_EQ(response["results"][1][0]["id"], "field_3");
+
+  // Out-of-range numbers saturate instead of wrapping (2^32 + 5 is not 5)
+  for (const std::string& top_k : {"1e30", "4294967301", "18446744073709551615"}) {
+    response = nlohmann::json::parse(handler.handle(
+      "{\"endpoint\": \"/search\", \"params\": {\"query\": \"Parsed memory 0\", \"top_k\": " + top_k + "}}"));
+    ASSERT_EQ(response["success"], true) << top_k << ": " << response.dump();
+    EXPECT_EQ(response["results"].size(), 8u) << top_k;
+  }
+  response = nlohmann::json::parse(handler.handle(
+    "{\"endpoint\": \"/search\", \"params\": {\"query\": \"Parsed memory 0\", \"top_k\": -1e30}}"));
+  ASSERT_EQ(response["success"], true) << response.dump();
+  EXPECT_TRUE(response["results"].empty());
+
+  // MessagePack can carry NaN, which is refused
+  nlohmann::json request;
+  request["endpoint"] = "/search";
+  request["params"]["query"] = "Parsed memory 0";
+  request["params"]["top_k"] = std::numeric_limits<double>::quiet_NaN();
+  std::vector<uint8_t> packed = nlohmann::json::to_msgpack(request);
+  std::string out;
+  handler.handleMessagePack(std::string(packed.begin(), packed.end()), &out);
+  response = nlohmann::json::from_msgpack(out);
+  EXPECT_EQ(response["success"], false);
+  EXPECT_NE(response.value("error", "").find("top_k"), std::string::npos) << response.dump();
+}
+
+// Env that fails chosen store writes on demand, for the write-failure paths
+class FaultInjectionEnv : public rocksdb::EnvWrapper {
+public:
+  FaultInjectionEnv() : rocksdb::EnvWrapper(rocksdb::Env::Default()) {}
+
+  // WAL records containing `text` fail to append; "" fails none
+  void failWalWrites(const std::string& text) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    wal_text_ = text;
+  }
+
+  // Table files created in or linked into the store fail; ingesting
+  // external files links or copies them in this way
+  std::atomic<bool> fail_table_files{false};
+  std::atomic<int> injected{0};
+
+  rocksdb::Status NewWritableFile(const std::string& name, std::unique_ptr<rocksdb::WritableFile>* result,
+                                  const rocksdb::EnvOptions& options) override {
+    if (fail_table_files && storeTable(name)) {
+      ++injected;
+      return rocksdb::Status::IOError("injected", name);
+    }
+    std::unique_ptr<rocksdb::WritableFile> file;
+    rocksdb::Status status = target()->NewWritableFile(name, &file, options);
+    if (status.ok() && name.size() > 4 && name.compare(name.size() - 4, 4, ".log") == 0) {
+      file = std::make_unique<FaultyWal>(std::move(file), this);
+    }
+    *result = std::move(file);
+    return status;
+  }
+
+  rocksdb::Status LinkFile(const std::string& from, const std::string& to) override {
+    if (fail_table_files && storeTable(to)) {
+      ++injected;
+      return rocksdb::Status::IOError("injected", to);
+    }
+    return target()->LinkFile(from, to);
+  }
+
+private:
+  class FaultyWal : public rocksdb::WritableFileWrapper {
+  public:
+    FaultyWal(std::unique_ptr<rocksdb::WritableFile> file, FaultInjectionEnv* env)
+      : rocksdb::WritableFileWrapper(file.get()), file_(std::move(file)), env_(env) {}
+
+    using rocksdb::WritableFileWrapper::Append;
+    rocksdb::Status Append(const rocksdb::Slice& data) override {
+      if (env_->failsWalWrite(data)) {
+        return rocksdb::Status::IOError("injected WAL write failure");
+      }
+      return rocksdb::WritableFileWrapper::Append(data);
+    }
+
+  private:
+    std::unique_ptr<rocksdb::WritableFile> file_;
+    FaultInjectionEnv* env_;
+  };
+
+  // Staged import files live in the store's import/ directory
+  static bool storeTable(const std::string& name) {
+    return name.size() > 4 && name.compare(name.size() - 4, 4, ".sst") == 0 &&
+           name.find("/import/") == std::string::npos;
+  }
+
+  bool failsWalWrite(const rocksdb::Slice& data) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (wal_text_.empty() || data.ToString().find(wal_text_) == std::string::npos) {
+      return false;
+    }
+    ++injected;
+    return true;
+  }
+
+  std::mutex mutex_;
+  std::string wal_text_;
+};
+
+// Test 90: A Batch The Store Fails To Write Stays Pending And Is Stored Once
+TEST_F(KnowledgeBaseTest, IngestPipelineRetriesFailedStoreWrites) {
+  kb_.reset();
+  FaultInjectionEnv env;
+  kb::StoreOptions store_options;
+  store_options.env = &env;
+  auto embedder = std::make_shared<CountingEmbeddingService>(128);
+  kb::IngestOptions options;
+  options.retry_delay = std::chrono::milliseconds(10);
+  options.max_retry_delay = std::chrono::milliseconds(20);
+
+  std::vector<std::string> ids;
+  {
+    auto kb = std::make_shared<kb::KnowledgeBase>(test_db_path_, 128, kb::IndexOptions(), store_options);
+    embedder->fail = true;  // hold the submissions until the store fails
+    auto ingest = std::make_shared<kb::IngestPipeline>(kb, embedder, options);
+    for (int i = 0; i < 10; ++i) {
+      kb::Memory memory;
+      memory.content = "stored once " + std::to_string(i);
+      memory.category = "async";
+      memory.timestamp = i;
+      uint64_t ticket = 0;
+      ids.push_back(ingest->submit(memory, &ticket));
+      ASSERT_FALSE(ids.back().empty());
+    }
+
+    env.failWalWrites("stored once");
+    embedder->fail = false;
+    kb::RequestHandler handler(kb, embedder, ingest);
+    auto response = nlohmann::json::parse(handler.handle(
+      "{\"endpoint\": \"/wait\", \"params\": {\"timeout_ms\": 300}}"));
+    EXPECT_GT(env.injected, 0);
+    EXPECT_EQ(response["success"], false);
+    EXPECT_EQ(response["pending"], 10);
+    EXPECT_FALSE(response.contains("failed")) << response.dump();
+    EXPECT_EQ(kb->size(), 0u);
+  }
+
+  // Writable again after a restart, the queued adds are stored exactly once
+  env.failWalWrites("");
+  {
+    auto kb = std::make_shared<kb::KnowledgeBase>(test_db_path_, 128, kb::IndexOptions(), store_options);
+    EXPECT_EQ(kb->queuedMemories().size(), 10u);
+    kb::IngestPipeline ingest(kb, embedder, options);
+    ASSERT_TRUE(ingest.waitForAll(ingest.lastTicket(), std::chrono::seconds(10)));
+    EXPECT_TRUE(ingest.failures(0, ingest.lastTicket()).empty());
+    EXPECT_EQ(kb->size(), 10u);
+    EXPECT_TRUE(kb->queuedMemories().empty());
+
+    std::set<std::string> found;
+    for (const auto& result : kb->searchLexical("stored once", 20)) {
+      EXPECT_TRUE(found.insert(result.id).second) << result.id;
+    }
+    EXPECT_EQ(found, std::set<std::string>(ids.begin(), ids.end()));
+  }
+}
+
+// Test 91: Imports That Fail Part Way Are Reported And Leave A Usable Store
+TEST_F(KnowledgeBaseTest, ImportFailuresAreReported) {
+  for (int i = 0; i < 10; ++i) {
+    kb::Memory memory;
+    memory.id = "partial_" + std::to_string(i);
+    memory.content = "Partial memory " + std::to_string(i);
+    memory.category = "test";
+    memory.timestamp = i;
+    memory.embedding = embedding_service_->embed(memory.content);
+    ASSERT_TRUE(kb_->add(memory));
+  }
+  ASSERT_TRUE(kb_->updateUserPreference("partial", "yes"));
+
+  std::string export_dir = test_db_path_ + "_exports";
+  fs::create_directories(export_dir);
+  std::string export_file = export_dir + "/partial.export";
+  {
+    std::unique_ptr<FILE, int (*)(FILE*)> out(std::fopen(export_file.c_str(), "wb"), &std::fclose);
+    ASSERT_TRUE(out);
+    ASSERT_TRUE(kb_->exportTo(out.get()));
+  }
+  auto importInto = [&export_file](kb::KnowledgeBase& kb, kb::TransferCounts* counts) {
+    std::unique_ptr<FILE, int (*)(FILE*)> in(std::fopen(export_file.c_str(), "rb"), &std::fclose);
+    return kb.importFrom(in.get(), counts);
+  };
+
+  FaultInjectionEnv env;
+  kb::StoreOptions store_options;
+  store_options.env = &env;
+
+  // A failed ingest changes nothing and keeps the index snapshot
+  std::string ingest_path = test_db_path_ + "_failed_ingest";
+  {
+    kb::KnowledgeBase copy(ingest_path, 128, kb::IndexOptions(), store_options);
+    kb::Memory resident;
+    resident.id = "resident";
+    resident.content = "Resident memory";
+    resident.category = "test";
+    resident.timestamp = 0;
+    resident.embedding = embedding_service_->embed(resident.content);
+    ASSERT_TRUE(copy.add(resident));
+  }
+  ASSERT_TRUE(fs::exists(ingest_path + "/faiss.snapshot"));
+  {
+    kb::KnowledgeBase copy(ingest_path, 128, kb::IndexOptions(), store_options);
+    kb::TransferCounts counts;
+    env.fail_table_files = true;
+    EXPECT_FALSE(importInto(copy, &counts));
+    env.fail_table_files = false;
+    EXPECT_GT(env.injected, 0);
+    EXPECT_EQ(counts.memories, 0u);
+    EXPECT_FALSE(counts.unmarked);
+    EXPECT_EQ(copy.size(), 1u);
+    EXPECT_FALSE(copy.exists("partial_0"));
+    EXPECT_TRUE(fs::exists(ingest_path + "/faiss.snapshot"));
+
+    // The store takes the same import once it can
+    ASSERT_TRUE(importInto(copy, &counts));
+    EXPECT_EQ(copy.size(), 11u);
+  }
+
+  // Once ingested, memories are indexed even if the import marker is not
+  // written; /import says that replicas must be reseeded
+  std::string marker_path = test_db_path_ + "_failed_marker";
+  {
+    auto copy = std::make_shared<kb::KnowledgeBase>(marker_path, 128, kb::IndexOptions(), store_options);
+    kb::RequestHandler handler(copy, std::make_shared<kb::MockEmbeddingService>(128));
+    handler.setExportDirectory(export_dir);
+    env.failWalWrites("meta:last_import");
+    auto response = nlohmann::json::parse(handler.handle(
+      "{\"endpoint\": \"/import\", \"params\": {\"path\": \"partial.export\"}}"));
+    env.failWalWrites("");
+    EXPECT_EQ(response["success"], false);
+    EXPECT_NE(response.value("error", "").find("reseed"), std::string::npos) << response.dump();
+    EXPECT_EQ(response["memories"], 10);
+    EXPECT_EQ(copy->size(), 10u);
+    auto results = copy->search(embedding_service_->embed("Partial memory 4"), 1);
+    ASSERT_EQ(results.size(), 1u);
+    EXPECT_EQ(results[0].id, "partial_4");
+  }
+
+  // The same when only the preferences fail to be written
+  std::string preferences_path = test_db_path_ + "_failed_preferences";
+  {
+    kb::KnowledgeBase copy(preferences_path, 128, kb::IndexOptions(), store_options);
+    kb::TransferCounts counts;
+    env.failWalWrites("pref:");
+    EXPECT_FALSE(importInto(copy, &counts));
+    env.failWalWrites("");
+    EXPECT_FALSE(counts.unmarked);
+    EXPECT_EQ(counts.memories, 10u);
+    EXPECT_EQ(counts.preferences, 0u);
+    EXPECT_EQ(copy.size(), 10u);
+    EXPECT_TRUE(copy.exists("partial_7"));
+    EXPECT_EQ(copy.getUserPreference("partial"), "");
+  }
+
+  for (const std::string& path : {export_dir, ingest_path, marker_path, preferences_path}) {
+    fs::remove_all(path);
+  }
+}
+
+// A model server on a free loopback port. Each HTTP request it receives
+// is recorded and answered with the next scripted raw response.
+class FakeEmbeddingServer {
+public:
+  struct Request {
+    std::string head;  // request line and headers
+    std::string body;
+  };
+
+  // On ::1 rather than 127.0.0.1 when `ipv6`; throws if that is unavailable
+  explicit FakeEmbeddingServer(bool ipv6 = false)
+    : listen_fd_(socket(ipv6 ? AF_INET6 : AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0)), host_(ipv6 ? "[::1]" : "127.0.0.1") {
+    sockaddr_storage addr{};
+    socklen_t length;
+    if (ipv6) {
+      auto* v6 = reinterpret_cast<sockaddr_in6*>(&addr);
+      v6->sin6_family = AF_INET6;
+      v6->sin6_addr = in6addr_loopback;
+      length = sizeof(*v6);
+    } else {
+      auto* v4 = reinterpret_cast<sockaddr_in*>(&addr);
+      v4->sin_family = AF_INET;
+      inet_pton(AF_INET, "127.0.0.1", &v4->sin_addr);
+      length = sizeof(*v4);
+    }
+    if (listen_fd_ < 0 || bind(listen_fd_, reinterpret_cast<sockaddr*>(&addr), length) != 0 ||
+        listen(listen_fd_, 16) != 0 || getsockname(listen_fd_, reinterpret_cast<sockaddr*>(&addr), &length) != 0) {
+      if (listen_fd_ >= 0) {
+        close(listen_fd_);
+      }
+      throw std::runtime_error("FakeEmbeddingServer cannot listen");
+    }
+    port_ = ntohs(ipv6 ? reinterpret_cast<sockaddr_in6*>(&addr)->sin6_port
+                       : reinterpret_cast<sockaddr_in*>(&addr)->sin_port);
+    acceptor_ = std::thread([this] { acceptLoop(); });
+  }
+
+  ~FakeEmbeddingServer() {
+    closeConnections(false);
+    shutdown(listen_fd_, SHUT_RDWR);  // wakes accept()
+    acceptor_.join();
+    close(listen_fd_);
+    for (std::thread& handler : handlers_) {
+      handler.join();
+    }
+  }
+
+  // host:port as it goes in a URL or a Host header
+  std::string authority() const { return host_ + ":" + std::to_string(port_); }
+  std::string url() const { return "http://" + authority() + "/v1/embeddings"; }
+
+  // Answer the next request with `raw`, closing the connection afterwards
+  // when `close_after`
+  void reply(const std::string& raw, bool close_after = false) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    replies_.push_back({raw, close_after, false});
+  }
+
+  // Reset the connection the next request arrives on, unanswered
+  void resetNext() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    replies_.push_back({"", true, true});
+  }
+
+  std::vector<Request> requests() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return requests_;
+  }
+
+  int connections() const { return connections_; }
+
+  // Closes every open connection, as a server dropping idle keep-alive
+  // connections does: with a FIN, or with a RST when `reset`
+  void closeConnections(bool reset) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      reset_ = reset;
+      for (int fd : open_) {
+        shutdown(fd, SHUT_RD);  // wakes the handler's recv()
+      }
+    }
+    for (int i = 0; i < 100; ++i) {
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (open_.empty()) {
+          reset_ = false;
+          return;
+        }
+      }
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+  }
+
+private:
+  struct Reply {
+    std::string raw;
+    bool close_after;
+    bool reset;
+  };
+
+  void acceptLoop() {
+    while (true) {
+      int fd = accept4(listen_fd_, nullptr, nullptr, SOCK_CLOEXEC);
+      if (fd < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        return;
+      }
+      std::lock_guard<std::mutex> lock(mutex_);
+      ++connections_;
+      open_.insert(fd);
+      handlers_.emplace_back([this, fd] { serve(fd); });
+    }
+  }
+
+  static bool fill(int fd, std::string* buffered) {
+    char chunk[4096];
+    ssize_t n = recv(fd, chunk, sizeof(chunk), 0);
+    if (n <= 0) {
+      return false;
+    }
+    buffered->append(chunk, static_cast<size_t>(n));
+    return true;
+  }
+
+  void serve(int fd) {
+    std::string buffered;
+    bool reset = false;
+    while (true) {
+      size_t end = 0;
+      bool open = true;
+      while (open && (end = buffered.find("\r\n\r\n")) == std::string::npos) {
+        open = fill(fd, &buffered);
+      }
+      if (!open) {
+        break;
+      }
+      Request request;
+      request.head = buffered.substr(0, end + 2);
+      buffered.erase(0, end + 4);
+      size_t length = 0;
+      size_t field = request.head.find("Content-Length: ");
+      if (field != std::string::npos) {
+        length = std::stoul(request.head.substr(field + 16));
+      }
+      while (open && buffered.size() < length) {
+        open = fill(fd, &buffered);
+      }
+      if (!open) {
+        break;
+      }
+      request.body = buffered.substr(0, length);
+      buffered.erase(0, length);
+
+      Reply reply{"HTTP/1.1 500 Internal Server Error\r\nContent-Length: 0\r\n\r\n", false, false};
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        requests_.push_back(std::move(request));
+        if (!replies_.empty()) {
+          reply = replies_.front();
+          replies_.pop_front();
+        }
+      }
+      ::send(fd, reply.raw.data(), reply.raw.size(), MSG_NOSIGNAL);
+      if (reply.close_after) {
+        reset = reply.reset;
+        break;
+      }
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (reset || reset_) {
+      linger hard_close{1, 0};
+      setsockopt(fd, SOL_SOCKET, SO_LINGER, &hard_close, sizeof(hard_close));
+    }
+    open_.erase(fd);
+    close(fd);
+  }
+
+  int listen_fd_;
+  std::string host_;
+  int port_ = 0;
+  std::thread acceptor_;
+  std::vector<std::thread> handlers_;  // appended by acceptor_ only
+  mutable std::mutex mutex_;
+  std::deque<Reply> replies_;
+  std::vector<Request> requests_;
+  std::set<int> open_;
+  bool reset_ = false;
+  std::atomic<int> connections_{0};
+};
+
+std::string httpResponse(int status, const std::string& body, const std::string& headers = "") {
+  return "HTTP/1.1 " + std::to_string(status) + (status == 200 ? " OK" : " Error") + "\r\n" +
+         "Content-Type: application/json\r\n" + headers +
+         "Content-Length: " + std::to_string(body.size()) + "\r\n\r\n" + body;
+}
+
+// An embeddings response listing `indices` in that order; input i embeds
+// to 4 copies of i + 1
+std::string embeddingsJson(const std::vector<size_t>& indices) {
+  nlohmann::json data = nlohmann::json::array();
+  for (size_t index : indices) {
+    data.push_back({{"index", index}, {"embedding", std::vector<float>(4, index + 1.0f)}});
+  }
+  nlohmann::json response;
+  response["data"] = data;
+  return response.dump();
+}
+
+std::string httpChunk(const std::string& data) {
+  char size[16];
+  std::snprintf(size, sizeof(size), "%zx", data.size());
+  return std::string(size) + "\r\n" + data + "\r\n";
+}
+
+// Test 92: HTTP Embeddings Are Read From Content-Length And Chunked Responses
+TEST_F(KnowledgeBaseTest, HttpEmbeddingServiceReadsResponses) {
+  FakeEmbeddingServer server;
+  kb::HttpEmbeddingOptions options;
+  options.url = server.url();
+  options.model = "test-model";
+  kb::HttpEmbeddingService service(options, 4);
+
+  server.reply(httpResponse(200, embeddingsJson({0, 1})));
+  auto embeddings = service.embedBatch({"first", "", "second"});
+  ASSERT_EQ(embeddings.size(), 3u);
+  EXPECT_EQ(embeddings[0], std::vector<float>(4, 1.0f));
+  EXPECT_EQ(embeddings[1], std::vector<float>(4, 0.0f));  // empty texts are not sent
+  EXPECT_EQ(embeddings[2], std::vector<float>(4, 2.0f));
+
+  auto requests = server.requests();
+  ASSERT_EQ(requests.size(), 1u);
+  EXPECT_EQ(requests[0].head.rfind("POST /v1/embeddings HTTP/1.1\r\n", 0), 0u) << requests[0].head;
+  EXPECT_NE(requests[0].head.find("Host: " + server.authority() + "\r\n"), std::string::npos) << requests[0].head;
+  auto body = nlohmann::json::parse(requests[0].body);
+  EXPECT_EQ(body["input"], nlohmann::json::array({"first", "second"}));
+  EXPECT_EQ(body["model"], "test-model");
+
+  // Chunked, with a chunk boundary inside the JSON and a trailer
+  std::string json = embeddingsJson({0});
+  server.reply("HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n" + httpChunk(json.substr(0, 7)) +
+               httpChunk(json.substr(7)) + "0\r\nX-Trailer: done\r\n\r\n");
+  EXPECT_EQ(service.embed("third"), std::vector<float>(4, 1.0f));
+
+  // Both came over the one pooled connection
+  EXPECT_EQ(server.connections(), 1);
+
+  // An IPv6 literal keeps its brackets in the Host header
+  std::unique_ptr<FakeEmbeddingServer> v6_server;
+  try {
+    v6_server = std::make_unique<FakeEmbeddingServer>(true);
+  } catch (const std::runtime_error&) {
+    GTEST_SKIP() << "No IPv6 loopback";
+  }
+  options.url = v6_server->url();
+  kb::HttpEmbeddingService v6_service(options, 4);
+  v6_server->reply(httpResponse(200, embeddingsJson({0})));
+  EXPECT_EQ(v6_service.embed("over IPv6"), std::vector<float>(4, 1.0f));
+  requests = v6_server->requests();
+  ASSERT_EQ(requests.size(), 1u);
+  EXPECT_NE(requests[0].head.find("Host: " + v6_server->authority() + "\r\n"), std::string::npos)
+    << requests[0].head;
+}
+
+// Test 93: Pooled HTTP Connections Are Reused, And Retried When Stale
+TEST_F(KnowledgeBaseTest, HttpEmbeddingServicePoolsConnections) {
+  FakeEmbeddingServer server;
+  kb::HttpEmbeddingOptions options;
+  options.url = server.url();
+  kb::HttpEmbeddingService service(options, 4);
+
+  for (int i = 0; i < 3; ++i) {
+    server.reply(httpResponse(200, embeddingsJson({0})));
+    EXPECT_EQ(service.embed("pooled"), std::vector<float>(4, 1.0f));
+  }
+  EXPECT_EQ(server.connections(), 1);
+
+  // The server drops the idle connection, cleanly or with a reset; the
+  // next call notices and retries once on a fresh one
+  for (bool reset : {false, true}) {
+    SCOPED_TRACE(reset ? "reset" : "closed");
+    server.closeConnections(reset);
+    server.reply(httpResponse(200, embeddingsJson({0})));
+    EXPECT_EQ(service.embed("after idle close"), std::vector<float>(4, 1.0f));
+  }
+  EXPECT_EQ(server.connections(), 3);
+
+  // ...or only once a request arrives on it, resetting it unanswered
+  server.resetNext();
+  server.reply(httpResponse(200, embeddingsJson({0})));
+  EXPECT_EQ(service.embed("reset on arrival"), std::vector<float>(4, 1.0f));
+  EXPECT_EQ(server.connections(), 4);
+
+  // A connection the server says it closes is not pooled
+  server.reply(httpResponse(200, embeddingsJson({0}), "Connection: close\r\n"), true);
+  EXPECT_EQ(service.embed("closing"), std::vector<float>(4, 1.0f));
+  server.reply(httpResponse(200, embeddingsJson({0})));
+  EXPECT_EQ(service.embed("reconnected"), std::vector<float>(4, 1.0f));
+  EXPECT_EQ(server.connections(), 5);
+}
+
+// Test 94: HTTP Errors Blame The Input Only For 400, 413 And 422, And
+// Embeddings Are Placed By Their Index
+TEST_F(KnowledgeBaseTest, HttpEmbeddingServiceClassifiesResponses) {
+  FakeEmbeddingServer server;
+  kb::HttpEmbeddingOptions options;
+  options.url = server.url();
+  kb::HttpEmbeddingService service(options, 4);
+
+  for (int status : {400, 413, 422}) {
+    server.reply(httpResponse(status, "{\"error\": \"bad input\"}"));
+    EXPECT_THROW(service.embed("rejected"), kb::EmbeddingInputError) << status;
+  }
+  for (int status : {401, 404, 503}) {
+    server.reply(httpResponse(status, "unavailable"));
+    try {
+      service.embed("not the input's fault");
+      ADD_FAILURE() << status << " did not throw";
+    } catch (const kb::EmbeddingInputError&) {
+      ADD_FAILURE() << status << " blamed the input";
+    } catch (const std::runtime_error& e) {
+      EXPECT_NE(std::string(e.what()).find(std::to_string(status)), std::string::npos) << e.what();
+    }
+  }
+
+  // Out-of-order entries land by index
+  server.reply(httpResponse(200, embeddingsJson({2, 0, 1})));
+  auto embeddings = service.embedBatch({"a", "b", "c"});
+  ASSERT_EQ(embeddings.size(), 3u);
+  for (size_t i = 0; i < embeddings.size(); ++i) {
+    EXPECT_EQ(embeddings[i], std::vector<float>(4, i + 1.0f)) << i;
+  }
+
+  // A repeated or out-of-range index, or another dimension, is the
+  // server's fault and fails the call
+  for (const std::string& response : {embeddingsJson({0, 0}), embeddingsJson({0, 2}),
+                                      std::string("{\"data\": [{\"index\": 0, \"embedding\": [1, 2]}, "
+                                                  "{\"index\": 1, \"embedding\": [1, 2]}]}")}) {
+    server.reply(httpResponse(200, response));
+    try {
+      service.embedBatch({"a", "b"});
+      ADD_FAILURE() << response << " was accepted";
+    } catch (const kb::EmbeddingInputError&) {
+      ADD_FAILURE() << response << " blamed the input";
+    } catch (const std::runtime_error&) {
+    }
+  }
+}
+
 int main(int argc, char** argv) {
   ::testing::InitGoogleTest(&argc, argv);
   return RUN_ALL_TESTS();
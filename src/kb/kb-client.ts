@@ -1,5 +1,4 @@
 import { Socket } from 'net';
-import { promisify } from 'util';
 
 export interface KBMemory {
   id?: string;
@@ -17,70 +16,202 @@ export interface KBSearchResult {
   timestamp: number;
 }
 
+/**
+ * Server-side search filters. Timestamps are milliseconds since the epoch
+ * and both bounds are inclusive.
+ */
+export interface KBSearchFilter {
+  category?: string;
+  since?: number;
+  until?: number;
+}
+
+/**
+ * 'vector' ranks by embedding similarity, 'lexical' by BM25 keyword match
+ * (exact names, paths, error codes), 'hybrid' fuses the two
+ */
+export type KBSearchMode = 'vector' | 'lexical' | 'hybrid';
+
 export interface KBResponse {
   success: boolean;
   error?: string;
   id?: string;
-  results?: KBSearchResult[];
+  ids?: string[];
+  results?: KBSearchResult[] | KBSearchResult[][];
   value?: string;
+  values?: Record<string, string>;
+  preferences?: Record<string, string>;
+  ticket?: number;
+  pending?: boolean | number;
+}
+
+interface PendingRequest {
+  resolve: (response: KBResponse) => void;
+  reject: (error: Error) => void;
+  timer: NodeJS.Timeout;
 }
 
 /**
- * Client for communicating with the kb-service via TCP
+ * Client for communicating with the kb-service via TCP.
+ *
+ * Requests are newline-delimited JSON sent over a single persistent
+ * connection, so calls after the first one skip the TCP handshake. The
+ * server answers in order, which lets responses be matched to a FIFO
+ * queue of pending requests.
+ *
+ * A client given a namespace sends it with every request, so all of its
+ * memories and preferences live in that isolated memory space.
  */
 export class KBClient {
   private host: string;
   private port: number;
+  private namespace?: string;
+  private socket: Socket | null = null;
+  private connecting: Promise<Socket> | null = null;
+  private pending: PendingRequest[] = [];
+  private buffer = '';
 
-  constructor(host: string = 'localhost', port: number = 50051) {
+  constructor(host: string = 'localhost', port: number = 50051, namespace?: string) {
     this.host = host;
     this.port = port;
+    this.namespace = namespace;
   }
 
   /**
-   * Send a request to the kb-service and return the response
+   * Close the connection to the kb-service
    */
-  private async sendRequest(endpoint: string, params: any): Promise<KBResponse> {
-    return new Promise((resolve, reject) => {
+  close(): void {
+    const socket = this.socket;
+    this.socket = null;
+    this.failPending(new Error('Connection closed'));
+    socket?.destroy();
+  }
+
+  /**
+   * Return the open connection, establishing it if needed
+   */
+  private connect(): Promise<Socket> {
+    if (this.socket) {
+      return Promise.resolve(this.socket);
+    }
+    if (this.connecting) {
+      return this.connecting;
+    }
+
+    this.connecting = new Promise((resolve, reject) => {
       const socket = new Socket();
-      let responseData = '';
+      socket.setNoDelay(true);
+      socket.setKeepAlive(true);
+      // Decode across chunks, so a character split between two packets
+      // arrives whole
+      socket.setEncoding('utf8');
 
-      socket.on('data', (data) => {
-        responseData += data.toString();
-      });
+      socket.on('data', (data: string) => this.onData(data));
 
-      socket.on('end', () => {
-        try {
-          const response = JSON.parse(responseData);
-          resolve(response);
-        } catch (error) {
-          reject(new Error(`Failed to parse response: ${error}`));
+      socket.on('close', () => {
+        if (this.socket === socket) {
+          this.socket = null;
+          this.failPending(new Error('Connection closed by kb-service'));
         }
       });
 
       socket.on('error', (error) => {
-        reject(new Error(`Socket error: ${error.message}`));
+        if (this.socket === socket) {
+          this.socket = null;
+          this.failPending(new Error(`Socket error: ${error.message}`));
+        } else if (this.connecting) {
+          clearTimeout(connectTimer);
+          this.connecting = null;
+          reject(new Error(`Socket error: ${error.message}`));
+        }
       });
 
+      const connectTimer = setTimeout(() => {
+        socket.destroy(new Error('Connection timeout'));
+      }, 10000);
+
       socket.connect(this.port, this.host, () => {
-        const request = JSON.stringify({ endpoint, params });
-        socket.write(request);
-        socket.end();
+        clearTimeout(connectTimer);
+        this.connecting = null;
+        this.socket = socket;
+        this.buffer = '';
+        // Only keep the process alive while requests are outstanding
+        socket.unref();
+        resolve(socket);
       });
+    });
 
-      // Timeout after 10 seconds
-      socket.setTimeout(10000, () => {
-        socket.destroy();
+    return this.connecting;
+  }
+
+  private onData(data: string): void {
+    this.buffer += data;
+
+    let newline: number;
+    while ((newline = this.buffer.indexOf('\n')) !== -1) {
+      const line = this.buffer.slice(0, newline);
+      this.buffer = this.buffer.slice(newline + 1);
+
+      const request = this.pending.shift();
+      if (!request) {
+        continue;
+      }
+      clearTimeout(request.timer);
+
+      try {
+        request.resolve(JSON.parse(line));
+      } catch (error) {
+        request.reject(new Error(`Failed to parse response: ${error}`));
+      }
+    }
+
+    if (this.pending.length === 0) {
+      this.socket?.unref();
+    }
+  }
+
+  private failPending(error: Error): void {
+    const pending = this.pending;
+    this.pending = [];
+    this.buffer = '';
+    for (const request of pending) {
+      clearTimeout(request.timer);
+      request.reject(error);
+    }
+  }
+
+  /**
+   * Send a request to the kb-service and return the response
+   */
+  private async sendRequest(endpoint: string, params: any): Promise<KBResponse> {
+    const socket = await this.connect();
+
+    return new Promise((resolve, reject) => {
+      // Timeout after 10 seconds. Responses are matched by position, so a
+      // timed-out request poisons the connection and it is dropped.
+      const timer = setTimeout(() => {
         reject(new Error('Request timeout'));
-      });
+        if (this.socket === socket) {
+          this.socket = null;
+          this.failPending(new Error('Connection reset after request timeout'));
+        }
+        socket.destroy();
+      }, 10000);
+
+      this.pending.push({ resolve, reject, timer });
+      socket.ref();
+      const scoped = this.namespace ? { ...params, namespace: this.namespace } : params;
+      socket.write(JSON.stringify({ endpoint, params: scoped }) + '\n');
     });
   }
 
   /**
-   * Add a memory to the knowledge base
+   * Add a memory to the knowledge base. When the service runs with
+   * --async-ingest the memory may not be searchable yet on return; pass
+   * `wait` to return only once it is.
    */
-  async add(content: string, category: string = 'general', id?: string): Promise<string> {
-    const response = await this.sendRequest('/add', { content, category, id });
+  async add(content: string, category: string = 'general', id?: string, wait: boolean = false): Promise<string> {
+    const response = await this.sendRequest('/add', { content, category, id, wait });
     if (!response.success) {
       throw new Error(response.error || 'Failed to add memory');
     }
@@ -88,14 +219,62 @@ export class KBClient {
   }
 
   /**
-   * Search for memories based on a query
+   * Wait until every memory added so far is searchable
+   */
+  async flush(timeoutMs: number = 5000): Promise<void> {
+    const response = await this.sendRequest('/wait', { timeout_ms: timeoutMs });
+    if (!response.success) {
+      throw new Error(response.error || 'Failed to wait for ingestion');
+    }
+  }
+
+  /**
+   * Search for memories based on a query, optionally restricted to a
+   * category and/or time range
    */
-  async search(query: string, topK: number = 5): Promise<KBSearchResult[]> {
-    const response = await this.sendRequest('/search', { query, top_k: topK });
+  async search(query: string, topK: number = 5, filter: KBSearchFilter = {},
+               mode: KBSearchMode = 'vector'): Promise<KBSearchResult[]> {
+    const response = await this.sendRequest('/search', { query, top_k: topK, mode, ...filter });
     if (!response.success) {
       throw new Error(response.error || 'Failed to search');
     }
-    return response.results || [];
+    return (response.results as KBSearchResult[]) || [];
+  }
+
+  /**
+   * Add many memories in one round trip. Returned ids are aligned with the
+   * input; entries that failed to add have an empty id.
+   */
+  async addBatch(memories: KBMemory[]): Promise<string[]> {
+    const response = await this.sendRequest('/add_batch', {
+      memories: memories.map(({ content, category = 'general', id }) => ({ content, category, id })),
+    });
+    if (!response.ids) {
+      throw new Error(response.error || 'Failed to add memories');
+    }
+    return response.ids;
+  }
+
+  /**
+   * Run several searches in one round trip
+   */
+  async searchBatch(queries: string[], topK: number = 5, filter: KBSearchFilter = {}): Promise<KBSearchResult[][]> {
+    const response = await this.sendRequest('/search_batch', { queries, top_k: topK, ...filter });
+    if (!response.success) {
+      throw new Error(response.error || 'Failed to search');
+    }
+    return (response.results as KBSearchResult[][]) || [];
+  }
+
+  /**
+   * Find memories similar to a stored one, excluding the memory itself
+   */
+  async searchById(id: string, topK: number = 5, filter: KBSearchFilter = {}): Promise<KBSearchResult[]> {
+    const response = await this.sendRequest('/search_by_id', { id, top_k: topK, ...filter });
+    if (!response.success) {
+      throw new Error(response.error || 'Failed to search');
+    }
+    return (response.results as KBSearchResult[]) || [];
   }
 
   /**
@@ -138,4 +317,26 @@ export class KBClient {
     }
     return response.value || '';
   }
+
+  /**
+   * Get several user preferences in one round trip; unset keys map to ''
+   */
+  async getPreferences(keys: string[]): Promise<Record<string, string>> {
+    const response = await this.sendRequest('/get_preferences', { keys });
+    if (!response.success) {
+      throw new Error(response.error || 'Failed to get preferences');
+    }
+    return response.values || {};
+  }
+
+  /**
+   * List the user preferences whose keys start with a prefix
+   */
+  async listPreferences(prefix: string = ''): Promise<Record<string, string>> {
+    const response = await this.sendRequest('/list_preferences', { prefix });
+    if (!response.success) {
+      throw new Error(response.error || 'Failed to list preferences');
+    }
+    return response.preferences || {};
+  }
 }
@@ -456,10 +456,11 @@ server.tool(
   {
     query: z.string().describe('Search query'),
     top_k: z.number().optional().default(5).describe('Number of results to return (default: 5)'),
+    category: z.string().optional().describe('Only return memories in this category'),
   },
-  async ({ query, top_k }) => {
+  async ({ query, top_k, category }) => {
     try {
-      const results = await kbClient.search(query, top_k);
+      const results = await kbClient.search(query, top_k, { category });
       if (results.length === 0) {
         return {
           content: [{ type: 'text' as const, text: 'No memories found matching the query.' }],
@@ -471,14 +472,14 @@ server.tool(
       const result = {
         content: [{ type: 'text' as const, text: `Found ${results.length} memories:\n\n${formatted}` }],
       };
-      logToolCall('kb_search', { query, top_k }, { results });
+      logToolCall('kb_search', { query, top_k, category }, { results });
       return result;
     } catch (err: any) {
       const result = {
         content: [{ type: 'text' as const, text: `Failed to search: ${err.message}` }],
         isError: true,
       };
-      logToolCall('kb_search', { query, top_k }, undefined, err);
+      logToolCall('kb_search', { query, top_k, category }, undefined, err);
       return result;
     }
   },
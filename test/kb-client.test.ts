@@ -0,0 +1,171 @@
+import { describe, it, expect, beforeEach, afterEach, vi } from 'vitest';
+import { createServer, Server, Socket, AddressInfo } from 'net';
+import { KBClient } from '../src/kb/kb-client.js';
+
+/**
+ * Stand-in for the kb-service: collects newline-delimited requests per
+ * connection and leaves answering them to the test.
+ */
+class FakeKBService {
+  server: Server;
+  connections: Socket[] = [];
+  requests: any[] = [];
+  private waiters: Array<{ count: number; resolve: () => void }> = [];
+
+  constructor() {
+    this.server = createServer((socket) => {
+      this.connections.push(socket);
+      let buffer = '';
+      socket.setEncoding('utf8');
+      socket.on('data', (data: string) => {
+        buffer += data;
+        let newline: number;
+        while ((newline = buffer.indexOf('\n')) !== -1) {
+          this.requests.push(JSON.parse(buffer.slice(0, newline)));
+          buffer = buffer.slice(newline + 1);
+        }
+        this.waiters = this.waiters.filter((waiter) => {
+          if (this.requests.length < waiter.count) {
+            return true;
+          }
+          waiter.resolve();
+          return false;
+        });
+      });
+      socket.on('error', () => {});
+    });
+  }
+
+  listen(): Promise<number> {
+    return new Promise((resolve) => {
+      this.server.listen(0, '127.0.0.1', () => resolve((this.server.address() as AddressInfo).port));
+    });
+  }
+
+  /**
+   * Resolve once `count` requests have arrived in total
+   */
+  received(count: number): Promise<void> {
+    if (this.requests.length >= count) {
+      return Promise.resolve();
+    }
+    return new Promise((resolve) => this.waiters.push({ count, resolve }));
+  }
+
+  close(): Promise<void> {
+    for (const socket of this.connections) {
+      socket.destroy();
+    }
+    return new Promise((resolve) => this.server.close(() => resolve()));
+  }
+}
+
+describe('KBClient pipelining', () => {
+  let service: FakeKBService;
+  let client: KBClient;
+
+  beforeEach(async () => {
+    service = new FakeKBService();
+    client = new KBClient('127.0.0.1', await service.listen());
+  });
+
+  afterEach(async () => {
+    client.close();
+    await service.close();
+  });
+
+  it('matches in-order responses to concurrent requests', async () => {
+    const calls = [client.getPreference('a'), client.getPreference('b'), client.getPreference('c')];
+    await service.received(3);
+
+    // All three went out on one connection before any answer
+    expect(service.connections).toHaveLength(1);
+    expect(service.requests.map((request) => request.params.key)).toEqual(['a', 'b', 'c']);
+
+    const answers = service.requests.map((request) =>
+      JSON.stringify({ success: true, value: `value of ${request.params.key}` }) + '\n').join('');
+    // Two responses in one chunk, the third split mid-line
+    const split = answers.indexOf('\n', answers.indexOf('\n') + 1) + 10;
+    const socket = service.connections[0];
+    socket.write(answers.slice(0, split));
+    await new Promise((resolve) => setTimeout(resolve, 20));
+    socket.write(answers.slice(split));
+
+    await expect(Promise.all(calls)).resolves.toEqual(['value of a', 'value of b', 'value of c']);
+  });
+
+  it('reuses the connection for later requests', async () => {
+    const first = client.getPreference('a');
+    await service.received(1);
+    service.connections[0].write(JSON.stringify({ success: true, value: '1' }) + '\n');
+    await expect(first).resolves.toBe('1');
+
+    const second = client.getPreference('b');
+    await service.received(2);
+    service.connections[0].write(JSON.stringify({ success: true, value: '2' }) + '\n');
+    await expect(second).resolves.toBe('2');
+    expect(service.connections).toHaveLength(1);
+  });
+
+  it('fails pending requests when the service closes the connection, then reconnects', async () => {
+    const calls = Promise.allSettled([client.getPreference('a'), client.getPreference('b')]);
+    await service.received(2);
+    service.connections[0].destroy();
+
+    for (const result of await calls) {
+      expect(result.status).toBe('rejected');
+      expect(((result as PromiseRejectedResult).reason as Error).message).toBe('Connection closed by kb-service');
+    }
+
+    const retry = client.getPreference('a');
+    await service.received(3);
+    expect(service.connections).toHaveLength(2);
+    service.connections[1].write(JSON.stringify({ success: true, value: 'again' }) + '\n');
+    await expect(retry).resolves.toBe('again');
+  });
+});
+
+describe('KBClient timeouts', () => {
+  let service: FakeKBService;
+  let client: KBClient;
+
+  beforeEach(async () => {
+    // Only timers are faked; sockets still run on the real event loop
+    vi.useFakeTimers({ toFake: ['setTimeout', 'clearTimeout'] });
+    service = new FakeKBService();
+    client = new KBClient('127.0.0.1', await service.listen());
+  });
+
+  afterEach(async () => {
+    vi.useRealTimers();
+    client.close();
+    await service.close();
+  });
+
+  it('times out an unanswered request and resets the connection for those behind it', async () => {
+    const first = client.getPreference('a');
+    const second = client.getPreference('b');
+    const firstResult = first.catch((error: Error) => error);
+    const secondResult = second.catch((error: Error) => error);
+    await service.received(2);
+
+    vi.advanceTimersByTime(10000);
+
+    expect(((await firstResult) as Error).message).toBe('Request timeout');
+    // A late answer to the first request must not be taken as the second's
+    expect(((await secondResult) as Error).message).toBe('Connection reset after request timeout');
+  });
+
+  it('opens a fresh connection after a timeout', async () => {
+    const first = client.getPreference('a').catch((error: Error) => error);
+    await service.received(1);
+    vi.advanceTimersByTime(10000);
+    expect(((await first) as Error).message).toBe('Request timeout');
+
+    const retry = client.getPreference('a');
+    await service.received(2);
+    expect(service.connections).toHaveLength(2);
+    service.connections[1].write(JSON.stringify({ success: true, value: 'fresh' }) + '\n');
+    await expect(retry).resolves.toBe('fresh');
+  });
+});